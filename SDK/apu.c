@@ -1,15 +1,46 @@
 #include "core.h"
 #include "apu.h"
+#include "trace.h"
 
-// Command codes for APU control
-#define APUCMD_BUFFERSIZE   0x00000000
-#define APUCMD_START        0x00000001
-#define APUCMD_NOOP         0x00000002
-#define APUCMD_SWAPCHANNELS 0x00000003
-#define APUCMD_SETRATE      0x00000004
+// How long before the predicted buffer swap a sleeping wait switches to polling
+#define APU_WAIT_GUARD_NS   300000ull
 
 // Audio Processing Unit (APU) functions
 
+/*
+ * Derive the expected time between two buffer swaps from the buffer size and sample rate.
+ * Each buffer holds 16bit stereo samples, 4 bytes per sample.
+ */
+static void APUUpdateFramePeriod(struct EAudioContext* _context)
+{
+	static const uint32_t sampleRates[] = { 44100, 22050, 11025, 0 };
+	uint32_t rate = sampleRates[_context->m_sampleRate & 0x3];
+
+	_context->m_framePeriodNs = rate ? ((uint64_t)_context->m_bufferSize * 1000000000ull) / ((uint64_t)rate * 4) : 0;
+	_context->m_lastFrameNs = 0;
+}
+
+/*
+ * Sends _command followed by _value to the APU, unless the register already holds _value.
+ * Returns 0 if the write was skipped.
+ */
+static int APUWriteShadowed(struct EAudioContext* _context, enum EAudioRegister _register, uint32_t _command, uint32_t _value)
+{
+	uint32_t bit = 1u << _register;
+	if ((_context->m_shadowValid & bit) && _context->m_shadow[_register] == _value)
+	{
+		_context->m_shadowStats.elided += 2;
+		return 0;
+	}
+
+	_context->m_shadow[_register] = _value;
+	_context->m_shadowValid |= bit;
+	_context->m_shadowStats.writes += 2;
+	audiowrite32(_context->m_platform, 0, _command);
+	audiowrite32(_context->m_platform, 0, _value);
+	return 1;
+}
+
 /*
  * Set the audio buffer size.
  * Parameters:
@@ -18,10 +49,12 @@
  */
 void APUSetBufferSize(struct EAudioContext* _context, enum EAPUBufferSize _bufferSize)
 {
-	_context->m_bufferSize = 128 << (uint32_t)_bufferSize;
+	// An unchanged size keeps the swap prediction
+	if (!APUWriteShadowed(_context, EAR_BufferSize, APUCMD_BUFFERSIZE, (uint32_t)_bufferSize))
+		return;
 
-	audiowrite32(_context->m_platform, 0, APUCMD_BUFFERSIZE);
-	audiowrite32(_context->m_platform, 0, (uint32_t)_bufferSize);
+	_context->m_bufferSize = 128 << (uint32_t)_bufferSize;
+	APUUpdateFramePeriod(_context);
 }
 
 /*
@@ -29,9 +62,12 @@ void APUSetBufferSize(struct EAudioContext* _context, enum EAPUBufferSize _buffe
  * Parameters:
  *   _context - Pointer to the audio context.
  *   _audioBufferAddress16byteAligned - 16-byte aligned address of the audio buffer.
+ * Cached or write-combined buffers are flushed before the APU is told to read them.
  */
 void APUStartDMA(struct EAudioContext* _context, uint32_t _audioBufferAddress16byteAligned)
 {
+	SP_TRACE_INSTANT("APUStartDMA", _audioBufferAddress16byteAligned);
+	SPFlushDMARange(_context->m_platform, _audioBufferAddress16byteAligned, _context->m_bufferSize);
 	audiowrite32(_context->m_platform, 0, APUCMD_START);
 	audiowrite32(_context->m_platform, 0, _audioBufferAddress16byteAligned);
 }
@@ -44,10 +80,11 @@ void APUStartDMA(struct EAudioContext* _context, uint32_t _audioBufferAddress16b
  */
 void APUSetSampleRate(struct EAudioContext* _context, enum EAPUSampleRate _sampleRate)
 {
-	_context->m_sampleRate = _sampleRate;
+	if (!APUWriteShadowed(_context, EAR_SampleRate, APUCMD_SETRATE, (uint32_t)_sampleRate))
+		return;
 
-	audiowrite32(_context->m_platform, 0, APUCMD_SETRATE);
-	audiowrite32(_context->m_platform, 0, (uint32_t)_sampleRate);
+	_context->m_sampleRate = _sampleRate;
+	APUUpdateFramePeriod(_context);
 }
 
 /*
@@ -58,8 +95,7 @@ void APUSetSampleRate(struct EAudioContext* _context, enum EAPUSampleRate _sampl
  */
 void APUSwapChannels(struct EAudioContext* _context, uint32_t _swap)
 {
-	audiowrite32(_context->m_platform, 0, APUCMD_SWAPCHANNELS);
-	audiowrite32(_context->m_platform, 0, _swap);
+	APUWriteShadowed(_context, EAR_SwapChannels, APUCMD_SWAPCHANNELS, _swap);
 }
 
 /*
@@ -111,6 +147,14 @@ int APUInitAudio(struct EAudioContext* _context, struct SPPlatform* _platform)
 	_context->m_platform = _platform;
 	_context->m_sampleRate = ASR_Halt;
 	_context->m_bufferSize = 0;
+	_context->m_waitMode = EWM_Sleep;
+	_context->m_framePeriodNs = 0;
+	_context->m_lastFrameNs = 0;
+	__builtin_memset(&_context->m_waitStats, 0, sizeof(struct SPWaitStats));
+	__builtin_memset(&_context->m_shadowStats, 0, sizeof(struct SPShadowStats));
+
+	// Whatever ran before us left the registers in an unknown state
+	APUInvalidateShadow(_context);
 
 	// NOTE: No failure conditions yet
 	return 0;
@@ -136,12 +180,88 @@ void APUShutdownAudio(struct EAudioContext* _context)
  *   _context - Pointer to the audio context.
  * Each time APU swaps buffers, the frame toggles between 0 and 1.
  * This function blocks until the next frame is reached.
+ * Unless the wait mode is EWM_Spin, the thread sleeps until shortly before the swap predicted
+ * from the previous one, and only polls for the remainder.
  */
 void APUWaitSync(struct EAudioContext *_context)
 {
+	struct SPWaitStats *stats = &_context->m_waitStats;
+	SP_TRACE_BEGIN("APUWaitSync");
+
 	volatile uint32_t prevsync = APUFrame(_context);
 	volatile uint32_t currentsync;
+
+	if (_context->m_waitMode != EWM_Spin && _context->m_lastFrameNs && _context->m_framePeriodNs)
+	{
+		uint64_t due = _context->m_lastFrameNs + _context->m_framePeriodNs;
+		uint64_t now = SPGetTimeNs();
+		if (due > now + APU_WAIT_GUARD_NS)
+		{
+			SPSleep(_context->m_platform, due - now - APU_WAIT_GUARD_NS, _context->m_waitMode == EWM_Blocking);
+			stats->sleptNs += SPGetTimeNs() - now;
+		}
+	}
+
+	uint64_t pollStart = SPGetTimeNs();
+	uint32_t polls = 0;
 	do {
 		currentsync = APUFrame(_context);
+		++polls;
 	} while (currentsync == prevsync);
+	uint64_t now = SPGetTimeNs();
+
+	stats->polledNs += now - pollStart;
+	stats->pollCount += polls;
+	stats->waitCount++;
+
+	// Refine the period from swaps we saw happen, a wait that woke up late would skew the prediction
+	uint64_t interval = now - _context->m_lastFrameNs;
+	if (polls > 1 && _context->m_lastFrameNs && interval > (_context->m_framePeriodNs * 3) / 4 && interval < (_context->m_framePeriodNs * 5) / 4)
+		_context->m_framePeriodNs = (_context->m_framePeriodNs * 7 + interval) / 8;
+	_context->m_lastFrameNs = now;
+
+	SP_TRACE_END("APUWaitSync");
+}
+
+/*
+ * Select how APUWaitSync waits for the buffer swap.
+ * Parameters:
+ *   _context - Pointer to the audio context.
+ *   _mode - EWM_Sleep (the default) frees up the CPU between swaps, EWM_Spin restores pure polling.
+ */
+void APUSetWaitMode(struct EAudioContext *_context, const enum ESPWaitMode _mode)
+{
+	_context->m_waitMode = _mode;
+}
+
+/*
+ * Retrieve the time APUWaitSync spent asleep and polling.
+ * Parameters:
+ *   _context - Pointer to the audio context.
+ *   _stats - Receives the statistics.
+ */
+void APUGetWaitStats(struct EAudioContext *_context, struct SPWaitStats *_stats)
+{
+	*_stats = _context->m_waitStats;
+}
+
+/*
+ * Forget the shadowed register values, so that the next call of each setter reaches the device.
+ * Parameters:
+ *   _context - Pointer to the audio context.
+ */
+void APUInvalidateShadow(struct EAudioContext *_context)
+{
+	_context->m_shadowValid = 0;
+}
+
+/*
+ * Retrieve the number of register writes the shadowed setters sent and skipped.
+ * Parameters:
+ *   _context - Pointer to the audio context.
+ *   _stats - Receives the statistics.
+ */
+void APUGetShadowStats(struct EAudioContext *_context, struct SPShadowStats *_stats)
+{
+	*_stats = _context->m_shadowStats;
 }
@@ -2,6 +2,13 @@
 
 #include "platform.h"
 
+// Command codes for APU control
+#define APUCMD_BUFFERSIZE   0x00000000
+#define APUCMD_START        0x00000001
+#define APUCMD_NOOP         0x00000002
+#define APUCMD_SWAPCHANNELS 0x00000003
+#define APUCMD_SETRATE      0x00000004
+
 int APUInitAudio(struct EAudioContext* _context, struct SPPlatform* _platform);
 void APUShutdownAudio(struct EAudioContext* _context);
 
@@ -12,4 +19,8 @@ void APUSetSampleRate(struct EAudioContext* _context, enum EAPUSampleRate _sampl
 void APUSwapChannels(struct EAudioContext* _context, uint32_t _swap);
 uint32_t APUFrame(struct EAudioContext* _context);
 uint32_t APUGetWordCount(struct EAudioContext* _context);
-void APUWaitSync(struct EAudioContext *_context);
\ No newline at end of file
+void APUWaitSync(struct EAudioContext *_context);
+void APUSetWaitMode(struct EAudioContext *_context, const enum ESPWaitMode _mode);
+void APUGetWaitStats(struct EAudioContext *_context, struct SPWaitStats *_stats);
+void APUInvalidateShadow(struct EAudioContext *_context);
+void APUGetShadowStats(struct EAudioContext *_context, struct SPShadowStats *_stats);
@@ -0,0 +1,185 @@
+#include "arena.h"
+#include "vpu.h"
+#include "trace.h"
+#include <stdlib.h>
+
+static inline uint32_t arena_alignup(uint32_t _x, uint32_t _align)
+{
+	return (_x + _align - 1) & ~(_align - 1);
+}
+
+/*
+ * A frame is off the screen once the vblank that latched the swap replacing it went by. That is the next
+ * vblank, which the toggle flipping proves, unless the swap came too close to it to latch. Then, and in
+ * case the toggle flipped twice, the time that vblank was predicted for tells.
+ */
+static int arena_retired(struct EVideoContext* _context, struct SPFrameArena* _arena)
+{
+	if (!_arena->retireNs)
+		return 0;
+	if (!_arena->retireLate && VPUReadVBlankCounter(_context) != _arena->retireBit)
+		return 1;
+	return SPGetTimeNs() >= _arena->retireNs;
+}
+
+/*
+ * Create a ring of _frameCount arenas of _bytesPerFrame each, and attach it to _sc.
+ * With three arenas one frame is recorded while the two before it are waiting for or on the screen,
+ * two arenas make every swap wait for the vblank. _policy is the mapping allocations are handed out with,
+ * remember to SPFlushRange cached ones before a device reads them.
+ * Returns 0 on success, -1 if the reserved region is out of memory.
+ */
+int SPCreateFrameArenas(struct SPPlatform* _platform, struct EVideoSwapContext* _sc, uint32_t _frameCount, uint32_t _bytesPerFrame, enum ESPMapPolicy _policy)
+{
+	if (_frameCount < 2 || _frameCount > SP_FRAME_ARENA_MAX || _sc->arenas)
+		return -1;
+
+	struct SPFrameArenas* arenas = (struct SPFrameArenas*)calloc(1, sizeof(struct SPFrameArenas));
+	if (!arenas)
+		return -1;
+
+	// Keep every arena on a cache line of its own
+	arenas->bytesPerFrame = arena_alignup(_bytesPerFrame ? _bytesPerFrame : SPALIGN_DEFAULT, SPALIGN_DEFAULT);
+	arenas->frameCount = _frameCount;
+	arenas->platform = _platform;
+	arenas->buffer.size = arenas->bytesPerFrame * _frameCount;
+	if (SPAllocateMappedBuffer(_platform, &arenas->buffer, SPALIGN_DEFAULT, _policy) != 0)
+	{
+		free(arenas);
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < _frameCount; ++i)
+		arenas->arenas[i].offset = i * arenas->bytesPerFrame;
+
+	_sc->arenas = arenas;
+	return 0;
+}
+
+/*
+ * Release the arenas of _sc. No device may be reading from them anymore.
+ */
+void SPDestroyFrameArenas(struct SPPlatform* _platform, struct EVideoSwapContext* _sc)
+{
+	if (!_sc->arenas)
+		return;
+
+	SPFreeBuffer(_platform, &_sc->arenas->buffer);
+	free(_sc->arenas);
+	_sc->arenas = NULL;
+}
+
+/*
+ * Allocate _sizealloc->size bytes that stay valid until the current frame is off the screen.
+ * _alignment has to be a power of two, see SPALIGN_*. The buffer must not be passed to SPFreeBuffer,
+ * the memory comes back on its own.
+ * Returns 0 on success, -1 if there are no arenas or the frame's arena is full.
+ */
+int SPFrameAlloc(struct EVideoSwapContext* _sc, struct SPSizeAlloc* _sizealloc, uint32_t _alignment)
+{
+	struct SPFrameArenas* arenas = _sc->arenas;
+	_sizealloc->cpuAddress = NULL;
+	_sizealloc->dmaAddress = NULL;
+	_sizealloc->block = NULL;
+	_sizealloc->policy = ESM_Uncached;
+
+	if (!arenas || arenas->current >= arenas->frameCount)
+	{
+		if (arenas)
+			arenas->stats.failedCount++;
+		return -1;
+	}
+
+	struct SPFrameArena* arena = &arenas->arenas[arenas->current];
+	uint32_t start = arena_alignup(arena->offset + arena->used, _alignment ? _alignment : SPHEAP_GRANULE);
+	uint32_t end = start + _sizealloc->size;
+	if (end < start || end > arena->offset + arenas->bytesPerFrame)
+	{
+		arenas->stats.failedCount++;
+		return -1;
+	}
+
+	arena->used = end - arena->offset;
+	if (arena->used > arenas->stats.peakUsedBytes)
+		arenas->stats.peakUsedBytes = arena->used;
+	arenas->stats.allocCount++;
+
+	// The backing buffer is aligned to SPALIGN_DEFAULT, so offsets keep any smaller alignment
+	_sizealloc->cpuAddress = arenas->buffer.cpuAddress + start;
+	_sizealloc->dmaAddress = arenas->buffer.dmaAddress + start;
+	_sizealloc->policy = arenas->buffer.policy;
+
+	return 0;
+}
+
+/*
+ * Close the arena of the frame that was just swapped in, and start recording into the oldest one.
+ * Called by VPUSwapPages, waits for a vblank if the oldest frame is still on the screen.
+ */
+void SPFrameArenaAdvance(struct EVideoContext* _context, struct EVideoSwapContext* _sc)
+{
+	struct SPFrameArenas* arenas = _sc->arenas;
+	if (!arenas)
+		return;
+
+	// The frame before the one just finished leaves the screen at the next vblank, or the one after if the
+	// scanout address was written too close to it. Toggle and scanline come from one status read.
+	uint32_t previous = (arenas->current + arenas->frameCount - 1) % arenas->frameCount;
+	struct SPFrameArena* leaving = &arenas->arenas[previous];
+	uint32_t status = videoread32(_context->m_platform, 0);
+	uint32_t scanline = ((status & 0x7FE) >> 1) % VPU_SCANLINE_COUNT;
+	uint32_t lines = (_context->m_vblankScanline + VPU_SCANLINE_COUNT - scanline - 1) % VPU_SCANLINE_COUNT + 1;
+	leaving->retireBit = status & 0x1;
+	leaving->retireLate = lines < VPU_LATCH_GUARD_LINES;
+	if (leaving->retireLate)
+		lines += VPU_SCANLINE_COUNT;
+	leaving->retireNs = SPGetTimeNs() + (uint64_t)(lines + VPU_LATCH_GUARD_LINES) * _context->m_framePeriodNs / VPU_SCANLINE_COUNT;
+
+	arenas->current = (arenas->current + 1) % arenas->frameCount;
+	struct SPFrameArena* next = &arenas->arenas[arenas->current];
+
+	// A fresh ring has nothing to wait for, its arenas were never used
+	if (next->used && !arena_retired(_context, next))
+	{
+		SP_TRACE_BEGIN("SPFrameArenaWait");
+		uint64_t waitStart = SPGetTimeNs();
+		while (!arena_retired(_context, next))
+			VPUWaitVSync(_context);
+		arenas->stats.waitCount++;
+		arenas->stats.waitNs += SPGetTimeNs() - waitStart;
+		SP_TRACE_END("SPFrameArenaWait");
+	}
+
+	next->used = 0;
+	next->retireNs = 0;
+}
+
+/*
+ * Start recording into arena _index, which the caller knows to be off the screen.
+ * Called by SPAcquireNextImage with the index of the image it hands out, whose fence has passed.
+ * Without an arena of that index, allocations fail until the next one is selected.
+ */
+void SPFrameArenaSelect(struct EVideoSwapContext* _sc, uint32_t _index)
+{
+	struct SPFrameArenas* arenas = _sc->arenas;
+	if (!arenas)
+		return;
+
+	arenas->current = _index;
+	if (_index < arenas->frameCount)
+	{
+		arenas->arenas[_index].used = 0;
+		arenas->arenas[_index].retireNs = 0;
+	}
+}
+
+/*
+ * Retrieve allocation and wait statistics of the arenas of _sc.
+ */
+void SPGetFrameArenaStats(struct EVideoSwapContext* _sc, struct SPFrameArenaStats* _stats)
+{
+	if (_sc->arenas)
+		*_stats = _sc->arenas->stats;
+	else
+		__builtin_memset(_stats, 0, sizeof(struct SPFrameArenaStats));
+}
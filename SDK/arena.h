@@ -0,0 +1,48 @@
+#pragma once
+
+#include "platform.h"
+
+// Scratch memory from the reserved region for data that only lives for one frame, such as VCP program
+// uploads, staging buffers and per-frame tables. Each frame in flight owns one arena of a ring, and
+// allocating is a pointer bump. VPUSwapPages() moves on to the next arena, which is only reused once
+// the vblank that took its frame off the screen has passed, so nothing has to be freed. With a swap chain,
+// create as many arenas as it has images, each image's frames record into the arena of the same index,
+// and SPAcquireNextImage() hands it out again together with the image.
+
+#define SP_FRAME_ARENA_MAX		4
+
+struct SPFrameArenaStats
+{
+	uint32_t allocCount;			// Successful allocations
+	uint32_t failedCount;			// Allocations that did not fit into the arena of their frame
+	uint32_t peakUsedBytes;			// Most bytes allocated in a single frame, including alignment padding
+	uint32_t waitCount;				// Swaps that had to wait for a vblank before an arena could be reused
+	uint64_t waitNs;				// Time spent in those waits
+};
+
+struct SPFrameArena
+{
+	uint32_t offset;				// Start within the backing buffer
+	uint32_t used;
+	uint32_t retireBit;				// Vblank toggle at the swap that took this frame off the screen
+	uint32_t retireLate;			// Set if that swap was too close to the vblank to latch at it
+	uint64_t retireNs;				// Time the frame is off the screen by, 0 while it is still recorded or shown
+};
+
+struct SPFrameArenas
+{
+	struct SPPlatform* platform;
+	struct SPSizeAlloc buffer;		// Backing memory of all arenas
+	uint32_t bytesPerFrame;
+	uint32_t frameCount;
+	uint32_t current;				// Arena of the frame being recorded
+	struct SPFrameArena arenas[SP_FRAME_ARENA_MAX];
+	struct SPFrameArenaStats stats;
+};
+
+int SPCreateFrameArenas(struct SPPlatform* _platform, struct EVideoSwapContext* _sc, uint32_t _frameCount, uint32_t _bytesPerFrame, enum ESPMapPolicy _policy);
+void SPDestroyFrameArenas(struct SPPlatform* _platform, struct EVideoSwapContext* _sc);
+int SPFrameAlloc(struct EVideoSwapContext* _sc, struct SPSizeAlloc* _sizealloc, uint32_t _alignment);
+void SPFrameArenaAdvance(struct EVideoContext* _context, struct EVideoSwapContext* _sc);
+void SPFrameArenaSelect(struct EVideoSwapContext* _sc, uint32_t _index);
+void SPGetFrameArenaStats(struct EVideoSwapContext* _sc, struct SPFrameArenaStats* _stats);
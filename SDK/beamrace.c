@@ -0,0 +1,168 @@
+#include "beamrace.h"
+#include "vpu.h"
+#include "trace.h"
+
+/*
+ * Wait until the beam is at or past _line, sleeping through most of the wait when the platform allows.
+ */
+static void beamwait(struct SPBeamRacer* _racer, uint64_t _line)
+{
+	struct EVideoContext* vx = _racer->platform->vx;
+	uint64_t line = SPBeamRaceGetLine(_racer);
+	if (line >= _line)
+		return;
+
+	SP_TRACE_BEGIN("SPBeamRaceWait");
+	uint64_t start = SPGetTimeNs();
+	uint64_t remaining = (_line - line) * vx->m_framePeriodNs / VPU_SCANLINE_COUNT;
+	if (vx->m_waitMode != EWM_Spin && remaining > SP_BEAMRACE_GUARD_NS)
+		SPSleep(_racer->platform, remaining - SP_BEAMRACE_GUARD_NS, vx->m_waitMode == EWM_Blocking);
+	while (SPBeamRaceGetLine(_racer) < _line) { }
+	_racer->stats.waitNs += SPGetTimeNs() - start;
+	SP_TRACE_END("SPBeamRaceWait");
+}
+
+/*
+ * Point scanout and CPU writes at _framebuffer, which has to hold a frame of the current video mode, and split
+ * it into _bandCount bands of rows. Each band is started _leadLines scanlines before the beam reaches it,
+ * pass 0 to start it as the beam enters the band above. More bands lower the latency and the slack each
+ * band has to be drawn in, as every band has to be drawn within the time the beam takes to scan the lead.
+ * Returns 0 on success, -1 if _bandCount is out of range.
+ */
+int SPBeamRaceInit(struct SPBeamRacer* _racer, struct SPPlatform* _platform, struct SPSizeAlloc* _framebuffer, uint32_t _bandCount, uint32_t _leadLines)
+{
+	__builtin_memset(_racer, 0, sizeof(struct SPBeamRacer));
+	struct EVideoContext* vx = _platform->vx;
+	if (_bandCount == 0 || _bandCount > vx->m_graphicsHeight)
+		return -1;
+
+	_racer->platform = _platform;
+	_racer->framebuffer = _framebuffer;
+	_racer->height = vx->m_graphicsHeight;
+	_racer->stride = vx->m_strideInWords * 4;
+	_racer->bandCount = _bandCount;
+	// Visible lines of the nominal timing, where they sit in the frame is measured by VPUWaitVSync
+	_racer->linesPerRow = VPU_VBLANK_SCANLINE / _racer->height;
+
+	// A band can not be started before the beam has left it in the previous frame
+	uint32_t bandLines = (_racer->height * _racer->linesPerRow + _bandCount - 1) / _bandCount;
+	_racer->leadLines = _leadLines ? _leadLines : bandLines;
+	if (_racer->leadLines > VPU_SCANLINE_COUNT - bandLines)
+		_racer->leadLines = VPU_SCANLINE_COUNT - bandLines;
+
+	VPUSetWriteAddress(vx, (uint32_t)(uintptr_t)_framebuffer->cpuAddress);
+	VPUSetScanoutAddress(vx, (uint32_t)(uintptr_t)_framebuffer->dmaAddress);
+
+	_racer->lastLine = VPUGetScanline(vx) % VPU_SCANLINE_COUNT;
+	_racer->lastLineNs = SPGetTimeNs();
+	_racer->frame = 1;
+	return 0;
+}
+
+/*
+ * Where the beam is, in scanlines since SPBeamRaceInit. The scanline register wraps every frame, the number
+ * of frames in between is predicted from the time since the last read and the measured display period.
+ */
+uint64_t SPBeamRaceGetLine(struct SPBeamRacer* _racer)
+{
+	struct EVideoContext* vx = _racer->platform->vx;
+	uint64_t now = SPGetTimeNs();
+	uint32_t scanline = VPUGetScanline(vx) % VPU_SCANLINE_COUNT;
+
+	uint64_t expected = _racer->lastLine + (now - _racer->lastLineNs) * VPU_SCANLINE_COUNT / vx->m_framePeriodNs;
+	uint64_t line = expected - expected % VPU_SCANLINE_COUNT + scanline;
+	if (line + VPU_SCANLINE_COUNT / 2 < expected)
+		line += VPU_SCANLINE_COUNT;
+	else if (line > expected + VPU_SCANLINE_COUNT / 2 && line >= VPU_SCANLINE_COUNT)
+		line -= VPU_SCANLINE_COUNT;
+
+	// Bus delays can make the register lag behind the last read a little
+	if (line < _racer->lastLine)
+		line = _racer->lastLine;
+	_racer->lastLine = line;
+	_racer->lastLineNs = now;
+	return line;
+}
+
+/*
+ * Render the next frame one band at a time, each just ahead of the beam, by calling _draw for every band
+ * in order from the top. If rendering fell so far behind that the beam already left the visible area of
+ * the frame that was due, that frame is skipped and the next one is raced instead.
+ * Returns the number of bands the beam reached before they were finished, 0 for a tear free frame.
+ */
+uint32_t SPBeamRaceFrame(struct SPBeamRacer* _racer, SPBeamBandFunc _draw, void* _userData)
+{
+	SP_TRACE_BEGIN("SPBeamRaceFrame");
+
+	// The visible area ends at the scanline the vblank counter was measured to flip at
+	uint32_t visibleLines = _racer->height * _racer->linesPerRow;
+	uint32_t vblankScanline = _racer->platform->vx->m_vblankScanline;
+	uint32_t top = vblankScanline > visibleLines ? vblankScanline - visibleLines : 0;
+
+	uint64_t line = SPBeamRaceGetLine(_racer);
+	uint64_t frameStart = _racer->frame * VPU_SCANLINE_COUNT;
+	if (line >= frameStart + top + visibleLines)
+	{
+		uint64_t next = line / VPU_SCANLINE_COUNT + 1;
+		_racer->stats.skippedFrames += next - _racer->frame;
+		_racer->frame = next;
+		frameStart = next * VPU_SCANLINE_COUNT;
+	}
+
+	uint32_t late = 0;
+	uint8_t* pixels = (uint8_t*)_racer->framebuffer->cpuAddress;
+	for (uint32_t band = 0; band < _racer->bandCount; ++band)
+	{
+		uint32_t y0 = band * _racer->height / _racer->bandCount;
+		uint32_t y1 = (band + 1) * _racer->height / _racer->bandCount;
+		uint64_t first = frameStart + top + y0 * _racer->linesPerRow;
+		uint64_t last = frameStart + top + y1 * _racer->linesPerRow;
+
+		// Start the lead ahead of the beam, but only once the previous frame's scan of the band is over
+		uint64_t start = first > _racer->leadLines ? first - _racer->leadLines : 0;
+		if (start < last - VPU_SCANLINE_COUNT)
+			start = last - VPU_SCANLINE_COUNT;
+		beamwait(_racer, start);
+
+		_draw(_userData, pixels + y0 * _racer->stride, _racer->stride, y0, y1, _racer->frame);
+		SPFlushRange(_racer->platform, pixels + y0 * _racer->stride, (y1 - y0) * _racer->stride);
+
+		line = SPBeamRaceGetLine(_racer);
+		if (line >= first)
+		{
+			uint32_t lines = (uint32_t)(line - first);
+			if (lines > _racer->stats.worstLateLines)
+				_racer->stats.worstLateLines = lines;
+			++late;
+		}
+		else
+			_racer->totalSlackLines += first - line;
+	}
+
+	_racer->stats.bandCount += _racer->bandCount;
+	_racer->stats.lateBands += late;
+	_racer->stats.lateFrames += late ? 1 : 0;
+	_racer->stats.frameCount++;
+	_racer->frame++;
+	SP_TRACE_END("SPBeamRaceFrame");
+	return late;
+}
+
+/*
+ * Retrieve frame, band and lateness counts since SPBeamRaceInit or the last SPResetBeamRaceStats.
+ */
+void SPGetBeamRaceStats(struct SPBeamRacer* _racer, struct SPBeamRaceStats* _stats)
+{
+	*_stats = _racer->stats;
+	uint64_t inTime = _racer->stats.bandCount - _racer->stats.lateBands;
+	_stats->averageSlackLines = inTime ? (float)((double)_racer->totalSlackLines / (double)inTime) : 0.f;
+}
+
+/*
+ * Start counting from zero, for instance once loading is over and frames are expected to be on time.
+ */
+void SPResetBeamRaceStats(struct SPBeamRacer* _racer)
+{
+	__builtin_memset(&_racer->stats, 0, sizeof(struct SPBeamRaceStats));
+	_racer->totalSlackLines = 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "platform.h"
+
+// Rendering into a single framebuffer that races the beam. The frame is split into horizontal bands,
+// and each band is drawn while the beam scans the lines just above it, so it is finished before the beam
+// gets there and not started before the beam has left it in the previous frame. The output does not
+// tear as long as every band is drawn in time, with about one band of latency and half the framebuffer
+// memory of double buffering. The beam position is predicted from the scanline register and the display
+// period, and the stats tell how often rendering fell behind it. On the host backend, SPHostSetBeamCapture()
+// records what the display would have shown, to check for tearing without the board.
+
+// Sleeps that end this close to the band's start line are finished by polling the scanline
+#define SP_BEAMRACE_GUARD_NS	300000ull
+
+struct SPBeamRaceStats
+{
+	uint64_t frameCount;			// Frames rendered
+	uint64_t bandCount;				// Bands rendered
+	uint64_t lateBands;				// Bands the beam reached before they were finished
+	uint64_t lateFrames;			// Frames with at least one late band
+	uint64_t skippedFrames;			// Frames skipped because rendering fell behind the whole visible area
+	uint32_t worstLateLines;		// Furthest the beam got into a band before it was finished
+	float averageSlackLines;		// Average lines left between a finished band and the beam
+	uint64_t waitNs;				// Time spent waiting for the beam
+};
+
+// Draw rows [_y0, _y1) of _frame, _pixels points at row _y0 of the framebuffer
+typedef void (*SPBeamBandFunc)(void* _userData, uint8_t* _pixels, uint32_t _stride, uint32_t _y0, uint32_t _y1, uint64_t _frame);
+
+struct SPBeamRacer
+{
+	struct SPPlatform* platform;
+	struct SPSizeAlloc* framebuffer;
+	uint32_t height;				// Framebuffer rows
+	uint32_t stride;				// In bytes
+	uint32_t bandCount;
+	uint32_t linesPerRow;			// Scanlines per framebuffer row, 2 in 320x240 modes
+	uint32_t leadLines;				// How far ahead of the beam a band is started
+	uint64_t frame;					// Display frame the next SPBeamRaceFrame renders, counted in beam passes
+	uint64_t lastLine;				// Beam position when last read, in scanlines since SPBeamRaceInit
+	uint64_t lastLineNs;
+	uint64_t totalSlackLines;
+	struct SPBeamRaceStats stats;
+};
+
+int SPBeamRaceInit(struct SPBeamRacer* _racer, struct SPPlatform* _platform, struct SPSizeAlloc* _framebuffer, uint32_t _bandCount, uint32_t _leadLines);
+uint32_t SPBeamRaceFrame(struct SPBeamRacer* _racer, SPBeamBandFunc _draw, void* _userData);
+uint64_t SPBeamRaceGetLine(struct SPBeamRacer* _racer);
+void SPGetBeamRaceStats(struct SPBeamRacer* _racer, struct SPBeamRaceStats* _stats);
+void SPResetBeamRaceStats(struct SPBeamRacer* _racer);
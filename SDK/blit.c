@@ -0,0 +1,358 @@
+#include "simd.h"
+#include "blit.h"
+#include "kernels.h"
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint32_t bytesperpixel(enum EColorMode _cmode)
+{
+	return _cmode == ECM_16bit_RGB ? 2 : 1;
+}
+
+/*
+ * Clip _rect of a source placed at *_x, *_y against the destination, moving the position along with the rect.
+ * Returns 0 if nothing is left to draw.
+ */
+static int cliprect(const struct SPSurface* _dst, int* _x, int* _y, struct SPRect* _rect)
+{
+	if (*_x < 0)
+	{
+		_rect->x -= *_x;
+		_rect->width += *_x;
+		*_x = 0;
+	}
+	if (*_y < 0)
+	{
+		_rect->y -= *_y;
+		_rect->height += *_y;
+		*_y = 0;
+	}
+	if (*_x + _rect->width > (int)_dst->width)
+		_rect->width = (int)_dst->width - *_x;
+	if (*_y + _rect->height > (int)_dst->height)
+		_rect->height = (int)_dst->height - *_y;
+
+	return _rect->width > 0 && _rect->height > 0;
+}
+
+static inline uint16_t blend16(uint16_t _src, uint16_t _dst, enum ESPBlend _blend)
+{
+	if (_blend == EBL_Half)
+	{
+		// Average without carries crossing into the next channel: drop the low bit of each channel first
+		return (uint16_t)((_src & _dst) + (((_src ^ _dst) & 0xF7DE) >> 1));
+	}
+	if (_blend == EBL_Add)
+	{
+		uint32_t r = (_src >> 11) + (_dst >> 11);
+		uint32_t g = ((_src >> 5) & 0x3F) + ((_dst >> 5) & 0x3F);
+		uint32_t b = (_src & 0x1F) + (_dst & 0x1F);
+		return (uint16_t)(((r > 0x1F ? 0x1F : r) << 11) | ((g > 0x3F ? 0x3F : g) << 5) | (b > 0x1F ? 0x1F : b));
+	}
+	return _src;
+}
+
+#if defined(SP_USE_NEON)
+static inline uint16x8_t blend16x8(uint16x8_t _src, uint16x8_t _dst, enum ESPBlend _blend)
+{
+	if (_blend == EBL_Half)
+		return vaddq_u16(vandq_u16(_src, _dst), vshrq_n_u16(vandq_u16(veorq_u16(_src, _dst), vdupq_n_u16(0xF7DE)), 1));
+	if (_blend == EBL_Add)
+	{
+		uint16x8_t r = vminq_u16(vaddq_u16(vshrq_n_u16(_src, 11), vshrq_n_u16(_dst, 11)), vdupq_n_u16(0x1F));
+		uint16x8_t g = vminq_u16(vaddq_u16(vandq_u16(vshrq_n_u16(_src, 5), vdupq_n_u16(0x3F)), vandq_u16(vshrq_n_u16(_dst, 5), vdupq_n_u16(0x3F))), vdupq_n_u16(0x3F));
+		uint16x8_t b = vminq_u16(vaddq_u16(vandq_u16(_src, vdupq_n_u16(0x1F)), vandq_u16(_dst, vdupq_n_u16(0x1F))), vdupq_n_u16(0x1F));
+		return vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b);
+	}
+	return _src;
+}
+#endif
+
+/*
+ * Copy _count 8 bit pixels, leaving the destination alone where the source equals _key.
+ */
+static void keyrow8(uint8_t* _dst, const uint8_t* _src, uint32_t _count, uint8_t _key)
+{
+	uint32_t x = 0;
+#if defined(SP_USE_NEON)
+	uint8x16_t key = vdupq_n_u8(_key);
+	for (; x + 16 <= _count; x += 16)
+	{
+		uint8x16_t src = vld1q_u8(_src + x);
+		vst1q_u8(_dst + x, vbslq_u8(vceqq_u8(src, key), vld1q_u8(_dst + x), src));
+	}
+#endif
+	for (; x < _count; ++x)
+	{
+		if (_src[x] != _key)
+			_dst[x] = _src[x];
+	}
+}
+
+/*
+ * Blend _count RGB565 pixels into the destination, skipping source pixels equal to _key if _keyed.
+ * Always inlined so that every blend and key combination gets a loop of its own.
+ */
+static inline __attribute__((always_inline)) void blendrow16(uint16_t* _dst, const uint16_t* _src, uint32_t _count, enum ESPBlend _blend, int _keyed, uint16_t _key)
+{
+	uint32_t x = 0;
+#if defined(SP_USE_NEON)
+	uint16x8_t key = vdupq_n_u16(_key);
+	for (; x + 8 <= _count; x += 8)
+	{
+		uint16x8_t src = vld1q_u16(_src + x);
+		uint16x8_t dst = vld1q_u16(_dst + x);
+		uint16x8_t result = blend16x8(src, dst, _blend);
+		if (_keyed)
+			result = vbslq_u16(vceqq_u16(src, key), dst, result);
+		vst1q_u16(_dst + x, result);
+	}
+#endif
+	for (; x < _count; ++x)
+	{
+		if (!_keyed || _src[x] != _key)
+			_dst[x] = blend16(_src[x], _dst[x], _blend);
+	}
+}
+
+static void row16(uint16_t* _dst, const uint16_t* _src, uint32_t _count, enum ESPBlend _blend, int _keyed, uint16_t _key)
+{
+	switch (_blend)
+	{
+		case EBL_Half:
+			if (_keyed)
+				blendrow16(_dst, _src, _count, EBL_Half, 1, _key);
+			else
+				blendrow16(_dst, _src, _count, EBL_Half, 0, 0);
+			break;
+		case EBL_Add:
+			if (_keyed)
+				blendrow16(_dst, _src, _count, EBL_Add, 1, _key);
+			else
+				blendrow16(_dst, _src, _count, EBL_Add, 0, 0);
+			break;
+		default:
+			// Unblended and unkeyed rows are plain copies, which SPCopyRect does
+			blendrow16(_dst, _src, _count, EBL_None, 1, _key);
+			break;
+	}
+}
+
+/*
+ * Describe _width by _height pixels at _pixels, rows _stride bytes apart.
+ */
+void SPInitSurface(struct SPSurface* _surface, void* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride, enum EColorMode _cmode)
+{
+	_surface->pixels = _pixels;
+	_surface->width = _width;
+	_surface->height = _height;
+	_surface->stride = _stride;
+	_surface->cmode = _cmode;
+}
+
+/*
+ * Describe the current CPU write page of the VPU.
+ */
+void SPGetWriteSurface(struct EVideoContext* _context, struct SPSurface* _surface)
+{
+	SPInitSurface(_surface, (void*)_context->m_cpuWriteAddressCacheAligned, _context->m_graphicsWidth, _context->m_graphicsHeight,
+		_context->m_strideInWords * sizeof(uint32_t), _context->m_cmode);
+}
+
+/*
+ * Draw _srcRect of _src at _x, _y of _dst, the whole source if _srcRect is NULL. Source pixels equal to
+ * _colorKey are not drawn, pass SPBLIT_NOKEY to draw all of them.
+ * Returns 0 on success, also when nothing was visible, or -1 if the color modes differ or _blend needs RGB565.
+ */
+int SPBlit(struct SPSurface* _dst, int _x, int _y, const struct SPSurface* _src, const struct SPRect* _srcRect, enum ESPBlend _blend, uint32_t _colorKey)
+{
+	if (_dst->cmode != _src->cmode || (_blend != EBL_None && _dst->cmode != ECM_16bit_RGB))
+		return -1;
+
+	struct SPRect rect = { 0, 0, (int)_src->width, (int)_src->height };
+	if (_srcRect)
+	{
+		// Stay within the source as well
+		rect = *_srcRect;
+		if (rect.x < 0)
+		{
+			_x -= rect.x;
+			rect.width += rect.x;
+			rect.x = 0;
+		}
+		if (rect.y < 0)
+		{
+			_y -= rect.y;
+			rect.height += rect.y;
+			rect.y = 0;
+		}
+		if (rect.x + rect.width > (int)_src->width)
+			rect.width = (int)_src->width - rect.x;
+		if (rect.y + rect.height > (int)_src->height)
+			rect.height = (int)_src->height - rect.y;
+	}
+	if (!cliprect(_dst, &_x, &_y, &rect))
+		return 0;
+
+	uint32_t bpp = bytesperpixel(_dst->cmode);
+	uint8_t* dst = (uint8_t*)_dst->pixels + _y * _dst->stride + _x * bpp;
+	const uint8_t* src = (const uint8_t*)_src->pixels + rect.y * _src->stride + rect.x * bpp;
+
+	if (_blend == EBL_None && _colorKey == SPBLIT_NOKEY)
+	{
+		SPCopyRect(dst, _dst->stride, src, _src->stride, rect.width * bpp, rect.height);
+		return 0;
+	}
+
+	for (int y = 0; y < rect.height; ++y)
+	{
+		if (bpp == 1)
+			keyrow8(dst, src, rect.width, (uint8_t)_colorKey);
+		else
+			row16((uint16_t*)dst, (const uint16_t*)src, rect.width, _blend, _colorKey != SPBLIT_NOKEY, (uint16_t)_colorKey);
+		dst += _dst->stride;
+		src += _src->stride;
+	}
+
+	return 0;
+}
+
+/*
+ * Compress _srcRect of _src, or all of it if _srcRect is NULL, into spans of pixels that differ from _colorKey.
+ * Release the sprite with SPDestroyRLESprite.
+ * Returns 0 on success, -1 if _srcRect is not within _src or out of memory.
+ */
+int SPCreateRLESprite(struct SPRLESprite* _sprite, const struct SPSurface* _src, const struct SPRect* _srcRect, uint32_t _colorKey)
+{
+	struct SPRect rect = { 0, 0, (int)_src->width, (int)_src->height };
+	if (_srcRect)
+		rect = *_srcRect;
+
+	memset(_sprite, 0, sizeof(struct SPRLESprite));
+	if (rect.x < 0 || rect.y < 0 || rect.width <= 0 || rect.height <= 0 ||
+		rect.x + rect.width > (int)_src->width || rect.y + rect.height > (int)_src->height)
+		return -1;
+
+	uint32_t bpp = bytesperpixel(_src->cmode);
+	// Worst case is a span for every other pixel, plus the end of row
+	uint32_t worstCase = rect.height * (rect.width * (4 + 2) + 4);
+	_sprite->data = (uint8_t*)malloc(worstCase);
+	_sprite->rowOffsets = (uint32_t*)malloc(rect.height * sizeof(uint32_t));
+	if (!_sprite->data || !_sprite->rowOffsets)
+	{
+		SPDestroyRLESprite(_sprite);
+		return -1;
+	}
+
+	_sprite->width = rect.width;
+	_sprite->height = rect.height;
+	_sprite->cmode = _src->cmode;
+
+	uint8_t* out = _sprite->data;
+	for (int y = 0; y < rect.height; ++y)
+	{
+		const uint8_t* row = (const uint8_t*)_src->pixels + (rect.y + y) * _src->stride + rect.x * bpp;
+		_sprite->rowOffsets[y] = (uint32_t)(out - _sprite->data);
+
+		int x = 0;
+		while (x < rect.width)
+		{
+			int start = x;
+			while (x < rect.width && (bpp == 1 ? row[x] : ((const uint16_t*)row)[x]) == _colorKey)
+				++x;
+			uint16_t skip = (uint16_t)(x - start);
+
+			start = x;
+			while (x < rect.width && (bpp == 1 ? row[x] : ((const uint16_t*)row)[x]) != _colorKey)
+				++x;
+			uint16_t count = (uint16_t)(x - start);
+
+			// A transparent end of row is left to the terminating span
+			if (!count)
+				break;
+
+			((uint16_t*)out)[0] = skip;
+			((uint16_t*)out)[1] = count;
+			out += 4;
+			memcpy(out, row + start * bpp, count * bpp);
+			out += (count * bpp + 1) & ~1u;
+		}
+
+		((uint16_t*)out)[0] = 0;
+		((uint16_t*)out)[1] = 0;
+		out += 4;
+	}
+
+	_sprite->dataSize = (uint32_t)(out - _sprite->data);
+	uint8_t* shrunk = (uint8_t*)realloc(_sprite->data, _sprite->dataSize);
+	if (shrunk)
+		_sprite->data = shrunk;
+
+	return 0;
+}
+
+/*
+ * Release the memory of an RLE sprite.
+ */
+void SPDestroyRLESprite(struct SPRLESprite* _sprite)
+{
+	free(_sprite->data);
+	free(_sprite->rowOffsets);
+	_sprite->data = NULL;
+	_sprite->rowOffsets = NULL;
+}
+
+/*
+ * Draw an RLE sprite at _x, _y of _dst, transparent pixels are skipped without being read or tested.
+ * Returns 0 on success, also when nothing was visible, or -1 if the color modes differ or _blend needs RGB565.
+ */
+int SPBlitRLE(struct SPSurface* _dst, int _x, int _y, const struct SPRLESprite* _sprite, enum ESPBlend _blend)
+{
+	if (_dst->cmode != _sprite->cmode || (_blend != EBL_None && _dst->cmode != ECM_16bit_RGB))
+		return -1;
+
+	struct SPRect rect = { 0, 0, (int)_sprite->width, (int)_sprite->height };
+	int x = _x, y = _y;
+	if (!cliprect(_dst, &x, &y, &rect))
+		return 0;
+
+	uint32_t bpp = bytesperpixel(_dst->cmode);
+	// Sprite columns that are visible
+	const int left = rect.x;
+	const int right = rect.x + rect.width;
+
+	for (int sy = rect.y; sy < rect.y + rect.height; ++sy)
+	{
+		const uint8_t* span = _sprite->data + _sprite->rowOffsets[sy];
+		uint8_t* row = (uint8_t*)_dst->pixels + (_y + sy) * _dst->stride;
+		int sx = 0;
+
+		for (;;)
+		{
+			uint16_t skip = ((const uint16_t*)span)[0];
+			uint16_t count = ((const uint16_t*)span)[1];
+			const uint8_t* pixels = span + 4;
+			if (!count)
+				break;
+			span = pixels + ((count * bpp + 1) & ~1u);
+
+			sx += skip;
+			int first = sx < left ? left : sx;
+			int last = sx + count > right ? right : sx + count;
+			if (first < last)
+			{
+				uint8_t* dst = row + (_x + first) * bpp;
+				const uint8_t* src = pixels + (first - sx) * bpp;
+				if (_blend == EBL_None)
+					SPCopyRect(dst, 0, src, 0, (last - first) * bpp, 1);
+				else
+					row16((uint16_t*)dst, (const uint16_t*)src, last - first, _blend, 0, 0);
+			}
+			sx += count;
+			if (sx >= right)
+				break;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "platform.h"
+
+// Software 2D blits between surfaces: a pixel pointer with its size, stride and color mode, such as the
+// VPU write page or a sprite sheet in ordinary memory. Blits are clipped against the destination and
+// need both surfaces in the same color mode. Color keyed sprites can be RLE compressed, which skips
+// transparent pixels without testing them. Blending is only available for RGB565, as palette indices
+// do not mix. NEON versions are used on the device, scalar versions everywhere else.
+
+// Passed as the color key to draw every source pixel
+#define SPBLIT_NOKEY		0xFFFFFFFF
+
+enum ESPBlend
+{
+	EBL_None,		// Source replaces the destination
+	EBL_Half,		// 50% mix of source and destination, RGB565 only
+	EBL_Add,		// Per channel saturated sum, RGB565 only
+	EBL_Count
+};
+
+struct SPSurface
+{
+	void* pixels;
+	uint32_t width, height;			// In pixels
+	uint32_t stride;				// In bytes
+	enum EColorMode cmode;
+};
+
+// Each row is a list of spans: a uint16_t count of transparent pixels to skip, a uint16_t count of pixels
+// that follow, and the pixels padded to 2 bytes. A span with no pixels ends the row.
+struct SPRLESprite
+{
+	uint32_t width, height;
+	enum EColorMode cmode;
+	uint32_t* rowOffsets;			// Byte offset of each row within data
+	uint8_t* data;
+	uint32_t dataSize;
+};
+
+void SPInitSurface(struct SPSurface* _surface, void* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride, enum EColorMode _cmode);
+void SPGetWriteSurface(struct EVideoContext* _context, struct SPSurface* _surface);
+
+int SPBlit(struct SPSurface* _dst, int _x, int _y, const struct SPSurface* _src, const struct SPRect* _srcRect, enum ESPBlend _blend, uint32_t _colorKey);
+int SPCreateRLESprite(struct SPRLESprite* _sprite, const struct SPSurface* _src, const struct SPRect* _srcRect, uint32_t _colorKey);
+void SPDestroyRLESprite(struct SPRLESprite* _sprite);
+int SPBlitRLE(struct SPSurface* _dst, int _x, int _y, const struct SPRLESprite* _sprite, enum ESPBlend _blend);
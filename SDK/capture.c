@@ -0,0 +1,828 @@
+#include "capture.h"
+#include "vpu.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Slots hold frames of the largest video mode
+#define SP_CAPTURE_MAX_WIDTH	640
+#define SP_CAPTURE_MAX_HEIGHT	480
+#define SP_CAPTURE_SLOT_SIZE	(SP_CAPTURE_MAX_WIDTH * SP_CAPTURE_MAX_HEIGHT * 2)
+
+// Nice value of the worker, it only runs when the program leaves the CPU to it
+#define SP_CAPTURE_NICE			10
+
+// LZ77 match finder of the deflate encoder
+#define SP_DEFLATE_HASH_BITS	14
+#define SP_DEFLATE_WINDOW		32768
+#define SP_DEFLATE_MAX_MATCH	258
+
+enum ESPCaptureState
+{
+	ECS_Free,
+	ECS_Copying,
+	ECS_Pending,
+	ECS_Encoding,
+};
+
+struct SPCaptureSlot
+{
+	enum ESPCaptureState state;
+	uint32_t sequence;				// Capture order, the worker always picks the oldest pending slot
+	enum ESPCaptureFormat format;
+	uint32_t width, height;
+	uint32_t stride;				// In bytes
+	enum EColorMode cmode;
+	uint8_t* pixels;
+	uint32_t palette[256];
+	char filename[PATH_MAX];
+};
+
+struct SPEncodeScratch
+{
+	uint8_t* rows;					// Filtered PNG scanlines
+	int32_t* head;					// Latest position of each hash
+};
+
+struct SPCapture
+{
+	struct SPPlatform* platform;
+	struct EVideoSwapContext* sc;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;			// Signaled when a slot becomes pending, or on shutdown
+	pthread_cond_t finished;		// Signaled when a slot is free again
+	int quit;
+	uint32_t nextSequence;
+	uint32_t depth;
+	struct SPCaptureSlot* slots;
+	struct SPCaptureStats stats;
+
+	// Requests served by the next swaps
+	int frameRequested;
+	enum ESPCaptureFormat frameFormat;
+	char frameFilename[PATH_MAX];
+	uint32_t sequenceRemaining;
+	uint32_t sequenceIndex;
+	uint32_t sequenceInterval;
+	uint32_t sequenceCountdown;
+	enum ESPCaptureFormat sequenceFormat;
+	char sequencePattern[PATH_MAX];
+
+	// Worker side
+	struct SPEncodeScratch scratch;
+	uint8_t* encoded;
+	uint32_t encodedSize;
+};
+
+static uint32_t s_crcTable[256];
+static uint16_t s_fixedCode[288];	// Bit reversed fixed Huffman codes
+static uint8_t s_fixedLength[288];
+static uint8_t s_lengthCode[SP_DEFLATE_MAX_MATCH + 1];
+static uint8_t s_distanceCode[512];
+static pthread_once_t s_tablesOnce = PTHREAD_ONCE_INIT;
+
+static const uint16_t s_lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t s_lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t s_distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t s_distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static uint32_t reversebits(uint32_t _code, uint32_t _length)
+{
+	uint32_t reversed = 0;
+	for (uint32_t i = 0; i < _length; ++i)
+		reversed |= ((_code >> i) & 1) << (_length - 1 - i);
+	return reversed;
+}
+
+static void buildtables(void)
+{
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		uint32_t c = i;
+		for (uint32_t k = 0; k < 8; ++k)
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		s_crcTable[i] = c;
+	}
+
+	for (uint32_t sym = 0; sym < 288; ++sym)
+	{
+		uint32_t code, length;
+		if (sym < 144) { code = 0x30 + sym; length = 8; }
+		else if (sym < 256) { code = 0x190 + sym - 144; length = 9; }
+		else if (sym < 280) { code = sym - 256; length = 7; }
+		else { code = 0xC0 + sym - 280; length = 8; }
+		s_fixedCode[sym] = (uint16_t)reversebits(code, length);
+		s_fixedLength[sym] = (uint8_t)length;
+	}
+
+	for (uint32_t code = 0; code < 29; ++code)
+	{
+		uint32_t end = code < 28 ? s_lengthBase[code + 1] : SP_DEFLATE_MAX_MATCH + 1;
+		for (uint32_t length = s_lengthBase[code]; length < end; ++length)
+			s_lengthCode[length] = (uint8_t)code;
+	}
+	// 258 has a code of its own, 227 + 31 is not used
+	s_lengthCode[SP_DEFLATE_MAX_MATCH] = 28;
+
+	// Distances up to 256 are looked up directly, longer ones by (distance - 1) >> 7
+	for (uint32_t code = 0; code < 30; ++code)
+	{
+		uint32_t end = code < 29 ? s_distanceBase[code + 1] : SP_DEFLATE_WINDOW + 1;
+		for (uint32_t distance = s_distanceBase[code]; distance < end; ++distance)
+		{
+			if (distance <= 256)
+				s_distanceCode[distance - 1] = (uint8_t)code;
+			else
+				s_distanceCode[256 + ((distance - 1) >> 7)] = (uint8_t)code;
+		}
+	}
+}
+
+struct SPBitWriter
+{
+	uint8_t* out;
+	uint32_t pos, size;
+	uint32_t bits, count;
+	int overflow;
+};
+
+static void putbyte(struct SPBitWriter* _writer, uint32_t _value)
+{
+	if (_writer->pos < _writer->size)
+		_writer->out[_writer->pos++] = (uint8_t)_value;
+	else
+		_writer->overflow = 1;
+}
+
+static void putbe32(struct SPBitWriter* _writer, uint32_t _value)
+{
+	putbyte(_writer, _value >> 24);
+	putbyte(_writer, _value >> 16);
+	putbyte(_writer, _value >> 8);
+	putbyte(_writer, _value);
+}
+
+static void putbits(struct SPBitWriter* _writer, uint32_t _value, uint32_t _count)
+{
+	_writer->bits |= _value << _writer->count;
+	_writer->count += _count;
+	while (_writer->count >= 8)
+	{
+		putbyte(_writer, _writer->bits);
+		_writer->bits >>= 8;
+		_writer->count -= 8;
+	}
+}
+
+static void flushbits(struct SPBitWriter* _writer)
+{
+	if (_writer->count)
+		putbyte(_writer, _writer->bits);
+	_writer->bits = _writer->count = 0;
+}
+
+static void putsymbol(struct SPBitWriter* _writer, uint32_t _symbol)
+{
+	putbits(_writer, s_fixedCode[_symbol], s_fixedLength[_symbol]);
+}
+
+/*
+ * Compress _size bytes as one fixed Huffman block, matching each position against the last one with the same hash.
+ */
+static void deflate(struct SPBitWriter* _writer, const uint8_t* _data, uint32_t _size, int32_t* _head)
+{
+	memset(_head, 0xFF, sizeof(int32_t) << SP_DEFLATE_HASH_BITS);
+	putbits(_writer, 1, 1);			// Final block
+	putbits(_writer, 1, 2);			// Fixed Huffman codes
+
+	uint32_t i = 0;
+	while (i < _size && !_writer->overflow)
+	{
+		if (i + 3 <= _size)
+		{
+			uint32_t key = ((uint32_t)_data[i] << 16) | ((uint32_t)_data[i + 1] << 8) | _data[i + 2];
+			uint32_t hash = (key * 2654435761u) >> (32 - SP_DEFLATE_HASH_BITS);
+			int32_t candidate = _head[hash];
+			_head[hash] = (int32_t)i;
+
+			if (candidate >= 0 && i - (uint32_t)candidate <= SP_DEFLATE_WINDOW && memcmp(_data + candidate, _data + i, 3) == 0)
+			{
+				uint32_t limit = _size - i < SP_DEFLATE_MAX_MATCH ? _size - i : SP_DEFLATE_MAX_MATCH;
+				uint32_t length = 3;
+				while (length < limit && _data[candidate + length] == _data[i + length])
+					++length;
+
+				uint32_t distance = i - (uint32_t)candidate;
+				uint32_t lcode = s_lengthCode[length];
+				putsymbol(_writer, 257 + lcode);
+				putbits(_writer, length - s_lengthBase[lcode], s_lengthExtra[lcode]);
+				uint32_t dcode = distance <= 256 ? s_distanceCode[distance - 1] : s_distanceCode[256 + ((distance - 1) >> 7)];
+				putbits(_writer, reversebits(dcode, 5), 5);
+				putbits(_writer, distance - s_distanceBase[dcode], s_distanceExtra[dcode]);
+				i += length;
+				continue;
+			}
+		}
+		putsymbol(_writer, _data[i]);
+		++i;
+	}
+
+	putsymbol(_writer, 256);
+	flushbits(_writer);
+}
+
+static uint32_t adler32(const uint8_t* _data, uint32_t _size)
+{
+	uint32_t a = 1, b = 0;
+	while (_size)
+	{
+		// Largest run that can not overflow b before the modulo
+		uint32_t count = _size < 5552 ? _size : 5552;
+		_size -= count;
+		while (count--)
+		{
+			a += *_data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+static uint32_t crc32(uint32_t _crc, const uint8_t* _data, uint32_t _size)
+{
+	_crc = ~_crc;
+	while (_size--)
+		_crc = s_crcTable[(_crc ^ *_data++) & 0xFF] ^ (_crc >> 8);
+	return ~_crc;
+}
+
+/*
+ * Close a PNG chunk started at _start, where its length goes, by writing the length and the CRC.
+ */
+static void endchunk(struct SPBitWriter* _writer, uint32_t _start)
+{
+	if (_writer->overflow)
+		return;
+	uint32_t length = _writer->pos - _start - 8;
+	uint8_t* chunk = _writer->out + _start;
+	chunk[0] = (uint8_t)(length >> 24);
+	chunk[1] = (uint8_t)(length >> 16);
+	chunk[2] = (uint8_t)(length >> 8);
+	chunk[3] = (uint8_t)length;
+	putbe32(_writer, crc32(0, chunk + 4, length + 4));
+}
+
+static uint32_t beginchunk(struct SPBitWriter* _writer, const char* _type)
+{
+	uint32_t start = _writer->pos;
+	putbe32(_writer, 0);
+	for (uint32_t i = 0; i < 4; ++i)
+		putbyte(_writer, (uint8_t)_type[i]);
+	return start;
+}
+
+static void torgb(const uint8_t* _row, uint32_t _x, enum EColorMode _cmode, const uint32_t* _palette, uint8_t* _rgb)
+{
+	if (_cmode == ECM_16bit_RGB)
+	{
+		uint32_t c = ((const uint16_t*)_row)[_x];
+		uint32_t r = (c >> 11) & 0x1F, g = (c >> 5) & 0x3F, b = c & 0x1F;
+		_rgb[0] = (uint8_t)((r << 3) | (r >> 2));
+		_rgb[1] = (uint8_t)((g << 2) | (g >> 4));
+		_rgb[2] = (uint8_t)((b << 3) | (b >> 2));
+	}
+	else
+	{
+		uint32_t c = _palette[_row[_x]];
+		_rgb[0] = (uint8_t)(c >> 16);
+		_rgb[1] = (uint8_t)(c >> 8);
+		_rgb[2] = (uint8_t)c;
+	}
+}
+
+/*
+ * Palette images stay indexed with a PLTE chunk, RGB565 is widened to 24 bits with the Sub filter.
+ */
+static void encodepng(struct SPBitWriter* _writer, const uint8_t* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride, enum EColorMode _cmode, const uint32_t* _palette, struct SPEncodeScratch* _scratch)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	for (uint32_t i = 0; i < 8; ++i)
+		putbyte(_writer, signature[i]);
+
+	int indexed = _cmode == ECM_8bit_Indexed;
+	uint32_t start = beginchunk(_writer, "IHDR");
+	putbe32(_writer, _width);
+	putbe32(_writer, _height);
+	putbyte(_writer, 8);
+	putbyte(_writer, indexed ? 3 : 2);
+	putbyte(_writer, 0);
+	putbyte(_writer, 0);
+	putbyte(_writer, 0);
+	endchunk(_writer, start);
+
+	if (indexed)
+	{
+		start = beginchunk(_writer, "PLTE");
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			putbyte(_writer, _palette[i] >> 16);
+			putbyte(_writer, _palette[i] >> 8);
+			putbyte(_writer, _palette[i]);
+		}
+		endchunk(_writer, start);
+	}
+
+	uint32_t rowBytes = 1 + _width * (indexed ? 1 : 3);
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		const uint8_t* src = _pixels + y * _stride;
+		uint8_t* dst = _scratch->rows + y * rowBytes;
+		if (indexed)
+		{
+			dst[0] = 0;
+			memcpy(dst + 1, src, _width);
+			continue;
+		}
+
+		dst[0] = 1;
+		uint8_t previous[3] = { 0, 0, 0 };
+		for (uint32_t x = 0; x < _width; ++x)
+		{
+			uint8_t rgb[3];
+			torgb(src, x, _cmode, _palette, rgb);
+			for (uint32_t c = 0; c < 3; ++c)
+			{
+				dst[1 + x * 3 + c] = (uint8_t)(rgb[c] - previous[c]);
+				previous[c] = rgb[c];
+			}
+		}
+	}
+
+	uint32_t rawSize = rowBytes * _height;
+	start = beginchunk(_writer, "IDAT");
+	putbyte(_writer, 0x78);
+	putbyte(_writer, 0x01);
+	deflate(_writer, _scratch->rows, rawSize, _scratch->head);
+	putbe32(_writer, adler32(_scratch->rows, rawSize));
+	endchunk(_writer, start);
+
+	start = beginchunk(_writer, "IEND");
+	endchunk(_writer, start);
+}
+
+static void encodeqoi(struct SPBitWriter* _writer, const uint8_t* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride, enum EColorMode _cmode, const uint32_t* _palette)
+{
+	putbyte(_writer, 'q');
+	putbyte(_writer, 'o');
+	putbyte(_writer, 'i');
+	putbyte(_writer, 'f');
+	putbe32(_writer, _width);
+	putbe32(_writer, _height);
+	putbyte(_writer, 3);			// RGB
+	putbyte(_writer, 0);			// sRGB
+
+	// Slots start out as transparent black like the decoder's, the pixels are all opaque
+	uint8_t index[64][4];
+	memset(index, 0, sizeof(index));
+	uint8_t prev[3] = { 0, 0, 0 };
+	uint32_t run = 0;
+	uint32_t remaining = _width * _height;
+	for (uint32_t y = 0; y < _height && !_writer->overflow; ++y)
+	{
+		const uint8_t* row = _pixels + y * _stride;
+		for (uint32_t x = 0; x < _width; ++x)
+		{
+			uint8_t px[3];
+			torgb(row, x, _cmode, _palette, px);
+			--remaining;
+
+			if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2])
+			{
+				if (++run == 62 || remaining == 0)
+				{
+					putbyte(_writer, 0xC0 | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+
+			if (run)
+			{
+				putbyte(_writer, 0xC0 | (run - 1));
+				run = 0;
+			}
+
+			uint32_t slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+			if (index[slot][0] == px[0] && index[slot][1] == px[1] && index[slot][2] == px[2] && index[slot][3] == 255)
+				putbyte(_writer, slot);
+			else
+			{
+				memcpy(index[slot], px, 3);
+				index[slot][3] = 255;
+				int32_t vr = (int8_t)(px[0] - prev[0]);
+				int32_t vg = (int8_t)(px[1] - prev[1]);
+				int32_t vb = (int8_t)(px[2] - prev[2]);
+				int32_t vgr = vr - vg, vgb = vb - vg;
+				if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+					putbyte(_writer, 0x40 | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
+				else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+				{
+					putbyte(_writer, 0x80 | (vg + 32));
+					putbyte(_writer, ((vgr + 8) << 4) | (vgb + 8));
+				}
+				else
+				{
+					putbyte(_writer, 0xFE);
+					putbyte(_writer, px[0]);
+					putbyte(_writer, px[1]);
+					putbyte(_writer, px[2]);
+				}
+			}
+			memcpy(prev, px, 3);
+		}
+	}
+
+	for (uint32_t i = 0; i < 7; ++i)
+		putbyte(_writer, 0);
+	putbyte(_writer, 1);
+}
+
+static int allocscratch(struct SPEncodeScratch* _scratch, uint32_t _width, uint32_t _height)
+{
+	_scratch->rows = (uint8_t*)malloc((1 + _width * 3) * _height);
+	_scratch->head = (int32_t*)malloc(sizeof(int32_t) << SP_DEFLATE_HASH_BITS);
+	return _scratch->rows && _scratch->head ? 0 : -1;
+}
+
+static void freescratch(struct SPEncodeScratch* _scratch)
+{
+	free(_scratch->rows);
+	free(_scratch->head);
+	_scratch->rows = NULL;
+	_scratch->head = NULL;
+}
+
+static uint32_t encodeimage(enum ESPCaptureFormat _format, const uint8_t* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride, enum EColorMode _cmode, const uint32_t* _palette, uint8_t* _out, uint32_t _outSize, struct SPEncodeScratch* _scratch)
+{
+	pthread_once(&s_tablesOnce, buildtables);
+
+	struct SPBitWriter writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.out = _out;
+	writer.size = _outSize;
+	if (_format == ECF_PNG)
+		encodepng(&writer, _pixels, _width, _height, _stride, _cmode, _palette, _scratch);
+	else
+		encodeqoi(&writer, _pixels, _width, _height, _stride, _cmode, _palette);
+	return writer.overflow ? 0 : writer.pos;
+}
+
+/*
+ * Largest file SPEncodeImage can produce for an image of _width x _height pixels.
+ */
+uint32_t SPGetEncodedSizeBound(enum ESPCaptureFormat _format, uint32_t _width, uint32_t _height)
+{
+	if (_format == ECF_PNG)
+	{
+		// Every byte as a 9 bit literal, plus the chunks around it
+		uint32_t raw = (1 + _width * 3) * _height;
+		return raw + raw / 8 + 1024;
+	}
+	return 14 + _width * _height * 4 + 8;
+}
+
+/*
+ * Compress an image into _out in _format. _palette holds 256 0xRRGGBB entries for 8 bit indexed images,
+ * and may be NULL for RGB565. PNG images need scratch memory, which is allocated for each call.
+ * Returns the encoded size, or 0 if _out is too small or memory runs out.
+ */
+uint32_t SPEncodeImage(enum ESPCaptureFormat _format, const uint8_t* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride, enum EColorMode _cmode, const uint32_t* _palette, uint8_t* _out, uint32_t _outSize)
+{
+	struct SPEncodeScratch scratch = { NULL, NULL };
+	if (_format == ECF_PNG && allocscratch(&scratch, _width, _height) != 0)
+	{
+		freescratch(&scratch);
+		return 0;
+	}
+	uint32_t size = encodeimage(_format, _pixels, _width, _height, _stride, _cmode, _palette, _out, _outSize, &scratch);
+	freescratch(&scratch);
+	return size;
+}
+
+static int writefile(const char* _filename, const uint8_t* _data, uint32_t _size)
+{
+	FILE* file = fopen(_filename, "wb");
+	if (!file)
+		return -1;
+	size_t written = fwrite(_data, 1, _size, file);
+	return (fclose(file) == 0 && written == _size) ? 0 : -1;
+}
+
+static void* captureworker(void* _arg)
+{
+	struct SPCapture* capture = (struct SPCapture*)_arg;
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), SP_CAPTURE_NICE);
+	SPTraceSetThreadName("SPCapture");
+
+	pthread_mutex_lock(&capture->lock);
+	while (!capture->quit)
+	{
+		struct SPCaptureSlot* next = NULL;
+		for (uint32_t i = 0; i < capture->depth; ++i)
+		{
+			struct SPCaptureSlot* slot = &capture->slots[i];
+			if (slot->state == ECS_Pending && (!next || (int32_t)(slot->sequence - next->sequence) < 0))
+				next = slot;
+		}
+
+		if (!next)
+		{
+			pthread_cond_wait(&capture->queued, &capture->lock);
+			continue;
+		}
+
+		next->state = ECS_Encoding;
+		pthread_mutex_unlock(&capture->lock);
+
+		SP_TRACE_BEGIN("SPCaptureEncode");
+		uint64_t encodeStart = SPGetTimeNs();
+		uint32_t size = encodeimage(next->format, next->pixels, next->width, next->height, next->stride, next->cmode, next->palette, capture->encoded, capture->encodedSize, &capture->scratch);
+		uint64_t writeStart = SPGetTimeNs();
+		int err = size ? writefile(next->filename, capture->encoded, size) : -1;
+		uint64_t writeEnd = SPGetTimeNs();
+		SP_TRACE_END("SPCaptureEncode");
+
+		pthread_mutex_lock(&capture->lock);
+		if (err)
+			capture->stats.failedCount++;
+		else
+		{
+			capture->stats.frameCount++;
+			capture->stats.byteCount += size;
+		}
+		capture->stats.encodeNs += writeStart - encodeStart;
+		capture->stats.writeNs += writeEnd - writeStart;
+		next->state = ECS_Free;
+		pthread_cond_broadcast(&capture->finished);
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+	return NULL;
+}
+
+/*
+ * Create a capture with _depth frame slots and attach it to _sc, so VPUSwapPages can copy the frames asked for.
+ * More slots ride out slow writes, each takes 600KB. Requests and swaps have to come from one thread.
+ * Returns NULL on failure.
+ */
+struct SPCapture* SPCreateCapture(struct SPPlatform* _platform, struct EVideoSwapContext* _sc, uint32_t _depth)
+{
+	struct SPCapture* capture = (struct SPCapture*)calloc(1, sizeof(struct SPCapture));
+	if (!capture)
+		return NULL;
+
+	capture->platform = _platform;
+	capture->sc = _sc;
+	capture->depth = _depth ? _depth : 1;
+	capture->slots = (struct SPCaptureSlot*)calloc(capture->depth, sizeof(struct SPCaptureSlot));
+	capture->encodedSize = SPGetEncodedSizeBound(ECF_PNG, SP_CAPTURE_MAX_WIDTH, SP_CAPTURE_MAX_HEIGHT);
+	if (capture->encodedSize < SPGetEncodedSizeBound(ECF_QOI, SP_CAPTURE_MAX_WIDTH, SP_CAPTURE_MAX_HEIGHT))
+		capture->encodedSize = SPGetEncodedSizeBound(ECF_QOI, SP_CAPTURE_MAX_WIDTH, SP_CAPTURE_MAX_HEIGHT);
+	capture->encoded = (uint8_t*)malloc(capture->encodedSize);
+	int err = !capture->slots || !capture->encoded || allocscratch(&capture->scratch, SP_CAPTURE_MAX_WIDTH, SP_CAPTURE_MAX_HEIGHT) != 0;
+	for (uint32_t i = 0; !err && i < capture->depth; ++i)
+		err = (capture->slots[i].pixels = (uint8_t*)malloc(SP_CAPTURE_SLOT_SIZE)) == NULL;
+
+	pthread_mutex_init(&capture->lock, NULL);
+	pthread_cond_init(&capture->queued, NULL);
+	pthread_cond_init(&capture->finished, NULL);
+
+	if (err || pthread_create(&capture->worker, NULL, captureworker, capture) != 0)
+	{
+		pthread_cond_destroy(&capture->finished);
+		pthread_cond_destroy(&capture->queued);
+		pthread_mutex_destroy(&capture->lock);
+		for (uint32_t i = 0; capture->slots && i < capture->depth; ++i)
+			free(capture->slots[i].pixels);
+		freescratch(&capture->scratch);
+		free(capture->encoded);
+		free(capture->slots);
+		free(capture);
+		return NULL;
+	}
+
+	_sc->capture = capture;
+	return capture;
+}
+
+/*
+ * Write out the frames already captured, then stop the worker and detach from the swap context.
+ */
+void SPDestroyCapture(struct SPCapture* _capture)
+{
+	if (!_capture)
+		return;
+
+	SPWaitCapture(_capture);
+	if (_capture->sc->capture == _capture)
+		_capture->sc->capture = NULL;
+
+	pthread_mutex_lock(&_capture->lock);
+	_capture->quit = 1;
+	pthread_cond_signal(&_capture->queued);
+	pthread_mutex_unlock(&_capture->lock);
+	pthread_join(_capture->worker, NULL);
+
+	pthread_cond_destroy(&_capture->finished);
+	pthread_cond_destroy(&_capture->queued);
+	pthread_mutex_destroy(&_capture->lock);
+	for (uint32_t i = 0; i < _capture->depth; ++i)
+		free(_capture->slots[i].pixels);
+	freescratch(&_capture->scratch);
+	free(_capture->encoded);
+	free(_capture->slots);
+	free(_capture);
+}
+
+/*
+ * Capture the frame the next VPUSwapPages presents into _filename.
+ * Returns 0 on success, -1 if the file name is too long.
+ */
+int SPCaptureFrame(struct SPCapture* _capture, const char* _filename, enum ESPCaptureFormat _format)
+{
+	if (strlen(_filename) >= PATH_MAX)
+		return -1;
+	pthread_mutex_lock(&_capture->lock);
+	strcpy(_capture->frameFilename, _filename);
+	_capture->frameFormat = _format;
+	_capture->frameRequested = 1;
+	pthread_mutex_unlock(&_capture->lock);
+	return 0;
+}
+
+/*
+ * Capture _frameCount frames, one every _interval swaps starting with the next one, into files named by
+ * the printf pattern _pattern, which takes the frame number as an unsigned int, such as "frame%04u.qoi".
+ * Starting a sequence replaces the one in progress.
+ * Returns 0 on success, -1 if the pattern is too long.
+ */
+int SPCaptureSequence(struct SPCapture* _capture, const char* _pattern, enum ESPCaptureFormat _format, uint32_t _frameCount, uint32_t _interval)
+{
+	if (strlen(_pattern) >= PATH_MAX)
+		return -1;
+	pthread_mutex_lock(&_capture->lock);
+	strcpy(_capture->sequencePattern, _pattern);
+	_capture->sequenceFormat = _format;
+	_capture->sequenceRemaining = _frameCount;
+	_capture->sequenceIndex = 0;
+	_capture->sequenceInterval = _interval ? _interval : 1;
+	_capture->sequenceCountdown = 0;
+	pthread_mutex_unlock(&_capture->lock);
+	return 0;
+}
+
+/*
+ * Reserve a free slot for a frame, counting a drop if there is none. Called with the lock held.
+ */
+static struct SPCaptureSlot* reserveslot(struct SPCapture* _capture)
+{
+	for (uint32_t i = 0; i < _capture->depth; ++i)
+	{
+		if (_capture->slots[i].state == ECS_Free)
+		{
+			_capture->slots[i].state = ECS_Copying;
+			return &_capture->slots[i];
+		}
+	}
+	_capture->stats.droppedCount++;
+	return NULL;
+}
+
+/*
+ * Copy _height rows of pixels into a reserved slot and hand it to the worker.
+ */
+static void queueslot(struct SPCapture* _capture, struct SPCaptureSlot* _slot, const uint8_t* _pixels, uint32_t _stride, struct EVideoContext* _context)
+{
+	uint64_t copyStart = SPGetTimeNs();
+	SP_TRACE_BEGIN("SPCaptureCopy");
+	uint32_t rowBytes = _slot->width * (_slot->cmode == ECM_16bit_RGB ? 2 : 1);
+	if (_stride == rowBytes)
+		memcpy(_slot->pixels, _pixels, rowBytes * _slot->height);
+	else
+		for (uint32_t y = 0; y < _slot->height; ++y)
+			memcpy(_slot->pixels + y * rowBytes, _pixels + y * _stride, rowBytes);
+	_slot->stride = rowBytes;
+	if (_slot->cmode == ECM_8bit_Indexed)
+		memcpy(_slot->palette, _context->m_palette, sizeof(_slot->palette));
+	SP_TRACE_END("SPCaptureCopy");
+	uint64_t copyNs = SPGetTimeNs() - copyStart;
+
+	pthread_mutex_lock(&_capture->lock);
+	_capture->stats.copyNs += copyNs;
+	if (copyNs > _capture->stats.worstCopyNs)
+		_capture->stats.worstCopyNs = copyNs;
+	_slot->sequence = _capture->nextSequence++;
+	_slot->state = ECS_Pending;
+	pthread_cond_signal(&_capture->queued);
+	pthread_mutex_unlock(&_capture->lock);
+}
+
+/*
+ * Capture the pixels of a surface right away, such as a tile layer or a racing the beam framebuffer
+ * that are never swapped. Up to 640x480.
+ * Returns 0 on success, -1 if the surface is too large or the frame was dropped.
+ */
+int SPCaptureSurface(struct SPCapture* _capture, const struct SPSurface* _surface, const char* _filename, enum ESPCaptureFormat _format)
+{
+	if (_surface->width > SP_CAPTURE_MAX_WIDTH || _surface->height > SP_CAPTURE_MAX_HEIGHT || strlen(_filename) >= PATH_MAX)
+		return -1;
+
+	pthread_mutex_lock(&_capture->lock);
+	struct SPCaptureSlot* slot = reserveslot(_capture);
+	pthread_mutex_unlock(&_capture->lock);
+	if (!slot)
+		return -1;
+
+	slot->format = _format;
+	slot->width = _surface->width;
+	slot->height = _surface->height;
+	slot->cmode = _surface->cmode;
+	strcpy(slot->filename, _filename);
+	queueslot(_capture, slot, (const uint8_t*)_surface->pixels, _surface->stride, _capture->platform->vx);
+	return 0;
+}
+
+/*
+ * Copy the page VPUSwapPages is presenting if a frame is due. Called by VPUSwapPages.
+ */
+void SPCaptureSwap(struct EVideoContext* _context, struct EVideoSwapContext* _sc, const struct SPSizeAlloc* _presented)
+{
+	struct SPCapture* capture = _sc->capture;
+	if (!capture)
+		return;
+
+	pthread_mutex_lock(&capture->lock);
+	struct SPCaptureSlot* slot = NULL;
+	if (capture->frameRequested)
+	{
+		capture->frameRequested = 0;
+		if ((slot = reserveslot(capture)) != NULL)
+		{
+			slot->format = capture->frameFormat;
+			strcpy(slot->filename, capture->frameFilename);
+		}
+	}
+	else if (capture->sequenceRemaining && capture->sequenceCountdown-- == 0)
+	{
+		capture->sequenceCountdown = capture->sequenceInterval - 1;
+		capture->sequenceRemaining--;
+		uint32_t index = capture->sequenceIndex++;
+		if ((slot = reserveslot(capture)) != NULL)
+		{
+			slot->format = capture->sequenceFormat;
+			snprintf(slot->filename, PATH_MAX, capture->sequencePattern, index);
+		}
+	}
+	pthread_mutex_unlock(&capture->lock);
+	if (!slot)
+		return;
+
+	slot->width = _context->m_graphicsWidth;
+	slot->height = _context->m_graphicsHeight;
+	slot->cmode = _context->m_cmode;
+	queueslot(capture, slot, _presented->cpuAddress, _context->m_strideInWords * 4, _context);
+}
+
+/*
+ * Wait until every captured frame is written.
+ */
+void SPWaitCapture(struct SPCapture* _capture)
+{
+	pthread_mutex_lock(&_capture->lock);
+	for (;;)
+	{
+		int busy = 0;
+		for (uint32_t i = 0; i < _capture->depth; ++i)
+			busy |= _capture->slots[i].state != ECS_Free;
+		if (!busy)
+			break;
+		pthread_cond_wait(&_capture->finished, &_capture->lock);
+	}
+	pthread_mutex_unlock(&_capture->lock);
+}
+
+void SPGetCaptureStats(struct SPCapture* _capture, struct SPCaptureStats* _stats)
+{
+	pthread_mutex_lock(&_capture->lock);
+	*_stats = _capture->stats;
+	pthread_mutex_unlock(&_capture->lock);
+}
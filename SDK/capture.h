@@ -0,0 +1,44 @@
+#pragma once
+
+#include "platform.h"
+#include "blit.h"
+
+// Screenshots and frame sequences of a running program, saved as QOI or PNG files. A capture is attached
+// to a swap context, and VPUSwapPages copies the page it presents into a free slot when a frame was asked
+// for, which is the only cost on the render thread. A worker thread at a lower priority converts the copy
+// to 24 bit color, 8 bit indexed frames through the palette at the time of the swap, compresses it and
+// writes the file. Requests that find every slot busy are dropped and counted, rendering never waits.
+// PNG files use a single fixed Huffman deflate block, which trades some size for speed.
+
+enum ESPCaptureFormat
+{
+	ECF_QOI,
+	ECF_PNG,
+	ECF_Count
+};
+
+struct SPCaptureStats
+{
+	uint32_t frameCount;			// Files written
+	uint32_t droppedCount;			// Frames not captured as every slot was busy
+	uint32_t failedCount;			// Frames that could not be written
+	uint64_t byteCount;				// Bytes written
+	uint64_t copyNs;				// Time the render thread spent copying frames
+	uint64_t worstCopyNs;
+	uint64_t encodeNs;				// Time the worker spent converting and compressing
+	uint64_t writeNs;				// Time the worker spent writing files
+};
+
+struct SPCapture;
+
+struct SPCapture* SPCreateCapture(struct SPPlatform* _platform, struct EVideoSwapContext* _sc, uint32_t _depth);
+void SPDestroyCapture(struct SPCapture* _capture);
+int SPCaptureFrame(struct SPCapture* _capture, const char* _filename, enum ESPCaptureFormat _format);
+int SPCaptureSequence(struct SPCapture* _capture, const char* _pattern, enum ESPCaptureFormat _format, uint32_t _frameCount, uint32_t _interval);
+int SPCaptureSurface(struct SPCapture* _capture, const struct SPSurface* _surface, const char* _filename, enum ESPCaptureFormat _format);
+void SPCaptureSwap(struct EVideoContext* _context, struct EVideoSwapContext* _sc, const struct SPSizeAlloc* _presented);
+void SPWaitCapture(struct SPCapture* _capture);
+void SPGetCaptureStats(struct SPCapture* _capture, struct SPCaptureStats* _stats);
+
+uint32_t SPGetEncodedSizeBound(enum ESPCaptureFormat _format, uint32_t _width, uint32_t _height);
+uint32_t SPEncodeImage(enum ESPCaptureFormat _format, const uint8_t* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride, enum EColorMode _cmode, const uint32_t* _palette, uint8_t* _out, uint32_t _outSize);
@@ -0,0 +1,278 @@
+#include "clock.h"
+#include "vpu.h"
+#include "apu.h"
+#include "trace.h"
+
+// Minimum number of vblanks between two measurements of the display period, about a second
+#define SP_CLOCK_PERIOD_SPAN		64
+// Audio is considered stopped after this many buffer periods without a swap
+#define SP_CLOCK_AUDIO_TIMEOUT		4
+
+static uint64_t roundedperiods(uint64_t _elapsedNs, uint64_t _periodNs)
+{
+	return (_elapsedNs + _periodNs / 2) / _periodNs;
+}
+
+/*
+ * Move the display timeline to a vblank seen at _vblankNs with toggle state _bit.
+ * The number of vblanks since the last one comes from the elapsed time, and is corrected by one
+ * if the toggle says an odd number of vblanks went by but the time says even, or the other way around.
+ */
+static void observevblank(struct SPClock *_clock, uint32_t _bit, uint64_t _vblankNs)
+{
+	uint64_t period = _clock->m_framePeriodNs;
+	uint64_t elapsed = _vblankNs > _clock->m_lastVBlankNs ? _vblankNs - _clock->m_lastVBlankNs : 0;
+	uint64_t count = roundedperiods(elapsed, period);
+
+	if ((count & 1) != (_bit ^ _clock->m_vblankBit))
+	{
+		if (count == 0 || elapsed > count * period)
+			++count;
+		else
+			--count;
+	}
+
+	if (count == 0)
+		return;
+
+	_clock->m_vblankCount += count;
+	_clock->m_lastVBlankNs = _vblankNs;
+	_clock->m_lastVBlankDisplayNs += count * period;
+	_clock->m_vblankBit = _bit;
+
+	// Measure the period over many vblanks, so the error of a single observation is spread thin
+	uint64_t span = _clock->m_vblankCount - _clock->m_anchorVBlankCount;
+	if (span >= SP_CLOCK_PERIOD_SPAN)
+	{
+		uint64_t measured = (_vblankNs - _clock->m_anchorVBlankNs) / span;
+		if (measured > (period * 3) / 4 && measured < (period * 5) / 4)
+			_clock->m_framePeriodNs = (period * 3 + measured) / 4;
+		_clock->m_anchorVBlankNs = _vblankNs;
+		_clock->m_anchorVBlankCount = _clock->m_vblankCount;
+	}
+}
+
+static uint64_t displaytime(struct SPClock *_clock, uint64_t _now)
+{
+	uint64_t displayNs = _clock->m_lastVBlankDisplayNs + (_now > _clock->m_lastVBlankNs ? _now - _clock->m_lastVBlankNs : 0);
+	if (displayNs < _clock->m_lastDisplayNs)
+		displayNs = _clock->m_lastDisplayNs;
+	_clock->m_lastDisplayNs = displayNs;
+	return displayNs;
+}
+
+/*
+ * Count APU buffer swaps and compare the audio time they add up to with the display time.
+ * The swap is only seen when we sample, so the skew is filtered to hide the sampling jitter.
+ */
+static void observeaudio(struct SPClock *_clock, uint64_t _now)
+{
+	struct EAudioContext *ac = _clock->m_platform->ac;
+	uint64_t period = ac->m_framePeriodNs;
+	uint32_t bit = APUFrame(ac);
+
+	// Restart when the buffer size or sample rate changes, or when the APU stopped swapping
+	if (_clock->m_audioPeriodNs && (period != _clock->m_audioPeriodNs || _now - _clock->m_lastAudioNs > period * SP_CLOCK_AUDIO_TIMEOUT))
+		_clock->m_audioPeriodNs = 0;
+
+	if (bit == _clock->m_audioBit || !period)
+	{
+		_clock->m_audioBit = bit;
+		return;
+	}
+	_clock->m_audioBit = bit;
+
+	if (!_clock->m_audioPeriodNs)
+	{
+		_clock->m_audioPeriodNs = period;
+		_clock->m_audioFrameCount = 0;
+		_clock->m_audioStartNs = displaytime(_clock, _now);
+		_clock->m_lastAudioNs = _now;
+		_clock->m_skewNs = 0;
+		return;
+	}
+
+	// The toggle flipped, so an odd number of buffers went by
+	uint64_t count = roundedperiods(_now - _clock->m_lastAudioNs, period);
+	if ((count & 1) == 0)
+		++count;
+	_clock->m_audioFrameCount += count;
+	_clock->m_lastAudioNs = _now;
+
+	int64_t audioNs = (int64_t)(_clock->m_audioFrameCount * period);
+	int64_t videoNs = (int64_t)(displaytime(_clock, _now) - _clock->m_audioStartNs);
+	_clock->m_skewNs += (audioNs - videoNs - _clock->m_skewNs) / 8;
+}
+
+/*
+ * Initialize a clock for _platform, starting at zero.
+ * A clock is meant to be used from one thread, usually the one that presents frames.
+ */
+void SPClockInit(struct SPClock *_clock, struct SPPlatform *_platform)
+{
+	__builtin_memset(_clock, 0, sizeof(struct SPClock));
+
+	uint64_t now = SPGetTimeNs();
+	_clock->m_platform = _platform;
+	_clock->m_originNs = now;
+	_clock->m_framePeriodNs = _platform->vx->m_framePeriodNs ? _platform->vx->m_framePeriodNs : VPU_DEFAULT_FRAME_PERIOD_NS;
+	_clock->m_vblankBit = VPUReadVBlankCounter(_platform->vx);
+	_clock->m_lastVBlankNs = now;
+	_clock->m_anchorVBlankNs = now;
+	_clock->m_audioBit = APUFrame(_platform->ac);
+	_clock->m_targetInterval = 1;
+}
+
+/*
+ * Sample the vblank toggle, scanline and APU toggle, and advance the timelines.
+ * Every SPClock function calls this, call it directly from long running loops that don't,
+ * at least once per frame, so that the vblank count keeps up.
+ */
+void SPClockUpdate(struct SPClock *_clock)
+{
+	struct EVideoContext *vx = _clock->m_platform->vx;
+
+	// Toggle and scanline come from one status read so they can't straddle a vblank
+	uint64_t now = SPGetTimeNs();
+	uint32_t status = videoread32(_clock->m_platform, 0);
+	uint32_t bit = status & 0x1;
+	uint32_t scanline = ((status & 0x7FE) >> 1) % VPU_SCANLINE_COUNT;
+	_clock->m_scanline = scanline;
+
+	// The scanline tells how long ago the latest vblank was
+	uint32_t lines = (scanline + VPU_SCANLINE_COUNT - vx->m_vblankScanline) % VPU_SCANLINE_COUNT;
+	uint64_t sinceVBlank = (uint64_t)lines * _clock->m_framePeriodNs / VPU_SCANLINE_COUNT;
+	observevblank(_clock, bit, now - sinceVBlank);
+
+	observeaudio(_clock, now);
+}
+
+/*
+ * Time since SPClockInit in nanoseconds, straight from CLOCK_MONOTONIC.
+ */
+uint64_t SPClockGetTimeNs(struct SPClock *_clock)
+{
+	return SPGetTimeNs() - _clock->m_originNs;
+}
+
+/*
+ * Time since SPClockInit in nanoseconds, advancing by exactly one measured frame period per vblank.
+ * Differences taken at the same point of two frames are whole multiples of the frame period, free of
+ * scheduling jitter, which makes this the time to step game logic and animation with.
+ */
+uint64_t SPClockGetDisplayTimeNs(struct SPClock *_clock)
+{
+	SPClockUpdate(_clock);
+	return displaytime(_clock, SPGetTimeNs());
+}
+
+/*
+ * Number of vblanks since SPClockInit.
+ */
+uint64_t SPClockGetVBlankCount(struct SPClock *_clock)
+{
+	SPClockUpdate(_clock);
+	return _clock->m_vblankCount;
+}
+
+/*
+ * Predicts when a vblank will happen, in SPClockGetTimeNs time.
+ * _vblanksAhead of 0 is the next vblank, 1 the one after, and so on.
+ */
+uint64_t SPClockPredictVBlankNs(struct SPClock *_clock, uint32_t _vblanksAhead)
+{
+	SPClockUpdate(_clock);
+
+	uint64_t now = SPGetTimeNs();
+	uint64_t period = _clock->m_framePeriodNs;
+	uint64_t passed = now > _clock->m_lastVBlankNs ? (now - _clock->m_lastVBlankNs) / period : 0;
+	return _clock->m_lastVBlankNs + (passed + 1 + _vblanksAhead) * period - _clock->m_originNs;
+}
+
+/*
+ * Set how many vblanks each frame is shown for, 1 for 60Hz, 2 for 30Hz and so on.
+ */
+void SPClockSetTargetRate(struct SPClock *_clock, uint32_t _vblanksPerFrame)
+{
+	_clock->m_targetInterval = _vblanksPerFrame ? _vblanksPerFrame : 1;
+}
+
+/*
+ * Wait for the vblank the next frame is due on, then record the frame as SPClockMarkFrame does.
+ * Returns right away if the frame is already late.
+ * Returns the number of vblanks the frame missed its slot by, 0 if it was on time.
+ */
+uint32_t SPClockWaitFrame(struct SPClock *_clock)
+{
+	struct EVideoContext *vx = _clock->m_platform->vx;
+
+	SPClockUpdate(_clock);
+	uint64_t due = _clock->m_lastFrameVBlank + _clock->m_targetInterval;
+	while (_clock->m_vblankCount < due)
+	{
+		VPUWaitVSync(vx);
+		// The toggle has just flipped, so this vblank time is exact
+		observevblank(_clock, VPUReadVBlankCounter(vx), SPGetTimeNs());
+	}
+
+	return SPClockMarkFrame(_clock);
+}
+
+/*
+ * Record that a frame was presented now, for programs that wait for the vblank on their own.
+ * Returns the number of vblanks the frame missed its slot by, 0 if it was on time.
+ */
+uint32_t SPClockMarkFrame(struct SPClock *_clock)
+{
+	SPClockUpdate(_clock);
+
+	uint64_t now = SPGetTimeNs();
+	uint32_t missed = 0;
+	struct SPFrameStats *stats = &_clock->m_stats;
+
+	if (_clock->m_lastFrameNs)
+	{
+		uint64_t due = _clock->m_lastFrameVBlank + _clock->m_targetInterval;
+		if (_clock->m_vblankCount > due)
+		{
+			missed = (uint32_t)(_clock->m_vblankCount - due);
+			stats->missedFrames++;
+			stats->missedVBlanks += missed;
+		}
+
+		uint64_t frameNs = now - _clock->m_lastFrameNs;
+		uint64_t bin = frameNs / 1000000ull;
+		stats->histogram[bin < SP_FRAME_HISTOGRAM_BINS ? bin : SP_FRAME_HISTOGRAM_BINS - 1]++;
+		if (frameNs > stats->worstFrameNs)
+			stats->worstFrameNs = frameNs;
+		_clock->m_totalFrameNs += frameNs;
+		stats->frameCount++;
+	}
+
+	_clock->m_lastFrameVBlank = _clock->m_vblankCount;
+	_clock->m_lastFrameNs = now;
+	SP_TRACE_INSTANT("SPClockFrame", missed);
+
+	return missed;
+}
+
+/*
+ * Retrieve frame pacing statistics, display rate and audio/video skew.
+ */
+void SPClockGetFrameStats(struct SPClock *_clock, struct SPFrameStats *_stats)
+{
+	*_stats = _clock->m_stats;
+	_stats->averageFrameMs = _stats->frameCount ? (float)((double)_clock->m_totalFrameNs / (1000000.0 * _stats->frameCount)) : 0.f;
+	_stats->displayHz = (float)(1000000000.0 / (double)_clock->m_framePeriodNs);
+	_stats->audioVideoSkewMs = _clock->m_audioPeriodNs ? (float)((double)_clock->m_skewNs / 1000000.0) : 0.f;
+}
+
+/*
+ * Clear the frame statistics, for example after loading when the first frames are expected to be slow.
+ */
+void SPClockResetFrameStats(struct SPClock *_clock)
+{
+	__builtin_memset(&_clock->m_stats, 0, sizeof(struct SPFrameStats));
+	_clock->m_totalFrameNs = 0;
+	_clock->m_lastFrameNs = 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "platform.h"
+
+// One timebase for the whole program, built from CLOCK_MONOTONIC, the VPU vblank toggle and the APU buffer
+// toggle. Both toggles only carry one bit, so SPClockUpdate() reconstructs how many vblanks and audio buffers
+// went by from the scanline and the elapsed time, and keeps the measured display period drift corrected.
+// Frame pacing is done against the display: SPClockWaitFrame() waits for the vblank a frame is due on,
+// and records missed vblanks and frame times for SPClockGetFrameStats().
+
+// Frame time histogram, 1ms per bin, the last bin collects everything slower
+#define SP_FRAME_HISTOGRAM_BINS	64
+
+struct SPFrameStats
+{
+	uint64_t frameCount;			// Frames recorded by SPClockWaitFrame / SPClockMarkFrame
+	uint64_t missedFrames;			// Frames that were presented after the vblank they were due on
+	uint64_t missedVBlanks;			// Total vblanks lost by late frames
+	uint64_t worstFrameNs;			// Longest time between two frames
+	float averageFrameMs;			// Average time between two frames
+	float displayHz;				// Measured display refresh rate
+	float audioVideoSkewMs;			// Audio time minus display time since audio started, positive when audio runs ahead
+	uint32_t histogram[SP_FRAME_HISTOGRAM_BINS];
+};
+
+struct SPClock
+{
+	struct SPPlatform *m_platform;
+	uint64_t m_originNs;			// CLOCK_MONOTONIC at SPClockInit
+
+	// Display timeline
+	uint32_t m_vblankBit;			// Vblank toggle at the last observed vblank
+	uint32_t m_scanline;			// Scanline of the last SPClockUpdate, from the same status read as the toggle
+	uint64_t m_vblankCount;			// Vblanks since SPClockInit
+	uint64_t m_lastVBlankNs;		// Time of vblank number m_vblankCount
+	uint64_t m_lastVBlankDisplayNs;	// Display time of vblank number m_vblankCount
+	uint64_t m_anchorVBlankNs;		// Reference vblank the period is measured against
+	uint64_t m_anchorVBlankCount;
+	uint64_t m_framePeriodNs;		// Drift corrected display frame period
+	uint64_t m_lastDisplayNs;		// Last value returned by SPClockGetDisplayTimeNs, which never goes back
+
+	// Audio timeline
+	uint32_t m_audioBit;
+	uint64_t m_audioFrameCount;		// APU buffer swaps since audio was first seen running
+	uint64_t m_lastAudioNs;
+	uint64_t m_audioPeriodNs;		// APU buffer period the count was taken with, 0 while audio is stopped
+	uint64_t m_audioStartNs;		// Display time at the first observed buffer swap
+	int64_t m_skewNs;				// Filtered audio minus display time
+
+	// Frame pacing
+	uint32_t m_targetInterval;		// Vblanks per frame
+	uint64_t m_lastFrameVBlank;
+	uint64_t m_lastFrameNs;
+	uint64_t m_totalFrameNs;
+	struct SPFrameStats m_stats;
+};
+
+void SPClockInit(struct SPClock *_clock, struct SPPlatform *_platform);
+void SPClockUpdate(struct SPClock *_clock);
+
+uint64_t SPClockGetTimeNs(struct SPClock *_clock);
+uint64_t SPClockGetDisplayTimeNs(struct SPClock *_clock);
+uint64_t SPClockGetVBlankCount(struct SPClock *_clock);
+uint64_t SPClockPredictVBlankNs(struct SPClock *_clock, uint32_t _vblanksAhead);
+
+void SPClockSetTargetRate(struct SPClock *_clock, uint32_t _vblanksPerFrame);
+uint32_t SPClockWaitFrame(struct SPClock *_clock);
+uint32_t SPClockMarkFrame(struct SPClock *_clock);
+void SPClockGetFrameStats(struct SPClock *_clock, struct SPFrameStats *_stats);
+void SPClockResetFrameStats(struct SPClock *_clock);
@@ -0,0 +1,456 @@
+#include "simd.h"
+#include "color.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Error diffusion works through images in strips of this many pixels, with the error rows on the stack
+#define SP_DIFFUSION_STRIP		1024
+
+static const uint8_t s_bayer[16] = {
+	0, 8, 2, 10,
+	12, 4, 14, 6,
+	3, 11, 1, 9,
+	15, 7, 13, 5,
+};
+
+static inline uint32_t colorkey(uint32_t _r, uint32_t _g, uint32_t _b)
+{
+	return ((_r >> 3) << 10) | ((_g >> 3) << 5) | (_b >> 3);
+}
+
+static inline uint32_t clamp8(int32_t _value)
+{
+	return _value < 0 ? 0 : (_value > 255 ? 255 : (uint32_t)_value);
+}
+
+/*
+ * Pack pixels to RGB565. r * 249 >> 11 and g * 253 >> 10 scale to 31 and 63, the biases round them:
+ * 1014 and 505 round to nearest, the ordered ones spread evenly over one step. Both fit in 16 bits.
+ */
+static void torgb565(uint16_t* _dst, const uint8_t* _src, uint32_t _width, const uint16_t* _rbBias, const uint16_t* _gBias)
+{
+	uint32_t x = 0;
+
+#if defined(SP_USE_NEON)
+	// The bias pattern repeats every 4 pixels, so lanes line up with it from any multiple of 8
+	uint16x8_t rbBias = vld1q_u16(_rbBias);
+	uint16x8_t gBias = vld1q_u16(_gBias);
+	for (; x + 8 <= _width; x += 8)
+	{
+		uint8x8x3_t rgb = vld3_u8(_src + x * 3);
+		uint16x8_t r = vshrq_n_u16(vaddq_u16(vmull_u8(rgb.val[0], vdup_n_u8(249)), rbBias), 11);
+		uint16x8_t g = vshrq_n_u16(vaddq_u16(vmull_u8(rgb.val[1], vdup_n_u8(253)), gBias), 10);
+		uint16x8_t b = vshrq_n_u16(vaddq_u16(vmull_u8(rgb.val[2], vdup_n_u8(249)), rbBias), 11);
+		vst1q_u16(_dst + x, vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b));
+	}
+#endif
+
+	for (; x < _width; ++x)
+	{
+		const uint8_t* p = _src + x * 3;
+		uint32_t r = (p[0] * 249 + _rbBias[x & 3]) >> 11;
+		uint32_t g = (p[1] * 253 + _gBias[x & 3]) >> 10;
+		uint32_t b = (p[2] * 249 + _rbBias[x & 3]) >> 11;
+		_dst[x] = (uint16_t)((r << 11) | (g << 5) | b);
+	}
+}
+
+/*
+ * Look up the palette entry of each pixel, after adding a bias to all three channels.
+ */
+static void toindexed(uint8_t* _dst, const uint8_t* _src, uint32_t _width, const uint8_t* _index, const int16_t* _bias)
+{
+	uint32_t x = 0;
+
+#if defined(SP_USE_NEON)
+	// Keys are built 8 at a time, there is no 32K table lookup in NEON so that part stays scalar
+	int16x8_t bias = vld1q_s16(_bias);
+	uint16_t keys[8];
+	for (; x + 8 <= _width; x += 8)
+	{
+		uint8x8x3_t rgb = vld3_u8(_src + x * 3);
+		uint8x8_t r = vshr_n_u8(vqmovun_s16(vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(rgb.val[0])), bias)), 3);
+		uint8x8_t g = vshr_n_u8(vqmovun_s16(vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(rgb.val[1])), bias)), 3);
+		uint8x8_t b = vshr_n_u8(vqmovun_s16(vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(rgb.val[2])), bias)), 3);
+		vst1q_u16(keys, vorrq_u16(vorrq_u16(vshlq_n_u16(vmovl_u8(r), 10), vshlq_n_u16(vmovl_u8(g), 5)), vmovl_u8(b)));
+		for (uint32_t i = 0; i < 8; ++i)
+			_dst[x + i] = _index[keys[i]];
+	}
+#endif
+
+	for (; x < _width; ++x)
+	{
+		const uint8_t* p = _src + x * 3;
+		int32_t bias = _bias[x & 3];
+		_dst[x] = _index[colorkey(clamp8(p[0] + bias), clamp8(p[1] + bias), clamp8(p[2] + bias))];
+	}
+}
+
+/*
+ * Floyd-Steinberg over a strip of at most SP_DIFFUSION_STRIP pixels, in serpentine order. _map is NULL for
+ * RGB565 output. Errors are kept in 1/16ths, one row ahead, with a pixel of margin on either side.
+ */
+static void diffusestrip(void* _dst, uint32_t _dstStride, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, const struct SPColormap* _map)
+{
+	int16_t errors[2][(SP_DIFFUSION_STRIP + 2) * 3];
+	int16_t* cur = errors[0];
+	int16_t* next = errors[1];
+	memset(cur, 0, sizeof(errors[0]));
+
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		const uint8_t* src = _src + y * _srcStride;
+		uint8_t* dst = (uint8_t*)_dst + y * _dstStride;
+		memset(next, 0, sizeof(errors[1]));
+
+		int32_t dir = (y & 1) ? -1 : 1;
+		for (uint32_t i = 0; i < _width; ++i)
+		{
+			uint32_t x = dir > 0 ? i : _width - 1 - i;
+			int16_t* e = cur + (x + 1) * 3;
+			uint32_t r = clamp8(src[x * 3 + 0] + ((e[0] + 8) >> 4));
+			uint32_t g = clamp8(src[x * 3 + 1] + ((e[1] + 8) >> 4));
+			uint32_t b = clamp8(src[x * 3 + 2] + ((e[2] + 8) >> 4));
+
+			int32_t qr, qg, qb;
+			if (_map)
+			{
+				uint8_t index = _map->index[colorkey(r, g, b)];
+				uint32_t c = _map->palette[index];
+				dst[x] = index;
+				qr = (c >> 16) & 0xFF;
+				qg = (c >> 8) & 0xFF;
+				qb = c & 0xFF;
+			}
+			else
+			{
+				uint32_t r5 = (r * 249 + 1014) >> 11, g6 = (g * 253 + 505) >> 10, b5 = (b * 249 + 1014) >> 11;
+				((uint16_t*)dst)[x] = (uint16_t)((r5 << 11) | (g6 << 5) | b5);
+				qr = (r5 << 3) | (r5 >> 2);
+				qg = (g6 << 2) | (g6 >> 4);
+				qb = (b5 << 3) | (b5 >> 2);
+			}
+
+			int32_t error[3] = { (int32_t)r - qr, (int32_t)g - qg, (int32_t)b - qb };
+			int16_t* ahead = cur + (x + 1 + dir) * 3;
+			int16_t* below = next + (x + 1) * 3;
+			for (int32_t c = 0; c < 3; ++c)
+			{
+				ahead[c] = (int16_t)(ahead[c] + error[c] * 7);
+				below[c - dir * 3] = (int16_t)(below[c - dir * 3] + error[c] * 3);
+				below[c] = (int16_t)(below[c] + error[c] * 5);
+				below[c + dir * 3] = (int16_t)(below[c + dir * 3] + error[c]);
+			}
+		}
+
+		int16_t* swap = cur;
+		cur = next;
+		next = swap;
+	}
+}
+
+static void diffuse(void* _dst, uint32_t _dstStride, uint32_t _bpp, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, const struct SPColormap* _map)
+{
+	for (uint32_t x = 0; x < _width; x += SP_DIFFUSION_STRIP)
+	{
+		uint32_t width = _width - x < SP_DIFFUSION_STRIP ? _width - x : SP_DIFFUSION_STRIP;
+		diffusestrip((uint8_t*)_dst + x * _bpp, _dstStride, _src + x * 3, _srcStride, width, _height, _map);
+	}
+}
+
+/*
+ * Convert r, g, b byte triplets to RGB565, rounded to the nearest color or dithered.
+ * _width is in pixels.
+ */
+void SPConvertRGB888To565(uint16_t* _dst, uint32_t _dstStride, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, enum ESPDither _dither)
+{
+	if (_dither == EDT_Diffusion)
+	{
+		diffuse(_dst, _dstStride, 2, _src, _srcStride, _width, _height, NULL);
+		return;
+	}
+
+	uint16_t rbBias[8], gBias[8];
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			uint32_t threshold = s_bayer[(y & 3) * 4 + (i & 3)];
+			rbBias[i] = (uint16_t)(_dither == EDT_Ordered ? threshold * 128 + 64 : 1014);
+			gBias[i] = (uint16_t)(_dither == EDT_Ordered ? threshold * 64 + 32 : 505);
+		}
+		torgb565((uint16_t*)((uint8_t*)_dst + y * _dstStride), _src + y * _srcStride, _width, rbBias, gBias);
+	}
+}
+
+struct SPColorBox
+{
+	uint8_t lo[3], hi[3];			// Inclusive r5, g5, b5 bounds
+	uint32_t count;					// Pixels inside
+};
+
+/*
+ * Shrink a box to the cells that hold pixels, and count them.
+ */
+static void shrinkbox(struct SPColorBox* _box, const uint32_t* _histogram)
+{
+	uint8_t lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 };
+	uint32_t count = 0;
+	for (uint32_t r = _box->lo[0]; r <= _box->hi[0]; ++r)
+		for (uint32_t g = _box->lo[1]; g <= _box->hi[1]; ++g)
+			for (uint32_t b = _box->lo[2]; b <= _box->hi[2]; ++b)
+			{
+				uint32_t n = _histogram[(r << 10) | (g << 5) | b];
+				if (!n)
+					continue;
+				count += n;
+				uint8_t cell[3] = { (uint8_t)r, (uint8_t)g, (uint8_t)b };
+				for (uint32_t c = 0; c < 3; ++c)
+				{
+					lo[c] = cell[c] < lo[c] ? cell[c] : lo[c];
+					hi[c] = cell[c] > hi[c] ? cell[c] : hi[c];
+				}
+			}
+
+	_box->count = count;
+	if (count)
+	{
+		memcpy(_box->lo, lo, 3);
+		memcpy(_box->hi, hi, 3);
+	}
+}
+
+/*
+ * Split a box at the median of its longest side, green first on ties as the eye sees it best.
+ */
+static void splitbox(struct SPColorBox* _box, struct SPColorBox* _other, const uint32_t* _histogram)
+{
+	static const uint32_t order[3] = { 1, 0, 2 };
+	uint32_t axis = order[0];
+	for (uint32_t i = 1; i < 3; ++i)
+		if (_box->hi[order[i]] - _box->lo[order[i]] > _box->hi[axis] - _box->lo[axis])
+			axis = order[i];
+
+	uint32_t projection[32];
+	memset(projection, 0, sizeof(projection));
+	for (uint32_t r = _box->lo[0]; r <= _box->hi[0]; ++r)
+		for (uint32_t g = _box->lo[1]; g <= _box->hi[1]; ++g)
+			for (uint32_t b = _box->lo[2]; b <= _box->hi[2]; ++b)
+			{
+				uint32_t cell[3] = { r, g, b };
+				projection[cell[axis]] += _histogram[(r << 10) | (g << 5) | b];
+			}
+
+	// The first half keeps at least one plane and leaves one for the second
+	uint32_t cut = _box->lo[axis];
+	uint32_t sum = projection[cut];
+	while (cut + 1 < _box->hi[axis] && sum + projection[cut + 1] <= _box->count / 2)
+		sum += projection[++cut];
+
+	*_other = *_box;
+	_box->hi[axis] = (uint8_t)cut;
+	_other->lo[axis] = (uint8_t)(cut + 1);
+	shrinkbox(_box, _histogram);
+	shrinkbox(_other, _histogram);
+}
+
+/*
+ * Pick up to _count colors for an image with median cut: the box of colors with the most pixels times
+ * length is split in two until there are _count boxes, and each becomes the average of its pixels.
+ * Returns the number of colors written to _palette, fewer than _count for images with few colors,
+ * or 0 if memory runs out.
+ */
+uint32_t SPBuildPalette(uint32_t* _palette, uint32_t _count, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height)
+{
+	if (_count == 0 || _width == 0 || _height == 0)
+		return 0;
+	if (_count > 256)
+		_count = 256;
+
+	uint32_t* histogram = (uint32_t*)calloc(SP_COLORMAP_SIZE, sizeof(uint32_t));
+	if (!histogram)
+		return 0;
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		const uint8_t* src = _src + y * _srcStride;
+		for (uint32_t x = 0; x < _width; ++x, src += 3)
+			histogram[colorkey(src[0], src[1], src[2])]++;
+	}
+
+	struct SPColorBox boxes[256];
+	uint32_t boxCount = 1;
+	boxes[0].lo[0] = boxes[0].lo[1] = boxes[0].lo[2] = 0;
+	boxes[0].hi[0] = boxes[0].hi[1] = boxes[0].hi[2] = 31;
+	shrinkbox(&boxes[0], histogram);
+
+	while (boxCount < _count)
+	{
+		uint32_t best = boxCount;
+		uint64_t bestScore = 0;
+		for (uint32_t i = 0; i < boxCount; ++i)
+		{
+			uint32_t longest = 0;
+			for (uint32_t c = 0; c < 3; ++c)
+				longest = (uint32_t)(boxes[i].hi[c] - boxes[i].lo[c]) > longest ? (uint32_t)(boxes[i].hi[c] - boxes[i].lo[c]) : longest;
+			uint64_t score = (uint64_t)boxes[i].count * longest;
+			if (score > bestScore)
+			{
+				bestScore = score;
+				best = i;
+			}
+		}
+		if (best == boxCount)
+			break;
+		splitbox(&boxes[best], &boxes[boxCount++], histogram);
+	}
+
+	// Cells stand for the middle of the colors they hold
+	for (uint32_t i = 0; i < boxCount; ++i)
+	{
+		uint64_t sum[3] = { 0, 0, 0 };
+		uint64_t count = 0;
+		for (uint32_t r = boxes[i].lo[0]; r <= boxes[i].hi[0]; ++r)
+			for (uint32_t g = boxes[i].lo[1]; g <= boxes[i].hi[1]; ++g)
+				for (uint32_t b = boxes[i].lo[2]; b <= boxes[i].hi[2]; ++b)
+				{
+					uint32_t n = histogram[(r << 10) | (g << 5) | b];
+					sum[0] += (uint64_t)n * ((r << 3) + 4);
+					sum[1] += (uint64_t)n * ((g << 3) + 4);
+					sum[2] += (uint64_t)n * ((b << 3) + 4);
+					count += n;
+				}
+		count = count ? count : 1;
+		_palette[i] = ((uint32_t)(sum[0] / count) << 16) | ((uint32_t)(sum[1] / count) << 8) | (uint32_t)(sum[2] / count);
+	}
+
+	free(histogram);
+	return boxCount;
+}
+
+static uint32_t isqrt(uint32_t _value)
+{
+	uint32_t root = 0;
+	for (uint32_t bit = 1u << 30; bit; bit >>= 2)
+	{
+		if (_value >= root + bit)
+		{
+			_value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+			root >>= 1;
+	}
+	return root;
+}
+
+/*
+ * Find the nearest of _count palette colors for every r5g5b5 color. Each palette color sweeps the whole
+ * cube, keeping a distance per cell, which turns the search into adds and compares over rows of 32 cells.
+ * Returns 0 on success, -1 if _count is not 1 to 256 or memory runs out.
+ */
+int SPBuildColormap(struct SPColormap* _map, const uint32_t* _palette, uint32_t _count)
+{
+	if (_count == 0 || _count > 256)
+		return -1;
+	uint32_t* distances = (uint32_t*)malloc(SP_COLORMAP_SIZE * sizeof(uint32_t));
+	if (!distances)
+		return -1;
+
+	memset(distances, 0xFF, SP_COLORMAP_SIZE * sizeof(uint32_t));
+	memset(_map->index, 0, sizeof(_map->index));
+	memcpy(_map->palette, _palette, _count * sizeof(uint32_t));
+	_map->count = _count;
+
+	for (uint32_t i = 0; i < _count; ++i)
+	{
+		int32_t cr = (_palette[i] >> 16) & 0xFF, cg = (_palette[i] >> 8) & 0xFF, cb = _palette[i] & 0xFF;
+		uint32_t blue[32];
+		for (uint32_t b = 0; b < 32; ++b)
+		{
+			int32_t d = (int32_t)(b << 3) + 4 - cb;
+			blue[b] = (uint32_t)(d * d);
+		}
+
+		for (uint32_t r = 0; r < 32; ++r)
+		{
+			int32_t dr = (int32_t)(r << 3) + 4 - cr;
+			for (uint32_t g = 0; g < 32; ++g)
+			{
+				int32_t dg = (int32_t)(g << 3) + 4 - cg;
+				uint32_t base = (uint32_t)(dr * dr + dg * dg);
+				uint32_t* distance = distances + (r << 10) + (g << 5);
+				uint8_t* index = _map->index + (r << 10) + (g << 5);
+#if defined(SP_USE_NEON)
+				uint32x4_t vbase = vdupq_n_u32(base);
+				uint8x8_t vindex = vdup_n_u8((uint8_t)i);
+				for (uint32_t b = 0; b < 32; b += 8)
+				{
+					uint32x4_t d0 = vaddq_u32(vbase, vld1q_u32(blue + b));
+					uint32x4_t d1 = vaddq_u32(vbase, vld1q_u32(blue + b + 4));
+					uint32x4_t o0 = vld1q_u32(distance + b);
+					uint32x4_t o1 = vld1q_u32(distance + b + 4);
+					uint8x8_t closer = vmovn_u16(vcombine_u16(vmovn_u32(vcltq_u32(d0, o0)), vmovn_u32(vcltq_u32(d1, o1))));
+					vst1q_u32(distance + b, vminq_u32(d0, o0));
+					vst1q_u32(distance + b + 4, vminq_u32(d1, o1));
+					vst1_u8(index + b, vbsl_u8(closer, vindex, vld1_u8(index + b)));
+				}
+#else
+				for (uint32_t b = 0; b < 32; ++b)
+				{
+					uint32_t d = base + blue[b];
+					if (d < distance[b])
+					{
+						distance[b] = d;
+						index[b] = (uint8_t)i;
+					}
+				}
+#endif
+			}
+		}
+	}
+	free(distances);
+
+	// Ordered dither swings pixels by about the distance between neighbouring palette colors
+	uint64_t spread = 0;
+	for (uint32_t i = 0; i < _count; ++i)
+	{
+		uint32_t nearest = 0xFFFFFFFF;
+		for (uint32_t j = 0; j < _count; ++j)
+		{
+			int32_t dr = (int32_t)((_palette[i] >> 16) & 0xFF) - (int32_t)((_palette[j] >> 16) & 0xFF);
+			int32_t dg = (int32_t)((_palette[i] >> 8) & 0xFF) - (int32_t)((_palette[j] >> 8) & 0xFF);
+			int32_t db = (int32_t)(_palette[i] & 0xFF) - (int32_t)(_palette[j] & 0xFF);
+			uint32_t d = (uint32_t)(dr * dr + dg * dg + db * db);
+			if (j != i && d && d < nearest)
+				nearest = d;
+		}
+		spread += nearest == 0xFFFFFFFF ? 64 : isqrt(nearest);
+	}
+	_map->spread = (uint32_t)(spread / _count);
+	return 0;
+}
+
+/*
+ * Convert r, g, b byte triplets to entries of the palette _map was built for, nearest or dithered.
+ * _width is in pixels.
+ */
+void SPConvertRGB888To8(uint8_t* _dst, uint32_t _dstStride, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, const struct SPColormap* _map, enum ESPDither _dither)
+{
+	if (_dither == EDT_Diffusion)
+	{
+		diffuse(_dst, _dstStride, 1, _src, _srcStride, _width, _height, _map);
+		return;
+	}
+
+	// The same bias goes to all three channels, so dithering does not tint flat areas
+	int16_t bias[8];
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			int32_t threshold = s_bayer[(y & 3) * 4 + (i & 3)];
+			bias[i] = (int16_t)(_dither == EDT_Ordered ? (threshold * 2 - 15) * (int32_t)_map->spread / 32 : 0);
+		}
+		toindexed(_dst + y * _dstStride, _src + y * _srcStride, _width, _map->index, bias);
+	}
+}
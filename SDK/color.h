@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Conversion of 24 bit images, such as decoded photos, to the RGB565 and 8 bit indexed color modes.
+// Source pixels are r, g, b byte triplets, all strides are in bytes. Ordered dither adds a 4x4 Bayer pattern
+// before rounding, error diffusion spreads the rounding error of each pixel onto its neighbours the Floyd-Steinberg
+// way. Ordered dither runs on NEON like the plain conversion, error diffusion is sequential and runs scalar.
+// For indexed output, SPBuildPalette picks colors for an image with median cut on a 15 bit histogram, and
+// SPBuildColormap precomputes the nearest palette entry of every 15 bit color, so each pixel is a table lookup.
+
+enum ESPDither
+{
+	EDT_None,
+	EDT_Ordered,
+	EDT_Diffusion,
+};
+
+// Entries of the inverse colormap, one per r5g5b5 color
+#define SP_COLORMAP_SIZE		32768
+
+struct SPColormap
+{
+	uint8_t index[SP_COLORMAP_SIZE];	// Nearest palette entry of each r5g5b5 color
+	uint32_t palette[256];				// r8g8b8 colors the map was built for
+	uint32_t count;						// Entries in palette
+	uint32_t spread;					// Average distance between neighbouring palette colors, scales ordered dither
+};
+
+void SPConvertRGB888To565(uint16_t* _dst, uint32_t _dstStride, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, enum ESPDither _dither);
+uint32_t SPBuildPalette(uint32_t* _palette, uint32_t _count, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height);
+int SPBuildColormap(struct SPColormap* _map, const uint32_t* _palette, uint32_t _count);
+void SPConvertRGB888To8(uint8_t* _dst, uint32_t _dstStride, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, const struct SPColormap* _map, enum ESPDither _dither);
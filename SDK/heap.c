@@ -0,0 +1,387 @@
+#include "heap.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Two level segregated fit (TLSF) allocator for the reserved memory region.
+// Block headers are kept in CPU memory instead of inside the managed range,
+// so that the DMA region only ever contains user data and device reads or
+// writes can never corrupt the allocator state.
+
+// Size class layout
+#define SL_INDEX_COUNT_LOG2		4
+#define SL_INDEX_COUNT			(1 << SL_INDEX_COUNT_LOG2)
+#define ALIGN_SIZE_LOG2			4
+#define FL_INDEX_MAX			26
+#define FL_INDEX_SHIFT			(SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_COUNT			(FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE		(1 << FL_INDEX_SHIFT)
+
+// Number of block headers to grab from the C heap at once
+#define BLOCK_POOL_CHUNK		256
+
+// Values of isFree other than 0, for blocks in a free list and for headers back in the pool
+#define HEAP_BLOCK_FREE			1
+#define HEAP_BLOCK_SPARE		2
+
+struct SPHeapBlock
+{
+	uint32_t offset;
+	uint32_t size;
+	uint32_t isFree;				// HEAP_BLOCK_FREE or HEAP_BLOCK_SPARE when not in use
+	// Physical neighbours, used for coalescing
+	struct SPHeapBlock* prevPhys;
+	struct SPHeapBlock* nextPhys;
+	// Free list links, also used to chain unused headers
+	struct SPHeapBlock* prevFree;
+	struct SPHeapBlock* nextFree;
+};
+
+struct SPHeapBlockChunk
+{
+	struct SPHeapBlockChunk* next;
+	struct SPHeapBlock blocks[BLOCK_POOL_CHUNK];
+};
+
+struct SPHeap
+{
+	uint32_t flBitmap;
+	uint32_t slBitmap[FL_INDEX_COUNT];
+	struct SPHeapBlock* freeLists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
+	// Header pool
+	struct SPHeapBlockChunk* chunks;
+	struct SPHeapBlock* spareBlocks;
+
+	struct SPHeapStats stats;
+};
+
+static inline uint32_t heap_fls(uint32_t _word)
+{
+	return 31 - __builtin_clz(_word);
+}
+
+static inline uint32_t heap_ffs(uint32_t _word)
+{
+	return __builtin_ctz(_word);
+}
+
+static inline uint32_t heap_alignup(uint32_t _x, uint32_t _align)
+{
+	return (_x + (_align - 1)) & ~(_align - 1);
+}
+
+static void heap_mapping_insert(uint32_t _size, uint32_t* _fl, uint32_t* _sl)
+{
+	if (_size < SMALL_BLOCK_SIZE)
+	{
+		*_fl = 0;
+		*_sl = _size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+	}
+	else
+	{
+		uint32_t fl = heap_fls(_size);
+		*_sl = (_size >> (fl - SL_INDEX_COUNT_LOG2)) ^ (1 << SL_INDEX_COUNT_LOG2);
+		*_fl = fl - (FL_INDEX_SHIFT - 1);
+	}
+}
+
+static void heap_mapping_search(uint32_t _size, uint32_t* _fl, uint32_t* _sl)
+{
+	// Round up to the next size class so that any block in the resulting list is large enough
+	if (_size >= SMALL_BLOCK_SIZE)
+		_size += (1 << (heap_fls(_size) - SL_INDEX_COUNT_LOG2)) - 1;
+	heap_mapping_insert(_size, _fl, _sl);
+}
+
+static struct SPHeapBlock* heap_new_block(struct SPHeap* _heap)
+{
+	if (!_heap->spareBlocks)
+	{
+		struct SPHeapBlockChunk* chunk = (struct SPHeapBlockChunk*)malloc(sizeof(struct SPHeapBlockChunk));
+		if (!chunk)
+			return NULL;
+		chunk->next = _heap->chunks;
+		_heap->chunks = chunk;
+		for (uint32_t i=0; i<BLOCK_POOL_CHUNK; ++i)
+		{
+			chunk->blocks[i].nextFree = _heap->spareBlocks;
+			_heap->spareBlocks = &chunk->blocks[i];
+		}
+	}
+
+	struct SPHeapBlock* block = _heap->spareBlocks;
+	_heap->spareBlocks = block->nextFree;
+	memset(block, 0, sizeof(struct SPHeapBlock));
+	return block;
+}
+
+static void heap_release_block(struct SPHeap* _heap, struct SPHeapBlock* _block)
+{
+	_block->isFree = HEAP_BLOCK_SPARE;
+	_block->nextFree = _heap->spareBlocks;
+	_heap->spareBlocks = _block;
+}
+
+static void heap_insert_free(struct SPHeap* _heap, struct SPHeapBlock* _block)
+{
+	uint32_t fl, sl;
+	heap_mapping_insert(_block->size, &fl, &sl);
+
+	struct SPHeapBlock* head = _heap->freeLists[fl][sl];
+	_block->prevFree = NULL;
+	_block->nextFree = head;
+	if (head)
+		head->prevFree = _block;
+	_heap->freeLists[fl][sl] = _block;
+	_heap->flBitmap |= (1U << fl);
+	_heap->slBitmap[fl] |= (1U << sl);
+
+	_block->isFree = HEAP_BLOCK_FREE;
+	_heap->stats.freeBlockCount++;
+}
+
+static void heap_remove_free(struct SPHeap* _heap, struct SPHeapBlock* _block)
+{
+	uint32_t fl, sl;
+	heap_mapping_insert(_block->size, &fl, &sl);
+
+	if (_block->prevFree)
+		_block->prevFree->nextFree = _block->nextFree;
+	else
+		_heap->freeLists[fl][sl] = _block->nextFree;
+	if (_block->nextFree)
+		_block->nextFree->prevFree = _block->prevFree;
+
+	if (!_heap->freeLists[fl][sl])
+	{
+		_heap->slBitmap[fl] &= ~(1U << sl);
+		if (!_heap->slBitmap[fl])
+			_heap->flBitmap &= ~(1U << fl);
+	}
+
+	_block->prevFree = NULL;
+	_block->nextFree = NULL;
+	_block->isFree = 0;
+	_heap->stats.freeBlockCount--;
+}
+
+static struct SPHeapBlock* heap_find_suitable(struct SPHeap* _heap, uint32_t _fl, uint32_t _sl)
+{
+	if (_fl >= FL_INDEX_COUNT)
+		return NULL;
+
+	uint32_t slMap = _heap->slBitmap[_fl] & (~0U << _sl);
+	if (!slMap)
+	{
+		// Nothing in this first level, look for the next non-empty one
+		uint32_t flMap = (_fl + 1 < FL_INDEX_COUNT) ? (_heap->flBitmap & (~0U << (_fl + 1))) : 0;
+		if (!flMap)
+			return NULL;
+		_fl = heap_ffs(flMap);
+		slMap = _heap->slBitmap[_fl];
+	}
+
+	return _heap->freeLists[_fl][heap_ffs(slMap)];
+}
+
+// Splits _size bytes off the front of _block, returning the remainder as a new block
+static struct SPHeapBlock* heap_split(struct SPHeap* _heap, struct SPHeapBlock* _block, uint32_t _size)
+{
+	struct SPHeapBlock* remainder = heap_new_block(_heap);
+	if (!remainder)
+		return NULL;
+
+	remainder->offset = _block->offset + _size;
+	remainder->size = _block->size - _size;
+	remainder->prevPhys = _block;
+	remainder->nextPhys = _block->nextPhys;
+	if (_block->nextPhys)
+		_block->nextPhys->prevPhys = remainder;
+	_block->nextPhys = remainder;
+	_block->size = _size;
+
+	return remainder;
+}
+
+// Folds _next into _block and releases the header of _next
+static void heap_absorb(struct SPHeap* _heap, struct SPHeapBlock* _block, struct SPHeapBlock* _next)
+{
+	_block->size += _next->size;
+	_block->nextPhys = _next->nextPhys;
+	if (_next->nextPhys)
+		_next->nextPhys->prevPhys = _block;
+	heap_release_block(_heap, _next);
+}
+
+/*
+ * Create a heap that manages the byte range [_baseOffset, _baseOffset+_size) of the reserved region.
+ * Both values are rounded inwards to SPHEAP_GRANULE.
+ * Returns NULL if the range is empty or header memory could not be allocated.
+ */
+struct SPHeap* SPHeapCreate(uint32_t _baseOffset, uint32_t _size)
+{
+	uint32_t start = heap_alignup(_baseOffset, SPHEAP_GRANULE);
+	uint32_t end = (_baseOffset + _size) & ~(SPHEAP_GRANULE - 1);
+	if (end <= start)
+		return NULL;
+
+	struct SPHeap* heap = (struct SPHeap*)malloc(sizeof(struct SPHeap));
+	if (!heap)
+		return NULL;
+	memset(heap, 0, sizeof(struct SPHeap));
+
+	struct SPHeapBlock* block = heap_new_block(heap);
+	if (!block)
+	{
+		free(heap);
+		return NULL;
+	}
+
+	block->offset = start;
+	block->size = end - start;
+	heap_insert_free(heap, block);
+
+	heap->stats.totalBytes = end - start;
+	heap->stats.freeBytes = end - start;
+
+	return heap;
+}
+
+/*
+ * Destroy the heap and release all header memory.
+ * Any outstanding SPHeapBlock handles become invalid.
+ */
+void SPHeapDestroy(struct SPHeap* _heap)
+{
+	if (!_heap)
+		return;
+
+	struct SPHeapBlockChunk* chunk = _heap->chunks;
+	while (chunk)
+	{
+		struct SPHeapBlockChunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	free(_heap);
+}
+
+/*
+ * Allocate _size bytes aligned to _alignment (a power of two, at least SPHEAP_GRANULE).
+ * On success the region offset of the allocation is written to _offset and
+ * a handle to pass to SPHeapFree is returned. Returns NULL when out of memory.
+ * Runs in constant time regardless of the number of live allocations.
+ */
+struct SPHeapBlock* SPHeapAlloc(struct SPHeap* _heap, uint32_t _size, uint32_t _alignment, uint32_t* _offset)
+{
+	if (_alignment < SPHEAP_GRANULE)
+		_alignment = SPHEAP_GRANULE;
+	if (_size == 0 || (_alignment & (_alignment - 1)) || _size > _heap->stats.totalBytes)
+	{
+		_heap->stats.failedCount++;
+		return NULL;
+	}
+
+	uint32_t size = heap_alignup(_size, SPHEAP_GRANULE);
+	// Worst case padding required to reach the alignment from a granule aligned block
+	uint32_t request = size + (_alignment - SPHEAP_GRANULE);
+
+	uint32_t fl, sl;
+	heap_mapping_search(request, &fl, &sl);
+	struct SPHeapBlock* block = heap_find_suitable(_heap, fl, sl);
+	if (!block)
+	{
+		_heap->stats.failedCount++;
+		return NULL;
+	}
+	heap_remove_free(_heap, block);
+
+	// Give the leading padding back as a free block
+	uint32_t gap = heap_alignup(block->offset, _alignment) - block->offset;
+	if (gap)
+	{
+		struct SPHeapBlock* aligned = heap_split(_heap, block, gap);
+		if (!aligned)
+		{
+			heap_insert_free(_heap, block);
+			_heap->stats.failedCount++;
+			return NULL;
+		}
+		heap_insert_free(_heap, block);
+		block = aligned;
+	}
+
+	// Give the unused tail back as a free block
+	if (block->size - size >= SPHEAP_GRANULE)
+	{
+		struct SPHeapBlock* tail = heap_split(_heap, block, size);
+		if (tail)
+			heap_insert_free(_heap, tail);
+	}
+
+	_heap->stats.usedBytes += block->size;
+	_heap->stats.freeBytes -= block->size;
+	if (_heap->stats.usedBytes > _heap->stats.peakUsedBytes)
+		_heap->stats.peakUsedBytes = _heap->stats.usedBytes;
+	_heap->stats.usedBlockCount++;
+	_heap->stats.allocCount++;
+
+	*_offset = block->offset;
+	return block;
+}
+
+/*
+ * Return a block to the heap, merging it with free neighbours.
+ * Passing NULL is a no-op. Freeing a block twice is undefined: it is detected and ignored until
+ * the header of the block is handed out again by a later SPHeapAlloc, after that it frees that allocation.
+ */
+void SPHeapFree(struct SPHeap* _heap, struct SPHeapBlock* _block)
+{
+	if (!_block || _block->isFree)
+		return;
+
+	_heap->stats.usedBytes -= _block->size;
+	_heap->stats.freeBytes += _block->size;
+	_heap->stats.usedBlockCount--;
+	_heap->stats.freeCount++;
+
+	struct SPHeapBlock* prev = _block->prevPhys;
+	if (prev && prev->isFree)
+	{
+		heap_remove_free(_heap, prev);
+		heap_absorb(_heap, prev, _block);
+		_block = prev;
+	}
+
+	struct SPHeapBlock* next = _block->nextPhys;
+	if (next && next->isFree)
+	{
+		heap_remove_free(_heap, next);
+		heap_absorb(_heap, _block, next);
+	}
+
+	heap_insert_free(_heap, _block);
+}
+
+/*
+ * Retrieve usage, high water mark and fragmentation figures for the heap.
+ */
+void SPHeapGetStats(struct SPHeap* _heap, struct SPHeapStats* _stats)
+{
+	*_stats = _heap->stats;
+
+	// Largest free block lives in the highest non-empty size class
+	_stats->largestFreeBlock = 0;
+	if (_heap->flBitmap)
+	{
+		uint32_t fl = heap_fls(_heap->flBitmap);
+		uint32_t sl = heap_fls(_heap->slBitmap[fl]);
+		for (struct SPHeapBlock* block = _heap->freeLists[fl][sl]; block; block = block->nextFree)
+			if (block->size > _stats->largestFreeBlock)
+				_stats->largestFreeBlock = block->size;
+	}
+
+	_stats->fragmentation = _stats->freeBytes ? (uint32_t)(((uint64_t)(_stats->freeBytes - _stats->largestFreeBlock) * 100) / _stats->freeBytes) : 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// Smallest unit of allocation inside the reserved memory region
+#define SPHEAP_GRANULE			16
+
+// Common alignment requirements of the devices that read from the reserved region
+#define SPALIGN_AUDIO			16		// APU DMA buffers
+#define SPALIGN_SCANOUT			64		// VPU scanout and CPU write pages
+#define SPALIGN_DEFAULT			128		// Default for SPAllocateBuffer (also VCP program uploads)
+
+struct SPHeapBlock;
+struct SPHeap;
+
+struct SPHeapStats
+{
+	uint32_t totalBytes;			// Size of the managed range
+	uint32_t usedBytes;				// Bytes currently handed out (including alignment padding)
+	uint32_t freeBytes;				// Bytes currently available
+	uint32_t peakUsedBytes;			// High water mark of usedBytes
+	uint32_t largestFreeBlock;		// Largest single allocation that can currently succeed at granule alignment
+	uint32_t usedBlockCount;		// Number of live allocations
+	uint32_t freeBlockCount;		// Number of free fragments
+	uint32_t allocCount;			// Lifetime number of successful allocations
+	uint32_t freeCount;				// Lifetime number of frees
+	uint32_t failedCount;			// Lifetime number of failed allocations
+	uint32_t fragmentation;			// 0 (one contiguous free block) to 100 (free space is scattered), in percent
+};
+
+struct SPHeap* SPHeapCreate(uint32_t _baseOffset, uint32_t _size);
+void SPHeapDestroy(struct SPHeap* _heap);
+
+struct SPHeapBlock* SPHeapAlloc(struct SPHeap* _heap, uint32_t _size, uint32_t _alignment, uint32_t* _offset);
+void SPHeapFree(struct SPHeap* _heap, struct SPHeapBlock* _block);
+void SPHeapGetStats(struct SPHeap* _heap, struct SPHeapStats* _stats);
@@ -0,0 +1,754 @@
+#include "platform.h"
+#include "hostdevice.h"
+#include "vpu.h"
+#include "apu.h"
+#include "vcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// Software model of the sandpiper devices, so that SDK code can run and be profiled without the board.
+// The reserved region is backed by anonymous memory. The VPU command FIFO, vblank counter, scanout swap
+// and palette are emulated on a 640x480@60 timeline, and the APU consumes DMA buffers at the configured
+// sample rate. Device state advances in real time whenever a register is accessed, under a lock
+// since the SDK may read registers from several threads while one of them is writing.
+// VCP programs are accepted but not executed, and scroll/shift commands are ignored by frame dumps.
+// With beam capture on, a thread copies every line of the scanout buffer at the time the beam would
+// scan it, so that what a display would have shown, tearing included, can be read back and dumped.
+
+#define HOST_SCANLINE_COUNT		525
+#define HOST_VBLANK_SCANLINE	480
+#define HOST_FRAME_PERIOD_NS	16683333ull
+#define HOST_MAX_AUDIO_BUFFER	4096
+#define HOST_BEAM_BUFFER		(640 * 480 * 2)
+#define HOST_BEAM_POLL_NS		10000
+
+struct SPHostVideo
+{
+	uint32_t pendingCommand;
+	int awaitingArgument;
+	uint32_t modeInfo;			// As written by VPUCMD_SETVMODE
+	uint32_t scanout;
+	uint32_t scanout2;
+	uint32_t control;
+	int swapPending;			// Sync swap waiting for the next vblank, keeps the FIFO busy
+	int presented;				// Scanout changed since the last vblank
+	uint64_t vblanks;			// Number of vblanks processed so far
+	uint32_t palette[256];
+	char* dumpPrefix;
+	uint32_t dumpIndex;
+	// Beam capture, see SPHostSetBeamCapture
+	uint8_t* beamLines;			// Lines of the frame being scanned, copied as the beam passes them
+	uint8_t* beamFrame;			// Last frame scanned from top to bottom
+	uint64_t beamLine;			// Lines since the epoch the capture got to
+	uint64_t beamFrames;		// Frames scanned completely
+	pthread_t beamThread;
+	volatile int beamRunning;
+};
+
+struct SPHostAudio
+{
+	uint32_t pendingCommand;
+	int awaitingArgument;
+	uint32_t bufferSize;
+	uint32_t sampleRate;		// In Hz, 0 while halted
+	uint32_t swapChannels;
+	uint32_t frame;
+	uint64_t epochNs;			// Start of the current playback timeline
+	uint64_t buffersPlayed;
+	uint8_t queued[HOST_MAX_AUDIO_BUFFER];
+	uint32_t queuedSize;
+	FILE* wav;
+	uint32_t wavRate;
+	uint32_t wavBytes;
+};
+
+struct SPHostDevice
+{
+	pthread_mutex_t lock;
+	uint64_t epochNs;
+	struct SPHostVideo video;
+	struct SPHostAudio audio;
+};
+
+static struct SPHostDevice* hostdevice(struct SPPlatform* _platform)
+{
+	if (_platform->backend != SPGetHostBackend())
+		return NULL;
+	return (struct SPHostDevice*)_platform->backendData;
+}
+
+/*
+ * Resolve a device address to the CPU view of the reserved region, or NULL if [_address, _address+_size) is outside of it.
+ */
+static uint8_t* hostmemory(struct SPPlatform* _platform, uint32_t _address, uint32_t _size)
+{
+	if (_address < RESERVED_MEMORY_ADDRESS || _address - RESERVED_MEMORY_ADDRESS > RESERVED_MEMORY_SIZE - _size)
+		return NULL;
+	return _platform->mapped_memory + (_address - RESERVED_MEMORY_ADDRESS);
+}
+
+static void videogeometry(struct SPHostVideo* _video, uint32_t* _width, uint32_t* _height, uint32_t* _stride)
+{
+	enum EVideoMode vmode = (_video->modeInfo & 0x2) ? EVM_640_Wide : EVM_320_Wide;
+	enum EColorMode cmode = (_video->modeInfo & 0x4) ? ECM_16bit_RGB : ECM_8bit_Indexed;
+	VPUGetDimensions(vmode, _width, _height);
+	*_stride = VPUGetStride(vmode, cmode);
+}
+
+/*
+ * Write the scanout buffer to a PPM file, or the last frame the beam scanned if beam capture is on.
+ */
+static int writeframe(struct SPPlatform* _platform, struct SPHostVideo* _video, const char* _filename)
+{
+	enum EColorMode cmode = (_video->modeInfo & 0x4) ? ECM_16bit_RGB : ECM_8bit_Indexed;
+	uint32_t width, height, stride;
+	videogeometry(_video, &width, &height, &stride);
+
+	const uint8_t* source = _video->beamFrame ? _video->beamFrame : hostmemory(_platform, _video->scanout, stride * height);
+	if (!source)
+		return -1;
+
+	uint8_t* row = (uint8_t*)malloc(width * 3);
+	if (!row)
+		return -1;
+
+	FILE* fp = fopen(_filename, "wb");
+	if (!fp)
+	{
+		free(row);
+		return -1;
+	}
+
+	fprintf(fp, "P6\n%u %u\n255\n", width, height);
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		const uint8_t* line = source + y * stride;
+		for (uint32_t x = 0; x < width; ++x)
+		{
+			uint8_t* rgb = row + x * 3;
+			if (cmode == ECM_8bit_Indexed)
+			{
+				uint32_t color = _video->palette[line[x]];
+				rgb[0] = (uint8_t)(color >> 16);
+				rgb[1] = (uint8_t)(color >> 8);
+				rgb[2] = (uint8_t)color;
+			}
+			else
+			{
+				uint16_t color = ((const uint16_t*)line)[x];
+				rgb[0] = (uint8_t)(((color >> 11) & 0x1F) * 255 / 31);
+				rgb[1] = (uint8_t)(((color >> 5) & 0x3F) * 255 / 63);
+				rgb[2] = (uint8_t)((color & 0x1F) * 255 / 31);
+			}
+		}
+		fwrite(row, 1, width * 3, fp);
+	}
+	free(row);
+
+	int failed = ferror(fp);
+	fclose(fp);
+	return failed ? -1 : 0;
+}
+
+static void swappages(struct SPHostVideo* _video)
+{
+	uint32_t page = _video->scanout;
+	_video->scanout = _video->scanout2;
+	_video->scanout2 = page;
+	_video->swapPending = 0;
+	_video->presented = 1;
+}
+
+/*
+ * Copy the visible lines the beam went over up to _line from the scanout buffer into the beam capture.
+ * In 320 pixel modes every row is scanned twice, it is copied at the first one.
+ */
+static void capturelines(struct SPPlatform* _platform, struct SPHostVideo* _video, uint64_t _line)
+{
+	if (!_video->beamLines)
+		return;
+
+	// Only the last frame that went by is of any interest
+	if (_line > _video->beamLine + 2 * HOST_SCANLINE_COUNT)
+		_video->beamLine = _line - _line % HOST_SCANLINE_COUNT - HOST_SCANLINE_COUNT;
+
+	uint32_t width, height, stride;
+	videogeometry(_video, &width, &height, &stride);
+	uint32_t linesPerRow = HOST_VBLANK_SCANLINE / height;
+
+	for (; _video->beamLine < _line; ++_video->beamLine)
+	{
+		uint32_t scanline = (uint32_t)(_video->beamLine % HOST_SCANLINE_COUNT);
+		if (scanline >= HOST_VBLANK_SCANLINE || scanline % linesPerRow)
+			continue;
+
+		uint32_t row = scanline / linesPerRow;
+		const uint8_t* source = hostmemory(_platform, _video->scanout + row * stride, stride);
+		if (source)
+			memcpy(_video->beamLines + row * stride, source, stride);
+
+		if (row == height - 1)
+		{
+			memcpy(_video->beamFrame, _video->beamLines, stride * height);
+			_video->beamFrames++;
+		}
+	}
+}
+
+/*
+ * Process the vblanks that happened since the last register access.
+ */
+static void advancevideo(struct SPPlatform* _platform, struct SPHostDevice* _device, uint64_t _now)
+{
+	struct SPHostVideo* video = &_device->video;
+	uint64_t lines = (_now - _device->epochNs) * HOST_SCANLINE_COUNT / HOST_FRAME_PERIOD_NS;
+	uint64_t vblanks = (lines + HOST_SCANLINE_COUNT - HOST_VBLANK_SCANLINE) / HOST_SCANLINE_COUNT;
+
+	while (video->vblanks < vblanks)
+	{
+		// The lines before the vblank were scanned from the page that was shown until then
+		capturelines(_platform, video, video->vblanks * HOST_SCANLINE_COUNT + HOST_VBLANK_SCANLINE);
+		video->vblanks++;
+
+		if (video->swapPending)
+			swappages(video);
+
+		if (video->presented && video->dumpPrefix && (video->modeInfo & 0x1))
+		{
+			char filename[PATH_MAX];
+			snprintf(filename, sizeof(filename), "%s%06u.ppm", video->dumpPrefix, video->dumpIndex++);
+			writeframe(_platform, video, filename);
+		}
+		video->presented = 0;
+	}
+
+	capturelines(_platform, video, lines);
+}
+
+static void* beamthread(void* _platform)
+{
+	struct SPPlatform* platform = (struct SPPlatform*)_platform;
+	struct SPHostDevice* device = (struct SPHostDevice*)platform->backendData;
+	struct timespec poll = { 0, HOST_BEAM_POLL_NS };
+
+	while (device->video.beamRunning)
+	{
+		pthread_mutex_lock(&device->lock);
+		advancevideo(platform, device, SPGetTimeNs());
+		pthread_mutex_unlock(&device->lock);
+		nanosleep(&poll, NULL);
+	}
+	return NULL;
+}
+
+static void freebeambuffers(struct SPHostVideo* _video)
+{
+	free(_video->beamLines);
+	free(_video->beamFrame);
+	_video->beamLines = NULL;
+	_video->beamFrame = NULL;
+}
+
+static void stopbeamcapture(struct SPHostDevice* _device)
+{
+	struct SPHostVideo* video = &_device->video;
+	if (!video->beamRunning)
+		return;
+	video->beamRunning = 0;
+	pthread_join(video->beamThread, NULL);
+
+	pthread_mutex_lock(&_device->lock);
+	freebeambuffers(video);
+	pthread_mutex_unlock(&_device->lock);
+}
+
+static uint32_t videoread(struct SPPlatform* _platform, struct SPHostDevice* _device)
+{
+	uint64_t now = SPGetTimeNs();
+	advancevideo(_platform, _device, now);
+
+	struct SPHostVideo* video = &_device->video;
+	uint64_t lines = (now - _device->epochNs) * HOST_SCANLINE_COUNT / HOST_FRAME_PERIOD_NS;
+	uint32_t scanline = (uint32_t)(lines % HOST_SCANLINE_COUNT);
+
+	return (uint32_t)(video->vblanks & 0x1) | (scanline << 1) | (video->swapPending ? 0x800 : 0) | ((video->control & 0xFF) << 12);
+}
+
+static void videowrite(struct SPPlatform* _platform, struct SPHostDevice* _device, uint32_t _value)
+{
+	advancevideo(_platform, _device, SPGetTimeNs());
+
+	struct SPHostVideo* video = &_device->video;
+	if (video->awaitingArgument)
+	{
+		video->awaitingArgument = 0;
+		switch (video->pendingCommand)
+		{
+			case VPUCMD_SETVPAGE: video->scanout = _value; video->presented = 1; break;
+			case VPUCMD_SETVPAGE2: video->scanout2 = _value; break;
+			case VPUCMD_SETVMODE: video->modeInfo = _value; break;
+			default: break; // Shifts and program upload
+		}
+		return;
+	}
+
+	uint32_t command = _value & 0xFF;
+	switch (command)
+	{
+		case VPUCMD_SETVPAGE:
+		case VPUCMD_SETVMODE:
+		case VPUCMD_SHIFTCACHE:
+		case VPUCMD_SHIFTSCANOUT:
+		case VPUCMD_SHIFTPIXEL:
+		case VPUCMD_SETVPAGE2:
+		case VPUCMD_WPROGADDR:
+		case VPUCMD_WPROGWORD:
+			video->pendingCommand = command;
+			video->awaitingArgument = 1;
+			break;
+		case VPUCMD_SYNCSWAP:
+			// Bit 8 swaps right away instead of at the next vblank
+			if (_value & 0x100)
+				swappages(video);
+			else
+				video->swapPending = 1;
+			break;
+		case VPUCMD_WCONTROLREG:
+			if (_value & 0x100)
+				video->control |= (_value >> 9) & 0xFF;
+			else
+				video->control &= ~((_value >> 9) & 0xFF);
+			break;
+		default:
+			break;
+	}
+}
+
+static void wavheader(FILE* _fp, uint32_t _rate, uint32_t _dataBytes)
+{
+	uint32_t header[11];
+	header[0] = 0x46464952;				// RIFF
+	header[1] = 36 + _dataBytes;
+	header[2] = 0x45564157;				// WAVE
+	header[3] = 0x20746D66;				// fmt
+	header[4] = 16;
+	header[5] = 1 | (2 << 16);			// PCM, stereo
+	header[6] = _rate;
+	header[7] = _rate * 4;
+	header[8] = 4 | (16 << 16);			// 4 byte frames, 16 bits per sample
+	header[9] = 0x61746164;				// data
+	header[10] = _dataBytes;
+	fwrite(header, sizeof(header), 1, _fp);
+}
+
+static void closewav(struct SPHostAudio* _audio)
+{
+	if (!_audio->wav)
+		return;
+
+	fseek(_audio->wav, 0, SEEK_SET);
+	wavheader(_audio->wav, _audio->wavRate ? _audio->wavRate : 44100, _audio->wavBytes);
+	fclose(_audio->wav);
+	_audio->wav = NULL;
+}
+
+/*
+ * Play one buffer: the last one queued by APUCMD_START, or silence if nothing was queued in time.
+ */
+static void playbuffer(struct SPHostAudio* _audio)
+{
+	if (_audio->wav)
+	{
+		uint8_t samples[HOST_MAX_AUDIO_BUFFER];
+		uint32_t size = _audio->bufferSize < HOST_MAX_AUDIO_BUFFER ? _audio->bufferSize : HOST_MAX_AUDIO_BUFFER;
+
+		memset(samples, 0, size);
+		memcpy(samples, _audio->queued, _audio->queuedSize < size ? _audio->queuedSize : size);
+
+		if (_audio->swapChannels)
+		{
+			uint16_t* pairs = (uint16_t*)samples;
+			for (uint32_t i = 0; i + 1 < size / 2; i += 2)
+			{
+				uint16_t left = pairs[i];
+				pairs[i] = pairs[i + 1];
+				pairs[i + 1] = left;
+			}
+		}
+
+		if (!_audio->wavRate)
+			_audio->wavRate = _audio->sampleRate;
+		_audio->wavBytes += (uint32_t)fwrite(samples, 1, size, _audio->wav);
+	}
+
+	_audio->queuedSize = 0;
+	_audio->frame ^= 1;
+	_audio->buffersPlayed++;
+}
+
+static uint64_t audioperiod(struct SPHostAudio* _audio)
+{
+	if (!_audio->sampleRate || !_audio->bufferSize)
+		return 0;
+	return ((uint64_t)_audio->bufferSize * 1000000000ull) / ((uint64_t)_audio->sampleRate * 4);
+}
+
+/*
+ * Consume the buffers that finished playing since the last register access.
+ */
+static void advanceaudio(struct SPHostAudio* _audio, uint64_t _now)
+{
+	uint64_t period = audioperiod(_audio);
+	if (!period)
+		return;
+
+	uint64_t buffers = (_now - _audio->epochNs) / period;
+	if (!_audio->wav && buffers > _audio->buffersPlayed + 1)
+	{
+		// Nobody listens, skip ahead but keep the frame parity
+		uint64_t skipped = buffers - _audio->buffersPlayed - 1;
+		_audio->frame ^= (uint32_t)(skipped & 1);
+		_audio->buffersPlayed += skipped;
+	}
+
+	while (_audio->buffersPlayed < buffers)
+		playbuffer(_audio);
+}
+
+static void restartaudio(struct SPHostAudio* _audio)
+{
+	_audio->epochNs = SPGetTimeNs();
+	_audio->buffersPlayed = 0;
+}
+
+static uint32_t audioread(struct SPHostDevice* _device)
+{
+	struct SPHostAudio* audio = &_device->audio;
+	uint64_t now = SPGetTimeNs();
+	advanceaudio(audio, now);
+
+	// Words left in the buffer that is currently playing
+	uint32_t words = 0;
+	uint64_t period = audioperiod(audio);
+	if (period)
+	{
+		uint64_t remaining = period - (now - audio->epochNs) % period;
+		words = (uint32_t)((audio->bufferSize / 4) * remaining / period);
+	}
+
+	return (audio->frame & 0x1) | ((words & 0x3FF) << 1);
+}
+
+static void audiowrite(struct SPPlatform* _platform, struct SPHostDevice* _device, uint32_t _value)
+{
+	static const uint32_t sampleRates[] = { 44100, 22050, 11025, 0 };
+	struct SPHostAudio* audio = &_device->audio;
+	advanceaudio(audio, SPGetTimeNs());
+
+	if (!audio->awaitingArgument)
+	{
+		audio->pendingCommand = _value;
+		audio->awaitingArgument = _value != APUCMD_NOOP;
+		return;
+	}
+
+	audio->awaitingArgument = 0;
+	switch (audio->pendingCommand)
+	{
+		case APUCMD_BUFFERSIZE:
+			audio->bufferSize = 128 << (_value & 0x7);
+			restartaudio(audio);
+			break;
+		case APUCMD_START:
+		{
+			uint32_t size = audio->bufferSize < HOST_MAX_AUDIO_BUFFER ? audio->bufferSize : HOST_MAX_AUDIO_BUFFER;
+			const uint8_t* source = hostmemory(_platform, _value, size);
+			if (source)
+			{
+				memcpy(audio->queued, source, size);
+				audio->queuedSize = size;
+			}
+			break;
+		}
+		case APUCMD_SWAPCHANNELS:
+			audio->swapChannels = _value;
+			break;
+		case APUCMD_SETRATE:
+			audio->sampleRate = sampleRates[_value & 0x3];
+			restartaudio(audio);
+			break;
+		default:
+			break;
+	}
+}
+
+static int hostopen(struct SPPlatform* _platform)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(__x86_64__) && defined(MAP_32BIT)
+	// The SDK keeps CPU addresses of the reserved region in 32 bit fields
+	flags |= MAP_32BIT;
+#endif
+	_platform->mapped_memory = (uint8_t*)mmap(NULL, RESERVED_MEMORY_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (_platform->mapped_memory == (uint8_t*)MAP_FAILED)
+	{
+		perror("Can't allocate reserved region for host device");
+		return -1;
+	}
+
+	struct SPHostDevice* device = (struct SPHostDevice*)calloc(1, sizeof(struct SPHostDevice));
+	if (!device)
+	{
+		munmap((void*)_platform->mapped_memory, RESERVED_MEMORY_SIZE);
+		_platform->mapped_memory = (uint8_t*)MAP_FAILED;
+		return -1;
+	}
+
+	// Recursive, the signal handler may shut down while its thread is inside a register access
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&device->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	device->epochNs = SPGetTimeNs();
+	_platform->backendData = device;
+
+	const char* frames = getenv("SANDPIPER_DUMP_FRAMES");
+	if (frames && *frames)
+		SPHostSetFrameDump(_platform, frames);
+
+	const char* audio = getenv("SANDPIPER_DUMP_AUDIO");
+	if (audio && *audio)
+		SPHostSetAudioDump(_platform, audio);
+
+	return 0;
+}
+
+static void hostclose(struct SPPlatform* _platform)
+{
+	struct SPHostDevice* device = (struct SPHostDevice*)_platform->backendData;
+	if (device)
+	{
+		stopbeamcapture(device);
+		closewav(&device->audio);
+		free(device->video.dumpPrefix);
+		pthread_mutex_destroy(&device->lock);
+		free(device);
+		_platform->backendData = 0;
+	}
+
+	if (_platform->mapped_memory != (uint8_t*)MAP_FAILED)
+	{
+		munmap((void*)_platform->mapped_memory, RESERVED_MEMORY_SIZE);
+		_platform->mapped_memory = (uint8_t*)MAP_FAILED;
+	}
+}
+
+static uint32_t hostread32(struct SPPlatform* _platform, uint32_t _device, uint32_t _offset)
+{
+	struct SPHostDevice* device = (struct SPHostDevice*)_platform->backendData;
+	uint32_t value = 0; // VCP is always idle
+
+	pthread_mutex_lock(&device->lock);
+	switch (_device)
+	{
+		case ESD_Audio: value = audioread(device); break;
+		case ESD_Video: value = videoread(_platform, device); break;
+		case ESD_Palette: value = device->video.palette[_offset & 0xFF]; break;
+		default: break;
+	}
+	pthread_mutex_unlock(&device->lock);
+
+	return value;
+}
+
+static void hostwrite32(struct SPPlatform* _platform, uint32_t _device, uint32_t _offset, uint32_t _value)
+{
+	struct SPHostDevice* device = (struct SPHostDevice*)_platform->backendData;
+
+	pthread_mutex_lock(&device->lock);
+	switch (_device)
+	{
+		case ESD_Audio: audiowrite(_platform, device, _value); break;
+		case ESD_Video: videowrite(_platform, device, _value); break;
+		case ESD_Palette: device->video.palette[_offset & 0xFF] = _value & 0xFFFFFF; break;
+		default: break;
+	}
+	pthread_mutex_unlock(&device->lock);
+}
+
+static void hostwritebatch(struct SPPlatform* _platform, const struct SPBatchEntry* _entries, uint32_t _count)
+{
+	for (uint32_t i = 0; i < _count; ++i)
+		hostwrite32(_platform, _entries[i].device, _entries[i].offset, _entries[i].value);
+}
+
+static uint8_t* hostmapview(struct SPPlatform* _platform, enum ESPMapPolicy _policy)
+{
+	(void)_platform;
+	(void)_policy;
+	// Host memory is coherent, every buffer lives in the one view
+	return (uint8_t*)MAP_FAILED;
+}
+
+static void hostcachemaintenance(struct SPPlatform* _platform, uint32_t _offset, uint32_t _size, int _invalidate)
+{
+	(void)_platform;
+	(void)_offset;
+	(void)_size;
+	(void)_invalidate;
+}
+
+static const struct SPBackend s_hostBackend = {
+	"host",
+	hostopen,
+	hostclose,
+	hostread32,
+	hostwrite32,
+	hostwritebatch,
+	hostmapview,
+	hostcachemaintenance,
+};
+
+/*
+ * The software device model, for running and profiling SDK code without the board.
+ */
+const struct SPBackend* SPGetHostBackend()
+{
+	return &s_hostBackend;
+}
+
+/*
+ * Write every frame presented from now on to _prefix followed by a six digit frame number and .ppm.
+ * Pass NULL to stop.
+ */
+int SPHostSetFrameDump(struct SPPlatform* _platform, const char* _prefix)
+{
+	struct SPHostDevice* device = hostdevice(_platform);
+	if (!device)
+		return -1;
+
+	pthread_mutex_lock(&device->lock);
+	free(device->video.dumpPrefix);
+	device->video.dumpPrefix = _prefix ? strdup(_prefix) : NULL;
+	device->video.dumpIndex = 0;
+	pthread_mutex_unlock(&device->lock);
+	return 0;
+}
+
+/*
+ * Record everything the APU plays from now on, including silence when no buffer was queued in time,
+ * as a 16 bit stereo WAV file. Pass NULL to stop and finalize the file.
+ */
+int SPHostSetAudioDump(struct SPPlatform* _platform, const char* _filename)
+{
+	struct SPHostDevice* device = hostdevice(_platform);
+	if (!device)
+		return -1;
+
+	struct SPHostAudio* audio = &device->audio;
+	pthread_mutex_lock(&device->lock);
+	advanceaudio(audio, SPGetTimeNs());
+	closewav(audio);
+
+	int err = 0;
+	if (_filename)
+	{
+		audio->wav = fopen(_filename, "wb");
+		if (audio->wav)
+		{
+			audio->wavRate = 0;
+			audio->wavBytes = 0;
+			wavheader(audio->wav, 44100, 0);
+		}
+		else
+			err = -1;
+	}
+	pthread_mutex_unlock(&device->lock);
+
+	return err;
+}
+
+/*
+ * Start or stop copying each line of the scanout buffer when the beam passes it, from a thread that keeps up
+ * with the display timeline. While it runs, SPHostReadScannedFrame returns what a display would have shown,
+ * and frame dumps show it too, so that rendering which races the beam can be checked for tearing.
+ */
+int SPHostSetBeamCapture(struct SPPlatform* _platform, int _enable)
+{
+	struct SPHostDevice* device = hostdevice(_platform);
+	if (!device)
+		return -1;
+
+	struct SPHostVideo* video = &device->video;
+	if (!_enable)
+	{
+		stopbeamcapture(device);
+		return 0;
+	}
+	if (video->beamRunning)
+		return 0;
+
+	pthread_mutex_lock(&device->lock);
+	video->beamLines = (uint8_t*)calloc(1, HOST_BEAM_BUFFER);
+	video->beamFrame = (uint8_t*)calloc(1, HOST_BEAM_BUFFER);
+	video->beamLine = (SPGetTimeNs() - device->epochNs) * HOST_SCANLINE_COUNT / HOST_FRAME_PERIOD_NS;
+	video->beamFrames = 0;
+	video->beamRunning = 1;
+	int err = (video->beamLines && video->beamFrame) ? pthread_create(&video->beamThread, NULL, beamthread, _platform) : -1;
+	if (err)
+	{
+		video->beamRunning = 0;
+		freebeambuffers(video);
+	}
+	pthread_mutex_unlock(&device->lock);
+
+	return err ? -1 : 0;
+}
+
+/*
+ * Copy the last frame the beam scanned from top to bottom into _dst, at most _size bytes with the scanout stride.
+ * _frame receives the number of frames scanned since the capture started, a new frame has a new number.
+ * Returns -1 if beam capture is off or no frame was scanned yet.
+ */
+int SPHostReadScannedFrame(struct SPPlatform* _platform, void* _dst, uint32_t _size, uint64_t* _frame)
+{
+	struct SPHostDevice* device = hostdevice(_platform);
+	if (!device)
+		return -1;
+
+	pthread_mutex_lock(&device->lock);
+	struct SPHostVideo* video = &device->video;
+	advancevideo(_platform, device, SPGetTimeNs());
+	int err = -1;
+	if (video->beamRunning && video->beamFrames)
+	{
+		uint32_t width, height, stride;
+		videogeometry(video, &width, &height, &stride);
+		memcpy(_dst, video->beamFrame, _size < stride * height ? _size : stride * height);
+		if (_frame)
+			*_frame = video->beamFrames;
+		err = 0;
+	}
+	pthread_mutex_unlock(&device->lock);
+	return err;
+}
+
+/*
+ * Write the page that is currently scanned out to a PPM file.
+ */
+int SPHostDumpFrame(struct SPPlatform* _platform, const char* _filename)
+{
+	struct SPHostDevice* device = hostdevice(_platform);
+	if (!device)
+		return -1;
+
+	pthread_mutex_lock(&device->lock);
+	advancevideo(_platform, device, SPGetTimeNs());
+	int err = writeframe(_platform, &device->video, _filename);
+	pthread_mutex_unlock(&device->lock);
+	return err;
+}
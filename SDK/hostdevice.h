@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+struct SPPlatform;
+
+// Controls for the software device model returned by SPGetHostBackend().
+// These can also be set without code changes through the environment:
+//   SANDPIPER_BACKEND=host           run SPInitPlatform() on the device model
+//   SANDPIPER_DUMP_FRAMES=<prefix>   write every presented frame to <prefix>NNNNNN.ppm
+//   SANDPIPER_DUMP_AUDIO=<file.wav>  write everything the APU plays to a WAV file
+// All functions return -1 if the platform is not running on the host backend.
+
+int SPHostSetFrameDump(struct SPPlatform* _platform, const char* _prefix);
+int SPHostSetAudioDump(struct SPPlatform* _platform, const char* _filename);
+int SPHostDumpFrame(struct SPPlatform* _platform, const char* _filename);
+int SPHostSetBeamCapture(struct SPPlatform* _platform, int _enable);
+int SPHostReadScannedFrame(struct SPPlatform* _platform, void* _dst, uint32_t _size, uint64_t* _frame);
@@ -0,0 +1,550 @@
+// pthread_setaffinity_np() is a GNU extension
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "jobs.h"
+#include "vpu.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+// Deque indices only ever grow and are compared by their difference, so they can wrap around
+#define SP_JOB_DEQUE_MASK		(SP_JOB_DEQUE_SIZE - 1)
+
+// Jobs SPJobFrameEnd starts have to end before the vblank, so it stops helping this close to it
+#define SP_JOB_VSYNC_GUARD_NS	1000000ull
+
+struct SPJobWorker
+{
+	struct SPJobSystem* system;
+	pthread_t thread;
+	uint32_t index;
+	uint32_t cpu;
+	uint32_t seed;					// Picks the first worker to steal from
+
+	// Thieves move top, only the owner moves bottom, each on a cache line of its own
+	uint32_t top __attribute__((aligned(64)));
+	uint32_t bottom __attribute__((aligned(64)));
+	struct SPJob jobs[SP_JOB_DEQUE_SIZE] __attribute__((aligned(64)));
+
+	// Only written by the worker itself
+	uint64_t jobCount;
+	uint64_t itemCount;
+	uint64_t stealCount;
+	uint64_t splitCount;
+	uint64_t overflowCount;
+	uint64_t sleepCount;
+	uint64_t helpedCount;
+};
+
+struct SPJobSystem
+{
+	struct SPPlatform* platform;
+	uint32_t workerCount;
+	struct SPJobWorker* workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;			// Broadcast when jobs are pushed while workers sleep
+	uint32_t epoch;					// Bumped on every push, sleeping workers wait for it to change
+	uint32_t sleepers;
+	uint32_t quit;
+};
+
+static __thread struct SPJobWorker* s_worker = NULL;
+
+/*
+ * Push a job onto the bottom of the worker's own deque.
+ * Returns 0 on success, -1 if the deque is full.
+ */
+static int dequepush(struct SPJobWorker* _worker, const struct SPJob* _job)
+{
+	uint32_t b = __atomic_load_n(&_worker->bottom, __ATOMIC_RELAXED);
+	uint32_t t = __atomic_load_n(&_worker->top, __ATOMIC_ACQUIRE);
+	if ((int32_t)(b - t) >= SP_JOB_DEQUE_SIZE)
+		return -1;
+	_worker->jobs[b & SP_JOB_DEQUE_MASK] = *_job;
+	__atomic_store_n(&_worker->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Take the most recently pushed job off the worker's own deque, racing thieves for the last one.
+ * Returns 1 if a job was taken.
+ */
+static int dequepop(struct SPJobWorker* _worker, struct SPJob* _job)
+{
+	uint32_t b = __atomic_load_n(&_worker->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&_worker->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint32_t t = __atomic_load_n(&_worker->top, __ATOMIC_RELAXED);
+
+	if ((int32_t)(b - t) < 0)
+	{
+		__atomic_store_n(&_worker->bottom, b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	*_job = _worker->jobs[b & SP_JOB_DEQUE_MASK];
+	if (b != t)
+		return 1;
+
+	int taken = __atomic_compare_exchange_n(&_worker->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	__atomic_store_n(&_worker->bottom, b + 1, __ATOMIC_RELAXED);
+	return taken;
+}
+
+/*
+ * Take the oldest job off another worker's deque. A copy read while the owner wrapped around onto
+ * the same slot is thrown away, as top has moved on and the exchange fails.
+ * Returns 1 if a job was taken.
+ */
+static int dequesteal(struct SPJobWorker* _victim, struct SPJob* _job)
+{
+	uint32_t t = __atomic_load_n(&_victim->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint32_t b = __atomic_load_n(&_victim->bottom, __ATOMIC_ACQUIRE);
+	if ((int32_t)(b - t) <= 0)
+		return 0;
+
+	*_job = _victim->jobs[t & SP_JOB_DEQUE_MASK];
+	return __atomic_compare_exchange_n(&_victim->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/*
+ * Let sleeping workers know there are jobs to steal.
+ */
+static void wakeworkers(struct SPJobSystem* _system)
+{
+	__atomic_add_fetch(&_system->epoch, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_system->sleepers, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&_system->lock);
+	pthread_cond_broadcast(&_system->wake);
+	pthread_mutex_unlock(&_system->lock);
+}
+
+static void submit(struct SPJobSystem* _system, const struct SPJob* _job);
+
+/*
+ * Count _items of a batch as done. The worker that finishes the last item starts the batch waiting on the counter.
+ */
+static void finishitems(struct SPJobSystem* _system, struct SPJobCounter* _counter, uint32_t _items)
+{
+	if (!_counter || __atomic_sub_fetch(&_counter->pending, _items, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (__atomic_load_n(&_counter->hasNext, __ATOMIC_ACQUIRE))
+	{
+		struct SPJob next = _counter->next;
+		__atomic_store_n(&_counter->hasNext, 0, __ATOMIC_RELEASE);
+		submit(_system, &next);
+	}
+}
+
+/*
+ * Run every item of a job in place.
+ */
+static void runitems(struct SPJobSystem* _system, const struct SPJob* _job)
+{
+	if (_job->func)
+		_job->func(_job->userData, _job->begin, _job->end);
+	else
+	{
+		for (uint32_t i = _job->begin; i < _job->end; ++i)
+		{
+			uint32_t x = (i % _job->columns) * _job->tileWidth;
+			uint32_t y = (i / _job->columns) * _job->tileHeight;
+			uint32_t w = _job->width - x < _job->tileWidth ? _job->width - x : _job->tileWidth;
+			uint32_t h = _job->height - y < _job->tileHeight ? _job->height - y : _job->tileHeight;
+			_job->tileFunc(_job->userData, x, y, w, h);
+		}
+	}
+	finishitems(_system, _job->counter, _job->end - _job->begin);
+}
+
+/*
+ * Run a job, splitting off the upper half of its range for other workers until it is down to the grain size.
+ */
+static void runjob(struct SPJobWorker* _worker, struct SPJob _job)
+{
+	while (_job.end - _job.begin > _job.grain)
+	{
+		struct SPJob upper = _job;
+		upper.begin = _job.begin + (_job.end - _job.begin) / 2;
+		if (dequepush(_worker, &upper) != 0)
+		{
+			_worker->overflowCount++;
+			break;
+		}
+		_worker->splitCount++;
+		wakeworkers(_worker->system);
+		_job.end = upper.begin;
+	}
+
+	_worker->jobCount++;
+	_worker->itemCount += _job.end - _job.begin;
+	runitems(_worker->system, &_job);
+}
+
+/*
+ * Run one job from the worker's own deque, or stolen from another worker.
+ * Returns 1 if a job was run, 0 if there was none.
+ */
+static int runone(struct SPJobWorker* _worker)
+{
+	struct SPJobSystem* system = _worker->system;
+	struct SPJob job;
+	if (dequepop(_worker, &job))
+	{
+		runjob(_worker, job);
+		return 1;
+	}
+
+	_worker->seed = _worker->seed * 1664525u + 1013904223u;
+	uint32_t first = (_worker->seed >> 16) % system->workerCount;
+	for (uint32_t i = 0; i < system->workerCount; ++i)
+	{
+		struct SPJobWorker* victim = &system->workers[(first + i) % system->workerCount];
+		if (victim != _worker && dequesteal(victim, &job))
+		{
+			_worker->stealCount++;
+			runjob(_worker, job);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hand a job to the calling worker. Threads that are not workers of _system run it in place.
+ */
+static void submit(struct SPJobSystem* _system, const struct SPJob* _job)
+{
+	struct SPJobWorker* worker = s_worker;
+	if (!worker || worker->system != _system)
+	{
+		// There is no deque to split the range onto
+		runitems(_system, _job);
+		return;
+	}
+
+	if (dequepush(worker, _job) != 0)
+	{
+		worker->overflowCount++;
+		runjob(worker, *_job);
+		return;
+	}
+	wakeworkers(_system);
+}
+
+static void* workerthread(void* _arg)
+{
+	struct SPJobWorker* worker = (struct SPJobWorker*)_arg;
+	struct SPJobSystem* system = worker->system;
+	s_worker = worker;
+	SPTraceSetThreadName("SPJobWorker");
+
+	while (!__atomic_load_n(&system->quit, __ATOMIC_ACQUIRE))
+	{
+		uint32_t epoch = __atomic_load_n(&system->epoch, __ATOMIC_SEQ_CST);
+		if (runone(worker))
+			continue;
+
+		// Keep looking for a while, jobs of a frame tend to come in bursts
+		uint64_t spinStart = SPGetTimeNs();
+		int found = 0;
+		while (!found && SPGetTimeNs() - spinStart < SP_JOB_SPIN_NS && !__atomic_load_n(&system->quit, __ATOMIC_ACQUIRE))
+		{
+			sched_yield();
+			found = runone(worker);
+		}
+		if (found)
+			continue;
+
+		// Anything pushed after epoch was read bumps it, so the wait can not miss a wakeup
+		pthread_mutex_lock(&system->lock);
+		__atomic_add_fetch(&system->sleepers, 1, __ATOMIC_SEQ_CST);
+		worker->sleepCount++;
+		while (epoch == __atomic_load_n(&system->epoch, __ATOMIC_SEQ_CST) && !__atomic_load_n(&system->quit, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&system->wake, &system->lock);
+		__atomic_sub_fetch(&system->sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&system->lock);
+	}
+
+	s_worker = NULL;
+	return NULL;
+}
+
+/*
+ * Fill in a job covering _count items.
+ */
+static void initjob(struct SPJob* _job, SPJobFunc _func, void* _userData, uint32_t _count, uint32_t _grain, struct SPJobCounter* _counter)
+{
+	memset(_job, 0, sizeof(struct SPJob));
+	_job->func = _func;
+	_job->userData = _userData;
+	_job->counter = _counter;
+	_job->end = _count;
+	_job->grain = _grain ? _grain : 1;
+}
+
+/*
+ * Start _workerCount workers, or one per core the calling thread may run on if _workerCount is 0.
+ * The calling thread becomes worker 0 and runs jobs while it waits for them, its affinity is left alone.
+ * Every other worker is pinned to one of the cores the calling thread may run on, leaving the first of
+ * them to the calling thread, with more workers than cores they wrap around.
+ * Jobs can be started from the calling thread and from inside jobs, other threads run the batches
+ * they start by themselves.
+ * Returns NULL if the system can not be created.
+ */
+struct SPJobSystem* SPCreateJobSystem(struct SPPlatform* _platform, uint32_t _workerCount)
+{
+	struct SPJobSystem* system = (struct SPJobSystem*)calloc(1, sizeof(struct SPJobSystem));
+	if (!system)
+		return NULL;
+	system->platform = _platform;
+
+	// Cores are taken from the calling thread's affinity, which may not cover every online core
+	uint32_t cpus[SP_JOB_MAX_WORKERS];
+	uint32_t cpuCount = 0;
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0)
+	{
+		for (uint32_t cpu = 0; cpu < CPU_SETSIZE && cpuCount < SP_JOB_MAX_WORKERS; ++cpu)
+			if (CPU_ISSET(cpu, &cpuset))
+				cpus[cpuCount++] = cpu;
+	}
+	if (cpuCount == 0)
+		cpus[cpuCount++] = 0;
+
+	system->workerCount = _workerCount ? _workerCount : cpuCount;
+	if (system->workerCount > SP_JOB_MAX_WORKERS)
+		system->workerCount = SP_JOB_MAX_WORKERS;
+
+	// The deques have to be aligned for top and bottom to sit on cache lines of their own
+	if (posix_memalign((void**)&system->workers, 64, system->workerCount * sizeof(struct SPJobWorker)) != 0)
+	{
+		free(system);
+		return NULL;
+	}
+	memset(system->workers, 0, system->workerCount * sizeof(struct SPJobWorker));
+	pthread_mutex_init(&system->lock, NULL);
+	pthread_cond_init(&system->wake, NULL);
+
+	for (uint32_t i = 0; i < system->workerCount; ++i)
+	{
+		struct SPJobWorker* worker = &system->workers[i];
+		worker->system = system;
+		worker->index = i;
+		worker->cpu = cpus[i % cpuCount];
+		worker->seed = 0x9E3779B9u * (i + 1);
+	}
+
+	s_worker = &system->workers[0];
+
+	for (uint32_t i = 1; i < system->workerCount; ++i)
+	{
+		struct SPJobWorker* worker = &system->workers[i];
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		CPU_ZERO(&cpuset);
+		CPU_SET(worker->cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+		int err = pthread_create(&worker->thread, &attr, workerthread, worker);
+		pthread_attr_destroy(&attr);
+		if (err != 0)
+		{
+			system->workerCount = i;
+			SPDestroyJobSystem(system);
+			return NULL;
+		}
+	}
+
+	return system;
+}
+
+/*
+ * Stop the workers. Jobs that have not run yet are dropped,
+ * wait for them first. Has to be called from the thread that created the system.
+ */
+void SPDestroyJobSystem(struct SPJobSystem* _system)
+{
+	if (!_system)
+		return;
+
+	pthread_mutex_lock(&_system->lock);
+	__atomic_store_n(&_system->quit, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&_system->wake);
+	pthread_mutex_unlock(&_system->lock);
+
+	for (uint32_t i = 1; i < _system->workerCount; ++i)
+		pthread_join(_system->workers[i].thread, NULL);
+
+	if (s_worker && s_worker->system == _system)
+		s_worker = NULL;
+
+	pthread_cond_destroy(&_system->wake);
+	pthread_mutex_destroy(&_system->lock);
+	free(_system->workers);
+	free(_system);
+}
+
+uint32_t SPGetJobWorkerCount(struct SPJobSystem* _system)
+{
+	return _system->workerCount;
+}
+
+void SPInitJobCounter(struct SPJobCounter* _counter)
+{
+	memset(_counter, 0, sizeof(struct SPJobCounter));
+}
+
+/*
+ * Start a batch of _count items, run as _func(_userData, begin, end) over ranges of at least _grain items
+ * where possible. Pick a grain that takes a few microseconds to run, smaller ranges cost more to hand
+ * around than they help balance the workers. _counter may be NULL, otherwise _count is added to it.
+ */
+void SPRunJobs(struct SPJobSystem* _system, SPJobFunc _func, void* _userData, uint32_t _count, uint32_t _grain, struct SPJobCounter* _counter)
+{
+	if (_count == 0)
+		return;
+	struct SPJob job;
+	initjob(&job, _func, _userData, _count, _grain, _counter);
+	if (_counter)
+		__atomic_add_fetch(&_counter->pending, _count, __ATOMIC_ACQ_REL);
+	submit(_system, &job);
+}
+
+/*
+ * Start drawing a _width x _height framebuffer in tiles of _tileWidth x _tileHeight, as _func(_userData, x, y, w, h).
+ * Tiles on the right and bottom edges are clipped. Tiles are handed out one at a time and in rows, so
+ * neighbouring tiles tend to end up on the same core. _counter counts tiles, and may be NULL.
+ */
+void SPRunTiles(struct SPJobSystem* _system, SPTileFunc _func, void* _userData, uint32_t _width, uint32_t _height, uint32_t _tileWidth, uint32_t _tileHeight, struct SPJobCounter* _counter)
+{
+	if (_width == 0 || _height == 0 || _tileWidth == 0 || _tileHeight == 0)
+		return;
+	uint32_t columns = (_width + _tileWidth - 1) / _tileWidth;
+	uint32_t rows = (_height + _tileHeight - 1) / _tileHeight;
+
+	struct SPJob job;
+	initjob(&job, NULL, _userData, columns * rows, 1, _counter);
+	job.tileFunc = _func;
+	job.width = _width;
+	job.height = _height;
+	job.tileWidth = _tileWidth;
+	job.tileHeight = _tileHeight;
+	job.columns = columns;
+	if (_counter)
+		__atomic_add_fetch(&_counter->pending, columns * rows, __ATOMIC_ACQ_REL);
+	submit(_system, &job);
+}
+
+/*
+ * Start a batch like SPRunJobs once _dependency reaches zero, right away if it already did. _count is added to
+ * _counter immediately, so waiting on _counter also waits for _dependency. A counter holds one batch to start.
+ * Returns 0 on success, -1 if _dependency already has a batch waiting on it.
+ */
+int SPRunJobsAfter(struct SPJobSystem* _system, struct SPJobCounter* _dependency, SPJobFunc _func, void* _userData, uint32_t _count, uint32_t _grain, struct SPJobCounter* _counter)
+{
+	if (__atomic_load_n(&_dependency->hasNext, __ATOMIC_ACQUIRE))
+		return -1;
+	if (_count == 0)
+		return 0;
+	if (_counter)
+		__atomic_add_fetch(&_counter->pending, _count, __ATOMIC_ACQ_REL);
+
+	// Hold the dependency open while the batch is stored, whoever finishes it last starts the batch
+	__atomic_add_fetch(&_dependency->pending, 1, __ATOMIC_ACQ_REL);
+	initjob(&_dependency->next, _func, _userData, _count, _grain, _counter);
+	__atomic_store_n(&_dependency->hasNext, 1, __ATOMIC_RELEASE);
+	finishitems(_system, _dependency, 1);
+	return 0;
+}
+
+/*
+ * Returns 1 if every item counted by _counter is done.
+ */
+int SPJobsDone(struct SPJobCounter* _counter)
+{
+	return __atomic_load_n(&_counter->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+/*
+ * Run jobs until every item counted by _counter is done. Jobs of other batches may be run as well.
+ */
+void SPWaitJobs(struct SPJobSystem* _system, struct SPJobCounter* _counter)
+{
+	struct SPJobWorker* worker = s_worker && s_worker->system == _system ? s_worker : NULL;
+	SP_TRACE_BEGIN("SPWaitJobs");
+	while (!SPJobsDone(_counter))
+	{
+		if (!worker || !runone(worker))
+			sched_yield();
+	}
+	SP_TRACE_END("SPWaitJobs");
+}
+
+/*
+ * Frame end barrier: run jobs until _counter is done, then keep running queued jobs, such as the next frame's,
+ * until the vblank is about to come and wait for it with VPUWaitVSync. Jobs started close to the vblank have
+ * to be short enough to end before it. _counter may be NULL.
+ */
+void SPJobFrameEnd(struct SPJobSystem* _system, struct SPJobCounter* _counter)
+{
+	struct EVideoContext* vx = _system->platform->vx;
+	if (_counter)
+		SPWaitJobs(_system, _counter);
+
+	struct SPJobWorker* worker = s_worker && s_worker->system == _system ? s_worker : NULL;
+	SP_TRACE_BEGIN("SPJobFrameEnd");
+	while (worker)
+	{
+		uint32_t scanline = VPUGetScanline(vx) % VPU_SCANLINE_COUNT;
+		uint32_t lines = (vx->m_vblankScanline + VPU_SCANLINE_COUNT - scanline) % VPU_SCANLINE_COUNT;
+		if ((uint64_t)lines * vx->m_framePeriodNs / VPU_SCANLINE_COUNT < SP_JOB_VSYNC_GUARD_NS || !runone(worker))
+			break;
+		worker->helpedCount++;
+	}
+	SP_TRACE_END("SPJobFrameEnd");
+
+	VPUWaitVSync(vx);
+}
+
+/*
+ * Statistics since the system was created or last reset, summed over all workers.
+ * Read while jobs are running, the numbers may be a little behind.
+ */
+void SPGetJobStats(struct SPJobSystem* _system, struct SPJobStats* _stats)
+{
+	memset(_stats, 0, sizeof(struct SPJobStats));
+	_stats->workerCount = _system->workerCount;
+	for (uint32_t i = 0; i < _system->workerCount; ++i)
+	{
+		struct SPJobWorker* worker = &_system->workers[i];
+		_stats->jobCount += worker->jobCount;
+		_stats->itemCount += worker->itemCount;
+		_stats->stealCount += worker->stealCount;
+		_stats->splitCount += worker->splitCount;
+		_stats->overflowCount += worker->overflowCount;
+		_stats->sleepCount += worker->sleepCount;
+		_stats->helpedCount += worker->helpedCount;
+		_stats->workerItems[i] = worker->itemCount;
+	}
+}
+
+/*
+ * Clears the statistics, call while no jobs are running.
+ */
+void SPResetJobStats(struct SPJobSystem* _system)
+{
+	for (uint32_t i = 0; i < _system->workerCount; ++i)
+	{
+		struct SPJobWorker* worker = &_system->workers[i];
+		worker->jobCount = worker->itemCount = worker->stealCount = worker->splitCount = 0;
+		worker->overflowCount = worker->sleepCount = worker->helpedCount = 0;
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "platform.h"
+
+// Work stealing job system with one worker per CPU core. The thread that creates the system is worker 0,
+// every other worker is a thread of its own pinned to a core. Jobs cover a range of
+// indices or of framebuffer tiles, and a worker keeps splitting the range it runs in halves, pushing the
+// upper half onto its own Chase-Lev deque where idle workers steal it from. Only large pieces of work are
+// ever stolen that way, and the deques stay a few entries deep. Counters track how many items of a batch
+// are left, waiting on a counter runs jobs instead of blocking, and a counter can start another batch once
+// it reaches zero. SPJobFrameEnd() is a frame end barrier that keeps helping until the vblank is close.
+// The calling thread keeps its own affinity, so threads it starts later are not tied to a core either.
+
+#define SP_JOB_MAX_WORKERS		8
+#define SP_JOB_DEQUE_SIZE		256			// Jobs per worker deque, a power of two
+
+// Idle workers look for jobs this long before going to sleep
+#define SP_JOB_SPIN_NS			50000ull
+
+// Run items [_begin, _end) of a batch
+typedef void (*SPJobFunc)(void* _userData, uint32_t _begin, uint32_t _end);
+// Draw one tile, clipped to the framebuffer
+typedef void (*SPTileFunc)(void* _userData, uint32_t _x, uint32_t _y, uint32_t _width, uint32_t _height);
+
+struct SPJobCounter;
+
+struct SPJob
+{
+	SPJobFunc func;					// NULL for tile jobs
+	SPTileFunc tileFunc;
+	void* userData;
+	struct SPJobCounter* counter;	// Decremented by the number of items once they are done, may be NULL
+	uint32_t begin, end;			// Items of the batch this job covers
+	uint32_t grain;					// Ranges up to this many items are not split any further
+	uint32_t width, height;			// Framebuffer size for tile jobs
+	uint32_t tileWidth, tileHeight;
+	uint32_t columns;				// Tiles per row
+};
+
+// Zero initialize, or use SPInitJobCounter. A counter can be reused once it reached zero.
+struct SPJobCounter
+{
+	uint32_t pending;				// Items not finished yet
+	uint32_t hasNext;				// Read and written atomically, a batch is stored in next
+	struct SPJob next;				// Batch started when pending reaches zero
+};
+
+struct SPJobStats
+{
+	uint32_t workerCount;
+	uint64_t jobCount;				// Jobs run, after splitting
+	uint64_t itemCount;				// Indices and tiles run
+	uint64_t stealCount;			// Jobs taken from the deque of another worker
+	uint64_t splitCount;			// Ranges split in half for other workers to steal
+	uint64_t overflowCount;			// Splits that found the deque full and ran in place
+	uint64_t sleepCount;			// Times a worker ran out of jobs and went to sleep
+	uint64_t helpedCount;			// Jobs SPJobFrameEnd ran between its batch completing and the vblank
+	uint64_t workerItems[SP_JOB_MAX_WORKERS];	// Items run by each worker
+};
+
+struct SPJobSystem;
+
+struct SPJobSystem* SPCreateJobSystem(struct SPPlatform* _platform, uint32_t _workerCount);
+void SPDestroyJobSystem(struct SPJobSystem* _system);
+uint32_t SPGetJobWorkerCount(struct SPJobSystem* _system);
+
+void SPInitJobCounter(struct SPJobCounter* _counter);
+void SPRunJobs(struct SPJobSystem* _system, SPJobFunc _func, void* _userData, uint32_t _count, uint32_t _grain, struct SPJobCounter* _counter);
+void SPRunTiles(struct SPJobSystem* _system, SPTileFunc _func, void* _userData, uint32_t _width, uint32_t _height, uint32_t _tileWidth, uint32_t _tileHeight, struct SPJobCounter* _counter);
+int SPRunJobsAfter(struct SPJobSystem* _system, struct SPJobCounter* _dependency, SPJobFunc _func, void* _userData, uint32_t _count, uint32_t _grain, struct SPJobCounter* _counter);
+int SPJobsDone(struct SPJobCounter* _counter);
+void SPWaitJobs(struct SPJobSystem* _system, struct SPJobCounter* _counter);
+void SPJobFrameEnd(struct SPJobSystem* _system, struct SPJobCounter* _counter);
+
+void SPGetJobStats(struct SPJobSystem* _system, struct SPJobStats* _stats);
+void SPResetJobStats(struct SPJobSystem* _system);
@@ -0,0 +1,240 @@
+#include "simd.h"
+#include "kernels.h"
+#include <stdint.h>
+#include <string.h>
+
+// The reserved region is mapped uncached by default, where the cost of a store barely depends on its width.
+// All kernels therefore try to write 16 bytes at a time, and read the source only once.
+
+/*
+ * Rotate a 4-byte fill pattern so that it starts at byte _phase of the original pattern.
+ */
+static inline uint32_t rotatepattern(uint32_t _pattern, uint32_t _phase)
+{
+	_phase &= 3;
+	return _phase ? ((_pattern >> (_phase * 8)) | (_pattern << (32 - _phase * 8))) : _pattern;
+}
+
+/*
+ * Fill _count bytes, where the first byte gets byte _phase of _pattern.
+ */
+static void fillrow(uint8_t* _dst, uint32_t _count, uint32_t _pattern, uint32_t _phase)
+{
+	// Byte-wise until the destination is 16 byte aligned
+	while (_count && ((uintptr_t)_dst & 15))
+	{
+		*_dst++ = (uint8_t)(rotatepattern(_pattern, _phase) & 0xFF);
+		++_phase;
+		--_count;
+	}
+
+	uint32_t aligned = rotatepattern(_pattern, _phase);
+
+#if defined(SP_USE_NEON)
+	uint32x4_t v = vdupq_n_u32(aligned);
+	while (_count >= 64)
+	{
+		vst1q_u32((uint32_t*)_dst, v);
+		vst1q_u32((uint32_t*)(_dst + 16), v);
+		vst1q_u32((uint32_t*)(_dst + 32), v);
+		vst1q_u32((uint32_t*)(_dst + 48), v);
+		_dst += 64;
+		_count -= 64;
+	}
+	while (_count >= 16)
+	{
+		vst1q_u32((uint32_t*)_dst, v);
+		_dst += 16;
+		_count -= 16;
+	}
+#endif
+
+	while (_count >= 4)
+	{
+		*(uint32_t*)_dst = aligned;
+		_dst += 4;
+		_count -= 4;
+	}
+
+	// Remaining bytes continue the pattern from the aligned phase
+	for (uint32_t i = 0; i < _count; ++i)
+		_dst[i] = (uint8_t)((aligned >> (i * 8)) & 0xFF);
+}
+
+/*
+ * Copy _count bytes between non-overlapping rows.
+ */
+static void copyrow(uint8_t* _dst, const uint8_t* _src, uint32_t _count)
+{
+#if defined(SP_USE_NEON)
+	while (_count >= 64)
+	{
+		uint8x16_t a = vld1q_u8(_src);
+		uint8x16_t b = vld1q_u8(_src + 16);
+		uint8x16_t c = vld1q_u8(_src + 32);
+		uint8x16_t d = vld1q_u8(_src + 48);
+		vst1q_u8(_dst, a);
+		vst1q_u8(_dst + 16, b);
+		vst1q_u8(_dst + 32, c);
+		vst1q_u8(_dst + 48, d);
+		_dst += 64;
+		_src += 64;
+		_count -= 64;
+	}
+	while (_count >= 16)
+	{
+		vst1q_u8(_dst, vld1q_u8(_src));
+		_dst += 16;
+		_src += 16;
+		_count -= 16;
+	}
+	while (_count--)
+		*_dst++ = *_src++;
+#else
+	memcpy(_dst, _src, _count);
+#endif
+}
+
+/*
+ * Fill a rectangle with a repeating 4-byte pattern, as used by VPUClear.
+ * Byte n of each row receives byte (n%4) of _pattern, in little endian order.
+ */
+void SPFillRect(void* _dst, uint32_t _dstStride, uint32_t _widthInBytes, uint32_t _height, uint32_t _pattern)
+{
+	uint8_t* dst = (uint8_t*)_dst;
+
+	// Contiguous rows are filled in one go, as long as every row starts at pattern phase 0
+	if (_dstStride == _widthInBytes && (_dstStride & 3) == 0)
+	{
+		fillrow(dst, _widthInBytes * _height, _pattern, 0);
+		return;
+	}
+
+	for (uint32_t y = 0; y < _height; ++y)
+		fillrow(dst + y * _dstStride, _widthInBytes, _pattern, 0);
+}
+
+/*
+ * Copy a rectangle of _widthInBytes by _height between two surfaces with independent strides.
+ * Source and destination must not overlap.
+ */
+void SPCopyRect(void* _dst, uint32_t _dstStride, const void* _src, uint32_t _srcStride, uint32_t _widthInBytes, uint32_t _height)
+{
+	uint8_t* dst = (uint8_t*)_dst;
+	const uint8_t* src = (const uint8_t*)_src;
+
+	if (_dstStride == _widthInBytes && _srcStride == _widthInBytes)
+	{
+		copyrow(dst, src, _widthInBytes * _height);
+		return;
+	}
+
+	for (uint32_t y = 0; y < _height; ++y)
+		copyrow(dst + y * _dstStride, src + y * _srcStride, _widthInBytes);
+}
+
+/*
+ * Expand 8 bit palette indices into RGB565 pixels through a 256 entry palette.
+ * _width is in pixels, both strides are in bytes.
+ */
+void SPExpandPalette8to16(uint16_t* _dst, uint32_t _dstStride, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, const uint16_t* _palette)
+{
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		const uint8_t* src = _src + y * _srcStride;
+		uint16_t* dst = (uint16_t*)((uint8_t*)_dst + y * _dstStride);
+		uint32_t x = 0;
+
+#if defined(SP_USE_NEON)
+		// There is no 256 entry table lookup in NEON, gather in scalar and write 8 pixels at once
+		for (; x + 8 <= _width; x += 8)
+		{
+			uint16x8_t v = vdupq_n_u16(0);
+			v = vsetq_lane_u16(_palette[src[x + 0]], v, 0);
+			v = vsetq_lane_u16(_palette[src[x + 1]], v, 1);
+			v = vsetq_lane_u16(_palette[src[x + 2]], v, 2);
+			v = vsetq_lane_u16(_palette[src[x + 3]], v, 3);
+			v = vsetq_lane_u16(_palette[src[x + 4]], v, 4);
+			v = vsetq_lane_u16(_palette[src[x + 5]], v, 5);
+			v = vsetq_lane_u16(_palette[src[x + 6]], v, 6);
+			v = vsetq_lane_u16(_palette[src[x + 7]], v, 7);
+			vst1q_u16(dst + x, v);
+		}
+#else
+		// Pair up pixels so that each store writes a full word
+		if (((uintptr_t)dst & 3) == 0)
+		{
+			for (; x + 2 <= _width; x += 2)
+				*(uint32_t*)(dst + x) = (uint32_t)_palette[src[x]] | ((uint32_t)_palette[src[x + 1]] << 16);
+		}
+#endif
+
+		for (; x < _width; ++x)
+			dst[x] = _palette[src[x]];
+	}
+}
+
+/*
+ * Darken 8 bit pixels by shifting them right by _shift bits, for decay / trail effects.
+ * _width is in pixels, the stride is in bytes.
+ */
+void SPFadeRect8(uint8_t* _dst, uint32_t _dstStride, uint32_t _width, uint32_t _height, uint32_t _shift)
+{
+	if (_shift == 0)
+		return;
+	if (_shift > 8)
+		_shift = 8;
+
+	// Per-byte shift done on whole words: shift, then mask off the bits that crossed into the next byte
+	const uint32_t mask = (0xFFu >> _shift) * 0x01010101u;
+
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		uint8_t* row = _dst + y * _dstStride;
+		uint32_t x = 0;
+
+#if defined(SP_USE_NEON)
+		int8x16_t shift = vdupq_n_s8(-(int8_t)_shift);
+		for (; x + 16 <= _width; x += 16)
+			vst1q_u8(row + x, vshlq_u8(vld1q_u8(row + x), shift));
+#endif
+
+		for (; x < _width && ((uintptr_t)(row + x) & 3); ++x)
+			row[x] >>= _shift;
+		for (; x + 4 <= _width; x += 4)
+			*(uint32_t*)(row + x) = (*(uint32_t*)(row + x) >> _shift) & mask;
+		for (; x < _width; ++x)
+			row[x] >>= _shift;
+	}
+}
+
+/*
+ * Darken RGB565 pixels by shifting each color channel right by _shift bits.
+ * _width is in pixels, the stride is in bytes.
+ */
+void SPFadeRect16(uint16_t* _dst, uint32_t _dstStride, uint32_t _width, uint32_t _height, uint32_t _shift)
+{
+	if (_shift == 0)
+		return;
+	if (_shift > 6)
+		_shift = 6;
+
+	// Shifting the whole pixel and masking keeps each channel within its own bits
+	const uint16_t mask = (uint16_t)(((0x1F >> _shift) << 11) | ((0x3F >> _shift) << 5) | (0x1F >> _shift));
+
+	for (uint32_t y = 0; y < _height; ++y)
+	{
+		uint16_t* row = (uint16_t*)((uint8_t*)_dst + y * _dstStride);
+		uint32_t x = 0;
+
+#if defined(SP_USE_NEON)
+		int16x8_t shift = vdupq_n_s16(-(int16_t)_shift);
+		uint16x8_t vmask = vdupq_n_u16(mask);
+		for (; x + 8 <= _width; x += 8)
+			vst1q_u16(row + x, vandq_u16(vshlq_u16(vld1q_u16(row + x), shift), vmask));
+#endif
+
+		for (; x < _width; ++x)
+			row[x] = (uint16_t)((row[x] >> _shift) & mask);
+	}
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Pixel kernels for framebuffers and other DMA memory.
+// All strides are in bytes. NEON versions are used on the device, scalar versions everywhere else.
+
+void SPFillRect(void* _dst, uint32_t _dstStride, uint32_t _widthInBytes, uint32_t _height, uint32_t _pattern);
+void SPCopyRect(void* _dst, uint32_t _dstStride, const void* _src, uint32_t _srcStride, uint32_t _widthInBytes, uint32_t _height);
+void SPExpandPalette8to16(uint16_t* _dst, uint32_t _dstStride, const uint8_t* _src, uint32_t _srcStride, uint32_t _width, uint32_t _height, const uint16_t* _palette);
+void SPFadeRect8(uint8_t* _dst, uint32_t _dstStride, uint32_t _width, uint32_t _height, uint32_t _shift);
+void SPFadeRect16(uint16_t* _dst, uint32_t _dstStride, uint32_t _width, uint32_t _height, uint32_t _shift);
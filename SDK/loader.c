@@ -0,0 +1,335 @@
+#include "loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Size of each read() call, large enough for the kernel to read ahead on SD cards and USB sticks
+#define SP_LOAD_CHUNK_SIZE		(1024 * 1024)
+
+enum ESPLoadState
+{
+	ELS_Free,
+	ELS_Pending,
+	ELS_Reading,
+	ELS_Done,
+	ELS_Failed,
+};
+
+struct SPLoadSlot
+{
+	enum ESPLoadState state;
+	uint32_t sequence;				// Queue order, the worker always picks the oldest pending slot
+	uint64_t queuedNs;
+	struct SPSizeAlloc buffer;
+	char filename[PATH_MAX];
+};
+
+struct SPLoader
+{
+	struct SPPlatform* platform;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;			// Signaled when a slot becomes pending, or on shutdown
+	pthread_cond_t finished;		// Signaled when a slot is done or failed
+	int quit;
+	uint32_t nextSequence;
+	uint32_t depth;
+	struct SPLoadSlot* slots;
+	struct SPLoadStats stats;
+};
+
+static void finishstats(struct SPLoadStats* _stats)
+{
+	uint32_t count = _stats->fileCount + _stats->failedCount;
+	_stats->megabytesPerSecond = _stats->readNs ? (float)((double)_stats->byteCount * 1000.0 / (double)_stats->readNs) : 0.f;
+	_stats->averageFirstByteMs = count ? (float)((double)_stats->firstByteNs / (1000000.0 * count)) : 0.f;
+}
+
+static void addstats(struct SPLoadStats* _stats, int _ok, uint64_t _bytes, uint64_t _readNs, uint64_t _firstByteNs)
+{
+	if (_ok)
+		_stats->fileCount++;
+	else
+		_stats->failedCount++;
+	_stats->byteCount += _bytes;
+	_stats->readNs += _readNs;
+	_stats->firstByteNs += _firstByteNs;
+	if (_firstByteNs > _stats->maxFirstByteNs)
+		_stats->maxFirstByteNs = _firstByteNs;
+	finishstats(_stats);
+}
+
+/*
+ * Returns the size of a file, or -1 if it does not exist or is too large for the reserved region.
+ */
+static int64_t filesize(const char* _filename)
+{
+	struct stat st;
+	if (stat(_filename, &st) != 0 || st.st_size > RESERVED_MEMORY_SIZE)
+		return -1;
+	return (int64_t)st.st_size;
+}
+
+/*
+ * Read a whole file into _dest with large sequential reads.
+ * _startNs is where time to first byte is measured from.
+ * Returns 0 on success, -1 on failure.
+ */
+static int readfile(const char* _filename, uint8_t* _dest, uint32_t _size, uint64_t _startNs, uint64_t* _readNs, uint64_t* _firstByteNs)
+{
+	uint64_t openNs = SPGetTimeNs();
+	*_readNs = 0;
+	*_firstByteNs = 0;
+
+	int fd = open(_filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	uint32_t done = 0;
+	while (done < _size)
+	{
+		uint32_t count = _size - done < SP_LOAD_CHUNK_SIZE ? _size - done : SP_LOAD_CHUNK_SIZE;
+		ssize_t got = read(fd, _dest + done, count);
+		if (got <= 0)
+			break;
+		if (done == 0)
+			*_firstByteNs = SPGetTimeNs() - _startNs;
+		done += (uint32_t)got;
+	}
+	close(fd);
+
+	*_readNs = SPGetTimeNs() - openNs;
+	return done == _size ? 0 : -1;
+}
+
+/*
+ * Load a whole file into a newly allocated buffer from the reserved region, mapped with _policy.
+ * The buffer is flushed afterwards, so it can be handed to a device right away. Free it with SPFreeBuffer.
+ * Pass ESM_Cached for data parsed by the CPU, which is slow to read through an uncached mapping.
+ * _stats may be NULL, otherwise the load is added to it.
+ * Returns 0 on success, -1 if the file can't be read or does not fit into the reserved region.
+ */
+int SPLoadFile(struct SPPlatform* _platform, const char* _filename, struct SPSizeAlloc* _sizealloc, enum ESPMapPolicy _policy, struct SPLoadStats* _stats)
+{
+	uint64_t startNs = SPGetTimeNs();
+	uint64_t readNs = 0, firstByteNs = 0;
+
+	int64_t size = filesize(_filename);
+	_sizealloc->size = size > 0 ? (uint32_t)size : 1;
+	if (size < 0 || SPAllocateMappedBuffer(_platform, _sizealloc, SPALIGN_DEFAULT, _policy) != 0)
+	{
+		if (_stats)
+			addstats(_stats, 0, 0, 0, 0);
+		return -1;
+	}
+
+	_sizealloc->size = (uint32_t)size;
+	int err = readfile(_filename, _sizealloc->cpuAddress, _sizealloc->size, startNs, &readNs, &firstByteNs);
+	if (_stats)
+		addstats(_stats, !err, err ? 0 : _sizealloc->size, readNs, firstByteNs);
+
+	if (err)
+	{
+		SPFreeBuffer(_platform, _sizealloc);
+		return -1;
+	}
+
+	SPFlushRange(_platform, _sizealloc->cpuAddress, _sizealloc->size);
+	return 0;
+}
+
+static void* loaderworker(void* _arg)
+{
+	struct SPLoader* loader = (struct SPLoader*)_arg;
+
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->quit)
+	{
+		struct SPLoadSlot* next = NULL;
+		for (uint32_t i = 0; i < loader->depth; ++i)
+		{
+			struct SPLoadSlot* slot = &loader->slots[i];
+			if (slot->state == ELS_Pending && (!next || (int32_t)(slot->sequence - next->sequence) < 0))
+				next = slot;
+		}
+
+		if (!next)
+		{
+			pthread_cond_wait(&loader->queued, &loader->lock);
+			continue;
+		}
+
+		next->state = ELS_Reading;
+		pthread_mutex_unlock(&loader->lock);
+
+		// The buffer was allocated by SPQueueLoad, only the read happens here
+		uint64_t readNs = 0, firstByteNs = 0;
+		int err = readfile(next->filename, next->buffer.cpuAddress, next->buffer.size, next->queuedNs, &readNs, &firstByteNs);
+		if (!err)
+			SPFlushRange(loader->platform, next->buffer.cpuAddress, next->buffer.size);
+
+		pthread_mutex_lock(&loader->lock);
+		addstats(&loader->stats, !err, err ? 0 : next->buffer.size, readNs, firstByteNs);
+		next->state = err ? ELS_Failed : ELS_Done;
+		pthread_cond_broadcast(&loader->finished);
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	return NULL;
+}
+
+/*
+ * Create a loader that reads up to _depth queued files ahead on a background thread.
+ * SPQueueLoad and SPWaitLoad have to be called from one thread, the one that owns the platform.
+ * Returns NULL on failure.
+ */
+struct SPLoader* SPCreateLoader(struct SPPlatform* _platform, uint32_t _depth)
+{
+	struct SPLoader* loader = (struct SPLoader*)calloc(1, sizeof(struct SPLoader));
+	if (!loader)
+		return NULL;
+
+	loader->platform = _platform;
+	loader->depth = _depth ? _depth : 1;
+	loader->slots = (struct SPLoadSlot*)calloc(loader->depth, sizeof(struct SPLoadSlot));
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->queued, NULL);
+	pthread_cond_init(&loader->finished, NULL);
+
+	if (!loader->slots || pthread_create(&loader->worker, NULL, loaderworker, loader) != 0)
+	{
+		pthread_cond_destroy(&loader->finished);
+		pthread_cond_destroy(&loader->queued);
+		pthread_mutex_destroy(&loader->lock);
+		free(loader->slots);
+		free(loader);
+		return NULL;
+	}
+
+	return loader;
+}
+
+/*
+ * Stop the background thread and free every buffer that was loaded but not collected with SPWaitLoad.
+ * Blocks until the file currently being read is complete.
+ */
+void SPDestroyLoader(struct SPLoader* _loader)
+{
+	if (!_loader)
+		return;
+
+	pthread_mutex_lock(&_loader->lock);
+	_loader->quit = 1;
+	pthread_cond_signal(&_loader->queued);
+	pthread_mutex_unlock(&_loader->lock);
+	pthread_join(_loader->worker, NULL);
+
+	for (uint32_t i = 0; i < _loader->depth; ++i)
+	{
+		if (_loader->slots[i].state != ELS_Free)
+			SPFreeBuffer(_loader->platform, &_loader->slots[i].buffer);
+	}
+
+	pthread_cond_destroy(&_loader->finished);
+	pthread_cond_destroy(&_loader->queued);
+	pthread_mutex_destroy(&_loader->lock);
+	free(_loader->slots);
+	free(_loader);
+}
+
+/*
+ * Queue a file to be read in the background into a buffer from the reserved region mapped with _policy.
+ * The buffer is allocated here, on the calling thread, so the reserved region heap is never touched by the loader thread.
+ * Returns a ticket for SPWaitLoad, or -1 if all slots are in use or the file can't be allocated for.
+ */
+int SPQueueLoad(struct SPLoader* _loader, const char* _filename, enum ESPMapPolicy _policy)
+{
+	if (strlen(_filename) >= PATH_MAX)
+		return -1;
+
+	pthread_mutex_lock(&_loader->lock);
+	int ticket = -1;
+	for (uint32_t i = 0; i < _loader->depth && ticket < 0; ++i)
+	{
+		if (_loader->slots[i].state == ELS_Free)
+			ticket = (int)i;
+	}
+	pthread_mutex_unlock(&_loader->lock);
+
+	if (ticket < 0)
+		return -1;
+
+	// Only this thread moves slots out of ELS_Free, so the slot stays ours while we allocate
+	struct SPLoadSlot* slot = &_loader->slots[ticket];
+	uint64_t queuedNs = SPGetTimeNs();
+	int64_t size = filesize(_filename);
+	slot->buffer.size = size > 0 ? (uint32_t)size : 1;
+	if (size < 0 || SPAllocateMappedBuffer(_loader->platform, &slot->buffer, SPALIGN_DEFAULT, _policy) != 0)
+	{
+		pthread_mutex_lock(&_loader->lock);
+		addstats(&_loader->stats, 0, 0, 0, 0);
+		pthread_mutex_unlock(&_loader->lock);
+		return -1;
+	}
+	slot->buffer.size = (uint32_t)size;
+	strcpy(slot->filename, _filename);
+
+	pthread_mutex_lock(&_loader->lock);
+	slot->queuedNs = queuedNs;
+	slot->sequence = _loader->nextSequence++;
+	slot->state = ELS_Pending;
+	pthread_cond_signal(&_loader->queued);
+	pthread_mutex_unlock(&_loader->lock);
+
+	return ticket;
+}
+
+/*
+ * Block until the file behind _ticket is loaded, and take ownership of its buffer.
+ * Free the buffer with SPFreeBuffer when done. The ticket can be reused by SPQueueLoad afterwards.
+ * Returns 0 on success, -1 if the file could not be read.
+ */
+int SPWaitLoad(struct SPLoader* _loader, int _ticket, struct SPSizeAlloc* _sizealloc)
+{
+	if (_ticket < 0 || (uint32_t)_ticket >= _loader->depth)
+		return -1;
+
+	struct SPLoadSlot* slot = &_loader->slots[_ticket];
+
+	pthread_mutex_lock(&_loader->lock);
+	while (slot->state == ELS_Pending || slot->state == ELS_Reading)
+		pthread_cond_wait(&_loader->finished, &_loader->lock);
+	enum ESPLoadState state = slot->state;
+	pthread_mutex_unlock(&_loader->lock);
+
+	if (state == ELS_Free)
+		return -1;
+
+	*_sizealloc = slot->buffer;
+	memset(&slot->buffer, 0, sizeof(struct SPSizeAlloc));
+
+	if (state == ELS_Failed)
+		SPFreeBuffer(_loader->platform, _sizealloc);
+
+	pthread_mutex_lock(&_loader->lock);
+	slot->state = ELS_Free;
+	pthread_mutex_unlock(&_loader->lock);
+
+	return state == ELS_Done ? 0 : -1;
+}
+
+/*
+ * Retrieve throughput and time to first byte of everything loaded through _loader so far.
+ */
+void SPGetLoadStats(struct SPLoader* _loader, struct SPLoadStats* _stats)
+{
+	pthread_mutex_lock(&_loader->lock);
+	*_stats = _loader->stats;
+	pthread_mutex_unlock(&_loader->lock);
+}
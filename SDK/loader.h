@@ -0,0 +1,28 @@
+#pragma once
+
+#include "platform.h"
+
+// Asset loading straight into buffers from the reserved region, so that files
+// meant for the devices do not take a detour through malloc'd memory.
+
+struct SPLoadStats
+{
+	uint32_t fileCount;				// Files loaded successfully
+	uint32_t failedCount;			// Files that could not be opened, allocated or read
+	uint64_t byteCount;				// Bytes read
+	uint64_t readNs;				// Time from open() to the last byte, summed over all files
+	uint64_t firstByteNs;			// Time to first byte summed over all files, measured from SPQueueLoad() for queued files
+	uint64_t maxFirstByteNs;		// Worst time to first byte
+	float megabytesPerSecond;		// byteCount / readNs
+	float averageFirstByteMs;		// firstByteNs / (fileCount + failedCount)
+};
+
+struct SPLoader;
+
+int SPLoadFile(struct SPPlatform* _platform, const char* _filename, struct SPSizeAlloc* _sizealloc, enum ESPMapPolicy _policy, struct SPLoadStats* _stats);
+
+struct SPLoader* SPCreateLoader(struct SPPlatform* _platform, uint32_t _depth);
+void SPDestroyLoader(struct SPLoader* _loader);
+int SPQueueLoad(struct SPLoader* _loader, const char* _filename, enum ESPMapPolicy _policy);
+int SPWaitLoad(struct SPLoader* _loader, int _ticket, struct SPSizeAlloc* _sizealloc);
+void SPGetLoadStats(struct SPLoader* _loader, struct SPLoadStats* _stats);
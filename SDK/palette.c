@@ -0,0 +1,67 @@
+#include "palette.h"
+
+/*
+ * Mix two r8g8b8 colors, red and blue are weighted together and green on its own.
+ */
+static inline uint32_t palette_mix(uint32_t _a, uint32_t _b, uint32_t _amount)
+{
+	uint32_t inv = 256 - _amount;
+	uint32_t rb = ((_a & 0xFF00FF) * inv + (_b & 0xFF00FF) * _amount) >> 8;
+	uint32_t g = ((_a & 0x00FF00) * inv + (_b & 0x00FF00) * _amount) >> 8;
+	return (rb & 0xFF00FF) | (g & 0x00FF00);
+}
+
+/*
+ * Pack _count r, g, b byte triplets, the way Doom and Quake store palettes, into r8g8b8 colors.
+ * Each component goes through the 256 entry _gamma table if one is given.
+ */
+void SPPaletteFromRGB8(uint32_t* _dst, const uint8_t* _rgb, uint32_t _count, const uint8_t* _gamma)
+{
+	for (uint32_t i = 0; i < _count; ++i, _rgb += 3)
+	{
+		if (_gamma)
+			_dst[i] = ((uint32_t)_gamma[_rgb[0]] << 16) | ((uint32_t)_gamma[_rgb[1]] << 8) | _gamma[_rgb[2]];
+		else
+			_dst[i] = ((uint32_t)_rgb[0] << 16) | ((uint32_t)_rgb[1] << 8) | _rgb[2];
+	}
+}
+
+/*
+ * Blend two palettes entry by entry, _amount 0 gives _a and 256 gives _b. _dst may be either of them.
+ */
+void SPPaletteLerp(uint32_t* _dst, const uint32_t* _a, const uint32_t* _b, uint32_t _count, uint32_t _amount)
+{
+	if (_amount > 256)
+		_amount = 256;
+	for (uint32_t i = 0; i < _count; ++i)
+		_dst[i] = palette_mix(_a[i], _b[i], _amount);
+}
+
+/*
+ * Fade every entry towards _rgb24, black for a fade out or a tint for damage and pickup flashes.
+ * _amount 0 leaves the palette as it is and 256 turns every entry into _rgb24. _dst may be _src.
+ */
+void SPPaletteFade(uint32_t* _dst, const uint32_t* _src, uint32_t _count, uint32_t _rgb24, uint32_t _amount)
+{
+	if (_amount > 256)
+		_amount = 256;
+	for (uint32_t i = 0; i < _count; ++i)
+		_dst[i] = palette_mix(_src[i], _rgb24, _amount);
+}
+
+/*
+ * Rotate _count entries by _shift, entry i of _dst gets entry i + _shift of _src, wrapping around.
+ * Pass pointers into a palette to cycle part of it, such as water or lava colors. _dst and _src must not overlap.
+ */
+void SPPaletteCycle(uint32_t* _dst, const uint32_t* _src, uint32_t _count, int _shift)
+{
+	if (!_count)
+		return;
+	uint32_t offset = (uint32_t)(_shift % (int)_count + (int)_count) % _count;
+	for (uint32_t i = 0; i < _count; ++i)
+	{
+		_dst[i] = _src[offset];
+		if (++offset == _count)
+			offset = 0;
+	}
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Palette building and animation on the CPU. Palettes are arrays of r8g8b8 colors as VPUSetPaletteRange()
+// takes them, so a fade or a cycle is computed here and uploaded in one batch, and only the entries
+// that actually changed reach the device. Amounts run from 0 for the first color to 256 for the second.
+
+void SPPaletteFromRGB8(uint32_t* _dst, const uint8_t* _rgb, uint32_t _count, const uint8_t* _gamma);
+void SPPaletteLerp(uint32_t* _dst, const uint32_t* _a, const uint32_t* _b, uint32_t _count, uint32_t _amount);
+void SPPaletteFade(uint32_t* _dst, const uint32_t* _src, uint32_t _count, uint32_t _rgb24, uint32_t _amount);
+void SPPaletteCycle(uint32_t* _dst, const uint32_t* _src, uint32_t _count, int _shift);
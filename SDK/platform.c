@@ -1,16 +1,29 @@
+// ppoll() is a GNU extension
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "core.h"
 #include "platform.h"
 #include <sys/ioctl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "vpu.h"
 #include "vcp.h"
 #include "apu.h"
+#include "trace.h"
+#include "arena.h"
 
 static struct SPPlatform* g_activePlatform = NULL;
 
@@ -20,6 +33,16 @@ struct SPIoctl
 	uint32_t value;
 };
 
+struct SPIoctlBatch
+{
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t entries;	// User pointer to count SPBatchEntry items
+};
+
+// Default number of register writes a batch can hold before it is submitted automatically
+#define SP_BATCH_CAPACITY			1024
+
 // ioctl numbers for sandpiper device
 #define SP_IOCTL_GET_VIDEO_CTL		_IOR('k', 0, void*)
 #define SP_IOCTL_GET_AUDIO_CTL		_IOR('k', 1, void*)
@@ -33,10 +56,179 @@ struct SPIoctl
 #define SP_IOCTL_PALETTE_READ		_IOR('k', 9, void*)
 #define SP_IOCTL_PALETTE_WRITE		_IOW('k', 10, void*)
 #define SP_IOCTL_GET_VCP_CTL		_IOR('k', 11, void*)
+#define SP_IOCTL_BATCH_WRITE		_IOW('k', 12, void*)
+#define SP_IOCTL_CACHE_FLUSH		_IOW('k', 13, void*)
+#define SP_IOCTL_CACHE_INVALIDATE	_IOW('k', 14, void*)
+#define SP_IOCTL_SET_MAP_POLICY		_IOW('k', 15, void*)
+
+static const unsigned long s_readIoctls[ESD_Count] = {
+	SP_IOCTL_AUDIO_READ,
+	SP_IOCTL_VIDEO_READ,
+	SP_IOCTL_PALETTE_READ,
+	SP_IOCTL_VCP_READ,
+};
+
+static const unsigned long s_writeIoctls[ESD_Count] = {
+	SP_IOCTL_AUDIO_WRITE,
+	SP_IOCTL_VIDEO_WRITE,
+	SP_IOCTL_PALETTE_WRITE,
+	SP_IOCTL_VCP_WRITE,
+};
+
+// Barriers that give direct register accesses the same ordering guarantees as the driver's iowrite32/ioread32,
+// so that CPU writes to the reserved region are visible to a device before the command that consumes them.
+#if defined(__arm__)
+#define SP_WRITE_BARRIER()	__asm__ volatile("dsb st" ::: "memory")
+#define SP_READ_BARRIER()	__asm__ volatile("dsb" ::: "memory")
+#else
+#define SP_WRITE_BARRIER()	__sync_synchronize()
+#define SP_READ_BARRIER()	__sync_synchronize()
+#endif
+
+// Queue length, a thread never queues more than one batch worth of writes at once
+#define SP_RING_SIZE				SP_BATCH_CAPACITY
+// Batches of nothing but audio writes are queued apart so they can overtake other threads, everything else
+// shares one queue that keeps the order each thread recorded in, across devices
+#define SP_RING_AUDIO				0
+#define SP_RING_ORDERED				1
+#define SP_RING_COUNT				2
+// Writes sent to the backend at once while other threads are queueing, audio queued meanwhile goes out between chunks
+#define SP_SUBMIT_CHUNK				64
+
+struct SPThreadBatch
+{
+	struct SPThreadBatch* next;
+	pthread_t owner;
+	struct SPBatchEntry* entries;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t depth;					// Nesting level of SPBeginBatch calls
+};
+
+struct SPRingSlot
+{
+	struct SPBatchEntry entry;
+	uint32_t sequence;				// Position + 1 once the entry is written
+};
+
+// Bounded multi-producer single-consumer queue. Producers reserve a range by advancing tail,
+// the thread holding the submitter consumes from head.
+struct SPCommandRing
+{
+	uint32_t tail;
+	uint32_t head;
+	struct SPRingSlot slots[SP_RING_SIZE];
+};
+
+struct SPThreadBatchCache
+{
+	uint32_t platformId;
+	struct SPThreadBatch* batch;
+};
+
+static __thread struct SPThreadBatchCache s_threadBatch;
+static uint32_t s_nextPlatformId = 0;
+// Nonzero per thread, identifies the thread holding the submitter
+static __thread uint32_t s_threadToken;
+static uint32_t s_nextThreadToken = 0;
+
+/*
+ * Returns the recording state of the calling thread for _platform, creating it on first use.
+ */
+static struct SPThreadBatch* threadbatch(struct SPPlatform* _platform)
+{
+	struct SPBatch* batch = &_platform->batch;
+
+	uint32_t id = __atomic_load_n(&batch->id, __ATOMIC_ACQUIRE);
+	if (!id)
+	{
+		uint32_t newId = __atomic_add_fetch(&s_nextPlatformId, 1, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&batch->id, &id, newId, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			id = newId;
+	}
+
+	if (s_threadBatch.platformId == id)
+		return s_threadBatch.batch;
+
+	pthread_t self = pthread_self();
+	struct SPThreadBatch* threadBatch = __atomic_load_n(&batch->threads, __ATOMIC_ACQUIRE);
+	while (threadBatch && !pthread_equal(threadBatch->owner, self))
+		threadBatch = threadBatch->next;
+
+	if (!threadBatch)
+	{
+		threadBatch = (struct SPThreadBatch*)calloc(1, sizeof(struct SPThreadBatch));
+		if (!threadBatch)
+			return NULL;
+		threadBatch->owner = self;
+
+		struct SPThreadBatch* first = __atomic_load_n(&batch->threads, __ATOMIC_ACQUIRE);
+		do {
+			threadBatch->next = first;
+		} while (!__atomic_compare_exchange_n(&batch->threads, &first, threadBatch, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	}
+
+	s_threadBatch.platformId = id;
+	s_threadBatch.batch = threadBatch;
+	return threadBatch;
+}
+
+/*
+ * Returns the audio and the ordered queue, creating them the first time two threads submit at once.
+ */
+static struct SPCommandRing* commandrings(struct SPPlatform* _platform)
+{
+	struct SPCommandRing* rings = __atomic_load_n(&_platform->batch.rings, __ATOMIC_ACQUIRE);
+	if (rings)
+		return rings;
+
+	struct SPCommandRing* fresh = (struct SPCommandRing*)calloc(SP_RING_COUNT, sizeof(struct SPCommandRing));
+	if (!fresh)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&_platform->batch.rings, &rings, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(fresh);
+		return rings;
+	}
+	return fresh;
+}
 
 // NOTE: A list of all of the onboard devices can be found under /sys/bus/platform/devices/ including the audio and video devices.
 // The file names are annotated with the device addresses, which is useful for MMIO mapping.
 
+/*
+ * Map one page of device registers into user space through the sandpiper device.
+ * Returns MAP_FAILED if the driver does not allow mapping of the given address.
+ */
+static volatile uint32_t* mapdeviceregisters(struct SPPlatform* _platform, uint32_t _physicalAddress)
+{
+	return (volatile uint32_t*)mmap(NULL, DEVICE_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _platform->sandpiperfd, _physicalAddress);
+}
+
+/*
+ * Release a device register page mapped by mapdeviceregisters.
+ */
+static void unmapdeviceregisters(volatile uint32_t** _io)
+{
+	if (*_io && *_io != (volatile uint32_t*)MAP_FAILED)
+		munmap((void*)*_io, DEVICE_MEMORY_SIZE);
+	*_io = (volatile uint32_t*)MAP_FAILED;
+}
+
+static inline uint32_t directread32(volatile uint32_t* _io, uint32_t offset)
+{
+	uint32_t value = *(volatile uint32_t*)((volatile uint8_t*)_io + offset);
+	SP_READ_BARRIER();
+	return value;
+}
+
+static inline void directwrite32(volatile uint32_t* _io, uint32_t offset, uint32_t value)
+{
+	SP_WRITE_BARRIER();
+	*(volatile uint32_t*)((volatile uint8_t*)_io + offset) = value;
+}
+
 /*
  * This function is called at program exit to ensure that the Sandpiper platform is cleanly shut down.
  */
@@ -44,6 +236,14 @@ void shutdowncleanup()
 {
 	if (g_activePlatform)
 	{
+		// Send anything still pending so that the following commands land after it
+		struct SPThreadBatch* threadBatch = threadbatch(g_activePlatform);
+		if (threadBatch && threadBatch->depth)
+		{
+			threadBatch->depth = 1;
+			SPSubmit(g_activePlatform);
+		}
+
 		// Switch to fbcon buffer and shut down video
 		if (g_activePlatform->vx)
 		{
@@ -93,47 +293,29 @@ void shutdowncleanup()
  */
 static void signal_handler(int s)
 {
+	(void)s;
 	// We don't currently care about which signal was received and simply shut down the platform
 	shutdowncleanup();
 	exit(0);
 }
 
 /*
- * Initialize the Sandpiper platform, mapping necessary resources and setting up device contexts.
+ * Open the sandpiper device, map the reserved region and the device register pages.
  */
-struct SPPlatform* SPInitPlatform()
+static int deviceopen(struct SPPlatform* _platform)
 {
-	struct SPPlatform* platform = (struct SPPlatform*)malloc(sizeof(struct SPPlatform));
-	if (!platform)
-	{
-		fprintf(stderr, "Failed to allocate SPPlatform\n");
-		return NULL;
-	}
-
-	platform->audioio = (uint32_t*)MAP_FAILED;
-	platform->videoio = (uint32_t*)MAP_FAILED;
-	platform->paletteio = (uint32_t*)MAP_FAILED;
-	platform->vcpio = (uint32_t*)MAP_FAILED;
-	platform->mapped_memory = (uint8_t*)MAP_FAILED;
-	platform->alloc_cursor = 0x96000; // The cursor has to stay outside the framebuffer region, which is 640*480*2 bytes in size.
-	platform->sandpiperfd = -1;
-	platform->vx = 0;
-	platform->ac = 0;
-	platform->sc = 0;
-	platform->ready = 0;
-
 	int err = 0;
 
-	platform->sandpiperfd = open("/dev/sandpiper", O_RDWR | O_SYNC);
-	if (platform->sandpiperfd < 1)
+	_platform->sandpiperfd = open("/dev/sandpiper", O_RDWR | O_SYNC);
+	if (_platform->sandpiperfd < 1)
 	{
 		perror("Can't access sandpiper device");
 		err = 1;
 	}
 
 	// Map the 32MByte reserved region for CPU usage
-	platform->mapped_memory = (uint8_t*)mmap(NULL, RESERVED_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, platform->sandpiperfd, RESERVED_MEMORY_ADDRESS);
-	if (platform->mapped_memory == (uint8_t*)MAP_FAILED)
+	_platform->mapped_memory = (uint8_t*)mmap(NULL, RESERVED_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _platform->sandpiperfd, RESERVED_MEMORY_ADDRESS);
+	if (_platform->mapped_memory == (uint8_t*)MAP_FAILED)
 	{
 		perror("Can't map reserved region for CPU");
 		err = 1;
@@ -144,57 +326,152 @@ struct SPPlatform* SPInitPlatform()
 	ioctlstruct.value = 0;
 
 	// Grab the contol registers for audio device
-	if (ioctl(platform->sandpiperfd, SP_IOCTL_GET_AUDIO_CTL, &ioctlstruct) < 0)
+	if (ioctl(_platform->sandpiperfd, SP_IOCTL_GET_AUDIO_CTL, &ioctlstruct) < 0)
 	{
 		perror("Failed to get audio control");
-		close(platform->sandpiperfd);
+		close(_platform->sandpiperfd);
 		err = 1;
 	}
 	else
-		platform->audioio = (volatile uint32_t*)ioctlstruct.value;
+		_platform->audioio = mapdeviceregisters(_platform, AUDIODEVICE_ADDRESS);
 
 	// Grab the contol registers for video device
 	ioctlstruct.offset = 0;
 	ioctlstruct.value = 0;
-	if (ioctl(platform->sandpiperfd, SP_IOCTL_GET_VIDEO_CTL, &ioctlstruct) < 0)
+	if (ioctl(_platform->sandpiperfd, SP_IOCTL_GET_VIDEO_CTL, &ioctlstruct) < 0)
 	{
 		perror("Failed to get video control");
-		close(platform->sandpiperfd);
+		close(_platform->sandpiperfd);
 		err = 1;
 	}
 	else
-		platform->videoio = (volatile uint32_t*)ioctlstruct.value;
+		_platform->videoio = mapdeviceregisters(_platform, VIDEODEVICE_ADDRESS);
 
 	// Grab the contol registers for palette device
 	ioctlstruct.offset = 0;
 	ioctlstruct.value = 0;
-	if (ioctl(platform->sandpiperfd, SP_IOCTL_GET_PALETTE_CTL, &ioctlstruct) < 0)
+	if (ioctl(_platform->sandpiperfd, SP_IOCTL_GET_PALETTE_CTL, &ioctlstruct) < 0)
 	{
 		perror("Failed to get palette control");
-		close(platform->sandpiperfd);
+		close(_platform->sandpiperfd);
 		err = 1;
 	}
+#if defined(PALETTEDEVICE_ADDRESS)
 	else
-		platform->paletteio = (volatile uint32_t*)ioctlstruct.value;
+		_platform->paletteio = mapdeviceregisters(_platform, PALETTEDEVICE_ADDRESS);
+#endif
 
 	// Grab the contol registers for VCP (this is inside VPU for now)
 	ioctlstruct.offset = 0;
 	ioctlstruct.value = 0;
-	if (ioctl(platform->sandpiperfd, SP_IOCTL_GET_VCP_CTL, &ioctlstruct) < 0)
+	if (ioctl(_platform->sandpiperfd, SP_IOCTL_GET_VCP_CTL, &ioctlstruct) < 0)
 	{
 		perror("Failed to get coprocessor control");
-		close(platform->sandpiperfd);
+		close(_platform->sandpiperfd);
 		err = 1;
 	}
+#if defined(VCPDEVICE_ADDRESS)
 	else
-		platform->vcpio = (volatile uint32_t*)ioctlstruct.value;
+		_platform->vcpio = mapdeviceregisters(_platform, VCPDEVICE_ADDRESS);
+#endif
+
+	if (!err)
+	{
+		// Prefer direct register access when the driver lets us map any of the device pages
+		if (_platform->audioio != (volatile uint32_t*)MAP_FAILED || _platform->videoio != (volatile uint32_t*)MAP_FAILED ||
+			_platform->paletteio != (volatile uint32_t*)MAP_FAILED || _platform->vcpio != (volatile uint32_t*)MAP_FAILED)
+			_platform->registerAccess = ERA_Direct;
+	}
+
+	return err ? -1 : 0;
+}
+
+/*
+ * Unmap everything deviceopen and devicemapview mapped, and close the sandpiper device.
+ */
+static void deviceclose(struct SPPlatform* _platform)
+{
+	if (_platform->mapped_memory != (uint8_t*)MAP_FAILED)
+	{
+		munmap((void*)_platform->mapped_memory, RESERVED_MEMORY_SIZE);
+		_platform->mapped_memory = (uint8_t*)MAP_FAILED;
+	}
+
+	if (_platform->writecombined_memory != (uint8_t*)MAP_FAILED)
+	{
+		munmap((void*)_platform->writecombined_memory, RESERVED_MEMORY_SIZE);
+		_platform->writecombined_memory = (uint8_t*)MAP_FAILED;
+	}
+
+	if (_platform->cached_memory != (uint8_t*)MAP_FAILED)
+	{
+		munmap((void*)_platform->cached_memory, RESERVED_MEMORY_SIZE);
+		_platform->cached_memory = (uint8_t*)MAP_FAILED;
+	}
+
+	unmapdeviceregisters(&_platform->audioio);
+	unmapdeviceregisters(&_platform->videoio);
+	unmapdeviceregisters(&_platform->paletteio);
+	unmapdeviceregisters(&_platform->vcpio);
+
+	if (_platform->sandpiperfd != -1)
+	{
+		close(_platform->sandpiperfd);
+		_platform->sandpiperfd = -1;
+	}
+}
+
+/*
+ * Initialize the Sandpiper platform on the given backend, mapping necessary resources and setting up device contexts.
+ */
+struct SPPlatform* SPInitPlatformBackend(const struct SPBackend* _backend)
+{
+	struct SPPlatform* platform = (struct SPPlatform*)malloc(sizeof(struct SPPlatform));
+	if (!platform)
+	{
+		fprintf(stderr, "Failed to allocate SPPlatform\n");
+		return NULL;
+	}
+
+	platform->audioio = (uint32_t*)MAP_FAILED;
+	platform->videoio = (uint32_t*)MAP_FAILED;
+	platform->paletteio = (uint32_t*)MAP_FAILED;
+	platform->vcpio = (uint32_t*)MAP_FAILED;
+	platform->registerAccess = ERA_Ioctl;
+	memset(&platform->batch, 0, sizeof(struct SPBatch));
+	platform->mapped_memory = (uint8_t*)MAP_FAILED;
+	platform->writecombined_memory = (uint8_t*)MAP_FAILED;
+	platform->cached_memory = (uint8_t*)MAP_FAILED;
+	platform->heap = 0;
+	memset(&platform->vcpUpload, 0, sizeof(struct SPSizeAlloc));
+	platform->sandpiperfd = -1;
+	platform->vx = 0;
+	platform->ac = 0;
+	platform->sc = 0;
+	platform->ready = 0;
+
+	platform->backend = _backend;
+	platform->backendData = 0;
+
+	int err = _backend->open(platform) != 0;
+
+	if (!err)
+	{
+		// Hand out everything past the console framebuffer
+		platform->heap = SPHeapCreate(RESERVED_HEAP_OFFSET, RESERVED_MEMORY_SIZE - RESERVED_HEAP_OFFSET);
+		if (!platform->heap)
+		{
+			fprintf(stderr, "Failed to create reserved region heap\n");
+			err = 1;
+		}
+	}
 
 	if (!err)
 	{
 		platform->ready = 1;
 		platform->vx = (struct EVideoContext*)malloc(sizeof(struct EVideoContext));
 		platform->ac = (struct EAudioContext*)malloc(sizeof(struct EAudioContext));
-		platform->sc = (struct EVideoSwapContext*)malloc(sizeof(struct EVideoSwapContext));
+		platform->sc = (struct EVideoSwapContext*)calloc(1, sizeof(struct EVideoSwapContext));
 		g_activePlatform = platform;
 
 		// Start up main video and audio systems
@@ -251,6 +528,20 @@ struct SPPlatform* SPInitPlatform()
 	return platform;
 }
 
+/*
+ * Initialize the Sandpiper platform on the hardware.
+ * Setting SANDPIPER_BACKEND=host in the environment runs on the software device model instead,
+ * so that unmodified samples can run headless, see hostdevice.c.
+ */
+struct SPPlatform* SPInitPlatform()
+{
+	const char* backend = getenv("SANDPIPER_BACKEND");
+	if (backend && strcmp(backend, "host") == 0)
+		return SPInitPlatformBackend(SPGetHostBackend());
+
+	return SPInitPlatformBackend(SPGetDeviceBackend());
+}
+
 /*
  * Shutdown the Sandpiper platform, unmapping resources and closing device handles.
  */
@@ -259,16 +550,30 @@ void SPShutdownPlatform(struct SPPlatform* _platform)
 	_platform->ready = 0;
 	g_activePlatform = NULL;
 
-	if (_platform->mapped_memory != (uint8_t*)MAP_FAILED)
+	if (_platform->backend)
+		_platform->backend->close(_platform);
+
+	_platform->registerAccess = ERA_Ioctl;
+	struct SPThreadBatch* threadBatch = _platform->batch.threads;
+	while (threadBatch)
 	{
-		munmap((void*)_platform->mapped_memory, RESERVED_MEMORY_SIZE);
-		_platform->mapped_memory = (uint8_t*)MAP_FAILED;
+		struct SPThreadBatch* next = threadBatch->next;
+		free(threadBatch->entries);
+		free(threadBatch);
+		threadBatch = next;
 	}
+	free(_platform->batch.rings);
+	free(_platform->batch.loopback);
+	memset(&_platform->batch, 0, sizeof(struct SPBatch));
 
-	if (_platform->sandpiperfd != -1)
+	if (_platform->sc)
+		SPDestroyFrameArenas(_platform, _platform->sc);
+	SPFreeBuffer(_platform, &_platform->vcpUpload);
+
+	if (_platform->heap)
 	{
-		close(_platform->sandpiperfd);
-		_platform->sandpiperfd = -1;
+		SPHeapDestroy(_platform->heap);
+		_platform->heap = 0;
 	}
 
 	if (_platform->vx)
@@ -283,148 +588,840 @@ void SPShutdownPlatform(struct SPPlatform* _platform)
 		free(_platform->sc);
 	_platform->sc = 0;
 
-	_platform->alloc_cursor = 0x96000;
-	_platform->audioio = 0;
-	_platform->videoio = 0;
-	_platform->paletteio = 0;
-	_platform->vcpio = 0;
 }
 
 /*
- * Retrieve the console framebuffer addresses for CPU and DMA access.
+ * Monotonic time in nanoseconds.
  */
-void SPGetConsoleFramebuffer(struct SPPlatform* _platform, struct SPSizeAlloc* _sizealloc)
+uint64_t SPGetTimeNs()
 {
-	if (_platform->mapped_memory != (uint8_t*)MAP_FAILED)
-	{
-		_sizealloc->cpuAddress = _platform->mapped_memory;
-		_sizealloc->dmaAddress = (uint8_t*)RESERVED_MEMORY_ADDRESS;
-	}
-	else
-	{
-		_sizealloc->cpuAddress = NULL;
-		_sizealloc->dmaAddress = NULL;
-	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
 /*
- * Allocate a buffer from the reserved memory region.
+ * Sleep for up to _durationNs.
+ * With _wakeOnDeviceEvent set, the sleep is a poll() on the sandpiper device for POLLPRI,
+ * which ends early if the driver signals a device event (vblank or audio buffer swap).
+ * Drivers without event support never report POLLPRI, so this degrades to a plain sleep.
+ * Returns 1 if woken up by the device, 0 otherwise.
  */
-int SPAllocateBuffer(struct SPPlatform* _platform, struct SPSizeAlloc* _sizealloc)
+int SPSleep(struct SPPlatform* _platform, uint64_t _durationNs, int _wakeOnDeviceEvent)
 {
-	if (_platform->mapped_memory != (uint8_t*)MAP_FAILED)
-	{
-		uint32_t alignedSize = E32AlignUp(_sizealloc->size, 128);
-
-		// Add bounds checking
-		if (_platform->alloc_cursor + alignedSize > RESERVED_MEMORY_SIZE)
-		{
-			_sizealloc->cpuAddress = NULL;
-			_sizealloc->dmaAddress = NULL;
-			return -1; // Indicate allocation failure due to out of memory
-		}
+	struct timespec ts;
+	ts.tv_sec = (time_t)(_durationNs / 1000000000ull);
+	ts.tv_nsec = (long)(_durationNs % 1000000000ull);
 
-		_sizealloc->cpuAddress = _platform->mapped_memory + _platform->alloc_cursor;
-		_sizealloc->dmaAddress = (uint8_t*)RESERVED_MEMORY_ADDRESS + _platform->alloc_cursor;
-		_platform->alloc_cursor += alignedSize;
-
-		return 0;
-	}
-	else
+	if (_wakeOnDeviceEvent && _platform->sandpiperfd >= 0)
 	{
-		_sizealloc->cpuAddress = NULL;
-		_sizealloc->dmaAddress = NULL;
-
-		return -1;
+		struct pollfd pfd;
+		pfd.fd = _platform->sandpiperfd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		return ppoll(&pfd, 1, &ts, NULL) > 0 && (pfd.revents & POLLPRI);
 	}
+
+	nanosleep(&ts, NULL);
+	return 0;
 }
 
 /*
- * Free a previously allocated buffer.
- * Note: This is a placeholder as the current implementation does not support freeing individual allocations.
+ * Select how control registers are accessed.
+ * ERA_Direct uses the register pages mapped at init time, devices which could not be mapped keep using ioctl().
+ * Returns 0 on success, -1 if direct access was requested but no device registers are mapped.
  */
-void SPFreeBuffer(struct SPPlatform* _platform, struct SPSizeAlloc *_sizealloc)
+int SPSetRegisterAccess(struct SPPlatform* _platform, enum ESPRegisterAccess _access)
 {
-	// TODO
-}
+	if (_access == ERA_Direct &&
+		_platform->audioio == (volatile uint32_t*)MAP_FAILED && _platform->videoio == (volatile uint32_t*)MAP_FAILED &&
+		_platform->paletteio == (volatile uint32_t*)MAP_FAILED && _platform->vcpio == (volatile uint32_t*)MAP_FAILED)
+		return -1;
 
-// Read and write functions for APU, VPU, PAL, and VCP control registers.
+	_platform->registerAccess = _access == ERA_Direct ? ERA_Direct : ERA_Ioctl;
+	return 0;
+}
 
-uint32_t audioread32(struct SPPlatform* _platform, uint32_t offset)
+/*
+ * Returns the mapped register page of a device, or MAP_FAILED if it has to be reached through ioctl().
+ */
+static volatile uint32_t* deviceregisters(struct SPPlatform* _platform, uint32_t _device)
 {
-	struct SPIoctl ioctlstruct;
-	ioctlstruct.offset = offset;
-	ioctlstruct.value = 0;
-	if (ioctl(_platform->sandpiperfd, SP_IOCTL_AUDIO_READ, &ioctlstruct) < 0)
-		return 0;
-	return ioctlstruct.value;
+	if (_platform->registerAccess != ERA_Direct)
+		return (volatile uint32_t*)MAP_FAILED;
+
+	switch (_device)
+	{
+		case ESD_Audio: return _platform->audioio;
+		case ESD_Video: return _platform->videoio;
+		case ESD_Palette: return _platform->paletteio;
+		case ESD_VCP: return _platform->vcpio;
+		default: return (volatile uint32_t*)MAP_FAILED;
+	}
 }
 
-void audiowrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
+/*
+ * Write a register without going through batch recording.
+ */
+static void devicewrite32(struct SPPlatform* _platform, uint32_t _device, uint32_t offset, uint32_t value)
 {
+	volatile uint32_t* io = deviceregisters(_platform, _device);
+	if (io != (volatile uint32_t*)MAP_FAILED)
+	{
+		directwrite32(io, offset, value);
+		return;
+	}
+
 	struct SPIoctl ioctlstruct;
 	ioctlstruct.offset = offset;
 	ioctlstruct.value = value;
-	ioctl(_platform->sandpiperfd, SP_IOCTL_AUDIO_WRITE, &ioctlstruct);
+	if (ioctl(_platform->sandpiperfd, s_writeIoctls[_device], &ioctlstruct) < 0 && _device == ESD_VCP)
+		perror("can't write to VCP");
 }
 
-uint32_t videoread32(struct SPPlatform* _platform, uint32_t offset)
+/*
+ * Read a register through its mapped page, or with an ioctl() if the device is not mapped.
+ */
+static uint32_t deviceread32(struct SPPlatform* _platform, uint32_t _device, uint32_t offset)
 {
+	volatile uint32_t* io = deviceregisters(_platform, _device);
+	if (io != (volatile uint32_t*)MAP_FAILED)
+		return directread32(io, offset);
+
 	struct SPIoctl ioctlstruct;
 	ioctlstruct.offset = offset;
 	ioctlstruct.value = 0;
-	if (ioctl(_platform->sandpiperfd, SP_IOCTL_VIDEO_READ, &ioctlstruct) < 0)
+	if (ioctl(_platform->sandpiperfd, s_readIoctls[_device], &ioctlstruct) < 0)
+	{
+		if (_device == ESD_Palette || _device == ESD_VCP)
+		{
+			perror(_device == ESD_Palette ? "can't read from PAL" : "can't read from VCP");
+			return 0xCDCDCDCD;
+		}
 		return 0;
+	}
 	return ioctlstruct.value;
 }
 
-void videowrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
+/*
+ * Send a batch of register writes to the hardware.
+ * Uses direct stores if every device in the batch is mapped, otherwise a single batched ioctl,
+ * and falls back to one ioctl per write if the driver does not support batches.
+ */
+static void devicewritebatch(struct SPPlatform* _platform, const struct SPBatchEntry* _entries, uint32_t _count)
 {
-	struct SPIoctl ioctlstruct;
-	ioctlstruct.offset = offset;
-	ioctlstruct.value = value;
-	ioctl(_platform->sandpiperfd, SP_IOCTL_VIDEO_WRITE, &ioctlstruct);
-}
+	struct SPBatch* batch = &_platform->batch;
 
-uint32_t paletteread32(struct SPPlatform* _platform, uint32_t offset)
-{
-	struct SPIoctl ioctlstruct;
-	ioctlstruct.offset = offset;
-	ioctlstruct.value = 0;
-	if (ioctl(_platform->sandpiperfd, SP_IOCTL_PALETTE_READ, &ioctlstruct) < 0)
+	int allMapped = 1;
+	for (uint32_t i=0; i<_count && allMapped; ++i)
+		allMapped = deviceregisters(_platform, _entries[i].device) != (volatile uint32_t*)MAP_FAILED;
+
+	if (!allMapped && !batch->noBatchIoctl)
 	{
-		perror("can't read from PAL");
-		return 0xCDCDCDCD;
+		struct SPIoctlBatch ioctlbatch;
+		ioctlbatch.count = _count;
+		ioctlbatch.reserved = 0;
+		ioctlbatch.entries = (uint64_t)(uintptr_t)_entries;
+		int err;
+		do
+		{
+			batch->stats.syscalls++;
+			err = ioctl(_platform->sandpiperfd, SP_IOCTL_BATCH_WRITE, &ioctlbatch);
+		} while (err < 0 && errno == EINTR);
+		if (err == 0)
+			return;
+
+		// Older drivers do not know about batches, don't try again. Other errors only affect this batch,
+		// which is sent one write at a time
+		if (errno == ENOTTY || errno == EINVAL)
+			batch->noBatchIoctl = 1;
+		else
+			perror("sandpiper batch write");
 	}
-	return ioctlstruct.value;
-}
 
-void palettewrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
-{
-	struct SPIoctl ioctlstruct;
-	ioctlstruct.offset = offset;
-	ioctlstruct.value = value;
-	ioctl(_platform->sandpiperfd, SP_IOCTL_PALETTE_WRITE, &ioctlstruct);
+	for (uint32_t i=0; i<_count; ++i)
+	{
+		if (deviceregisters(_platform, _entries[i].device) == (volatile uint32_t*)MAP_FAILED)
+			batch->stats.syscalls++;
+		devicewrite32(_platform, _entries[i].device, _entries[i].offset, _entries[i].value);
+	}
 }
 
-uint32_t vcpread32(struct SPPlatform* _platform, uint32_t offset)
+static void loopbackappend(struct SPBatch* _batch, uint32_t _device, uint32_t offset, uint32_t value)
 {
-	struct SPIoctl ioctlstruct;
-	ioctlstruct.offset = offset;
-	ioctlstruct.value = 0;
-	if (ioctl(_platform->sandpiperfd, SP_IOCTL_VCP_READ, &ioctlstruct) < 0)
+	if (_batch->loopbackCount == _batch->loopbackCapacity)
 	{
-		perror("can't read from VCP");
-		return 0xCDCDCDCD;
+		uint32_t capacity = _batch->loopbackCapacity ? _batch->loopbackCapacity * 2 : SP_BATCH_CAPACITY;
+		struct SPBatchEntry* loopback = (struct SPBatchEntry*)realloc(_batch->loopback, capacity * sizeof(struct SPBatchEntry));
+		if (!loopback)
+			return;
+		_batch->loopback = loopback;
+		_batch->loopbackCapacity = capacity;
 	}
-	return ioctlstruct.value;
+
+	struct SPBatchEntry* entry = &_batch->loopback[_batch->loopbackCount++];
+	entry->device = _device;
+	entry->offset = offset;
+	entry->value = value;
 }
 
-void vcpwrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
+static uint32_t threadtoken()
 {
-	struct SPIoctl ioctlstruct;
-	ioctlstruct.offset = offset;
-	ioctlstruct.value = value;
-	if (ioctl(_platform->sandpiperfd, SP_IOCTL_VCP_WRITE, &ioctlstruct) < 0)
-		perror("can't write to VCP");
+	if (!s_threadToken)
+		s_threadToken = __atomic_add_fetch(&s_nextThreadToken, 1, __ATOMIC_RELAXED);
+	return s_threadToken;
+}
+
+/*
+ * Take over the submitter. Returns 0 if another thread holds it, 1 if we took it, and 2 if the calling
+ * thread already holds it, which happens when the signal handler shuts down in the middle of a submit.
+ */
+static int trysubmitter(struct SPBatch* _batch)
+{
+	uint32_t token = threadtoken();
+	uint32_t holder = 0;
+	if (__atomic_compare_exchange_n(&_batch->submitting, &holder, token, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 1;
+	return holder == token ? 2 : 0;
+}
+
+static void releasesubmitter(struct SPBatch* _batch, int _taken)
+{
+	if (_taken == 1)
+		__atomic_store_n(&_batch->submitting, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hand writes to the loopback log or the backend. Only called by the thread holding the submitter.
+ */
+static void sendentries(struct SPPlatform* _platform, const struct SPBatchEntry* _entries, uint32_t _count, int _batched)
+{
+	struct SPBatch* batch = &_platform->batch;
+
+	if (batch->backend == EBB_Loopback)
+	{
+		for (uint32_t i=0; i<_count; ++i)
+			loopbackappend(batch, _entries[i].device, _entries[i].offset, _entries[i].value);
+		return;
+	}
+
+	if (_batched)
+		_platform->backend->writebatch(_platform, _entries, _count);
+	else
+	{
+		for (uint32_t i=0; i<_count; ++i)
+			_platform->backend->write32(_platform, _entries[i].device, _entries[i].offset, _entries[i].value);
+	}
+}
+
+/*
+ * Send up to one chunk of queued writes from a queue, in queue order.
+ * Only called by the thread holding the submitter. Returns the number of writes sent.
+ */
+static uint32_t drainring(struct SPPlatform* _platform, struct SPCommandRing* _ring)
+{
+	struct SPBatchEntry chunk[SP_SUBMIT_CHUNK];
+	uint32_t head = _ring->head;
+	uint32_t count = 0;
+
+	// Stop at the first slot that is reserved but not written yet
+	while (count < SP_SUBMIT_CHUNK)
+	{
+		struct SPRingSlot* slot = &_ring->slots[(head + count) & (SP_RING_SIZE - 1)];
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + count + 1)
+			break;
+		chunk[count++] = slot->entry;
+	}
+
+	if (count)
+	{
+		sendentries(_platform, chunk, count, 1);
+		__atomic_store_n(&_ring->head, head + count, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+static void drainaudio(struct SPPlatform* _platform, struct SPCommandRing* _rings)
+{
+	while (drainring(_platform, &_rings[SP_RING_AUDIO]))
+		;
+}
+
+/*
+ * Send everything queued by other threads. Audio goes first and is checked again between chunks
+ * of the ordered queue, so DMA kicks never wait behind a long run of video commands.
+ */
+static void drainrings(struct SPPlatform* _platform, struct SPCommandRing* _rings)
+{
+	do {
+		drainaudio(_platform, _rings);
+	} while (drainring(_platform, &_rings[SP_RING_ORDERED]));
+}
+
+/*
+ * Send the calling thread's own writes while holding the submitter.
+ * Once other threads have queued writes, audio they queued goes first and long batches are split up so audio
+ * queued meanwhile can go out in between. Everything else stays queued for the threads that own it.
+ */
+static void sendlocal(struct SPPlatform* _platform, struct SPCommandRing* _rings, const struct SPBatchEntry* _entries, uint32_t _count, int _batched)
+{
+	if (!_rings)
+	{
+		sendentries(_platform, _entries, _count, _batched);
+		return;
+	}
+
+	drainaudio(_platform, _rings);
+	for (uint32_t i=0; i<_count; i+=SP_SUBMIT_CHUNK)
+	{
+		uint32_t count = _count - i < SP_SUBMIT_CHUNK ? _count - i : SP_SUBMIT_CHUNK;
+		sendentries(_platform, _entries + i, count, _batched);
+		drainaudio(_platform, _rings);
+	}
+}
+
+/*
+ * Try to take over the submitter and send what other threads queued, returns 1 if that happened.
+ */
+static int helpsubmit(struct SPPlatform* _platform, struct SPCommandRing* _rings)
+{
+	if (trysubmitter(&_platform->batch) != 1)
+		return 0;
+	drainrings(_platform, _rings);
+	releasesubmitter(&_platform->batch, 1);
+	return 1;
+}
+
+/*
+ * Queue the writes in one of the queues, returns the queue position past the last one.
+ */
+static uint32_t queuewrites(struct SPPlatform* _platform, struct SPCommandRing* _rings, uint32_t _ring, const struct SPBatchEntry* _entries, uint32_t _count)
+{
+	struct SPCommandRing* ring = &_rings[_ring];
+
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - head + _count > SP_RING_SIZE)
+		{
+			if (!helpsubmit(_platform, _rings))
+				sched_yield();
+			tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + _count, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	uint32_t position = tail;
+	for (uint32_t i=0; i<_count; ++i)
+	{
+		struct SPRingSlot* slot = &ring->slots[position & (SP_RING_SIZE - 1)];
+		slot->entry = _entries[i];
+		__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+		++position;
+	}
+	return position;
+}
+
+/*
+ * Send writes to the devices. Safe to call from any number of threads.
+ * Only one thread talks to the backend at a time: whoever gets there first sends its own writes and any queued audio,
+ * the others queue their writes and wait until they have been sent, taking over the submitter to send everything
+ * queued as soon as it is free. The writes of one thread reach the devices in the order it issued them, across
+ * devices, and a batch of nothing but audio writes is allowed to overtake the writes of other threads.
+ */
+static void submit(struct SPPlatform* _platform, const struct SPBatchEntry* _entries, uint32_t _count, int _batched)
+{
+	struct SPBatch* batch = &_platform->batch;
+
+	int taken = trysubmitter(batch);
+	if (taken)
+	{
+		// Re-entered from the signal handler, the interrupted submit may be halfway through draining a queue
+		struct SPCommandRing* rings = taken == 1 ? __atomic_load_n(&batch->rings, __ATOMIC_ACQUIRE) : NULL;
+		sendlocal(_platform, rings, _entries, _count, _batched);
+		releasesubmitter(batch, taken);
+		return;
+	}
+
+	struct SPCommandRing* rings = commandrings(_platform);
+	if (!rings)
+	{
+		while (!(taken = trysubmitter(batch)))
+			sched_yield();
+		sendlocal(_platform, NULL, _entries, _count, _batched);
+		releasesubmitter(batch, taken);
+		return;
+	}
+
+	uint32_t ring = SP_RING_AUDIO;
+	for (uint32_t i=0; i<_count && ring == SP_RING_AUDIO; ++i)
+	{
+		if (_entries[i].device != ESD_Audio)
+			ring = SP_RING_ORDERED;
+	}
+
+	uint32_t end = queuewrites(_platform, rings, ring, _entries, _count);
+	__atomic_fetch_add(&batch->stats.queued, _count, __ATOMIC_RELAXED);
+
+	// Return only once the writes have been sent, like the uncontended path
+	while ((int32_t)(__atomic_load_n(&rings[ring].head, __ATOMIC_ACQUIRE) - end) < 0)
+	{
+		if (!helpsubmit(_platform, rings))
+			sched_yield();
+	}
+}
+
+/*
+ * Send all writes the calling thread recorded, in recording order.
+ */
+static void batchflush(struct SPPlatform* _platform, struct SPThreadBatch* _threadBatch)
+{
+	if (!_threadBatch || !_threadBatch->count)
+		return;
+
+	__atomic_fetch_add(&_platform->batch.stats.submits, 1, __ATOMIC_RELAXED);
+	SP_TRACE_INSTANT("SPSubmit", _threadBatch->count);
+
+	submit(_platform, _threadBatch->entries, _threadBatch->count, 1);
+	_threadBatch->count = 0;
+}
+
+/*
+ * Capture a register write into the calling thread's open batch.
+ * Returns 1 if the write was consumed, 0 if the caller should send it immediately.
+ */
+static int batchrecord(struct SPPlatform* _platform, uint32_t _device, uint32_t offset, uint32_t value)
+{
+	struct SPThreadBatch* threadBatch = threadbatch(_platform);
+	if (!threadBatch || !threadBatch->depth || !threadBatch->capacity)
+		return 0;
+
+	if (threadBatch->count == threadBatch->capacity)
+		batchflush(_platform, threadBatch);
+
+	struct SPBatchEntry* entry = &threadBatch->entries[threadBatch->count++];
+	entry->device = _device;
+	entry->offset = offset;
+	entry->value = value;
+	__atomic_fetch_add(&_platform->batch.stats.writes, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/*
+ * Send a single write that is not part of a batch.
+ */
+static void submitwrite(struct SPPlatform* _platform, uint32_t _device, uint32_t offset, uint32_t value)
+{
+	struct SPBatchEntry entry;
+	entry.device = _device;
+	entry.offset = offset;
+	entry.value = value;
+	submit(_platform, &entry, 1, 0);
+}
+
+/*
+ * Called before every register read. Pending writes of the calling thread are submitted first so the read observes them.
+ * Returns 1 if there is no device to read from (loopback), in which case the read yields 0.
+ */
+static int batchbeforeread(struct SPPlatform* _platform)
+{
+	batchflush(_platform, threadbatch(_platform));
+	return _platform->batch.backend == EBB_Loopback;
+}
+
+/*
+ * Start recording register writes instead of sending them one by one.
+ * Every VPU/APU/PAL/VCP write the calling thread issues until the matching SPSubmit() is captured in order.
+ * Batches nest, only the outermost SPSubmit() sends the writes. Each thread has its own batch.
+ */
+void SPBeginBatch(struct SPPlatform* _platform)
+{
+	struct SPThreadBatch* threadBatch = threadbatch(_platform);
+	if (!threadBatch)
+		return;
+
+	if (!threadBatch->entries)
+	{
+		threadBatch->entries = (struct SPBatchEntry*)malloc(SP_BATCH_CAPACITY * sizeof(struct SPBatchEntry));
+		threadBatch->capacity = threadBatch->entries ? SP_BATCH_CAPACITY : 0;
+		threadBatch->count = 0;
+	}
+
+	threadBatch->depth++;
+}
+
+/*
+ * Record a single register write for the given device.
+ * Outside of a batch the write is sent immediately.
+ */
+void SPPush(struct SPPlatform* _platform, enum ESPDevice _device, uint32_t _offset, uint32_t _value)
+{
+	if ((uint32_t)_device >= ESD_Count)
+		return;
+
+	SP_TRACE_REGISTER(ETE_RegisterWrite, _device, _offset, _value);
+
+	if (!batchrecord(_platform, _device, _offset, _value))
+		submitwrite(_platform, _device, _offset, _value);
+}
+
+/*
+ * Close the calling thread's current batch. When the outermost batch is closed, all recorded writes
+ * are submitted in the order they were recorded, with at most one syscall unless other threads are submitting too.
+ * Returns the number of writes submitted.
+ */
+int SPSubmit(struct SPPlatform* _platform)
+{
+	struct SPThreadBatch* threadBatch = threadbatch(_platform);
+	if (!threadBatch || !threadBatch->depth)
+		return 0;
+
+	if (--threadBatch->depth)
+		return 0;
+
+	int count = (int)threadBatch->count;
+	batchflush(_platform, threadBatch);
+	return count;
+}
+
+/*
+ * Select where register writes end up.
+ * EBB_Loopback captures every write, batched or not, into a log that can be inspected with SPGetLoopbackLog().
+ * Switch backends while no other thread is writing.
+ */
+void SPSetBatchBackend(struct SPPlatform* _platform, enum ESPBatchBackend _backend)
+{
+	// Writes recorded so far belong to the previous backend
+	batchflush(_platform, threadbatch(_platform));
+	_platform->batch.backend = _backend == EBB_Loopback ? EBB_Loopback : EBB_Device;
+}
+
+/*
+ * Retrieve the register writes captured by the loopback backend, in the order the hardware would have seen them.
+ */
+const struct SPBatchEntry* SPGetLoopbackLog(struct SPPlatform* _platform, uint32_t* _count)
+{
+	*_count = _platform->batch.loopbackCount;
+	return _platform->batch.loopback;
+}
+
+/*
+ * Discard all writes captured by the loopback backend.
+ */
+void SPClearLoopbackLog(struct SPPlatform* _platform)
+{
+	_platform->batch.loopbackCount = 0;
+}
+
+/*
+ * Retrieve the console framebuffer addresses for CPU and DMA access.
+ */
+void SPGetConsoleFramebuffer(struct SPPlatform* _platform, struct SPSizeAlloc* _sizealloc)
+{
+	if (_platform->mapped_memory != (uint8_t*)MAP_FAILED)
+	{
+		_sizealloc->cpuAddress = _platform->mapped_memory;
+		_sizealloc->dmaAddress = (uint8_t*)RESERVED_MEMORY_ADDRESS;
+	}
+	else
+	{
+		_sizealloc->cpuAddress = NULL;
+		_sizealloc->dmaAddress = NULL;
+	}
+	_sizealloc->block = NULL;
+	_sizealloc->policy = ESM_Uncached;
+}
+
+/*
+ * Map another view of the reserved region with the given policy.
+ * The cached view relies on the driver honoring the absence of O_SYNC, the write-combined view
+ * has to be requested from the driver explicitly. Both need the driver's cache maintenance ioctls,
+ * as nothing else reaches past the L2 cache before the devices read the memory.
+ * Returns MAP_FAILED if the view is not available.
+ */
+static uint8_t* devicemapview(struct SPPlatform* _platform, enum ESPMapPolicy _policy)
+{
+	// A one line clean of the start of the region tells whether the driver can maintain caches
+	struct SPIoctl probe;
+	probe.offset = 0;
+	probe.value = 32;
+	if (ioctl(_platform->sandpiperfd, SP_IOCTL_CACHE_FLUSH, &probe) < 0)
+		return (uint8_t*)MAP_FAILED;
+
+	int fd = open("/dev/sandpiper", _policy == ESM_Cached ? O_RDWR : (O_RDWR | O_SYNC));
+	if (fd < 0)
+		return (uint8_t*)MAP_FAILED;
+
+	if (_policy == ESM_WriteCombined)
+	{
+		struct SPIoctl ioctlstruct;
+		ioctlstruct.offset = 0;
+		ioctlstruct.value = (uint32_t)_policy;
+		if (ioctl(fd, SP_IOCTL_SET_MAP_POLICY, &ioctlstruct) < 0)
+		{
+			close(fd);
+			return (uint8_t*)MAP_FAILED;
+		}
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	uint8_t* view = (uint8_t*)mmap(NULL, RESERVED_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, RESERVED_MEMORY_ADDRESS);
+	close(fd);
+	return view;
+}
+
+/*
+ * Returns the CPU view of the reserved region for the given policy, mapping it on first use.
+ * Falls back to the uncached view, and updates _policy accordingly, if the policy is not supported.
+ */
+static uint8_t* getreservedview(struct SPPlatform* _platform, enum ESPMapPolicy* _policy)
+{
+	uint8_t** view = NULL;
+	if (*_policy == ESM_WriteCombined)
+		view = &_platform->writecombined_memory;
+	else if (*_policy == ESM_Cached)
+		view = &_platform->cached_memory;
+
+	if (view)
+	{
+		if (*view == (uint8_t*)MAP_FAILED)
+			*view = _platform->backend->mapview(_platform, *_policy);
+		if (*view != (uint8_t*)MAP_FAILED)
+			return *view;
+	}
+
+	*_policy = ESM_Uncached;
+	return _platform->mapped_memory;
+}
+
+/*
+ * Allocate a buffer from the reserved memory region with the given alignment and CPU mapping policy.
+ * _alignment has to be a power of two, see SPALIGN_* for the device requirements.
+ * Cached and write-combined buffers are flushed automatically by VPUSwapPages, VPUSyncSwap and APUStartDMA,
+ * other device reads need an explicit SPFlushRange. _sizealloc->policy receives the policy that was applied,
+ * which is ESM_Uncached if the driver does not support the requested one or can not maintain the caches for it.
+ * Returns 0 on success, -1 if the region is unavailable or out of memory.
+ */
+int SPAllocateMappedBuffer(struct SPPlatform* _platform, struct SPSizeAlloc* _sizealloc, uint32_t _alignment, enum ESPMapPolicy _policy)
+{
+	_sizealloc->cpuAddress = NULL;
+	_sizealloc->dmaAddress = NULL;
+	_sizealloc->block = NULL;
+	_sizealloc->policy = ESM_Uncached;
+
+	if (_platform->mapped_memory == (uint8_t*)MAP_FAILED || !_platform->heap)
+		return -1;
+
+	uint32_t offset = 0;
+	struct SPHeapBlock* block = SPHeapAlloc(_platform->heap, _sizealloc->size, _alignment, &offset);
+	if (!block)
+		return -1; // Indicate allocation failure due to out of memory
+
+	uint8_t* view = getreservedview(_platform, &_policy);
+
+	_sizealloc->cpuAddress = view + offset;
+	_sizealloc->dmaAddress = (uint8_t*)RESERVED_MEMORY_ADDRESS + offset;
+	_sizealloc->block = block;
+	_sizealloc->policy = _policy;
+
+	return 0;
+}
+
+/*
+ * Allocate an uncached buffer from the reserved memory region with the given alignment.
+ * _alignment has to be a power of two, see SPALIGN_* for the device requirements.
+ * Returns 0 on success, -1 if the region is unavailable or out of memory.
+ */
+int SPAllocateAlignedBuffer(struct SPPlatform* _platform, struct SPSizeAlloc* _sizealloc, uint32_t _alignment)
+{
+	return SPAllocateMappedBuffer(_platform, _sizealloc, _alignment, ESM_Uncached);
+}
+
+/*
+ * Allocate a buffer from the reserved memory region, aligned to 128 bytes.
+ */
+int SPAllocateBuffer(struct SPPlatform* _platform, struct SPSizeAlloc* _sizealloc)
+{
+	return SPAllocateAlignedBuffer(_platform, _sizealloc, SPALIGN_DEFAULT);
+}
+
+/*
+ * Free a previously allocated buffer and return its memory to the reserved region.
+ * The caller has to make sure no device is still reading from or writing to the buffer.
+ */
+void SPFreeBuffer(struct SPPlatform* _platform, struct SPSizeAlloc *_sizealloc)
+{
+	if (_platform->heap && _sizealloc->block)
+		SPHeapFree(_platform->heap, _sizealloc->block);
+
+	_sizealloc->cpuAddress = NULL;
+	_sizealloc->dmaAddress = NULL;
+	_sizealloc->block = NULL;
+	_sizealloc->policy = ESM_Uncached;
+}
+
+/*
+ * Retrieve usage, high water mark and fragmentation statistics of the reserved memory region.
+ */
+void SPGetMemoryStats(struct SPPlatform* _platform, struct SPHeapStats *_stats)
+{
+	if (_platform->heap)
+		SPHeapGetStats(_platform->heap, _stats);
+	else
+		memset(_stats, 0, sizeof(struct SPHeapStats));
+}
+
+/*
+ * Clean or invalidate a byte range of the cached view, given as an offset into the reserved region.
+ * The driver does this to the point of coherency, devicemapview only maps cached views if it can.
+ */
+static void devicecachemaintenance(struct SPPlatform* _platform, uint32_t _offset, uint32_t _size, int _invalidate)
+{
+	struct SPIoctl ioctlstruct;
+	ioctlstruct.offset = _offset;
+	ioctlstruct.value = _size;
+	if (ioctl(_platform->sandpiperfd, _invalidate ? SP_IOCTL_CACHE_INVALIDATE : SP_IOCTL_CACHE_FLUSH, &ioctlstruct) < 0)
+		perror("sandpiper cache maintenance");
+}
+
+static const struct SPBackend s_deviceBackend = {
+	"device",
+	deviceopen,
+	deviceclose,
+	deviceread32,
+	devicewrite32,
+	devicewritebatch,
+	devicemapview,
+	devicecachemaintenance,
+};
+
+/*
+ * The backend that talks to the hardware through /dev/sandpiper.
+ */
+const struct SPBackend* SPGetDeviceBackend()
+{
+	return &s_deviceBackend;
+}
+
+/*
+ * Clamp a range of the cached view to the reserved region and hand it to the backend for maintenance.
+ */
+static void cachemaintenance(struct SPPlatform* _platform, uint32_t _offset, uint32_t _size, int _invalidate)
+{
+	if (_platform->cached_memory == (uint8_t*)MAP_FAILED || _offset >= RESERVED_MEMORY_SIZE || !_size)
+		return;
+	if (_size > RESERVED_MEMORY_SIZE - _offset)
+		_size = RESERVED_MEMORY_SIZE - _offset;
+
+	_platform->backend->cachemaintenance(_platform, _offset, _size, _invalidate);
+}
+
+/*
+ * Make CPU writes to the given range visible to the devices.
+ * A no-op for uncached memory, drains the write buffer for write-combined memory
+ * and cleans the data cache for cached memory.
+ */
+void SPFlushRange(struct SPPlatform* _platform, const void* _cpuAddress, uint32_t _size)
+{
+	const uint8_t* address = (const uint8_t*)_cpuAddress;
+
+	if (_platform->cached_memory != (uint8_t*)MAP_FAILED && address >= _platform->cached_memory && address < _platform->cached_memory + RESERVED_MEMORY_SIZE)
+		cachemaintenance(_platform, (uint32_t)(address - _platform->cached_memory), _size, 0);
+	else if (_platform->writecombined_memory != (uint8_t*)MAP_FAILED && address >= _platform->writecombined_memory && address < _platform->writecombined_memory + RESERVED_MEMORY_SIZE)
+		SP_WRITE_BARRIER();
+}
+
+/*
+ * Discard CPU cached copies of the given range so that following reads observe device writes.
+ * Only has an effect on cached memory. Any CPU writes to the range that were not flushed are lost.
+ */
+void SPInvalidateRange(struct SPPlatform* _platform, const void* _cpuAddress, uint32_t _size)
+{
+	const uint8_t* address = (const uint8_t*)_cpuAddress;
+
+	if (_platform->cached_memory != (uint8_t*)MAP_FAILED && address >= _platform->cached_memory && address < _platform->cached_memory + RESERVED_MEMORY_SIZE)
+		cachemaintenance(_platform, (uint32_t)(address - _platform->cached_memory), _size, 1);
+}
+
+/*
+ * Flush a range given by its device address, for callers that only know where a device will read from.
+ * Costs nothing unless cached or write-combined buffers are in use.
+ */
+void SPFlushDMARange(struct SPPlatform* _platform, uint32_t _dmaAddress, uint32_t _size)
+{
+	if (_dmaAddress < RESERVED_MEMORY_ADDRESS || _dmaAddress >= RESERVED_MEMORY_ADDRESS + RESERVED_MEMORY_SIZE)
+		return;
+
+	if (_platform->writecombined_memory != (uint8_t*)MAP_FAILED)
+		SP_WRITE_BARRIER();
+	cachemaintenance(_platform, _dmaAddress - RESERVED_MEMORY_ADDRESS, _size, 0);
+}
+
+// Read and write functions for APU, VPU, PAL, and VCP control registers.
+// The device backend goes straight to the mapped register page in ERA_Direct mode and falls back to one ioctl() per access otherwise.
+// Writes are captured instead while a batch is open, and reads submit any pending batch first.
+// Every access is recorded by the tracer in builds with SP_ENABLE_TRACE.
+
+static uint32_t registerread32(struct SPPlatform* _platform, uint32_t _device, uint32_t offset)
+{
+	if (batchbeforeread(_platform))
+		return 0;
+
+	uint32_t value = _platform->backend->read32(_platform, _device, offset);
+	SP_TRACE_REGISTER(ETE_RegisterRead, _device, offset, value);
+	return value;
+}
+
+static void registerwrite32(struct SPPlatform* _platform, uint32_t _device, uint32_t offset, uint32_t value)
+{
+	SP_TRACE_REGISTER(ETE_RegisterWrite, _device, offset, value);
+
+	if (batchrecord(_platform, _device, offset, value))
+		return;
+
+	submitwrite(_platform, _device, offset, value);
+}
+
+uint32_t audioread32(struct SPPlatform* _platform, uint32_t offset)
+{
+	return registerread32(_platform, ESD_Audio, offset);
+}
+
+void audiowrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
+{
+	registerwrite32(_platform, ESD_Audio, offset, value);
+}
+
+uint32_t videoread32(struct SPPlatform* _platform, uint32_t offset)
+{
+	return registerread32(_platform, ESD_Video, offset);
+}
+
+void videowrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
+{
+	registerwrite32(_platform, ESD_Video, offset, value);
+}
+
+uint32_t paletteread32(struct SPPlatform* _platform, uint32_t offset)
+{
+	return registerread32(_platform, ESD_Palette, offset);
+}
+
+void palettewrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
+{
+	registerwrite32(_platform, ESD_Palette, offset, value);
+}
+
+uint32_t vcpread32(struct SPPlatform* _platform, uint32_t offset)
+{
+	return registerread32(_platform, ESD_VCP, offset);
+}
+
+void vcpwrite32(struct SPPlatform* _platform, uint32_t offset, uint32_t value)
+{
+	registerwrite32(_platform, ESD_VCP, offset, value);
 }
@@ -4,34 +4,158 @@
 #include <linux/limits.h>
 #include <sys/mman.h>
 
+#include "heap.h"
+
 // Base address of the reserved memory region
 #define RESERVED_MEMORY_ADDRESS	0x18000000
 
 // Hardware MMIO addresses
 #define AUDIODEVICE_ADDRESS	0x40000000
 #define VIDEODEVICE_ADDRESS	0x40001000
+// NOTE: Palette and VCP registers can be mapped for direct access by defining
+// PALETTEDEVICE_ADDRESS and VCPDEVICE_ADDRESS, otherwise they are reached through ioctl()
 
 // 32Mbytes reserved for device access
 #define RESERVED_MEMORY_SIZE	0x2000000
 // Device region of access
 #define DEVICE_MEMORY_SIZE		0x1000
+// Start of the allocatable range, which has to stay outside the console framebuffer (640*480*2 bytes)
+#define RESERVED_HEAP_OFFSET	0x96000
+
+enum ESPMapPolicy
+{
+	ESM_Uncached,		// Every CPU access goes to memory, no maintenance needed (default)
+	ESM_WriteCombined,	// Writes are merged in the CPU write buffer, reads are uncached
+	ESM_Cached,			// Fully cached, has to be flushed before a device reads it
+	ESM_Count
+};
 
 struct SPSizeAlloc
 {
 	uint8_t* cpuAddress;
 	uint8_t* dmaAddress;
 	uint32_t size;
+	struct SPHeapBlock* block;	// Allocator handle, used by SPFreeBuffer
+	enum ESPMapPolicy policy;	// Mapping the cpuAddress belongs to
+};
+
+enum ESPWaitMode
+{
+	EWM_Spin,		// Poll the device continuously (lowest latency, keeps one core busy)
+	EWM_Sleep,		// Sleep until shortly before the predicted event, then poll
+	EWM_Blocking,	// Like EWM_Sleep, but lets the driver wake us up early if it supports event notification
+	EWM_Count
+};
+
+struct SPWaitStats
+{
+	uint64_t waitCount;		// Number of completed waits
+	uint64_t sleptNs;		// Time spent asleep, i.e. CPU time saved compared to spinning
+	uint64_t polledNs;		// Time spent polling the device
+	uint64_t pollCount;		// Number of status register reads while polling
+};
+
+struct SPShadowStats
+{
+	uint64_t writes;		// Register writes sent by the shadowed setters
+	uint64_t elided;		// Writes skipped because the device already held the value, each one an ioctl() outside of a batch
+};
+
+enum ESPDevice
+{
+	ESD_Audio,
+	ESD_Video,
+	ESD_Palette,
+	ESD_VCP,
+	ESD_Count
+};
+
+enum ESPBatchBackend
+{
+	EBB_Device,		// Batches are sent to the hardware
+	EBB_Loopback,	// All register writes are appended to an in-memory log instead, for testing without the board
+	EBB_Count
+};
+
+struct SPBatchEntry
+{
+	uint32_t device;	// One of ESPDevice
+	uint32_t offset;
+	uint32_t value;
+};
+
+struct SPBatchStats
+{
+	uint32_t submits;	// Number of non-empty batch submissions
+	uint32_t writes;	// Register writes recorded into batches
+	uint32_t syscalls;	// ioctl() calls spent submitting them
+	uint32_t queued;	// Writes that were queued because another thread was submitting
+};
+
+struct SPThreadBatch;
+struct SPCommandRing;
+struct SPFrameArenas;
+
+// Register writes can be issued from any number of threads. Each thread records into its own batch,
+// and one thread at a time sends writes to the backend, see submit() in platform.c.
+struct SPBatch
+{
+	enum ESPBatchBackend backend;
+	int noBatchIoctl;				// Set when the driver rejects batched writes
+	struct SPBatchEntry* loopback;
+	uint32_t loopbackCount;
+	uint32_t loopbackCapacity;
+	struct SPBatchStats stats;
+	uint32_t id;					// Tells platforms apart in the per-thread batch lookup
+	uint32_t submitting;			// Token of the thread sending writes to the backend, 0 if none
+	struct SPThreadBatch* threads;	// Recording state of each thread that wrote to this platform
+	struct SPCommandRing* rings;	// Queues for writes waiting on the submitting thread, see submit()
+};
+
+enum ESPRegisterAccess
+{
+	ERA_Ioctl,		// One ioctl() per register access, always available
+	ERA_Direct,		// Volatile loads and stores to device registers mapped into user space
+	ERA_Count
+};
+
+struct SPPlatform;
+
+// Implements device access for SPPlatform. Everything above register and reserved region access
+// (batching, tracing, the heap, VPU/APU/VCP helpers) is shared between backends.
+struct SPBackend
+{
+	const char* name;
+	// Map the reserved region and get hold of the devices, returns 0 on success
+	int (*open)(struct SPPlatform* _platform);
+	// Release everything open() and mapview() acquired
+	void (*close)(struct SPPlatform* _platform);
+	uint32_t (*read32)(struct SPPlatform* _platform, uint32_t _device, uint32_t _offset);
+	void (*write32)(struct SPPlatform* _platform, uint32_t _device, uint32_t _offset, uint32_t _value);
+	// Send a batch of register writes in order
+	void (*writebatch)(struct SPPlatform* _platform, const struct SPBatchEntry* _entries, uint32_t _count);
+	// Map another view of the reserved region with the given policy, or return MAP_FAILED if not supported
+	uint8_t* (*mapview)(struct SPPlatform* _platform, enum ESPMapPolicy _policy);
+	// Clean or invalidate a range of the cached view, given as an offset into the reserved region
+	void (*cachemaintenance)(struct SPPlatform* _platform, uint32_t _offset, uint32_t _size, int _invalidate);
 };
 
 struct SPPlatform
 {
 	// Internal state
+	const struct SPBackend* backend;
+	void* backendData;
 	volatile uint32_t *videoio;
 	volatile uint32_t *audioio;
 	volatile uint32_t *paletteio;
 	volatile uint32_t *vcpio;
+	enum ESPRegisterAccess registerAccess;
+	struct SPBatch batch;
 	uint8_t* mapped_memory;
-	uint32_t alloc_cursor;
+	uint8_t* writecombined_memory;
+	uint8_t* cached_memory;
+	struct SPHeap* heap;
+	struct SPSizeAlloc vcpUpload;	// VCP program staging, for swap contexts without frame arenas
 	int sandpiperfd;
 
 	// Status
@@ -92,11 +216,57 @@ enum EVideoScanoutEnable
 	EVS_Count
 };
 
+// Write-only registers the contexts keep a copy of, to skip writes that would not change anything
+enum EVideoRegister
+{
+	EVR_VideoMode,
+	EVR_ScanoutAddress,
+	EVR_ScanoutAddress2,
+	EVR_ShiftCache,
+	EVR_ShiftScanout,
+	EVR_ShiftPixel,
+	EVR_Count
+};
+
+enum EAudioRegister
+{
+	EAR_BufferSize,
+	EAR_SampleRate,
+	EAR_SwapChannels,
+	EAR_Count
+};
+
+// Framebuffers the console keeps track of, one per page of a double buffered console
+#define VPU_CONSOLE_TARGETS	2
+
+// What a framebuffer last received from VPUConsoleResolve, console rows fit into one 64 bit mask.
+// Rows are counted in the character grid, which is a ring starting at m_consoleTop.
+struct EConsoleTarget
+{
+	uint32_t m_address;				// CPU write address, 0 for an unused target
+	uint64_t m_dirtyRows;			// Rows changed since they were last drawn into this framebuffer
+	uint64_t m_dirtyMirror;			// Same for the second copy of each row in a ring framebuffer
+	uint16_t m_ringTop;				// Grid row the scanout address was last pointed at, in a ring framebuffer
+	uint16_t m_ringShownTop;		// Grid row on the screen, m_ringTop once a vblank went by after it was set
+	uint32_t m_ringVBlank;			// VBlank counter right after m_ringTop was set
+	uint64_t m_ringSetNs;			// Time m_ringTop was set
+	uint16_t m_caretX, m_caretRow;	// Where the caret was drawn
+	uint8_t m_caretShown;
+	uint8_t m_caretType;
+};
+
 struct EAudioContext
 {
 	struct SPPlatform *m_platform;
 	enum EAPUSampleRate m_sampleRate;
 	uint32_t m_bufferSize;
+	enum ESPWaitMode m_waitMode;
+	uint64_t m_framePeriodNs;		// Predicted time between two APU buffer swaps
+	uint64_t m_lastFrameNs;			// Time the last buffer swap was observed
+	struct SPWaitStats m_waitStats;
+	uint32_t m_shadow[EAR_Count];	// Last value written to each register
+	uint32_t m_shadowValid;			// One bit per register, set once the value is known
+	struct SPShadowStats m_shadowStats;
 };
 
 struct EVideoContext
@@ -119,8 +289,43 @@ struct EVideoContext
 	uint8_t m_consoleColor;
 	uint8_t m_caretBlink;
     uint8_t m_caretType;
+	enum ESPWaitMode m_waitMode;
+	uint32_t m_vblankScanline;		// Scanline at which the vblank counter was last seen to flip
+	uint64_t m_framePeriodNs;		// Measured display frame period
+	uint64_t m_lastVBlankNs;		// Time the last vblank was observed
+	struct SPWaitStats m_waitStats;
+	uint32_t m_shadow[EVR_Count];	// Last value written to each register
+	uint32_t m_shadowValid;			// One bit per register, set once the value is known
+	struct SPShadowStats m_shadowStats;
+	uint32_t m_palette[256];		// Last color written to each palette entry, r8g8b8
+	uint32_t m_paletteValid[8];		// One bit per palette entry, set once the color is known
+	struct EConsoleTarget m_consoleTargets[VPU_CONSOLE_TARGETS];
+	uint32_t m_consoleTargetNext;	// Target that the next unknown framebuffer replaces
+	uint16_t m_consoleTop;			// Grid row shown at the top of the console
+	uint32_t m_consoleRingAddress;	// CPU address of the ring framebuffer, see VPUConsoleSetRing
+	uint32_t m_consoleRingScanout;	// Its scanout address
+};
+
+struct SPRect
+{
+	int x, y;
+	int width, height;
+};
+
+// Regions to bring up to date per swap page, see VPUAddDamage
+#define VPU_DAMAGE_RECTS	16
+
+struct EVideoDamage
+{
+	uint32_t count;
+	struct SPRect rects[VPU_DAMAGE_RECTS];
 };
 
+// Most pages a swap context tracks damage for, the images of a swap chain
+#define VPU_SWAP_PAGE_MAX	4
+
+// Double buffering for VPUSwapPages. A swap chain (see swapchain.h) presents through one as well, so frame arenas,
+// captures and damage work the same with deeper chains with fences and present modes.
 struct EVideoSwapContext
 {
 	// Swap cycle counter
@@ -131,14 +336,46 @@ struct EVideoSwapContext
 	// Frame buffers to toggle between
 	struct SPSizeAlloc *framebufferA;
 	struct SPSizeAlloc *framebufferB;
+	// Per-frame scratch memory, advanced by VPUSwapPages, NULL if not used (see arena.h)
+	struct SPFrameArenas *arenas;
+	// Screenshot and frame sequence capture of presented pages, NULL if not used (see capture.h)
+	struct SPCapture *capture;
+	// Regions each page is missing from the latest frame, framebufferA and framebufferB are pages 0 and 1
+	struct EVideoDamage damage[VPU_SWAP_PAGE_MAX];
+	// Images of the swap chain presenting through this context, 0 for VPUSwapPages
+	uint32_t pageCount;
+	// Page writepage belongs to, when a swap chain presents through this context
+	uint32_t writeIndex;
 };
 
 struct SPPlatform* SPInitPlatform();
+struct SPPlatform* SPInitPlatformBackend(const struct SPBackend* _backend);
+const struct SPBackend* SPGetDeviceBackend();
+const struct SPBackend* SPGetHostBackend();
 void SPShutdownPlatform(struct SPPlatform* _platform);
 
+uint64_t SPGetTimeNs();
+int SPSleep(struct SPPlatform* _platform, uint64_t _durationNs, int _wakeOnDeviceEvent);
+
+int SPSetRegisterAccess(struct SPPlatform* _platform, enum ESPRegisterAccess _access);
+
+void SPBeginBatch(struct SPPlatform* _platform);
+void SPPush(struct SPPlatform* _platform, enum ESPDevice _device, uint32_t _offset, uint32_t _value);
+int SPSubmit(struct SPPlatform* _platform);
+void SPSetBatchBackend(struct SPPlatform* _platform, enum ESPBatchBackend _backend);
+const struct SPBatchEntry* SPGetLoopbackLog(struct SPPlatform* _platform, uint32_t* _count);
+void SPClearLoopbackLog(struct SPPlatform* _platform);
+
 void SPGetConsoleFramebuffer(struct SPPlatform* _platform, struct SPSizeAlloc *_sizealloc);
 int SPAllocateBuffer(struct SPPlatform* _platform, struct SPSizeAlloc *_sizealloc);
+int SPAllocateAlignedBuffer(struct SPPlatform* _platform, struct SPSizeAlloc *_sizealloc, uint32_t _alignment);
+int SPAllocateMappedBuffer(struct SPPlatform* _platform, struct SPSizeAlloc *_sizealloc, uint32_t _alignment, enum ESPMapPolicy _policy);
 void SPFreeBuffer(struct SPPlatform* _platform, struct SPSizeAlloc *_sizealloc);
+void SPGetMemoryStats(struct SPPlatform* _platform, struct SPHeapStats *_stats);
+
+void SPFlushRange(struct SPPlatform* _platform, const void* _cpuAddress, uint32_t _size);
+void SPInvalidateRange(struct SPPlatform* _platform, const void* _cpuAddress, uint32_t _size);
+void SPFlushDMARange(struct SPPlatform* _platform, uint32_t _dmaAddress, uint32_t _size);
 
 uint32_t audioread32(struct SPPlatform* _platform, uint32_t offset);
 uint32_t videoread32(struct SPPlatform* _platform, uint32_t offset);
@@ -0,0 +1,14 @@
+#pragma once
+
+// Include first in SDK translation units that contain NEON code paths.
+// Defines SP_USE_NEON when NEON intrinsics are available. Samples are built with -mfpu=vfpv3,
+// so NEON is enabled here for the including file only; every Zynq-7000 Cortex-A9 has the unit.
+// Define SP_NO_NEON to force the scalar fallbacks.
+
+#if !defined(SP_NO_NEON) && (defined(__arm__) || defined(__aarch64__))
+#if defined(__arm__) && !defined(__ARM_NEON)
+#pragma GCC target("fpu=neon")
+#endif
+#include <arm_neon.h>
+#define SP_USE_NEON
+#endif
@@ -0,0 +1,248 @@
+#include "swapchain.h"
+#include "vpu.h"
+#include "arena.h"
+#include "trace.h"
+#include <stddef.h>
+
+static uint64_t vblanktime(struct SPClock* _clock, uint64_t _vblank)
+{
+	return _clock->m_lastVBlankNs - (_clock->m_vblankCount - _vblank) * _clock->m_framePeriodNs;
+}
+
+static int imagefree(struct SPSwapChain* _chain, uint32_t _image)
+{
+	struct SPSwapImage* image = &_chain->images[_image];
+	return image->state == ESI_Free && _chain->clock.m_vblankCount >= image->fence;
+}
+
+/*
+ * Lines until the next vblank, from the scanline the last SPClockUpdate read along with the vblank toggle, so
+ * the count and the vblank number can't straddle a vblank. On the vblank scanline itself the toggle has already
+ * flipped, so the next one is a whole frame away.
+ */
+static uint32_t linestovblank(struct SPSwapChain* _chain)
+{
+	struct EVideoContext* vx = _chain->platform->vx;
+	return (vx->m_vblankScanline + VPU_SCANLINE_COUNT - _chain->clock.m_scanline - 1) % VPU_SCANLINE_COUNT + 1;
+}
+
+/*
+ * Point scanout at _image, it is on the screen from the next vblank, or the one after if this one is too close.
+ */
+static void latch(struct SPSwapChain* _chain, uint32_t _image, uint32_t _lines)
+{
+	struct EVideoContext* vx = _chain->platform->vx;
+	VPUSetScanoutAddress(vx, (uint32_t)(uintptr_t)_chain->images[_image].framebuffer->dmaAddress);
+	_chain->latchVBlank = _chain->clock.m_vblankCount + (_lines < VPU_LATCH_GUARD_LINES ? 2 : 1);
+	_chain->images[_image].state = ESI_Latching;
+	_chain->latching = (int)_image;
+}
+
+/*
+ * Move the latching image to the screen once its vblank passed, then latch the next presented one.
+ */
+static void advance(struct SPSwapChain* _chain)
+{
+	SPClockUpdate(&_chain->clock);
+	uint64_t vblank = _chain->clock.m_vblankCount;
+
+	if (_chain->latching >= 0 && vblank >= _chain->latchVBlank)
+	{
+		struct SPSwapImage* image = &_chain->images[_chain->latching];
+		uint64_t latencyNs = vblanktime(&_chain->clock, _chain->latchVBlank) - image->presentNs;
+		if ((int64_t)latencyNs < 0)
+			latencyNs = 0;
+		image->state = ESI_Displayed;
+		_chain->displayed = _chain->latching;
+		_chain->latching = -1;
+
+		_chain->totalLatencyNs += latencyNs;
+		_chain->stats.displayCount++;
+		if (latencyNs > _chain->stats.worstLatencyNs)
+			_chain->stats.worstLatencyNs = latencyNs;
+		SP_TRACE_INSTANT("SPSwapChainDisplay", _chain->displayed);
+	}
+
+	if (_chain->latching >= 0 || !_chain->queueCount)
+		return;
+
+	uint32_t next = _chain->queue[_chain->queueHead];
+	_chain->queueHead = (_chain->queueHead + 1) % SP_SWAPCHAIN_MAX;
+	_chain->queueCount--;
+
+	latch(_chain, next, linestovblank(_chain));
+
+	// The image on the screen keeps being scanned out until the new one latches
+	if (_chain->displayed >= 0)
+	{
+		_chain->images[_chain->displayed].state = ESI_Free;
+		_chain->images[_chain->displayed].fence = _chain->latchVBlank;
+		_chain->displayed = -1;
+	}
+}
+
+/*
+ * Set up a swap chain over _count framebuffers, 2 to SP_SWAPCHAIN_MAX. The framebuffers stay owned by
+ * the caller and have to be large enough for the current video mode.
+ * Returns 0 on success, -1 if _count is out of range.
+ */
+int SPSwapChainInit(struct SPSwapChain* _chain, struct SPPlatform* _platform, struct SPSizeAlloc** _framebuffers, uint32_t _count, enum ESPPresentMode _mode)
+{
+	__builtin_memset(_chain, 0, sizeof(struct SPSwapChain));
+	if (_count < 2 || _count > SP_SWAPCHAIN_MAX)
+		return -1;
+
+	_chain->platform = _platform;
+	_chain->mode = _mode;
+	_chain->count = _count;
+	_chain->latching = -1;
+	_chain->displayed = -1;
+	_chain->latest = -1;
+	_chain->sc.pageCount = _count;
+	for (uint32_t i = 0; i < _count; ++i)
+		_chain->images[i].framebuffer = _framebuffers[i];
+	SPClockInit(&_chain->clock, _platform);
+
+	return 0;
+}
+
+/*
+ * Latch the next presented frame if the previous one reached the screen.
+ * Every swap chain call does this, call it directly from long running work so queued frames keep moving.
+ */
+void SPSwapChainUpdate(struct SPSwapChain* _chain)
+{
+	advance(_chain);
+}
+
+/*
+ * Get a framebuffer to draw the next frame into, and make it the VPU write page. Like VPUSwapPages, damage
+ * the image is missing is copied in from the frame presented last, and the image's frame arena is selected.
+ * Blocks for as many vblanks as it takes for a presented frame to leave the screen if no buffer is free.
+ * Returns the image index, or -1 if every buffer is acquired and none will ever be released.
+ */
+int SPAcquireNextImage(struct SPSwapChain* _chain)
+{
+	struct EVideoContext* vx = _chain->platform->vx;
+	uint64_t waitStart = 0;
+
+	for (;;)
+	{
+		advance(_chain);
+
+		for (uint32_t i = 0; i < _chain->count; ++i)
+		{
+			if (imagefree(_chain, i))
+			{
+				if (waitStart)
+				{
+					_chain->stats.acquireWaitCount++;
+					_chain->stats.acquireWaitNs += SPGetTimeNs() - waitStart;
+					SP_TRACE_END("SPAcquireNextImage");
+				}
+
+				// The image's frame arena is off the screen along with it
+				_chain->images[i].state = ESI_Acquired;
+				VPUBeginWritePage(vx, &_chain->sc, i, _chain->images[i].framebuffer, _chain->latest >= 0 ? _chain->images[_chain->latest].framebuffer : NULL);
+				SPFrameArenaSelect(&_chain->sc, i);
+				return (int)i;
+			}
+		}
+
+		// Buffers only come back as presented frames move on, the one on the screen needs a successor
+		int progress = 0;
+		for (uint32_t i = 0; i < _chain->count; ++i)
+		{
+			enum ESPSwapImageState state = _chain->images[i].state;
+			progress |= state == ESI_Free || state == ESI_Queued || state == ESI_Latching;
+		}
+		if (!progress)
+		{
+			if (waitStart)
+				SP_TRACE_END("SPAcquireNextImage");
+			return -1;
+		}
+
+		if (!waitStart)
+		{
+			SP_TRACE_BEGIN("SPAcquireNextImage");
+			waitStart = SPGetTimeNs();
+		}
+		VPUWaitVSync(vx);
+	}
+}
+
+/*
+ * Queue an acquired image for display. The image is flushed, so cached framebuffers work as well, and a
+ * capture waiting for a frame gets a copy of it, see VPUPresentPage.
+ * In EPM_Fifo mode frames queue up and are shown one per vblank. In EPM_Mailbox mode a frame that has not
+ * reached the screen yet is dropped in favor of this one, and its buffer is free right away. That includes
+ * the frame whose scanout address is already written, as long as the vblank is far enough away.
+ */
+void SPQueuePresent(struct SPSwapChain* _chain, int _image)
+{
+	if (_image < 0 || (uint32_t)_image >= _chain->count || _chain->images[_image].state != ESI_Acquired)
+		return;
+
+	struct SPSwapImage* image = &_chain->images[_image];
+	SPFlushRange(_chain->platform, image->framebuffer->cpuAddress, image->framebuffer->size);
+	VPUPresentPage(_chain->platform->vx, &_chain->sc, (uint32_t)_image, image->framebuffer);
+	_chain->latest = _image;
+
+	if (_chain->mode == EPM_Mailbox)
+	{
+		while (_chain->queueCount)
+		{
+			struct SPSwapImage* dropped = &_chain->images[_chain->queue[_chain->queueHead]];
+			dropped->state = ESI_Free;
+			dropped->fence = 0;
+			_chain->queueHead = (_chain->queueHead + 1) % SP_SWAPCHAIN_MAX;
+			_chain->queueCount--;
+			_chain->stats.dropCount++;
+		}
+	}
+
+	image->presentNs = SPGetTimeNs();
+	_chain->stats.presentCount++;
+	SP_TRACE_INSTANT("SPQueuePresent", _image);
+
+	if (_chain->mode == EPM_Mailbox && _chain->latching >= 0)
+	{
+		// Until the vblank the VPU only latches whatever address was written last
+		SPClockUpdate(&_chain->clock);
+		uint32_t lines = linestovblank(_chain);
+		if (_chain->clock.m_vblankCount + 1 == _chain->latchVBlank && lines >= VPU_LATCH_GUARD_LINES)
+		{
+			struct SPSwapImage* replaced = &_chain->images[_chain->latching];
+			replaced->state = ESI_Free;
+			replaced->fence = 0;
+			_chain->stats.dropCount++;
+			latch(_chain, (uint32_t)_image, lines);
+			return;
+		}
+	}
+
+	image->state = ESI_Queued;
+	_chain->queue[(_chain->queueHead + _chain->queueCount) % SP_SWAPCHAIN_MAX] = (uint32_t)_image;
+	_chain->queueCount++;
+
+	advance(_chain);
+}
+
+/*
+ * Switch between EPM_Fifo and EPM_Mailbox, frames that are already queued are kept.
+ */
+void SPSwapChainSetMode(struct SPSwapChain* _chain, enum ESPPresentMode _mode)
+{
+	_chain->mode = _mode;
+}
+
+/*
+ * Retrieve present, drop and wait counts, and the latency from SPQueuePresent to the screen.
+ */
+void SPGetSwapChainStats(struct SPSwapChain* _chain, struct SPSwapChainStats* _stats)
+{
+	*_stats = _chain->stats;
+	_stats->averageLatencyMs = _chain->stats.displayCount ? (float)((double)_chain->totalLatencyNs / (1000000.0 * _chain->stats.displayCount)) : 0.f;
+	_stats->queuedFrames = _chain->queueCount + (_chain->latching >= 0 ? 1 : 0);
+}
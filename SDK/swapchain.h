@@ -0,0 +1,77 @@
+#pragma once
+
+#include "platform.h"
+#include "clock.h"
+
+// A chain of 2 to 4 framebuffers presented at vblanks. The VPU latches a new scanout address at the
+// next vblank, and nothing tells the CPU when that happened, so every buffer carries a fence: the vblank
+// count at which it is off the screen. SPAcquireNextImage() hands out a buffer whose fence has passed,
+// and only blocks when there is none. Presentation is driven from the CPU, every SPSwapChain call
+// latches the next presented buffer if the previous one reached the screen, call SPSwapChainUpdate()
+// from long running work to keep a queue of presented frames moving. Frames are presented through the
+// chain's swap context the way VPUSwapPages() does it, attach frame arenas and captures to it and mark
+// damage in it, and they work the same as with two pages.
+
+#define SP_SWAPCHAIN_MAX		VPU_SWAP_PAGE_MAX
+
+enum ESPPresentMode
+{
+	EPM_Fifo,		// Every presented frame is shown for at least one vblank, in order
+	EPM_Mailbox,	// A presented frame replaces the one still waiting, for the lowest latency at any frame rate
+	EPM_Count
+};
+
+enum ESPSwapImageState
+{
+	ESI_Free,		// Available to SPAcquireNextImage once the fence has passed
+	ESI_Acquired,	// Being drawn by the application
+	ESI_Queued,		// Presented, waiting for the previous frame to reach the screen
+	ESI_Latching,	// Scanout address written, on the screen from vblank latchVBlank
+	ESI_Displayed,	// Being scanned out
+};
+
+struct SPSwapChainStats
+{
+	uint64_t presentCount;			// Frames handed to SPQueuePresent
+	uint64_t displayCount;			// Frames that reached the screen
+	uint64_t dropCount;				// Frames replaced in mailbox mode before they were shown
+	uint64_t acquireWaitCount;		// SPAcquireNextImage calls that had to wait for a buffer
+	uint64_t acquireWaitNs;			// Time spent in those waits
+	uint64_t worstLatencyNs;		// Longest time from SPQueuePresent to the vblank that showed the frame
+	float averageLatencyMs;			// Average of the same
+	uint32_t queuedFrames;			// Frames presented but not on the screen yet
+};
+
+struct SPSwapImage
+{
+	struct SPSizeAlloc* framebuffer;
+	enum ESPSwapImageState state;
+	uint64_t fence;					// Vblank count from which a free image is off the screen
+	uint64_t presentNs;				// When the image was handed to SPQueuePresent
+};
+
+struct SPSwapChain
+{
+	struct SPPlatform* platform;
+	struct SPClock clock;
+	enum ESPPresentMode mode;
+	uint32_t count;
+	struct SPSwapImage images[SP_SWAPCHAIN_MAX];
+	uint32_t queue[SP_SWAPCHAIN_MAX];	// Presented images in order
+	uint32_t queueHead;
+	uint32_t queueCount;
+	int latching;					// Image waiting for latchVBlank, -1 if none
+	uint64_t latchVBlank;
+	int displayed;					// Image on the screen, -1 before the first one got there
+	int latest;						// Image presented last, -1 before the first one
+	struct EVideoSwapContext sc;	// Frame arenas, capture and damage of the presented images
+	uint64_t totalLatencyNs;
+	struct SPSwapChainStats stats;
+};
+
+int SPSwapChainInit(struct SPSwapChain* _chain, struct SPPlatform* _platform, struct SPSizeAlloc** _framebuffers, uint32_t _count, enum ESPPresentMode _mode);
+void SPSwapChainUpdate(struct SPSwapChain* _chain);
+int SPAcquireNextImage(struct SPSwapChain* _chain);
+void SPQueuePresent(struct SPSwapChain* _chain, int _image);
+void SPSwapChainSetMode(struct SPSwapChain* _chain, enum ESPPresentMode _mode);
+void SPGetSwapChainStats(struct SPSwapChain* _chain, struct SPSwapChainStats* _stats);
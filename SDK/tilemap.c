@@ -0,0 +1,202 @@
+#include "tilemap.h"
+#include "vpu.h"
+#include "trace.h"
+
+// Screens of memory the window moves through
+#define SP_TILEMAP_PAGES		3
+
+static int32_t floordiv(int32_t _value, int32_t _divisor)
+{
+	return _value >= 0 ? _value / _divisor : -((-_value + _divisor - 1) / _divisor);
+}
+
+static uint32_t wrap(int32_t _value, uint32_t _size)
+{
+	int32_t m = _value % (int32_t)_size;
+	return (uint32_t)(m < 0 ? m + (int32_t)_size : m);
+}
+
+/*
+ * Draw screen rows [_sy, _sy + _h) and columns [_sx, _sx + _w) of the window from the map at the current position.
+ */
+static void drawregion(struct SPTilemap* _map, int32_t _sx, int32_t _sy, int32_t _w, int32_t _h)
+{
+	if (_w <= 0 || _h <= 0)
+		return;
+
+	struct SPSurface region;
+	SPInitSurface(&region, _map->buffer.cpuAddress + _map->start + _sy * _map->stride + _sx * _map->bpp, _w, _h, _map->stride, _map->tiles->cmode);
+
+	int32_t wx = _map->x + _sx;
+	int32_t wy = _map->y + _sy;
+	int32_t c0 = floordiv(wx, _map->tileWidth), c1 = floordiv(wx + _w - 1, _map->tileWidth);
+	int32_t r0 = floordiv(wy, _map->tileHeight), r1 = floordiv(wy + _h - 1, _map->tileHeight);
+	for (int32_t r = r0; r <= r1; ++r)
+	{
+		const uint16_t* row = _map->indices + wrap(r, _map->mapHeight) * _map->mapWidth;
+		for (int32_t c = c0; c <= c1; ++c)
+		{
+			uint32_t tile = row[wrap(c, _map->mapWidth)];
+			struct SPRect source = { (int)((tile % _map->tileColumns) * _map->tileWidth), (int)((tile / _map->tileColumns) * _map->tileHeight), (int)_map->tileWidth, (int)_map->tileHeight };
+			SPBlit(&region, c * (int32_t)_map->tileWidth - wx, r * (int32_t)_map->tileHeight - wy, _map->tiles, &source, EBL_None, SPBLIT_NOKEY);
+		}
+	}
+
+	_map->stats.tileCount += (uint64_t)(r1 - r0 + 1) * (uint64_t)(c1 - c0 + 1);
+	_map->stats.pixelCount += (uint64_t)_w * (uint64_t)_h;
+}
+
+/*
+ * Point the scanout at the window, the aligned address takes whole 64 byte lines and the shifts the rest.
+ */
+static void applyscroll(struct SPTilemap* _map)
+{
+	struct EVideoContext* vx = _map->platform->vx;
+	uint32_t address = (uint32_t)(uintptr_t)_map->buffer.dmaAddress + _map->start;
+	VPUSetScanoutAddress(vx, address & ~63u);
+	VPUShiftScanout(vx, (uint8_t)((address & 63) >> 4));
+	VPUShiftPixel(vx, (uint8_t)((address & 15) / _map->bpp));
+}
+
+/*
+ * Set up a layer for the current video mode, of _mapWidth x _mapHeight cells holding indices of _tileWidth x _tileHeight
+ * tiles in _tiles. Tiles are numbered in rows, and _tiles has to stay around and be in the color mode of the video mode.
+ * _indices is not copied, change cells with SPTilemapSetTile. Nothing is drawn before the first SPTilemapScrollTo.
+ * Returns 0 on success, -1 if the tiles do not fit the video mode or the buffer can not be allocated.
+ */
+int SPTilemapInit(struct SPTilemap* _map, struct SPPlatform* _platform, const struct SPSurface* _tiles, uint32_t _tileWidth, uint32_t _tileHeight, uint16_t* _indices, uint32_t _mapWidth, uint32_t _mapHeight)
+{
+	__builtin_memset(_map, 0, sizeof(struct SPTilemap));
+	struct EVideoContext* vx = _platform->vx;
+	if (_tiles->cmode != vx->m_cmode || _tileWidth == 0 || _tileHeight == 0 || _tiles->width < _tileWidth || _tiles->height < _tileHeight || _mapWidth == 0 || _mapHeight == 0)
+		return -1;
+
+	_map->platform = _platform;
+	_map->tiles = _tiles;
+	_map->tileWidth = _tileWidth;
+	_map->tileHeight = _tileHeight;
+	_map->tileColumns = _tiles->width / _tileWidth;
+	_map->indices = _indices;
+	_map->mapWidth = _mapWidth;
+	_map->mapHeight = _mapHeight;
+	_map->width = vx->m_graphicsWidth;
+	_map->height = vx->m_graphicsHeight;
+	_map->stride = vx->m_strideInWords * 4;
+	_map->bpp = vx->m_cmode == ECM_16bit_RGB ? 2 : 1;
+
+	_map->buffer.size = SP_TILEMAP_PAGES * _map->height * _map->stride;
+	if (SPAllocateBuffer(_platform, &_map->buffer) != 0)
+		return -1;
+
+	_map->start = _map->height * _map->stride;
+	return 0;
+}
+
+void SPTilemapDestroy(struct SPTilemap* _map)
+{
+	SPFreeBuffer(_map->platform, &_map->buffer);
+}
+
+/*
+ * Scroll the screen to show the map from _x, _y, drawing only what scrolls into view. Moves further than
+ * the screen, and the first call, draw it all. Call right after the vblank.
+ */
+void SPTilemapScrollTo(struct SPTilemap* _map, int32_t _x, int32_t _y)
+{
+	SP_TRACE_BEGIN("SPTilemapScrollTo");
+	int32_t dx = _x - _map->x;
+	int32_t dy = _y - _map->y;
+	int32_t w = (int32_t)_map->width, h = (int32_t)_map->height;
+	int64_t page = (int64_t)_map->height * _map->stride;
+	_map->x = _x;
+	_map->y = _y;
+	_map->stats.frameCount++;
+
+	if (!_map->valid || dx >= w || dx <= -w || dy >= h || dy <= -h)
+	{
+		SPTilemapRedraw(_map);
+		SP_TRACE_END("SPTilemapScrollTo");
+		return;
+	}
+
+	int64_t start = (int64_t)_map->start + (int64_t)dy * _map->stride + (int64_t)dx * _map->bpp;
+	if (start < 0 || start > (SP_TILEMAP_PAGES - 1) * page)
+	{
+		// Two screens back, clear of the window on the screen now
+		_map->start = (uint32_t)(start < 0 ? start + (SP_TILEMAP_PAGES - 1) * page : start - (SP_TILEMAP_PAGES - 1) * page);
+		drawregion(_map, 0, 0, w, h);
+		_map->stats.resetCount++;
+	}
+	else
+	{
+		_map->start = (uint32_t)start;
+		drawregion(_map, 0, dy > 0 ? h - dy : 0, w, dy > 0 ? dy : -dy);
+		drawregion(_map, dx > 0 ? w - dx : 0, 0, dx > 0 ? dx : -dx, h);
+	}
+
+	applyscroll(_map);
+	SP_TRACE_END("SPTilemapScrollTo");
+}
+
+/*
+ * Draw the whole screen at the current position, into the half of the buffer away from the window on the screen.
+ */
+void SPTilemapRedraw(struct SPTilemap* _map)
+{
+	uint32_t page = _map->height * _map->stride;
+	_map->start = _map->start >= page ? _map->start - page : _map->start + page;
+	drawregion(_map, 0, 0, (int32_t)_map->width, (int32_t)_map->height);
+	_map->valid = 1;
+	_map->stats.redrawCount++;
+	applyscroll(_map);
+}
+
+/*
+ * Change the tile of a map cell, and draw it again wherever it is on the screen.
+ */
+void SPTilemapSetTile(struct SPTilemap* _map, uint32_t _column, uint32_t _row, uint16_t _tile)
+{
+	_map->indices[_row * _map->mapWidth + _column] = _tile;
+	if (!_map->valid)
+		return;
+
+	int32_t tw = (int32_t)_map->tileWidth, th = (int32_t)_map->tileHeight;
+	int32_t c0 = floordiv(_map->x, tw), c1 = floordiv(_map->x + (int32_t)_map->width - 1, tw);
+	int32_t r0 = floordiv(_map->y, th), r1 = floordiv(_map->y + (int32_t)_map->height - 1, th);
+	for (int32_t r = r0; r <= r1; ++r)
+	{
+		if (wrap(r, _map->mapHeight) != _row)
+			continue;
+		for (int32_t c = c0; c <= c1; ++c)
+		{
+			if (wrap(c, _map->mapWidth) != _column)
+				continue;
+			int32_t sx0 = c * tw - _map->x, sy0 = r * th - _map->y;
+			int32_t sx1 = sx0 + tw, sy1 = sy0 + th;
+			sx0 = sx0 < 0 ? 0 : sx0;
+			sy0 = sy0 < 0 ? 0 : sy0;
+			sx1 = sx1 > (int32_t)_map->width ? (int32_t)_map->width : sx1;
+			sy1 = sy1 > (int32_t)_map->height ? (int32_t)_map->height : sy1;
+			drawregion(_map, sx0, sy0, sx1 - sx0, sy1 - sy0);
+		}
+	}
+}
+
+/*
+ * The screen as a surface, to draw sprites and overlays on top of the layer until the next scroll.
+ * Rows run into each other, pixels drawn past the right edge show up on the left of the next row.
+ */
+void SPTilemapGetWindow(struct SPTilemap* _map, struct SPSurface* _surface)
+{
+	SPInitSurface(_surface, _map->buffer.cpuAddress + _map->start, _map->width, _map->height, _map->stride, _map->tiles->cmode);
+}
+
+void SPGetTilemapStats(struct SPTilemap* _map, struct SPTilemapStats* _stats)
+{
+	*_stats = _map->stats;
+}
+
+void SPResetTilemapStats(struct SPTilemap* _map)
+{
+	__builtin_memset(&_map->stats, 0, sizeof(struct SPTilemapStats));
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "platform.h"
+#include "blit.h"
+
+// Scrolling tile layer for the current video mode. The layer is drawn into a buffer three screens tall,
+// where the screen is a window that starts at any byte: the scanout address points at its 64 byte aligned
+// start and VPUShiftScanout / VPUShiftPixel skip the rest, as in samples/scroll. Moving the window by whole
+// rows scrolls vertically, and moving it by a few bytes scrolls horizontally, as the pixels that leave the
+// screen on the left of one row are the ones that enter it on the right of the row above. Only the strips
+// of tiles that scroll into view are drawn. Once the window runs off either end of the buffer, it jumps two
+// screens back and is drawn in full, in memory that is not on the screen at the time.
+// Columns that scroll in horizontally share memory with pixels still shown on the screen, so scroll right
+// after the vblank, before the beam reaches the first line.
+
+struct SPTilemapStats
+{
+	uint64_t frameCount;			// Calls to SPTilemapScrollTo
+	uint64_t pixelCount;			// Pixels drawn
+	uint64_t tileCount;				// Tiles drawn, in full or clipped to a strip
+	uint64_t resetCount;			// Full redraws after the window ran off the buffer
+	uint64_t redrawCount;			// Full redraws after jumps further than the screen and SPTilemapRedraw calls
+};
+
+struct SPTilemap
+{
+	struct SPPlatform* platform;
+	struct SPSizeAlloc buffer;		// Three screens of the current video mode
+	const struct SPSurface* tiles;	// Tiles in rows, in the color mode of the video mode
+	uint32_t tileWidth, tileHeight;
+	uint32_t tileColumns;			// Tiles per row of the tile surface
+	uint16_t* indices;				// Tile of each map cell, in rows
+	uint32_t mapWidth, mapHeight;	// In tiles, the map repeats beyond its edges
+	uint32_t width, height;			// Screen size in pixels
+	uint32_t stride;				// In bytes
+	uint32_t bpp;					// Bytes per pixel
+	uint32_t start;					// Byte offset of the window within the buffer
+	int32_t x, y;					// Map position of the top left pixel of the screen
+	int valid;						// Window contents match x and y
+	struct SPTilemapStats stats;
+};
+
+int SPTilemapInit(struct SPTilemap* _map, struct SPPlatform* _platform, const struct SPSurface* _tiles, uint32_t _tileWidth, uint32_t _tileHeight, uint16_t* _indices, uint32_t _mapWidth, uint32_t _mapHeight);
+void SPTilemapDestroy(struct SPTilemap* _map);
+void SPTilemapScrollTo(struct SPTilemap* _map, int32_t _x, int32_t _y);
+void SPTilemapRedraw(struct SPTilemap* _map);
+void SPTilemapSetTile(struct SPTilemap* _map, uint32_t _column, uint32_t _row, uint16_t _tile);
+void SPTilemapGetWindow(struct SPTilemap* _map, struct SPSurface* _surface);
+void SPGetTilemapStats(struct SPTilemap* _map, struct SPTilemapStats* _stats);
+void SPResetTilemapStats(struct SPTilemap* _map);
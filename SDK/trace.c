@@ -0,0 +1,190 @@
+#include "platform.h"
+#include "trace.h"
+
+#if defined(SP_ENABLE_TRACE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Number of events each thread keeps, has to be a power of two
+#define SP_TRACE_RING_SIZE		16384
+
+struct SPTraceEntry
+{
+	uint64_t timestamp;
+	const char* name;
+	uint32_t offset;
+	uint32_t value;
+	uint8_t event;
+	uint8_t device;
+};
+
+struct SPTraceRing
+{
+	struct SPTraceRing* next;
+	const char* threadName;
+	uint32_t threadId;
+	uint32_t head;			// Written by the owning thread only
+	uint32_t tail;			// Written by SPTraceFlush only
+	struct SPTraceEntry entries[SP_TRACE_RING_SIZE];
+};
+
+// All rings ever created, threads push themselves to the front and nothing is removed until exit
+static struct SPTraceRing* s_rings = NULL;
+static __thread struct SPTraceRing* s_threadRing = NULL;
+
+static const char* s_deviceNames[ESD_Count] = { "APU", "VPU", "PAL", "VCP" };
+
+static struct SPTraceRing* threadring()
+{
+	if (s_threadRing)
+		return s_threadRing;
+
+	struct SPTraceRing* ring = (struct SPTraceRing*)calloc(1, sizeof(struct SPTraceRing));
+	if (!ring)
+		return NULL;
+	ring->threadId = (uint32_t)syscall(SYS_gettid);
+
+	struct SPTraceRing* first = __atomic_load_n(&s_rings, __ATOMIC_ACQUIRE);
+	do {
+		ring->next = first;
+	} while (!__atomic_compare_exchange_n(&s_rings, &first, ring, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+	s_threadRing = ring;
+	return ring;
+}
+
+/*
+ * Record one event on the calling thread's ring. Use the SP_TRACE_* macros instead of calling this directly
+ * so that the calls go away in builds without SP_ENABLE_TRACE.
+ */
+void SPTraceRecord(enum ESPTraceEvent _event, const char* _name, uint32_t _device, uint32_t _offset, uint32_t _value)
+{
+	struct SPTraceRing* ring = threadring();
+	if (!ring)
+		return;
+
+	uint32_t head = ring->head;
+	struct SPTraceEntry* entry = &ring->entries[head & (SP_TRACE_RING_SIZE - 1)];
+	entry->timestamp = SPGetTimeNs();
+	entry->name = _name;
+	entry->offset = _offset;
+	entry->value = _value;
+	entry->event = (uint8_t)_event;
+	entry->device = (uint8_t)_device;
+
+	// Publish the entry after its contents
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Name the calling thread in the exported trace. _name has to stay valid until the last SPTraceFlush().
+ */
+void SPTraceSetThreadName(const char* _name)
+{
+	struct SPTraceRing* ring = threadring();
+	if (ring)
+		ring->threadName = _name;
+}
+
+/*
+ * Write everything recorded since the previous flush to _filename as Chrome trace JSON, then drop it.
+ * Can be called while other threads keep recording; events they overwrite during the flush are left out.
+ * Returns 0 on success, -1 if the file could not be written.
+ */
+int SPTraceFlush(const char* _filename)
+{
+	FILE* fp = fopen(_filename, "w");
+	if (!fp)
+		return -1;
+
+	uint32_t pid = (uint32_t)getpid();
+	int first = 1;
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (struct SPTraceRing* ring = __atomic_load_n(&s_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+	{
+		if (ring->threadName)
+		{
+			fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", pid, ring->threadId, ring->threadName);
+			first = 0;
+		}
+
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint32_t start = ring->tail;
+		if (head - start > SP_TRACE_RING_SIZE)
+			start = head - SP_TRACE_RING_SIZE;
+
+		for (uint32_t i = start; i != head; ++i)
+		{
+			struct SPTraceEntry entry = ring->entries[i & (SP_TRACE_RING_SIZE - 1)];
+
+			// Skip the entry if the owner wrapped around onto it while we were copying, once head is
+			// i + SP_TRACE_RING_SIZE the owner may already be writing entry head into the same slot
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - i >= SP_TRACE_RING_SIZE)
+				continue;
+
+			const char* separator = first ? "" : ",\n";
+			double ts = (double)entry.timestamp / 1000.0;
+			first = 0;
+
+			switch (entry.event)
+			{
+				case ETE_RegisterRead:
+				case ETE_RegisterWrite:
+				{
+					const char* device = entry.device < ESD_Count ? s_deviceNames[entry.device] : "???";
+					fprintf(fp, "%s{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"reg\",\"name\":\"%s %s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"args\":{\"offset\":\"0x%X\",\"value\":\"0x%08X\"}}",
+						separator, device, entry.event == ETE_RegisterRead ? "read" : "write", pid, ring->threadId, ts, entry.offset, entry.value);
+					break;
+				}
+				case ETE_Begin:
+				case ETE_End:
+					fprintf(fp, "%s{\"ph\":\"%s\",\"cat\":\"sdk\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+						separator, entry.event == ETE_Begin ? "B" : "E", entry.name ? entry.name : "", pid, ring->threadId, ts);
+					break;
+				default:
+					fprintf(fp, "%s{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"sdk\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"args\":{\"value\":\"0x%08X\"}}",
+						separator, entry.name ? entry.name : "", pid, ring->threadId, ts, entry.value);
+					break;
+			}
+		}
+
+		ring->tail = head;
+	}
+
+	fprintf(fp, "\n]}\n");
+	int failed = ferror(fp);
+	fclose(fp);
+
+	return failed ? -1 : 0;
+}
+
+#else
+
+void SPTraceRecord(enum ESPTraceEvent _event, const char* _name, uint32_t _device, uint32_t _offset, uint32_t _value)
+{
+	(void)_event;
+	(void)_name;
+	(void)_device;
+	(void)_offset;
+	(void)_value;
+}
+
+void SPTraceSetThreadName(const char* _name)
+{
+	(void)_name;
+}
+
+int SPTraceFlush(const char* _filename)
+{
+	(void)_filename;
+	// Tracing is compiled out
+	return -1;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+// Register access and SDK event tracer, exported as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+// Build with -DSP_ENABLE_TRACE to enable, otherwise the SP_TRACE_* macros compile to nothing
+// and SPTraceFlush() does not write anything.
+// Each thread records into its own ring buffer, so recording takes no locks. When a ring is full
+// the oldest events are overwritten. Event names have to be string literals, only the pointer is stored.
+
+enum ESPTraceEvent
+{
+	ETE_RegisterRead,
+	ETE_RegisterWrite,
+	ETE_Begin,		// Start of a duration on the calling thread
+	ETE_End,		// End of the most recent duration on the calling thread
+	ETE_Instant,	// Single point in time with a value attached
+	ETE_Count
+};
+
+#if defined(SP_ENABLE_TRACE)
+#define SP_TRACE_REGISTER(_event, _device, _offset, _value) SPTraceRecord(_event, 0, _device, _offset, _value)
+#define SP_TRACE_BEGIN(_name) SPTraceRecord(ETE_Begin, _name, 0, 0, 0)
+#define SP_TRACE_END(_name) SPTraceRecord(ETE_End, _name, 0, 0, 0)
+#define SP_TRACE_INSTANT(_name, _value) SPTraceRecord(ETE_Instant, _name, 0, 0, _value)
+#else
+#define SP_TRACE_REGISTER(_event, _device, _offset, _value) do {} while(0)
+#define SP_TRACE_BEGIN(_name) do {} while(0)
+#define SP_TRACE_END(_name) do {} while(0)
+#define SP_TRACE_INSTANT(_name, _value) do {} while(0)
+#endif
+
+void SPTraceRecord(enum ESPTraceEvent _event, const char* _name, uint32_t _device, uint32_t _offset, uint32_t _value);
+void SPTraceSetThreadName(const char* _name);
+int SPTraceFlush(const char* _filename);
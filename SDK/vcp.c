@@ -1,6 +1,8 @@
 
 #include "platform.h"
 #include "vcp.h"
+#include "trace.h"
+#include "arena.h"
 //#include "stdio.h"
 
 /*
@@ -8,20 +10,42 @@
  * ctx: Platform context
  * program: Pointer to the program data
  * size: One of the EVCPBufferSize enum values indicating the size of the program
+ * The program is staged in the frame arena when the swap context has one, otherwise in one buffer
+ * kept by the platform, which is only written once the DMA of the previous upload finished reading it.
  */
 void VCPUploadProgram(struct SPPlatform *ctx, const uint32_t* _program, enum EVCPBufferSize size)
 {
 	uint32_t bufferSize = 128 << (uint32_t)size;
 
+	SP_TRACE_BEGIN("VCPUploadProgram");
+
 	// Set aside some space for program uploads
 	struct SPSizeAlloc programUploadBuffer;
 	programUploadBuffer.size = bufferSize;
-	SPAllocateBuffer(ctx, &programUploadBuffer);
+	if (!ctx->sc || SPFrameAlloc(ctx->sc, &programUploadBuffer, SPALIGN_DEFAULT) != 0)
+	{
+		// The previous upload may still be queued or copying from this buffer
+		while (VCPStatus(ctx) & (VCPSTATUS_FIFONOTEMPTY | VCPSTATUS_COPYING)) { }
+
+		if (ctx->vcpUpload.size < bufferSize)
+		{
+			SPFreeBuffer(ctx, &ctx->vcpUpload);
+			ctx->vcpUpload.size = bufferSize;
+			if (SPAllocateBuffer(ctx, &ctx->vcpUpload) != 0)
+			{
+				ctx->vcpUpload.size = 0;
+				SP_TRACE_END("VCPUploadProgram");
+				return;
+			}
+		}
+		programUploadBuffer = ctx->vcpUpload;
+	}
 
 	// Copy the program into the upload buffer
 	uint32_t* uploadPtr = (uint32_t*)programUploadBuffer.cpuAddress;
 	for (uint32_t i = 0; i < (bufferSize / 4); i++)
 		uploadPtr[i] = _program[i];
+	SPFlushRange(ctx, uploadPtr, bufferSize);
 
 	/*printf("\n");
 	for (uint32_t i = 0; i < (bufferSize / 4); i++)
@@ -35,7 +59,7 @@ void VCPUploadProgram(struct SPPlatform *ctx, const uint32_t* _program, enum EVC
 	vcpwrite32(ctx, 0, VCPSTARTDMA);
 	vcpwrite32(ctx, 0, (uint32_t)programUploadBuffer.dmaAddress);
 
-	// TODO: We can wait for DMA completion by polling VCP status if needed
+	SP_TRACE_END("VCPUploadProgram");
 }
 
 /*
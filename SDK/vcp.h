@@ -7,6 +7,10 @@
 #define VCPSTARTDMA			0x1
 #define VCPEXEC				0x2
 
+// VCP status register bits
+#define VCPSTATUS_FIFONOTEMPTY	(1 << 21)	// Commands are waiting in the command fifo
+#define VCPSTATUS_COPYING		(1 << 22)	// A program upload DMA is in progress
+
 // VCP program instruction set
 #define VCP_NOOP			0x00
 #define VCP_LOADIMM			0x01
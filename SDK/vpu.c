@@ -1,5 +1,10 @@
+#include "simd.h"
 #include "core.h"
 #include "vpu.h"
+#include "kernels.h"
+#include "trace.h"
+#include "arena.h"
+#include "capture.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +14,9 @@
 #include <stdio.h>
 #include <fcntl.h>
 
+// How long before the predicted vblank a sleeping wait switches to polling
+#define VPU_WAIT_GUARD_NS			300000ull
+
 // Video mode control word
 #define MAKEVMODEINFO(_cmode, _vmode, _scanEnable) ((_cmode&0x1)<<2) | ((_vmode&0x1)<<1) | (_scanEnable&0x1)
 
@@ -145,17 +153,6 @@ static const uint8_t residentfont[] __attribute__((aligned(16))) = {
 0x00, 0xe7, 0xe7, 0xe7, 0x81, 0x8d, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc3, 0x00, 0x00, 0x00, 0x00, 
 0x00, 0x00, 0x00, 0x00, 0x81, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc1, 0x00, 0x00, 0x00, 0x00};
 
-/*
- * Lookup table for expanding 8-bit values to 32-bit values with repeated patterns.
- * Each entry corresponds to a specific bit pattern expansion used in the VPU.
- */
-static const uint32_t quadexpand[] __attribute__((aligned(16))) = {
-	0x00000000, 0xFF000000, 0x00FF0000, 0xFFFF0000,
-	0x0000FF00, 0xFF00FF00, 0x00FFFF00, 0xFFFFFF00,
-	0x000000FF, 0xFF0000FF, 0x00FF00FF, 0xFFFF00FF,
-	0x0000FFFF, 0xFF00FFFF, 0x00FFFFFF, 0xFFFFFFFF,
-};
-
 /*
  * VGA palette lookup table aligned to 16 bytes.
  * Contains 256 entries of 32-bit color values used for rendering.
@@ -180,13 +177,165 @@ static const uint32_t vgapalette[] __attribute__((aligned(16))) = {
 };
 
 /*
- * Sets the default VGA palette by writing each color entry to the hardware.
- * Iterates over all 256 palette entries and sends them to the VPU.
+ * Every glyph of the resident font expanded into a byte mask per pixel, one 8 pixel row per entry,
+ * and the VGA palette in RGB565 for consoles in 16 bit color mode. Built once by VPUInitVideo.
  */
-void VPUSetDefaultPalette(struct EVideoContext *_context)
+static uint64_t s_glyphCache[256][8] __attribute__((aligned(16)));
+static uint16_t s_vgapalette565[256];
+static int s_glyphCacheReady = 0;
+
+static void VPUBuildGlyphCache()
 {
+	if (s_glyphCacheReady)
+		return;
+
+	for (uint32_t c=0; c<256; ++c)
+	{
+		int charrow = (c>>4)*8;
+		int charcol = (c%16);
+		for (int y=0; y<8; ++y)
+		{
+			// Note that the nibbles of the font bytes are flipped, bit 3 is the leftmost pixel and bit 7 the fifth one
+			uint8_t chardata = residentfont[charcol+((charrow+y)*16)];
+			uint64_t mask = 0;
+			for (int x=0; x<8; ++x)
+			{
+				int bit = x<4 ? 3-x : 11-x;
+				if (chardata & (1<<bit))
+					mask |= 0xFFull << (x*8);
+			}
+			s_glyphCache[c][y] = mask;
+		}
+	}
+
 	for (uint32_t i=0; i<256; ++i)
-		palettewrite32(_context->m_platform, i & 0xFF, vgapalette[i]);
+	{
+		uint32_t rgb = vgapalette[i];
+		s_vgapalette565[i] = MAKECOLORRGB16(((rgb>>16)&0xFF)>>3, ((rgb>>8)&0xFF)>>2, (rgb&0xFF)>>3);
+	}
+
+	s_glyphCacheReady = 1;
+}
+
+#if !defined(SP_USE_NEON)
+/*
+ * Widens a mask of 4 bytes into a mask of 4 16 bit pixels.
+ */
+static inline uint64_t VPUWidenMask(uint32_t _mask)
+{
+	uint64_t x = _mask;
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+	x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+	return x | (x << 8);
+}
+#endif
+
+/*
+ * Draws glyph _char with 8 bit palette indices at _dst, 8 pixels wide and 8 rows of _strideBytes tall.
+ */
+static inline void VPUDrawGlyph8(uint8_t *_dst, uint32_t _strideBytes, uint8_t _char, uint8_t _fg, uint8_t _bg)
+{
+	const uint64_t *glyph = s_glyphCache[_char];
+#if defined(SP_USE_NEON)
+	// Two rows of the glyph per select
+	uint8x16_t fg = vdupq_n_u8(_fg);
+	uint8x16_t bg = vdupq_n_u8(_bg);
+	for (int y=0; y<8; y+=2)
+	{
+		uint8x16_t pixels = vbslq_u8(vld1q_u8((const uint8_t*)&glyph[y]), fg, bg);
+		vst1_u8(_dst, vget_low_u8(pixels));
+		vst1_u8(_dst + _strideBytes, vget_high_u8(pixels));
+		_dst += 2*_strideBytes;
+	}
+#else
+	uint64_t fg = _fg * 0x0101010101010101ull;
+	uint64_t bg = _bg * 0x0101010101010101ull;
+	for (int y=0; y<8; ++y)
+	{
+		*(uint64_t*)_dst = (glyph[y] & fg) | (~glyph[y] & bg);
+		_dst += _strideBytes;
+	}
+#endif
+}
+
+/*
+ * Draws glyph _char with RGB565 colors at _dst, 8 pixels wide and 8 rows of _strideBytes tall.
+ */
+static inline void VPUDrawGlyph16(uint8_t *_dst, uint32_t _strideBytes, uint8_t _char, uint16_t _fg, uint16_t _bg)
+{
+	const uint64_t *glyph = s_glyphCache[_char];
+#if defined(SP_USE_NEON)
+	// Byte masks sign extend into pixel masks, a whole row per select
+	uint16x8_t fg = vdupq_n_u16(_fg);
+	uint16x8_t bg = vdupq_n_u16(_bg);
+	for (int y=0; y<8; ++y)
+	{
+		uint16x8_t mask = vreinterpretq_u16_s16(vmovl_s8(vld1_s8((const int8_t*)&glyph[y])));
+		vst1q_u16((uint16_t*)_dst, vbslq_u16(mask, fg, bg));
+		_dst += _strideBytes;
+	}
+#else
+	uint64_t fg = _fg * 0x0001000100010001ull;
+	uint64_t bg = _bg * 0x0001000100010001ull;
+	for (int y=0; y<8; ++y)
+	{
+		uint64_t left = VPUWidenMask((uint32_t)glyph[y]);
+		uint64_t right = VPUWidenMask((uint32_t)(glyph[y] >> 32));
+		((uint64_t*)_dst)[0] = (left & fg) | (~left & bg);
+		((uint64_t*)_dst)[1] = (right & fg) | (~right & bg);
+		_dst += _strideBytes;
+	}
+#endif
+}
+
+/*
+ * Draws glyph _char at _dst in the color mode of the context, with palette indices _fg and _bg.
+ * In 16 bit color mode the indices go through the default VGA palette.
+ */
+static inline void VPUDrawGlyph(struct EVideoContext *_context, uint8_t *_dst, uint8_t _char, uint8_t _fg, uint8_t _bg)
+{
+	uint32_t strideBytes = _context->m_strideInWords * sizeof(uint32_t);
+	if (_context->m_cmode == ECM_16bit_RGB)
+		VPUDrawGlyph16(_dst, strideBytes, _char, s_vgapalette565[_fg], s_vgapalette565[_bg]);
+	else
+		VPUDrawGlyph8(_dst, strideBytes, _char, _fg, _bg);
+}
+
+/*
+ * Flushes the current CPU write page so that the VPU sees everything drawn into it.
+ * Costs nothing for uncached framebuffers.
+ */
+static void VPUFlushWritePage(struct EVideoContext *_context)
+{
+	if (_context->m_cpuWriteAddressCacheAligned)
+		SPFlushRange(_context->m_platform, (const void*)_context->m_cpuWriteAddressCacheAligned, _context->m_graphicsHeight * _context->m_strideInWords * sizeof(uint32_t));
+}
+
+/*
+ * Sends _command followed by _value to the VPU, unless the register already holds _value.
+ */
+static void VPUWriteShadowed(struct EVideoContext *_context, enum EVideoRegister _register, uint32_t _command, uint32_t _value)
+{
+	uint32_t bit = 1u << _register;
+	if ((_context->m_shadowValid & bit) && _context->m_shadow[_register] == _value)
+	{
+		_context->m_shadowStats.elided += 2;
+		return;
+	}
+
+	_context->m_shadow[_register] = _value;
+	_context->m_shadowValid |= bit;
+	_context->m_shadowStats.writes += 2;
+	videowrite32(_context->m_platform, 0, _command);
+	videowrite32(_context->m_platform, 0, _value);
+}
+
+/*
+ * Sets the default VGA palette, see VPUSetPaletteRange.
+ */
+void VPUSetDefaultPalette(struct EVideoContext *_context)
+{
+	VPUSetPaletteRange(_context, 0, 256, vgapalette);
 }
 
  /*
@@ -196,18 +345,22 @@ void VPUSetDefaultPalette(struct EVideoContext *_context)
   */
 void VPUSetScanoutAddress2(struct EVideoContext *_context, const uint32_t _scanOutAddress64ByteAligned)
 {
-	videowrite32(_context->m_platform, 0, VPUCMD_SETVPAGE2);
-	videowrite32(_context->m_platform, 0, _scanOutAddress64ByteAligned);
+	VPUWriteShadowed(_context, EVR_ScanoutAddress2, VPUCMD_SETVPAGE2, _scanOutAddress64ByteAligned);
 }
 
  /*
   * Initiates a (optionally) vsynced swap between the two video pages set up by
   * VPUSetScanoutAddress and VPUSetScanoutAddress2.
   * If _donotwaitforvsync is non-zero, the swap will not wait for vertical sync.
+  * The current CPU write page is flushed first, as it is the one about to be shown.
+  * The two scanout addresses trade places at some later vblank, so neither is known afterwards.
   */
 void VPUSyncSwap(struct EVideoContext *_context, uint8_t _donotwaitforvsync)
 {
+	SP_TRACE_INSTANT("VPUSyncSwap", _donotwaitforvsync);
+	VPUFlushWritePage(_context);
 	videowrite32(_context->m_platform, 0, (_donotwaitforvsync<<8) | VPUCMD_SYNCSWAP);
+	_context->m_shadowValid &= ~((1u << EVR_ScanoutAddress) | (1u << EVR_ScanoutAddress2));
 }
 
 /*
@@ -216,8 +369,7 @@ void VPUSyncSwap(struct EVideoContext *_context, uint8_t _donotwaitforvsync)
  */
 void VPUShiftCache(struct EVideoContext *_context, uint8_t _offset)
 {
-	videowrite32(_context->m_platform, 0, VPUCMD_SHIFTCACHE);
-	videowrite32(_context->m_platform, 0, _offset);
+	VPUWriteShadowed(_context, EVR_ShiftCache, VPUCMD_SHIFTCACHE, _offset);
 }
 
  /*
@@ -226,8 +378,7 @@ void VPUShiftCache(struct EVideoContext *_context, uint8_t _offset)
   */
 void VPUShiftScanout(struct EVideoContext *_context, uint8_t _offset)
 {
-	videowrite32(_context->m_platform, 0, VPUCMD_SHIFTSCANOUT);
-	videowrite32(_context->m_platform, 0, _offset);
+	VPUWriteShadowed(_context, EVR_ShiftScanout, VPUCMD_SHIFTSCANOUT, _offset);
 }
 
 /*
@@ -237,19 +388,22 @@ void VPUShiftScanout(struct EVideoContext *_context, uint8_t _offset)
  */
 void VPUShiftPixel(struct EVideoContext *_context, uint8_t _offset)
 {
-	videowrite32(_context->m_platform, 0, VPUCMD_SHIFTPIXEL);
-	videowrite32(_context->m_platform, 0, _offset);
+	VPUWriteShadowed(_context, EVR_ShiftPixel, VPUCMD_SHIFTPIXEL, _offset);
 }
 
 /*
  * Configures the video mode, color mode, and scanout enable settings for the VPU.
  * If a valid context is provided, it updates the context's state accordingly.
  * Otherwise, it directly writes the settings to the hardware registers.
+ * The VPU is only told when the mode actually changes.
  */
 void VPUSetVideoMode(struct EVideoContext *_context, const enum EVideoMode _mode, const enum EColorMode _cmode, const enum EVideoScanoutEnable _scanEnable)
 {
 	if (_context)
 	{
+		// The console ring and scroll position only outlive the mode if the layout stays the same
+		int resized = _context->m_vmode != _mode || _context->m_cmode != _cmode;
+
 		// Store for later
 		_context->m_vmode = _mode;
 		_context->m_cmode = _cmode;
@@ -264,9 +418,13 @@ void VPUSetVideoMode(struct EVideoContext *_context, const enum EVideoMode _mode
 		_context->m_consoleWidth = (uint16_t)(_context->m_graphicsWidth/8);
 		_context->m_consoleHeight = (uint16_t)(_context->m_graphicsHeight/8);
 		_context->m_consoleUpdated = 0;
+		if (resized)
+		{
+			_context->m_consoleTop = 0;
+			VPUConsoleSetRing(_context, NULL);
+		}
 
-		videowrite32(_context->m_platform, 0, VPUCMD_SETVMODE);
-		videowrite32(_context->m_platform, 0, MAKEVMODEINFO((uint32_t)_context->m_cmode, (uint32_t)_context->m_vmode, (uint32_t)_scanEnable));
+		VPUWriteShadowed(_context, EVR_VideoMode, VPUCMD_SETVMODE, MAKEVMODEINFO((uint32_t)_context->m_cmode, (uint32_t)_context->m_vmode, (uint32_t)_scanEnable));
 	}
 	else
 	{
@@ -294,8 +452,7 @@ void VPUSetScanoutAddress(struct EVideoContext *_context, const uint32_t _scanOu
 	_context->m_scanoutAddressCacheAligned = _scanOutAddress64ByteAligned;
 	//EAssert((_scanOutAddress64ByteAligned&0x3F) == 0, "Video scanout address has to be aligned to 64 bytes\n");
 
-	videowrite32(_context->m_platform, 0, VPUCMD_SETVPAGE);
-	videowrite32(_context->m_platform, 0, (uint32_t)_scanOutAddress64ByteAligned);
+	VPUWriteShadowed(_context, EVR_ScanoutAddress, VPUCMD_SETVPAGE, _scanOutAddress64ByteAligned);
 }
 
  /*
@@ -312,10 +469,45 @@ void VPUSetWriteAddress(struct EVideoContext *_context, const uint32_t _cpuWrite
  * Sets a palette entry in the VPU's color palette.
  * _paletteIndex specifies the palette slot to set.
  * _red, _green, and _blue specify the color components (0-255).
+ * The entry is always written, use VPUSetPaletteRange to upload many of them at once.
  */
 void VPUSetPal(struct EVideoContext *_context, const uint8_t _paletteIndex, const uint32_t _red, const uint32_t _green, const uint32_t _blue)
 {
-	palettewrite32(_context->m_platform, _paletteIndex & 0xFF, MAKECOLORRGB24(_red, _green, _blue));
+	uint32_t color = MAKECOLORRGB24(_red, _green, _blue);
+	_context->m_palette[_paletteIndex] = color;
+	_context->m_paletteValid[_paletteIndex >> 5] |= 1u << (_paletteIndex & 31);
+	palettewrite32(_context->m_platform, _paletteIndex, color);
+}
+
+/*
+ * Sets _count palette entries from _start on to the r8g8b8 colors in _rgb24, in a single batch.
+ * Entries already holding their color are skipped, so uploading a whole palette where only a few colors
+ * changed, or the same palette again, costs next to nothing. Palette writes from a VCP program are not
+ * seen here, call VPUInvalidateShadow after one ran to have every entry written again.
+ * Returns the number of entries written.
+ */
+uint32_t VPUSetPaletteRange(struct EVideoContext *_context, const uint32_t _start, const uint32_t _count, const uint32_t *_rgb24)
+{
+	uint32_t end = _start + _count > 256 ? 256 : _start + _count;
+	uint32_t written = 0;
+
+	SPBeginBatch(_context->m_platform);
+	for (uint32_t i = _start; i < end; ++i)
+	{
+		uint32_t color = _rgb24[i - _start] & 0xFFFFFF;
+		uint32_t bit = 1u << (i & 31);
+		if ((_context->m_paletteValid[i >> 5] & bit) && _context->m_palette[i] == color)
+			continue;
+		_context->m_palette[i] = color;
+		_context->m_paletteValid[i >> 5] |= bit;
+		palettewrite32(_context->m_platform, i, color);
+		++written;
+	}
+	SPSubmit(_context->m_platform);
+
+	_context->m_shadowStats.writes += written;
+	_context->m_shadowStats.elided += (end > _start ? end - _start : 0) - written;
+	return written;
 }
 
  /*
@@ -325,10 +517,8 @@ void VPUSetPal(struct EVideoContext *_context, const uint8_t _paletteIndex, cons
   */
 void VPUClear(struct EVideoContext *_context, const uint32_t _colorWord)
 {
-	uint32_t *vramBase = (uint32_t*)_context->m_cpuWriteAddressCacheAligned;
-	uint32_t W = _context->m_graphicsHeight * _context->m_strideInWords;
-	for (uint32_t i=0; i<W; ++i)
-		vramBase[i] = _colorWord;
+	uint32_t strideInBytes = _context->m_strideInWords * sizeof(uint32_t);
+	SPFillRect((void*)_context->m_cpuWriteAddressCacheAligned, strideInBytes, strideInBytes, _context->m_graphicsHeight, _colorWord);
 }
 
 /*
@@ -368,6 +558,7 @@ uint32_t VPUGetFIFONotEmpty(struct EVideoContext *_context)
   * Writes a value to the VPU's control register.
   * _setFlag determines whether to set (1) or clear (0) the control register bits.
   * _value is the value to write to or clear from the control register.
+  * Unlike the other setters this one is not shadowed, the VCP and the hardware change the register on their own.
   */
 void VPUWriteControlRegister(struct EVideoContext *_context, uint8_t _setFlag, uint8_t _value)
 {
@@ -382,17 +573,197 @@ uint8_t VPUReadControlRegister(struct EVideoContext *_context)
 	return (uint8_t)((videoread32(_context->m_platform, 0) & 0xFF000) >> 12);
 }
 
+/*
+ * Forget the shadowed register values, so that the next call of each setter reaches the device.
+ * Call this after writing VPU registers directly with videowrite32, or when another program may have changed them.
+ */
+void VPUInvalidateShadow(struct EVideoContext *_context)
+{
+	_context->m_shadowValid = 0;
+	__builtin_memset(_context->m_paletteValid, 0, sizeof(_context->m_paletteValid));
+}
+
+/*
+ * Retrieve the number of register writes the shadowed setters sent and skipped.
+ */
+void VPUGetShadowStats(struct EVideoContext *_context, struct SPShadowStats *_stats)
+{
+	*_stats = _context->m_shadowStats;
+}
+
+static uint32_t VPUDamagePageCount(struct EVideoSwapContext *_sc)
+{
+	if (_sc->pageCount)
+		return _sc->pageCount;
+	return _sc->framebufferA != _sc->framebufferB ? 2 : 1;
+}
+
+static uint32_t VPUDamageWritePage(struct EVideoSwapContext *_sc)
+{
+	if (_sc->pageCount)
+		return _sc->writeIndex;
+	return (VPUDamagePageCount(_sc) == 2 && _sc->writepage == _sc->framebufferB->cpuAddress) ? 1 : 0;
+}
+
+static uint32_t VPURectArea(const struct SPRect *_rect)
+{
+	return (uint32_t)_rect->width * (uint32_t)_rect->height;
+}
+
+static struct SPRect VPURectUnion(const struct SPRect *_a, const struct SPRect *_b)
+{
+	struct SPRect u;
+	u.x = _a->x < _b->x ? _a->x : _b->x;
+	u.y = _a->y < _b->y ? _a->y : _b->y;
+	int right = _a->x + _a->width > _b->x + _b->width ? _a->x + _a->width : _b->x + _b->width;
+	int bottom = _a->y + _a->height > _b->y + _b->height ? _a->y + _a->height : _b->y + _b->height;
+	u.width = right - u.x;
+	u.height = bottom - u.y;
+	return u;
+}
+
+/*
+ * Pixels a union of the two rectangles would copy that neither of them covers.
+ */
+static uint32_t VPURectWaste(const struct SPRect *_a, const struct SPRect *_b)
+{
+	struct SPRect u = VPURectUnion(_a, _b);
+	int ow = (_a->x + _a->width < _b->x + _b->width ? _a->x + _a->width : _b->x + _b->width) - (_a->x > _b->x ? _a->x : _b->x);
+	int oh = (_a->y + _a->height < _b->y + _b->height ? _a->y + _a->height : _b->y + _b->height) - (_a->y > _b->y ? _a->y : _b->y);
+	uint32_t overlap = (ow > 0 && oh > 0) ? (uint32_t)ow * (uint32_t)oh : 0;
+	return VPURectArea(&u) + overlap - VPURectArea(_a) - VPURectArea(_b);
+}
+
+/*
+ * Add _rect to a page's list. It is merged into a rectangle it is close to, so that glyphs of a line of text end up
+ * as one copy. When the list is full it grows whichever rectangle that wastes the fewest pixels.
+ */
+static void VPUDamageInsert(struct EVideoDamage *_damage, const struct SPRect *_rect)
+{
+	uint32_t best = 0, bestWaste = 0xFFFFFFFF;
+	for (uint32_t i = 0; i < _damage->count; ++i)
+	{
+		uint32_t waste = VPURectWaste(&_damage->rects[i], _rect);
+		if (waste < bestWaste)
+		{
+			best = i;
+			bestWaste = waste;
+		}
+	}
+
+	uint32_t smaller = VPURectArea(_rect);
+	if (_damage->count && VPURectArea(&_damage->rects[best]) < smaller)
+		smaller = VPURectArea(&_damage->rects[best]);
+	if (_damage->count && (bestWaste <= smaller || _damage->count == VPU_DAMAGE_RECTS))
+		_damage->rects[best] = VPURectUnion(&_damage->rects[best], _rect);
+	else
+		_damage->rects[_damage->count++] = *_rect;
+}
+
+/*
+ * Copy every region of a page's list from _source, and empty the list.
+ */
+static void VPUDamageCopy(struct EVideoContext *_context, struct EVideoDamage *_damage, uint8_t *_dst, const uint8_t *_source, uint32_t _sourceStride)
+{
+	uint32_t stride = _context->m_strideInWords * 4;
+	uint32_t bpp = _context->m_cmode == ECM_16bit_RGB ? 2 : 1;
+	for (uint32_t i = 0; i < _damage->count; ++i)
+	{
+		struct SPRect *r = &_damage->rects[i];
+		SPCopyRect(_dst + r->y * stride + r->x * bpp, stride, _source + r->y * _sourceStride + r->x * bpp, _sourceStride, r->width * bpp, r->height);
+	}
+	_damage->count = 0;
+}
+
+/*
+ * Mark a region of the screen as changed in the frame being drawn, for partial presentation.
+ * The region is clipped to the screen and recorded for every page of _sc, as each of them has to receive it once.
+ * Drawing straight into the write page, VPUSwapPages copies the region into the other page after presenting this one.
+ * Drawing into a buffer of your own, VPUCopyDamage copies everything the write page is missing from it.
+ * Nothing is tracked or copied if this is never called.
+ */
+void VPUAddDamage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, int _x, int _y, int _width, int _height)
+{
+	struct SPRect rect;
+	rect.x = _x < 0 ? 0 : _x;
+	rect.y = _y < 0 ? 0 : _y;
+	int right = _x + _width > (int)_context->m_graphicsWidth ? (int)_context->m_graphicsWidth : _x + _width;
+	int bottom = _y + _height > (int)_context->m_graphicsHeight ? (int)_context->m_graphicsHeight : _y + _height;
+	if (right <= rect.x || bottom <= rect.y)
+		return;
+	rect.width = right - rect.x;
+	rect.height = bottom - rect.y;
+
+	for (uint32_t i = 0; i < VPUDamagePageCount(_sc); ++i)
+		VPUDamageInsert(&_sc->damage[i], &rect);
+}
+
+/*
+ * Copy the regions the write page is missing from _source, a full screen image with a stride of _sourceStride bytes.
+ * These are the regions marked since the write page was last brought up to date, by this call or by VPUSwapPages.
+ */
+void VPUCopyDamage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, const void *_source, uint32_t _sourceStride)
+{
+	if (_sc->writepage == 0x0)
+		return;
+	VPUDamageCopy(_context, &_sc->damage[VPUDamageWritePage(_sc)], _sc->writepage, (const uint8_t*)_source, _sourceStride);
+}
+
 /*
  * Swaps the read and write pages for double buffering, on the CPU side context, and sets the new scanout and write pointers.
  * _sc is the swap context containing framebuffer addresses and the current cycle count.
+ * The page that was being drawn to is flushed before it is scanned out.
+ * Regions marked with VPUAddDamage since the new write page was last presented are copied into it from the
+ * page that is now scanned out, so only what changed has to be drawn again.
+ * If _sc has frame arenas, the next frame gets the oldest one, see SPFrameArenaAdvance.
+ * If _sc has a capture waiting for a frame, the presented page is copied for it, see SPCaptureSwap.
  */
 void VPUSwapPages(struct EVideoContext* _context, struct EVideoSwapContext *_sc)
 {
-	_sc->readpage = ((_sc->cycle)%2) ? _sc->framebufferA->dmaAddress : _sc->framebufferB->dmaAddress;
-	_sc->writepage = ((_sc->cycle)%2) ? _sc->framebufferB->cpuAddress : _sc->framebufferA->cpuAddress;
-	VPUSetWriteAddress(_context, (uint32_t)_sc->writepage);
+	SP_TRACE_INSTANT("VPUSwapPages", _sc->cycle);
+	VPUFlushWritePage(_context);
+
+	struct SPSizeAlloc *presented = ((_sc->cycle)%2) ? _sc->framebufferA : _sc->framebufferB;
+	struct SPSizeAlloc *next = ((_sc->cycle)%2) ? _sc->framebufferB : _sc->framebufferA;
+	uint32_t pages = VPUDamagePageCount(_sc);
+	VPUPresentPage(_context, _sc, (pages == 2 && presented == _sc->framebufferB) ? 1 : 0, presented);
+	VPUBeginWritePage(_context, _sc, (pages == 2 && next == _sc->framebufferB) ? 1 : 0, next, presented);
 	VPUSetScanoutAddress(_context, (uint32_t)_sc->readpage);
 	_sc->cycle = _sc->cycle + 1;
+
+	SPFrameArenaAdvance(_context, _sc);
+}
+
+/*
+ * Bookkeeping for page _page of _sc being presented, shared by VPUSwapPages and SPQueuePresent.
+ * The page holds the latest frame from now on, so it is missing nothing, and a capture waiting for a frame
+ * gets a copy of it, see SPCaptureSwap. Setting the scanout address is up to the caller.
+ */
+void VPUPresentPage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, uint32_t _page, const struct SPSizeAlloc *_presented)
+{
+	_sc->damage[_page].count = 0;
+	_sc->readpage = _presented->dmaAddress;
+	SPCaptureSwap(_context, _sc, _presented);
+}
+
+/*
+ * Make _framebuffer, page _page of _sc, the write page, shared by VPUSwapPages and SPAcquireNextImage.
+ * Regions marked with VPUAddDamage since the page was last presented are copied into it from _latest,
+ * the page presented last, so only what changed has to be drawn again. Pass NULL before the first frame.
+ */
+void VPUBeginWritePage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, uint32_t _page, const struct SPSizeAlloc *_framebuffer, const struct SPSizeAlloc *_latest)
+{
+	_sc->writepage = _framebuffer->cpuAddress;
+	_sc->writeIndex = _page;
+	VPUSetWriteAddress(_context, (uint32_t)_sc->writepage);
+
+	struct EVideoDamage *missing = &_sc->damage[_page];
+	if (missing->count && _latest && _latest != _framebuffer)
+	{
+		SP_TRACE_BEGIN("VPUSwapPages damage");
+		VPUDamageCopy(_context, missing, _sc->writepage, _latest->cpuAddress, _context->m_strideInWords * 4);
+		SP_TRACE_END("VPUSwapPages damage");
+	}
 }
 
 /*
@@ -402,217 +773,434 @@ void VPUSwapPages(struct EVideoContext* _context, struct EVideoSwapContext *_sc)
  * This is not a precise way to time for vsync, as it depends on the polling frequency and system load.
  * The recommended way to do this is to use a swapsync / noop pair and wait for the noop on the CPU instead,
  * then swap the buffer pointers on the CPU.
+ * Unless the wait mode is EWM_Spin, the thread sleeps until shortly before the vblank predicted from
+ * the current scanline and the measured frame period, and only polls for the remainder. If it is
+ * called inside a vblank that no earlier call has waited for yet, it returns right away.
  */
 void VPUWaitVSync(struct EVideoContext *_context)
 {
+	struct SPWaitStats *stats = &_context->m_waitStats;
+	SP_TRACE_BEGIN("VPUWaitVSync");
+
 	volatile uint32_t prevvsync = VPUReadVBlankCounter(_context);
 	volatile uint32_t currentvsync;
+
+	if (_context->m_waitMode != EWM_Spin)
+	{
+		uint32_t scanline = VPUGetScanline(_context) % VPU_SCANLINE_COUNT;
+
+		// Already inside a vblank no earlier wait returned in, the flip happened before prevvsync was read
+		uint32_t sinceFlip = (scanline + VPU_SCANLINE_COUNT - _context->m_vblankScanline) % VPU_SCANLINE_COUNT;
+		uint64_t now = SPGetTimeNs();
+		uint64_t flipNs = now - (uint64_t)sinceFlip * _context->m_framePeriodNs / VPU_SCANLINE_COUNT;
+		if (sinceFlip < VPU_SCANLINE_COUNT - VPU_VBLANK_SCANLINE && _context->m_lastVBlankNs + _context->m_framePeriodNs / 2 < flipNs)
+		{
+			stats->waitCount++;
+			_context->m_lastVBlankNs = flipNs;
+			SP_TRACE_END("VPUWaitVSync");
+			return;
+		}
+
+		uint32_t lines = (VPU_SCANLINE_COUNT - sinceFlip) % VPU_SCANLINE_COUNT;
+		uint64_t remaining = (uint64_t)lines * _context->m_framePeriodNs / VPU_SCANLINE_COUNT;
+		if (remaining > VPU_WAIT_GUARD_NS)
+		{
+			uint64_t sleepStart = SPGetTimeNs();
+			SPSleep(_context->m_platform, remaining - VPU_WAIT_GUARD_NS, _context->m_waitMode == EWM_Blocking);
+			stats->sleptNs += SPGetTimeNs() - sleepStart;
+		}
+	}
+
+	uint64_t pollStart = SPGetTimeNs();
+	uint32_t polls = 0;
 	do {
 		currentvsync = VPUReadVBlankCounter(_context);
+		++polls;
 	} while (currentvsync == prevvsync);
+	uint64_t now = SPGetTimeNs();
+
+	stats->polledNs += now - pollStart;
+	stats->pollCount += polls;
+	stats->waitCount++;
+
+	// Only learn from waits that saw the flip happen, a wait that woke up late would skew the prediction
+	if (polls > 1)
+	{
+		_context->m_vblankScanline = VPUGetScanline(_context) % VPU_SCANLINE_COUNT;
+
+		uint64_t interval = now - _context->m_lastVBlankNs;
+		if (_context->m_lastVBlankNs && interval > (_context->m_framePeriodNs * 3) / 4 && interval < (_context->m_framePeriodNs * 5) / 4)
+			_context->m_framePeriodNs = (_context->m_framePeriodNs * 7 + interval) / 8;
+	}
+	_context->m_lastVBlankNs = now;
+
+	SP_TRACE_END("VPUWaitVSync");
+}
+
+/*
+ * Selects how VPUWaitVSync waits for the vblank.
+ * EWM_Sleep (the default) frees up the CPU for most of the frame, EWM_Spin restores pure polling.
+ */
+void VPUSetWaitMode(struct EVideoContext *_context, const enum ESPWaitMode _mode)
+{
+	_context->m_waitMode = _mode;
+}
+
+/*
+ * Retrieves the time VPUWaitVSync spent asleep and polling.
+ */
+void VPUGetWaitStats(struct EVideoContext *_context, struct SPWaitStats *_stats)
+{
+	*_stats = _context->m_waitStats;
 }
 
 /*
  * Renders a string of text onto the screen at the specified position with the given foreground and background colors.
  * _foregroundIndex and _backgroundIndex are palette indices for the text color and background color, respectively.
- * _x and _y specify the starting pixel coordinates for the text.
- * _message is a pointer to the character array containing the text to be rendered.
+ * _x is the starting column in words of the scanline, rounded down to a multiple of 4, and _y the starting text row of 8 scanlines.
+ * _message is a pointer to the character array containing the text to be rendered, control characters are skipped.
  * _length is the number of characters to render from the _message array.
  */
 void VPUPrintString(struct EVideoContext *_context, const uint8_t _foregroundIndex, const uint8_t _backgroundIndex, const uint16_t _x, const uint16_t _y, const char *_message, int _length)
 {
-	uint32_t *vramBase = (uint32_t*)_context->m_cpuWriteAddressCacheAligned;
-	uint32_t stride = _context->m_strideInWords;
-	uint32_t FG = (_foregroundIndex<<24) | (_foregroundIndex<<16) | (_foregroundIndex<<8) | _foregroundIndex;
-	uint32_t BG = (_backgroundIndex<<24) | (_backgroundIndex<<16) | (_backgroundIndex<<8) | _backgroundIndex;
+	uint8_t *vramBase = (uint8_t*)_context->m_cpuWriteAddressCacheAligned;
+	uint32_t strideBytes = _context->m_strideInWords * sizeof(uint32_t);
+	uint32_t pixelBytes = _context->m_cmode == ECM_16bit_RGB ? 2 : 1;
 
-	// Align to 4 pixels
-	uint16_t cx = _x&0xFFFC;
-	// Y is aligned to 1 pixel
-	uint16_t cy = _y;
+	// Align to 4 words, cx counts bytes from here on
+	uint32_t cx = (_x&0xFFFC) * sizeof(uint32_t);
+	// Text rows are 8 scanlines
+	uint32_t cy = _y*8;
 
 	for (int i=0; i<_length; ++i)
 	{
-		int currentchar = _message[i];
+		uint8_t currentchar = (uint8_t)_message[i];
 		if (currentchar<32)
 			continue;
+		if (cx/pixelBytes+8 > _context->m_graphicsWidth || cy+8 > _context->m_graphicsHeight)
+			break;
 
-		int charrow = (currentchar>>4)*8;
-		int charcol = (currentchar%16);
-		for (int y=0; y<8; ++y)
+		VPUDrawGlyph(_context, vramBase + cy*strideBytes + cx, currentchar, _foregroundIndex, _backgroundIndex);
+		// Next char position, 8 pixels
+		cx += 8*pixelBytes;
+	}
+}
+
+static uint64_t VPUConsoleAllRows(struct EVideoContext *_context)
+{
+	return _context->m_consoleHeight >= 64 ? ~0ull : (1ull << _context->m_consoleHeight) - 1;
+}
+
+static uint64_t VPUConsoleRowBit(uint16_t _row)
+{
+	return _row < 64 ? 1ull << _row : 0;
+}
+
+/*
+ * Grid row of console row _row, the character and color buffers are a ring of rows starting at m_consoleTop.
+ */
+static uint16_t VPUConsoleGridRow(struct EVideoContext *_context, uint16_t _row)
+{
+	uint32_t row = _row + _context->m_consoleTop;
+	return (uint16_t)(row >= _context->m_consoleHeight ? row - _context->m_consoleHeight : row);
+}
+
+/*
+ * Offset of the first character of console row _row in the character and color buffers.
+ */
+static uint32_t VPUConsoleRowOffset(struct EVideoContext *_context, uint16_t _row)
+{
+	return VPUConsoleGridRow(_context, _row) * _context->m_consoleWidth;
+}
+
+/*
+ * Marks console rows _firstRow to _lastRow as changed for every framebuffer the console was resolved into.
+ */
+static void VPUConsoleMarkRows(struct EVideoContext *_context, int _firstRow, int _lastRow)
+{
+	if (_firstRow < 0)
+		_firstRow = 0;
+	if (_lastRow >= _context->m_consoleHeight)
+		_lastRow = _context->m_consoleHeight - 1;
+	if (_lastRow < _firstRow)
+		return;
+
+	uint64_t rows = 0;
+	for (int cy=_firstRow; cy<=_lastRow; ++cy)
+		rows |= VPUConsoleRowBit(VPUConsoleGridRow(_context, cy));
+	for (int i=0; i<VPU_CONSOLE_TARGETS; ++i)
+	{
+		_context->m_consoleTargets[i].m_dirtyRows |= rows;
+		_context->m_consoleTargets[i].m_dirtyMirror |= rows;
+	}
+}
+
+/*
+ * Marks grid row _gridRow, which just scrolled in, as changed. A ring framebuffer only has to draw that row,
+ * everywhere else every row moved.
+ */
+static void VPUConsoleMarkScroll(struct EVideoContext *_context, uint16_t _gridRow)
+{
+	for (int i=0; i<VPU_CONSOLE_TARGETS; ++i)
+	{
+		struct EConsoleTarget *target = &_context->m_consoleTargets[i];
+		if (_context->m_consoleRingAddress && target->m_address == _context->m_consoleRingAddress)
 		{
-			int yoffset = (cy*8+y)*stride;
-			// Expand bit packed character row into individual pixels
-			uint8_t chardata = residentfont[charcol+((charrow+y)*16)];
-			// Output the 2 words (8 pixels) for this row
-			for (int x=0; x<2; ++x)
-			{
-				// X offset in words
-				int xoffset = cx + x;
-				// Generate foreground / background output via masks
-				// Note that the nibbles of the font bytes are flipped for this to work
-				uint32_t mask = quadexpand[chardata&0x0F];
-				uint32_t invmask = ~mask;
-				uint32_t fourPixels = (mask & FG) | (invmask & BG);
-				// Output the combined 4-pixel value
-				vramBase[xoffset + yoffset] = fourPixels;
-				// Move to the next set of 4 pixels
-				chardata = chardata >> 4;
-			}
+			target->m_dirtyRows |= VPUConsoleRowBit(_gridRow);
+			target->m_dirtyMirror |= VPUConsoleRowBit(_gridRow);
 		}
-		// Next char position (2 words)
-		cx+=2;
+		else
+			target->m_dirtyRows |= VPUConsoleAllRows(_context);
+	}
+}
+
+/*
+ * Renders grid row _gridRow of the console at text row _textRow of the current CPU write page.
+ */
+static void VPUConsoleResolveRow(struct EVideoContext *_context, uint16_t _gridRow, uint16_t _textRow)
+{
+	uint8_t *characterBase = _context->m_characterBuffer + _gridRow*_context->m_consoleWidth;
+	uint8_t *colorBase = _context->m_colorBuffer + _gridRow*_context->m_consoleWidth;
+	uint32_t strideBytes = _context->m_strideInWords * sizeof(uint32_t);
+	uint8_t *rowBase = (uint8_t*)_context->m_cpuWriteAddressCacheAligned + _textRow*8*strideBytes;
+	const uint16_t W = _context->m_consoleWidth;
+
+	if (_context->m_cmode == ECM_16bit_RGB)
+	{
+		for (uint16_t cx=0; cx<W; ++cx)
+		{
+			uint8_t currentchar = characterBase[cx];
+			uint8_t currentcolor = colorBase[cx];
+			if (currentchar>=32)
+				VPUDrawGlyph16(rowBase + cx*16, strideBytes, currentchar, s_vgapalette565[currentcolor&0x0F], s_vgapalette565[(currentcolor>>4)&0x0F]);
+		}
+	}
+	else
+	{
+		for (uint16_t cx=0; cx<W; ++cx)
+		{
+			uint8_t currentchar = characterBase[cx];
+			uint8_t currentcolor = colorBase[cx];
+			if (currentchar>=32)
+				VPUDrawGlyph8(rowBase + cx*8, strideBytes, currentchar, currentcolor&0x0F, (currentcolor>>4)&0x0F);
+		}
+	}
+}
+
+/*
+ * Draws the caret over the character at column _x of text row _textRow of the current CPU write page.
+ */
+static void VPUConsoleDrawCaret(struct EVideoContext *_context, uint16_t _x, uint16_t _textRow)
+{
+	uint32_t strideBytes = _context->m_strideInWords * sizeof(uint32_t);
+	uint32_t pixelBytes = _context->m_cmode == ECM_16bit_RGB ? 2 : 1;
+	uint16_t FG = _context->m_cmode == ECM_16bit_RGB ? s_vgapalette565[CONSOLEDIMGREEN] : CONSOLEDIMGREEN;
+	// Last row of the character
+	uint8_t *caret = (uint8_t*)_context->m_cpuWriteAddressCacheAligned + (_textRow*8+7)*strideBytes + _x*8*pixelBytes;
+
+	// Regular cursor is 8 pixels wide, 2 pixels high, insert cursor shows differently and is taller
+	int width = _context->m_caretType == 0 ? 8 : 2;
+	int height = _context->m_caretType == 0 ? 2 : 8;
+	for (int y=0; y<height; ++y)
+	{
+		for (int x=0; x<width; ++x)
+		{
+			if (pixelBytes == 2)
+				((uint16_t*)caret)[x] = _context->m_caretType == 0 ? FG : ((uint16_t*)caret)[x] | FG;
+			else
+				caret[x] = _context->m_caretType == 0 ? (uint8_t)FG : caret[x] | (uint8_t)FG;
+		}
+		caret -= strideBytes;
 	}
 }
 
 /*
  * Resolves the console's character and color buffers into the current CPU write page,
- * rendering all visible characters with their respective colors.
+ * rendering the characters with their respective colors.
+ * Only rows that changed since the last resolve into the same write page are drawn again, along with
+ * the rows the caret moved from and to. Each of the last VPU_CONSOLE_TARGETS write pages keeps its own
+ * set of changed rows, any other write page is drawn in full.
+ * In a ring framebuffer (see VPUConsoleSetRing) scrolling only draws the row that scrolled in, and the
+ * scanout address is moved to the top row of the console.
  * Also handles the rendering of the blinking caret if it is set to be visible.
  */
 void VPUConsoleResolve(struct EVideoContext *_context)
 {
-	uint32_t *vramBase = (uint32_t*)_context->m_cpuWriteAddressCacheAligned;
-	uint8_t *characterBase = _context->m_characterBuffer;
-	uint8_t *colorBase = _context->m_colorBuffer;
-	uint32_t stride = _context->m_strideInWords;
 	const uint16_t H = _context->m_consoleHeight;
-	const uint16_t W = _context->m_consoleWidth;
+	const uint16_t top = _context->m_consoleTop;
 
-	for (uint16_t cy=0; cy<H; ++cy)
+	// Find what this write page already shows
+	struct EConsoleTarget *target = 0;
+	for (int i=0; i<VPU_CONSOLE_TARGETS; ++i)
 	{
-		for (uint16_t cx=0; cx<W; ++cx)
+		if (_context->m_consoleTargets[i].m_address == _context->m_cpuWriteAddressCacheAligned)
+			target = &_context->m_consoleTargets[i];
+	}
+	if (!target)
+	{
+		target = &_context->m_consoleTargets[_context->m_consoleTargetNext];
+		_context->m_consoleTargetNext = (_context->m_consoleTargetNext + 1) % VPU_CONSOLE_TARGETS;
+		target->m_address = _context->m_cpuWriteAddressCacheAligned;
+		target->m_dirtyRows = VPUConsoleAllRows(_context);
+		target->m_dirtyMirror = VPUConsoleAllRows(_context);
+		target->m_ringTop = top;
+		target->m_ringShownTop = top;
+		target->m_caretShown = 0;
+	}
+	int ring = _context->m_consoleRingAddress && target->m_address == _context->m_consoleRingAddress;
+
+	// A caret that moved, changed shape or blinked off leaves its old row behind to be redrawn
+	uint8_t caretShown = _context->m_caretBlink && _context->m_caretX < _context->m_consoleWidth && _context->m_caretY < H;
+	uint16_t caretRow = caretShown ? VPUConsoleGridRow(_context, _context->m_caretY) : 0;
+	if (target->m_caretShown != caretShown || (caretShown &&
+		(target->m_caretX != _context->m_caretX || target->m_caretRow != caretRow || target->m_caretType != _context->m_caretType)))
+	{
+		uint64_t rows = 0;
+		if (target->m_caretShown)
+			rows |= VPUConsoleRowBit(target->m_caretRow);
+		if (caretShown)
+			rows |= VPUConsoleRowBit(caretRow);
+		target->m_dirtyRows |= rows;
+		target->m_dirtyMirror |= rows;
+	}
+
+	if (!ring)
+	{
+		uint64_t rows = target->m_dirtyRows & VPUConsoleAllRows(_context);
+		for (uint16_t gy=0; gy<H && gy<64; ++gy)
+		{
+			if (rows & (1ull << gy))
+				VPUConsoleResolveRow(_context, gy, gy >= top ? gy - top : gy + H - top);
+		}
+
+		// Show caret if it's in the visible state, and its row was just drawn
+		if (caretShown && (rows & VPUConsoleRowBit(caretRow)))
+			VPUConsoleDrawCaret(_context, _context->m_caretX, _context->m_caretY);
+
+		target->m_dirtyRows = 0;
+		target->m_dirtyMirror = 0;
+	}
+	else
+	{
+		// Grid row gy is at text row gy and again at gy+H, the screen shows text rows top to top+H-1.
+		// A copy that is still on the screen but about to scroll off waits for a resolve after the vblank
+		// that applies the new scanout address. The counter only alternates, so a frame period since the
+		// address was set also counts as a vblank.
+		if (target->m_ringShownTop != target->m_ringTop &&
+			(VPUReadVBlankCounter(_context) != target->m_ringVBlank || SPGetTimeNs() - target->m_ringSetNs >= _context->m_framePeriodNs))
+			target->m_ringShownTop = target->m_ringTop;
+		const uint16_t shownTop = target->m_ringShownTop;
+		for (uint16_t gy=0; gy<H && gy<64; ++gy)
 		{
-			int currentchar = characterBase[cx+cy*W];
-			if (currentchar<32)
-				continue;
-
-			uint8_t currentcolor = colorBase[cx+cy*W];
-			uint32_t BG = (currentcolor>>4)&0x0F;
-			BG = (BG<<24) | (BG<<16) | (BG<<8) | BG;
-			uint32_t FG = currentcolor&0x0F;
-			FG = (FG<<24) | (FG<<16) | (FG<<8) | FG;
-
-			int charrow = (currentchar>>4)*8;
-			int charcol = (currentchar%16);
-			for (int y=0; y<8; ++y)
+			uint64_t bit = 1ull << gy;
+			if ((target->m_dirtyRows & bit) && (gy >= top || gy < shownTop))
 			{
-				int yoffset = (cy*8+y)*stride;
-				// Expand bit packed character row into individual pixels
-				uint8_t chardata = residentfont[charcol+((charrow+y)*16)];
-				// Output the 2 words (8 pixels) for this row
-				for (int x=0; x<2; ++x)
-				{
-					// X offset in words
-					int xoffset = cx*2 + x;
-					// Generate foreground / background output via masks
-					// Note that the nibbles of the font bytes are flipped for this to work
-					uint32_t mask = quadexpand[chardata&0x0F];
-					uint32_t invmask = ~mask;
-					uint32_t fourPixels = (mask & FG) | (invmask & BG);
-					// Output the combined 4-pixel value
-					vramBase[xoffset + yoffset] = fourPixels;
-					// Move to the next set of 4 pixels
-					chardata = chardata >> 4;
-				}
+				VPUConsoleResolveRow(_context, gy, gy);
+				if (caretShown && gy == caretRow)
+					VPUConsoleDrawCaret(_context, _context->m_caretX, gy);
+				target->m_dirtyRows &= ~bit;
+			}
+			if ((target->m_dirtyMirror & bit) && (gy < top || gy >= shownTop))
+			{
+				VPUConsoleResolveRow(_context, gy, gy + H);
+				if (caretShown && gy == caretRow)
+					VPUConsoleDrawCaret(_context, _context->m_caretX, gy + H);
+				target->m_dirtyMirror &= ~bit;
 			}
 		}
-	}
 
-	// Show caret if it's in the visible state
-	if (_context->m_caretBlink)
-	{
-		int cx = _context->m_caretX;
-		int cy = _context->m_caretY;
-		uint32_t yoffset = (cy*8+7)*stride; // Last row of the character
-		uint32_t xoffset = cx*2; // 2 words per character
-		uint32_t *caret = &vramBase[xoffset + yoffset];
-		uint32_t FG = CONSOLEDIMGREEN;
-
-        if (_context->m_caretType == 0)
-        {
-    		FG = (FG<<24) | (FG<<16) | (FG<<8) | FG;
-		    // Regular cursor is 8 pixels wide, 2 pixels high
-		    *caret = FG;
-		    *(caret+1) = FG;
-		    caret -= stride;
-		    *caret = FG;
-		    *(caret+1) = FG;
-        }
-        else
-        {
-            // Insert cursor shows differently and is taller
-            FG = (FG<<8) | FG;
-		    *caret |= FG;
-		    caret -= stride;
-		    *caret |= FG;
-		    caret -= stride;
-		    *caret |= FG;
-		    caret -= stride;
-		    *caret |= FG;
-		    caret -= stride;
-		    *caret |= FG;
-		    caret -= stride;
-		    *caret |= FG;
-		    caret -= stride;
-		    *caret |= FG;
-		    caret -= stride;
-		    *caret |= FG;
-        }
-    }
+		uint32_t textRowBytes = _context->m_strideInWords * sizeof(uint32_t) * 8;
+		VPUSetScanoutAddress(_context, _context->m_consoleRingScanout + top * textRowBytes);
+		if (top != target->m_ringTop)
+		{
+			// Read after the write, a vblank in between then only delays the mirror rows by a frame
+			target->m_ringVBlank = VPUReadVBlankCounter(_context);
+			target->m_ringSetNs = SPGetTimeNs();
+			target->m_ringTop = top;
+		}
+	}
 
+	target->m_caretShown = caretShown;
+	target->m_caretX = _context->m_caretX;
+	target->m_caretRow = caretRow;
+	target->m_caretType = _context->m_caretType;
 	_context->m_consoleUpdated = 0;
 }
 
+/*
+ * Forgets what the console drew so far, the next VPUConsoleResolve draws every row.
+ * Call this after drawing over the console framebuffer, or after writing to the character and color buffers directly.
+ */
+void VPUConsoleInvalidate(struct EVideoContext *_context)
+{
+	for (int i=0; i<VPU_CONSOLE_TARGETS; ++i)
+		_context->m_consoleTargets[i].m_address = 0;
+	_context->m_consoleTargetNext = 0;
+}
+
+/*
+ * Turns _framebuffer into a ring of console rows, which has to be twice as tall as the screen.
+ * Every row is kept twice, so that the screen is always a contiguous range of the framebuffer: scrolling
+ * moves the scanout address by one row of text, and only the row that scrolled in is drawn.
+ * The framebuffer becomes the CPU write page, and VPUConsoleResolve sets the scanout address from then on.
+ * Pass NULL to go back to a regular framebuffer.
+ * Returns 0 on success, -1 if the framebuffer is too small for the current video mode.
+ */
+int VPUConsoleSetRing(struct EVideoContext *_context, struct SPSizeAlloc *_framebuffer)
+{
+	VPUConsoleInvalidate(_context);
+	_context->m_consoleRingAddress = 0;
+	_context->m_consoleRingScanout = 0;
+	if (!_framebuffer)
+		return 0;
+
+	uint32_t textRowBytes = _context->m_strideInWords * sizeof(uint32_t) * 8;
+	if (_framebuffer->size < 2 * _context->m_consoleHeight * textRowBytes)
+		return -1;
+
+	_context->m_consoleRingAddress = (uint32_t)(uintptr_t)_framebuffer->cpuAddress;
+	_context->m_consoleRingScanout = (uint32_t)(uintptr_t)_framebuffer->dmaAddress;
+	VPUSetWriteAddress(_context, _context->m_consoleRingAddress);
+	return 0;
+}
+
 /*
  * Scrolls the console content up by one row.
- * This function moves all rows up by one, discarding the top row,
- * and clears the bottom row with spaces and the default background color.
+ * The top row is discarded and comes back as the bottom row, cleared with spaces and the default background color.
+ * The character and color buffers are a ring of rows, so nothing else has to move.
  */
 void VPUConsoleScrollUp(struct EVideoContext *_context)
 {
 	const uint16_t W = _context->m_consoleWidth;
 	const uint16_t H_1 = _context->m_consoleHeight - 1;
 
-	// We're trying to write past end of console; scroll up the contents of the console
 	// NOTE: This does not save the contents of the text buffer that has scrolled off
-	uint8_t* targettext = _context->m_characterBuffer;
-	uint8_t* targetcolor = _context->m_colorBuffer;
-	uint8_t* sourcetext = _context->m_characterBuffer + W;
-	uint8_t* sourcecolor = _context->m_colorBuffer + W;
-	uint8_t* lasttextrow = _context->m_characterBuffer + W*H_1;
-	uint8_t* lastcolorrow = _context->m_colorBuffer + W*H_1;
-	__builtin_memcpy((void*)targettext, (void*)sourcetext, W*H_1);
-	__builtin_memcpy((void*)targetcolor, (void*)sourcecolor, W*H_1);
+	uint16_t gridRow = VPUConsoleGridRow(_context, 0);
+	_context->m_consoleTop = VPUConsoleGridRow(_context, 1);
 	// Fill last row with spaces
-	__builtin_memset((void*)lasttextrow, 0x20, W);
+	__builtin_memset((void*)(_context->m_characterBuffer + VPUConsoleRowOffset(_context, H_1)), 0x20, W);
 	// Fill last row with default background
-	__builtin_memset((void*)lastcolorrow, (CONSOLEDEFAULTBG<<4) | (CONSOLEDEFAULTFG), W);
+	__builtin_memset((void*)(_context->m_colorBuffer + VPUConsoleRowOffset(_context, H_1)), (CONSOLEDEFAULTBG<<4) | (CONSOLEDEFAULTFG), W);
+	VPUConsoleMarkScroll(_context, gridRow);
 }
 
 /*
  * Scrolls the console content down by one row.
- * This function moves all rows down by one, discarding the bottom row,
- * and clears the top row with spaces and the default background color.
+ * The bottom row is discarded and comes back as the top row, cleared with spaces and the default background color.
  */
 void VPUConsoleScrollDown(struct EVideoContext *_context)
 {
 	const uint16_t W = _context->m_consoleWidth;
 	const uint16_t H_1 = _context->m_consoleHeight - 1;
-	// We're trying to write before start of console; scroll down the contents of the console
+
 	// NOTE: This does not save the contents of the text buffer that has scrolled off
-	uint8_t* targettext = _context->m_characterBuffer + W;
-	uint8_t* targetcolor = _context->m_colorBuffer + W;
-	uint8_t* sourcetext = _context->m_characterBuffer;
-	uint8_t* sourcecolor = _context->m_colorBuffer;
-	uint8_t* firsttextrow = _context->m_characterBuffer;
-	uint8_t* firstcolorrow = _context->m_colorBuffer;
-	__builtin_memcpy((void*)targettext, (void*)sourcetext, W*H_1);
-	__builtin_memcpy((void*)targetcolor, (void*)sourcecolor, W*H_1);
+	uint16_t gridRow = VPUConsoleGridRow(_context, H_1);
+	_context->m_consoleTop = gridRow;
 	// Fill first row with spaces
-	__builtin_memset((void*)firsttextrow, 0x20, W);
+	__builtin_memset((void*)(_context->m_characterBuffer + VPUConsoleRowOffset(_context, 0)), 0x20, W);
 	// Fill first row with default background
-	__builtin_memset((void*)firstcolorrow, (CONSOLEDEFAULTBG<<4) | (CONSOLEDEFAULTFG), W);
+	__builtin_memset((void*)(_context->m_colorBuffer + VPUConsoleRowOffset(_context, 0)), (CONSOLEDEFAULTBG<<4) | (CONSOLEDEFAULTFG), W);
+	VPUConsoleMarkScroll(_context, gridRow);
 }
 
 /*
@@ -653,6 +1241,7 @@ void VPUConsoleClear(struct EVideoContext *_context)
 	// Fill console with spaces
 	__builtin_memset(characterBase, 0x20, _context->m_consoleWidth*_context->m_consoleHeight);
 	__builtin_memset(colorBase, _context->m_consoleColor, _context->m_consoleWidth*_context->m_consoleHeight);
+	VPUConsoleMarkRows(_context, 0, _context->m_consoleHeight-1);
 	_context->m_consoleUpdated = 1;
 	_context->m_cursorX = 0;
 	_context->m_cursorY = 0;
@@ -670,7 +1259,6 @@ void VPUConsolePrintInPlace(struct EVideoContext *_context, const char *_message
 {
 	uint8_t *characterBase = _context->m_characterBuffer;
 	uint8_t *colorBase = _context->m_colorBuffer;
-	uint32_t stride = _context->m_consoleWidth;
 	int cx = _context->m_cursorX;
 	int cy = _context->m_cursorY;
 	const uint16_t W = _context->m_consoleWidth;
@@ -700,8 +1288,8 @@ void VPUConsolePrintInPlace(struct EVideoContext *_context, const char *_message
 		}
 		else
 		{
-			characterBase[cy*stride+cx] = currentchar;
-			colorBase[cy*stride+cx] = currentcolor;
+			characterBase[VPUConsoleRowOffset(_context, cy)+cx] = currentchar;
+			colorBase[VPUConsoleRowOffset(_context, cy)+cx] = currentcolor;
 			cx++;
 		}
 
@@ -717,6 +1305,7 @@ void VPUConsolePrintInPlace(struct EVideoContext *_context, const char *_message
 		++i;
 	}
 
+	VPUConsoleMarkRows(_context, _context->m_cursorY, cy);
 	_context->m_consoleUpdated = 1;
 }
 
@@ -731,12 +1320,12 @@ void VPUConsolePrint(struct EVideoContext *_context, const char *_message, int _
 {
 	uint8_t *characterBase = _context->m_characterBuffer;
 	uint8_t *colorBase = _context->m_colorBuffer;
-	uint32_t stride = _context->m_consoleWidth;
 	int cx = _context->m_cursorX;
 	int cy = _context->m_cursorY;
 	const uint16_t W = _context->m_consoleWidth;
 	const uint16_t H_1 = _context->m_consoleHeight - 1;
 	uint8_t currentcolor = _context->m_consoleColor;
+	int firstRow = cy;
 
 	int i=0;
 	int isNotTab = 1;
@@ -761,8 +1350,8 @@ void VPUConsolePrint(struct EVideoContext *_context, const char *_message, int _
 		}
 		else
 		{
-			characterBase[cy*stride+cx] = currentchar;
-			colorBase[cy*stride+cx] = currentcolor;
+			characterBase[VPUConsoleRowOffset(_context, cy)+cx] = currentchar;
+			colorBase[VPUConsoleRowOffset(_context, cy)+cx] = currentcolor;
 			cx++;
 		}
 
@@ -774,6 +1363,9 @@ void VPUConsolePrint(struct EVideoContext *_context, const char *_message, int _
 
 		if (cy > H_1)
 		{
+			// Rows are marked by their place in the ring, which scrolling does not change
+			VPUConsoleMarkRows(_context, firstRow, H_1);
+			firstRow = H_1;
 			VPUConsoleScrollUp(_context);
 			cy = H_1;
 			//UARTPrintf("\033[M");
@@ -781,6 +1373,7 @@ void VPUConsolePrint(struct EVideoContext *_context, const char *_message, int _
 
 		++i;
 	}
+	VPUConsoleMarkRows(_context, firstRow, cy);
 	_context->m_cursorX = cx;
 	_context->m_cursorY = cy;
 	_context->m_consoleUpdated = 1;
@@ -877,12 +1470,11 @@ void VPUConsoleHomeCursor(struct EVideoContext *_context)
 void VPUConsoleEndCursor(struct EVideoContext *_context)
 {
     uint8_t *characterBase = _context->m_characterBuffer;
-    uint32_t stride = _context->m_consoleWidth;
     const uint16_t W_1 = _context->m_consoleWidth - 1;
 
     for (uint16_t i=W_1; i!=0; i--)
     {
-        if (characterBase[_context->m_cursorY*stride+i] != ' ')
+        if (characterBase[VPUConsoleRowOffset(_context, _context->m_cursorY)+i] != ' ')
         {
             _context->m_cursorX = i+1;
             if (_context->m_cursorX > W_1)
@@ -902,12 +1494,11 @@ void VPUConsoleEndCursor(struct EVideoContext *_context)
 void VPUConsoleCopyLine(struct EVideoContext *_context, uint16_t _line, uint16_t _xStart, uint16_t _xEnd, char *_buffer)
 {
 	uint8_t *characterBase = _context->m_characterBuffer;
-	uint32_t stride = _context->m_consoleWidth;
 	uint16_t cy = _line == VPU_AUTO ? _context->m_cursorY : _line;
 
     int i = 0;
 	for (uint16_t cx=_xStart; cx<_xEnd; ++cx)
-		_buffer[i++] = characterBase[cy*stride+cx];
+		_buffer[i++] = characterBase[VPUConsoleRowOffset(_context, cy)+cx];
     _buffer[i] = 0;
 }
 
@@ -921,7 +1512,6 @@ int VPUConsoleFillLine(struct EVideoContext *_context, const char _character)
 {
 	uint8_t *characterBase = _context->m_characterBuffer;
 	uint8_t *colorBase = _context->m_colorBuffer;
-	uint32_t stride = _context->m_consoleWidth;
 	const uint16_t H_1 = _context->m_consoleHeight-1;
 	const uint16_t W = _context->m_consoleWidth;
 	uint8_t currentcolor = _context->m_consoleColor;
@@ -930,9 +1520,10 @@ int VPUConsoleFillLine(struct EVideoContext *_context, const char _character)
 	int numchars = W - _context->m_cursorX;
 	for (uint16_t cx=_context->m_cursorX; cx<W; ++cx)
 	{
-		characterBase[cy*stride+cx] = _character;
-		colorBase[cy*stride+cx] = currentcolor;
+		characterBase[VPUConsoleRowOffset(_context, cy)+cx] = _character;
+		colorBase[VPUConsoleRowOffset(_context, cy)+cx] = currentcolor;
 	}
+	VPUConsoleMarkRows(_context, cy, cy);
 	_context->m_cursorX = 0;
 	_context->m_cursorY++;
 
@@ -959,17 +1550,18 @@ void VPUInsertCharacter(struct EVideoContext *_context, uint16_t _x, uint16_t _y
 {
 	uint8_t *characterBase = _context->m_characterBuffer;
 	uint8_t *colorBase = _context->m_colorBuffer;
-	uint32_t stride = _context->m_consoleWidth;
+	uint32_t row = VPUConsoleRowOffset(_context, _y);
 	const uint16_t W_1 = _context->m_consoleWidth - 1;
 
 	for (uint16_t x=W_1; x!=_x; x--)
 	{
-	characterBase[_y*stride+x] = characterBase[_y*stride+x-1];
-	colorBase[_y*stride+x] = colorBase[_y*stride+x-1];
+	characterBase[row+x] = characterBase[row+x-1];
+	colorBase[row+x] = colorBase[row+x-1];
 	}
 
-	characterBase[_y*stride+_x] = _character;
-	colorBase[_y*stride+_x] = _context->m_consoleColor;
+	characterBase[row+_x] = _character;
+	colorBase[row+_x] = _context->m_consoleColor;
+	VPUConsoleMarkRows(_context, _y, _y);
 }
 
 /*
@@ -982,22 +1574,23 @@ void VPURemoveCharacter(struct EVideoContext *_context, uint16_t _x, uint16_t _y
 {
 	uint8_t *characterBase = _context->m_characterBuffer;
 	uint8_t *colorBase = _context->m_colorBuffer;
-	uint32_t stride = _context->m_consoleWidth;
+	uint32_t row = VPUConsoleRowOffset(_context, _y);
 	const uint16_t W = _context->m_consoleWidth;
 
 	for (uint16_t x=_x; x<W; x++)
 	{
 		if (x+1 < W)
 		{
-			characterBase[_y*stride+x] = characterBase[_y*stride+x+1];
-			colorBase[_y*stride+x] = colorBase[_y*stride+x+1];
+			characterBase[row+x] = characterBase[row+x+1];
+			colorBase[row+x] = colorBase[row+x+1];
 		}
 		else
 		{
-			characterBase[_y*stride+x] = ' ';
-			colorBase[_y*stride+x] = _context->m_consoleColor;
+			characterBase[row+x] = ' ';
+			colorBase[row+x] = _context->m_consoleColor;
 		}
 	}
+	VPUConsoleMarkRows(_context, _y, _y);
 }
 
 /*
@@ -1031,6 +1624,18 @@ void VPUConsoleSetCursor(struct EVideoContext *_context, uint16_t _x, uint16_t _
 void VPUInitVideo(struct EVideoContext* _context, struct  SPPlatform* _platform)
 {
 	_context->m_platform = _platform;
+	_context->m_waitMode = EWM_Sleep;
+	_context->m_vblankScanline = VPU_VBLANK_SCANLINE;
+	_context->m_framePeriodNs = VPU_DEFAULT_FRAME_PERIOD_NS;
+	_context->m_lastVBlankNs = 0;
+	__builtin_memset(&_context->m_waitStats, 0, sizeof(struct SPWaitStats));
+	__builtin_memset(&_context->m_shadowStats, 0, sizeof(struct SPShadowStats));
+
+	// Whatever ran before us left the registers in an unknown state
+	VPUInvalidateShadow(_context);
+	VPUBuildGlyphCache();
+	_context->m_consoleTop = 0;
+	VPUConsoleSetRing(_context, NULL);
 
 	_context->m_colorBuffer = (uint8_t*)malloc(640*480+128);
 	_context->m_characterBuffer = (uint8_t*)malloc(640*480+128);
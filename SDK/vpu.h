@@ -17,6 +17,13 @@
 
 #define VPU_AUTO 0xFFFF
 
+// Display timing used to predict the next vblank until it has been measured (640x480@60, 525 lines total)
+#define VPU_SCANLINE_COUNT			525
+#define VPU_VBLANK_SCANLINE			480
+#define VPU_DEFAULT_FRAME_PERIOD_NS	16683333ull
+// A scanout address written this close to the vblank may miss it and only latch at the one after
+#define VPU_LATCH_GUARD_LINES		4
+
 #define DEFAULT_VIDE_SCANOUT_START      0x18000000
 
 #define CONSOLEDIMGRAY 0x00
@@ -56,6 +63,7 @@ void VPUGetDimensions(const enum EVideoMode _mode, uint32_t *_width, uint32_t *_
 void VPUNoop(struct EVideoContext *_context);
 void VPUSetScanoutAddress(struct EVideoContext *_context, const uint32_t _scanOutAddress64ByteAligned);
 void VPUSetPal(struct EVideoContext *_context, const uint8_t _paletteIndex, const uint32_t _red, const uint32_t _green, const uint32_t _blue);
+uint32_t VPUSetPaletteRange(struct EVideoContext *_context, const uint32_t _start, const uint32_t _count, const uint32_t *_rgb24);
 void VPUSetVideoMode(struct EVideoContext *_context, const enum EVideoMode _mode, const enum EColorMode _cmode, const enum EVideoScanoutEnable _scanEnable);
 void VPUShiftCache(struct EVideoContext *_context, uint8_t _offset);
 void VPUShiftScanout(struct EVideoContext *_context, uint8_t _offset);
@@ -67,15 +75,25 @@ uint32_t VPUGetScanline(struct EVideoContext *_context);
 uint32_t VPUGetFIFONotEmpty(struct EVideoContext *_context);
 void VPUWriteControlRegister(struct EVideoContext *_context, uint8_t _setFlag, uint8_t _value);
 uint8_t VPUReadControlRegister(struct EVideoContext *_context);
+void VPUInvalidateShadow(struct EVideoContext *_context);
+void VPUGetShadowStats(struct EVideoContext *_context, struct SPShadowStats *_stats);
 
 void VPUClear(struct EVideoContext *_context, const uint32_t _colorWord);
 void VPUSetDefaultPalette(struct EVideoContext *_context);
 void VPUSetWriteAddress(struct EVideoContext *_context, const uint32_t _cpuWriteAddress64ByteAligned);
 void VPUSwapPages(struct EVideoContext* _context, struct EVideoSwapContext *_sc);
+void VPUPresentPage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, uint32_t _page, const struct SPSizeAlloc *_presented);
+void VPUBeginWritePage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, uint32_t _page, const struct SPSizeAlloc *_framebuffer, const struct SPSizeAlloc *_latest);
+void VPUAddDamage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, int _x, int _y, int _width, int _height);
+void VPUCopyDamage(struct EVideoContext *_context, struct EVideoSwapContext *_sc, const void *_source, uint32_t _sourceStride);
 void VPUWaitVSync(struct EVideoContext *_context);
+void VPUSetWaitMode(struct EVideoContext *_context, const enum ESPWaitMode _mode);
+void VPUGetWaitStats(struct EVideoContext *_context, struct SPWaitStats *_stats);
 void VPUPrintString(struct EVideoContext *_context, const uint8_t _foregroundIndex, const uint8_t _backgroundIndex, const uint16_t _x, const uint16_t _y, const char *_message, int _length);
 
 void VPUConsoleResolve(struct EVideoContext *_context);
+void VPUConsoleInvalidate(struct EVideoContext *_context);
+int VPUConsoleSetRing(struct EVideoContext *_context, struct SPSizeAlloc *_framebuffer);
 void VPUConsoleScrollUp(struct EVideoContext *_context);
 void VPUConsoleScrollDown(struct EVideoContext *_context);
 void VPUConsoleSetColors(struct EVideoContext *_context, const uint8_t _foregroundIndex, const uint8_t _backgroundIndex);
@@ -437,7 +437,8 @@ int main(int /*argc*/, char** /*argv*/)
 	uint32_t stride = VPUGetStride(VIDEO_MODE, VIDEO_COLOR);
 
 	// Grab memory address reserved for console framebuffer
-	frameBuffer.size = stride*VIDEO_HEIGHT;
+	// It holds the screen twice over, so the console can scroll through it as a ring of rows
+	frameBuffer.size = stride*VIDEO_HEIGHT*2;
 	SPGetConsoleFramebuffer(&s_platform, &frameBuffer);
 
 	// To handle key input
@@ -452,6 +453,7 @@ int main(int /*argc*/, char** /*argv*/)
 	VPUSetWriteAddress(&s_vctx, (uint32_t)frameBuffer.cpuAddress);
 	VPUSetScanoutAddress(&s_vctx, (uint32_t)frameBuffer.dmaAddress);
 	VPUSetVideoMode(&s_vctx, VIDEO_MODE, VIDEO_COLOR, EVS_Enable);
+	VPUConsoleSetRing(&s_vctx, &frameBuffer);
 
 	// Reset and start console
 	VPUConsoleSetColors(&s_vctx, CONSOLEDEFAULTFG, CONSOLEDEFAULTBG);
@@ -512,8 +514,9 @@ int main(int /*argc*/, char** /*argv*/)
 			VPUConsoleResolve(&s_vctx);
 
 		// Vsync is really not needed but nice to limit our pacing
+		// NOTE: No page swaps, the console resolve moves the scanout address as it scrolls
 		VPUWaitVSync(&s_vctx);
-		VPUSwapPages(&s_vctx, &s_sctx);
+		s_sctx.cycle++;
 	} while(1);
 
 	return 0;
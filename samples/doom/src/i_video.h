@@ -46,6 +46,10 @@ void I_SetPalette (byte* palette);
 void I_UpdateNoBlit (void);
 void I_FinishUpdate (void);
 
+// Mark part of screens[0] as changed,
+// only changed parts are copied by I_FinishUpdate
+void I_MarkRect (int x, int y, int width, int height);
+
 // Wait for vertical retrace or pause a bit.
 void I_WaitVBL(int count);
 
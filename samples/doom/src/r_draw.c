@@ -679,6 +679,9 @@ R_VideoErase
   //  a 32bit CPU, as GNU GCC/Linux libc did
   //  at one point.
     memcpy (screens[0]+ofs, screens[1]+ofs, count);
+    if (count > 0)
+        V_MarkRect (0, ofs/SCREENWIDTH, SCREENWIDTH,
+                    (ofs+count-1)/SCREENWIDTH - ofs/SCREENWIDTH + 1);
 }
 
 
@@ -260,7 +260,10 @@ void D_Display (void)
 
     // draw the view directly
     if (gamestate == GS_LEVEL && !automapactive && gametic)
+    {
         R_RenderPlayerView (&players[displayplayer]);
+        V_MarkRect (viewwindowx, viewwindowy, scaledviewwidth, viewheight);
+    }
 
     if (gamestate == GS_LEVEL && gametic)
         HU_Drawer ();
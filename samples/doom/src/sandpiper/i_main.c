@@ -27,9 +27,11 @@
 #include "platform.h"
 #include "vpu.h"
 #include "apu.h"
+#include "clock.h"
 
 // Platform context
 struct SPPlatform* s_platform = NULL;
+struct SPClock s_clock;
 
 // Video and audio buffers
 struct SPSizeAlloc frameBuffer;
@@ -43,6 +45,7 @@ int main(int argc, char *argv[])
 
 	// Initialize platform and subsystems
 	s_platform = SPInitPlatform();
+	SPClockInit(&s_clock, s_platform);
 
 	mixbufferB.size = mixbufferA.size = 512*2*2;
 	SPAllocateBuffer(s_platform, &mixbufferA);
@@ -38,6 +38,9 @@
 #include "i_system.h"
 
 #include "core.h"
+#include "clock.h"
+
+extern struct SPClock s_clock;
 
 void
 I_Init(void)
@@ -58,16 +61,7 @@ I_ZoneBase(int *size)
 int
 I_GetTime (void)
 {
-	uint64_t cur_time = (uint64_t) clock();
-	static int secbase;
-
-	if (!secbase) {
-		secbase = cur_time / 1000000;
-		return (uint64_t) secbase;
-	}
-
-	return ((cur_time/1000)*TICRATE)/1000;
-	//return (ClockToMs(E32ReadTime())*TICRATE)/1000;
+	return (int)((SPClockGetDisplayTimeNs(&s_clock) * TICRATE) / 1000000000ull);
 }
 
 static void
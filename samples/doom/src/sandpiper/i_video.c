@@ -29,13 +29,18 @@
 
 #include "platform.h"
 #include "vpu.h"
+#include "palette.h"
+#include "clock.h"
 
 extern struct SPPlatform* s_platform;
+extern struct SPClock s_clock;
 
 void
 I_InitGraphics(void)
 {
 	usegamma = 1;
+	// Nothing was copied to the framebuffer yet
+	I_MarkRect(0, 0, SCREENWIDTH, SCREENHEIGHT);
 }
 
 void
@@ -47,14 +52,10 @@ I_ShutdownGraphics(void)
 void
 I_SetPalette(byte* palette)
 {
-	// Copy palette to G-RAM
-	byte r, g, b;
-	for (int i=0 ; i<256 ; i++) {
-		r = gammatable[usegamma][*palette++];
-		g = gammatable[usegamma][*palette++];
-		b = gammatable[usegamma][*palette++];
-		VPUSetPal(s_platform->vx, i, r, g, b);
-	}
+	// Copy palette to G-RAM, entries that did not change are skipped
+	uint32_t colors[256];
+	SPPaletteFromRGB8(colors, palette, 256, gammatable[usegamma]);
+	VPUSetPaletteRange(s_platform->vx, 0, 256, colors);
 }
 
 
@@ -64,20 +65,18 @@ I_UpdateNoBlit(void)
 	// hmm....
 }
 
+void
+I_MarkRect(int x, int y, int width, int height)
+{
+	VPUAddDamage(s_platform->vx, s_platform->sc, x, y, width, height);
+}
+
 void
 I_FinishUpdate (void)
 {
-	// Copy screen to framebuffer
-	if (s_platform->sc->writepage != 0x0)
-	{
-		uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_8bit_Indexed);
-		for (uint32_t i=0;i<SCREENHEIGHT;++i)
-		{
-			uint32_t targetoffset = stride*i;
-			uint32_t sourceoffset = SCREENWIDTH*i;
-			memcpy(s_platform->sc->writepage + targetoffset, screens[0] + sourceoffset, SCREENWIDTH);
-		}
-	}
+	// Copy the parts of the screen that changed to the framebuffer
+	VPUCopyDamage(s_platform->vx, s_platform->sc, screens[0], SCREENWIDTH);
+	SPClockMarkFrame(&s_clock);
 }
 
 
@@ -29,6 +29,7 @@ rcsid[] = "$Id: v_video.c,v 1.5 1997/02/03 22:45:13 b1 Exp $";
 
 
 #include "i_system.h"
+#include "i_video.h"
 #include "r_local.h"
 
 #include "doomdef.h"
@@ -150,6 +151,7 @@ V_MarkRect
 {
     M_AddToBox (dirtybox, x, y);
     M_AddToBox (dirtybox, x+width-1, y+height-1);
+    I_MarkRect (x, y, width, height);
 }
 
 
@@ -9,6 +9,8 @@
 
 #include "platform.h"
 #include "vpu.h"
+#include "loader.h"
+#include "color.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,86 +43,82 @@ static struct pollfd fds[1];
 
 uint16_t *image;
 
+// Polls the keyboard for 10 ms, returns 1 if a key went down
+static int KeyPressed()
+{
+	int ret = poll(fds, 1, 10);
+	if (ret > 0)
+	{
+		struct input_event ev;
+		int n = read(fds[0].fd, &ev, sizeof(struct input_event));
+		if (n > 0 && ev.type == EV_KEY && ev.value == 1)
+			return 1;
+	}
+	return 0;
+}
+
 #define min(_x_,_y_) (_x_) < (_y_) ? (_x_) : (_y_)
 #define max(_x_,_y_) (_x_) > (_y_) ? (_x_) : (_y_)
 
-void DecodeJPEG(uint32_t stride, const char *fname)
+void DecodeJPEG(uint32_t stride, const struct SPSizeAlloc *rawjpeg)
 {
 	njInit();
 
-	FILE *fp = fopen(fname, "rb");
-	if (fp)
+	printf("Decoding image\n");
+	nj_result_t jres = njDecode(rawjpeg->cpuAddress, rawjpeg->size);
+
+	printf("Displaying\n");
+
+	if (jres == NJ_OK)
 	{
-		// Grab file size
-		fpos_t pos, endpos;
-		fgetpos(fp, &pos);
-		fseek(fp, 0, SEEK_END);
-		fgetpos(fp, &endpos);
-		fsetpos(fp, &pos);
-		uint32_t fsize = (uint32_t)endpos.__pos;
-
-		printf("Reading %ld bytes\n", (long int)fsize);
-		uint8_t *rawjpeg = (uint8_t *)malloc(fsize);
-		uint32_t readsize = fread(rawjpeg, fsize, 1, fp);
-		if (readsize != fsize)
-			printf("read length mismatch: %d read, %d bytes in file\n", readsize, fsize);
-		fclose(fp);
-
-		printf("Decoding image\n");
-		nj_result_t jres = njDecode(rawjpeg, fsize);
-
-		printf("Displaying\n");
-
-		if (jres == NJ_OK)
-		{
-			int W = njGetWidth();
-			int H = njGetHeight();
+		int W = njGetWidth();
+		int H = njGetHeight();
+
+		float wStep = float(W) / 640.f;
+		float hStep = float(H) / 480.f;
+		float maxStep = wStep > hStep ? wStep : hStep;
+		printf("image width:%d height:%d stepx:%f stepy:%f\n", W, H, wStep, hStep);
 
-			float wStep = float(W) / 640.f;
-			float hStep = float(H) / 480.f;
-			float maxStep = wStep > hStep ? wStep : hStep;
-			printf("image width:%d height:%d stepx:%f stepy:%f\n", W, H, wStep, hStep);
+		uint8_t *img = njGetImage();
+		if (njIsColor())
+		{
+			// Scale into a 24 bit image, then dither it to RGB565 in one go
+			int outW = min(VIDEO_WIDTH, int(float(W) / maxStep));
+			int outH = min(VIDEO_HEIGHT, int(float(H) / maxStep));
+			uint8_t *scaled = (uint8_t*)malloc(outW*outH*3);
 
-			uint8_t *img = njGetImage();
-			if (njIsColor())
+			float fy = 0.f;
+			for (int ry=0; ry<outH; ry++)
 			{
-				// Copy, dither and convert to indexed color
-				float fy = 0.f;
-				for (int ry=0; ry<480, fy<H; ry++)
+				int y = int(fy);
+				fy += maxStep;
+
+				float fx = 0.f;
+				for (int rx=0; rx<outW; rx++)
 				{
-					int y = int(fy);
-					fy += maxStep;
-
-					float fx = 0.f;
-					for (int rx=0; rx<640, fx<W; rx++)
-					{
-						int x = int(fx);
-						fx += maxStep;
-
-						uint32_t red = uint32_t(31.f*float(img[(x+y*W)*3+0])/255.f);
-						uint32_t green = uint32_t(63.f*float(img[(x+y*W)*3+1])/255.f);
-						uint32_t blue = uint32_t(31.f*float(img[(x+y*W)*3+2])/255.f);
-						image[rx+ry*stride] = MAKECOLORRGB16(red, green, blue);
-					}
+					int x = int(fx);
+					fx += maxStep;
+
+					memcpy(&scaled[(rx+ry*outW)*3], &img[(x+y*W)*3], 3);
 				}
 			}
-			else
+
+			SPConvertRGB888To565(image, stride*sizeof(uint16_t), scaled, outW*3, outW, outH, EDT_Diffusion);
+			free(scaled);
+		}
+		else
+		{
+			// Grayscale
+			for (int y=0,ry=0;y<H,ry<480;y+=hStep,ry++)
 			{
-				// Grayscale
-				for (int y=0,ry=0;y<H,ry<480;y+=hStep,ry++)
+				for (int x=0,rx=0;x<W,rx<640;x+=wStep,rx++)
 				{
-					for (int x=0,rx=0;x<W,rx<640;x+=wStep,rx++)
-					{
-						uint8_t V = img[x+y*W];
-						image[rx+ry*stride] = MAKECOLORRGB16(V,V,V);
-					}
+					uint8_t V = img[x+y*W];
+					image[rx+ry*stride] = MAKECOLORRGB16(V,V,V);
 				}
 			}
 		}
-		free(rawjpeg);
 	}
-	else
-		printf("Could not open file %s\n", fname);
 
 	njDone();
 }
@@ -144,40 +142,66 @@ int main(int argc, char** argv )
 
 	if (argc<=1)
 	{
-		printf("Usage: %s <image.jpg>\n", argv[0]);
+		printf("Usage: %s <image.jpg> [more images...]\n", argv[0]);
 		return 1;
 	}
+
+	// Open keyboard device (note: how do we know which one is the keyboard and which one is the mouse?)
+	fds[0].fd = open("/dev/input/event0", O_RDONLY | O_NONBLOCK);
+	fds[0].events = POLLIN;
+
+	if (fds[0].fd < 0)
+	{
+		perror("/dev/input/event0: make sure a keyboard is connected");
+		havekeyboard = 0;
+	}
 	else
+		printf("attached to /dev/input/event for keyboard access\n");
+
+	// Files are read straight into the reserved region, the next image loads in the background while the current one is on screen
+	struct SPLoader* loader = SPCreateLoader(s_platform, 2);
+	int tickets[2];
+	for (int i=0; i<2; ++i)
+		tickets[i] = i+1 < argc ? SPQueueLoad(loader, argv[i+1], ESM_Cached) : -1;
+
+	for (int i=1; i<argc; ++i)
 	{
-		// Open keyboard device (note: how do we know which one is the keyboard and which one is the mouse?)
-		fds[0].fd = open("/dev/input/event0", O_RDONLY | O_NONBLOCK);
-		fds[0].events = POLLIN;
+		int slot = (i-1)%2;
+		struct SPSizeAlloc rawjpeg;
+		int err = SPWaitLoad(loader, tickets[slot], &rawjpeg);
+		tickets[slot] = i+2 < argc ? SPQueueLoad(loader, argv[i+2], ESM_Cached) : -1;
 
-		if (fds[0].fd < 0)
+		if (err)
 		{
-			perror("/dev/input/event0: make sure a keyboard is connected");
-			havekeyboard = 0;
+			printf("Could not open file %s\n", argv[i]);
+			continue;
 		}
-		else
-			printf("attached to /dev/input/event for keyboard access\n");
 
-		DecodeJPEG(stride/sizeof(uint16_t), argv[1]);
+		printf("Read %d bytes from %s\n", rawjpeg.size, argv[i]);
+		memset(image, 0, stride*VIDEO_HEIGHT);
+		DecodeJPEG(stride/sizeof(uint16_t), &rawjpeg);
+		SPFreeBuffer(s_platform, &rawjpeg);
+
+		// Hold image while we view it, any key moves on to the next one, the last one is held below
+		if (i+1 == argc)
+			break;
+		if (!havekeyboard)
+			sleep(3);
+		while(havekeyboard && !KeyPressed())
+		{
+		}
 	}
 
+	struct SPLoadStats stats;
+	SPGetLoadStats(loader, &stats);
+	printf("Loaded %d file(s): %.2f MB/s, %.2f ms average time to first byte\n", stats.fileCount, stats.megabytesPerSecond, stats.averageFirstByteMs);
+	SPDestroyLoader(loader);
+
 	// Hold image while we view it
 	while(1)
 	{
-		if (havekeyboard)
-		{
-			int ret = poll(fds, 1, 10);
-			if (ret > 0)
-			{
-				struct input_event ev;
-				int n = read(fds[0].fd, &ev, sizeof(struct input_event));
-				if (n > 0 && ev.type == EV_KEY && ev.value == 1)
-					break;
-			}
-		}
+		if (havekeyboard && KeyPressed())
+			break;
 	}
 
 	return 0;
@@ -4,6 +4,7 @@
  *
  * \ingroup examples
  * This example demonstrates the use of the VPU frame buffers to render a Julia set.
+ * Tiles of each frame are rendered on all CPUs by the SDK job system.
  */
 
 #include <inttypes.h>
@@ -13,10 +14,12 @@
 #include <math.h>
 #include <cmath>
 #include <signal.h>
+#include <stdlib.h>
 
 #include "core.h"
 #include "platform.h"
 #include "vpu.h"
+#include "jobs.h"
 
 struct SPPlatform* s_platform = NULL;
 struct SPSizeAlloc framebufferA;
@@ -42,18 +45,21 @@ int x_c_i = 1;
 int y_c = (YCmin+YCmax)>>1;
 int y_c_i = 3;
 
-int tilex = 0;
-int tiley = 0;
+struct SFrameData
+{
+	uint8_t* pixels;
+	uint32_t stride;
+};
 
-void juliaTile(uint8_t* pixels, const uint32_t stride)
+void juliaTile(void* userData, uint32_t tilex, uint32_t tiley, uint32_t width, uint32_t height)
 {
-	for (int y = 0; y < 16; ++y)
+	SFrameData* frame = (SFrameData*)userData;
+	uint8_t* pixels = frame->pixels;
+	const uint32_t stride = frame->stride;
+	for (int row = tiley; row < (int)(tiley + height); ++row)
 	{
-		int row = y + tiley*16;
-		for (int x = 0; x < 16; ++x)
+		for (int col = tilex; col < (int)(tilex + width); ++col)
 		{
-			int col = x + tilex*16;
-
 			int x_f  = col-160;
 			int y_f  = row-120;
 			int clr=0;
@@ -77,7 +83,7 @@ void juliaTile(uint8_t* pixels, const uint32_t stride)
 	}
 }
 
-int main()
+int main(int argc, char** argv)
 {
 	// Initialize platform and video system
 	printf("starting platform code\n");
@@ -112,38 +118,56 @@ int main()
 
 	printf("Julia test\n");
 
-	while(1)
+	// One worker per CPU by default, run with 1 as the argument to compare against a single CPU
+	uint32_t workerCount = argc > 1 ? (uint32_t)atoi(argv[1]) : 0;
+	struct SPJobSystem* jobs = SPCreateJobSystem(s_platform, workerCount);
+	if (!jobs)
 	{
-		juliaTile(s_platform->sc->writepage, stride);
+		printf("Failed to create job system\n");
+		return -1;
+	}
+	printf("Rendering on %u workers\n", SPGetJobWorkerCount(jobs));
 
-		tilex++;
-		if (tilex == 20)
-		{
-			tilex = 0;
-			tiley++;
-		}
-		if (tiley == 15)
+	uint64_t frames = 0;
+	uint64_t start = SPGetTimeNs();
+	while(1)
+	{
+		// Render all 16x16 tiles of the frame across the CPUs
+		SFrameData frame;
+		frame.pixels = s_platform->sc->writepage;
+		frame.stride = stride;
+		struct SPJobCounter counter;
+		SPInitJobCounter(&counter);
+		SPRunTiles(jobs, juliaTile, &frame, 320, 240, 16, 16, &counter);
+		SPWaitJobs(jobs, &counter);
+
+		// Do some pre-swap stuff
+		x_c += x_c_i;
+		if (x_c < XCmin || x_c > XCmax) { x_c_i = - x_c_i; }
+		y_c += y_c_i;
+		if (y_c < YCmin || y_c > YCmax) { y_c_i = - y_c_i; }
+
+		// Ensure VPU fifo is empty
+		while(VPUGetFIFONotEmpty(s_platform->vx)) { }
+
+		// Swap buffers
+		VPUSwapPages(s_platform->vx, s_platform->sc);
+
+		// Add a buffer swap commmand to the VPU timeline
+		VPUSyncSwap(s_platform->vx, 0);
+
+		// Insert a no-operation command (barrier) that we can wait on
+		VPUNoop(s_platform->vx);
+
+		if (++frames % 64 == 0)
 		{
-			// Do some pre-swap stuff
-			tiley = 0;
-			x_c += x_c_i;
-			if (x_c < XCmin || x_c > XCmax) { x_c_i = - x_c_i; }
-			y_c += y_c_i;
-			if (y_c < YCmin || y_c > YCmax) { y_c_i = - y_c_i; }
-
-			// Ensure VPU fifo is empty
-			while(VPUGetFIFONotEmpty(s_platform->vx)) { }
-
-			// Swap buffers
-			VPUSwapPages(s_platform->vx, s_platform->sc);
-
-			// Add a buffer swap commmand to the VPU timeline
-			VPUSyncSwap(s_platform->vx, 0);
-
-			// Insert a no-operation command (barrier) that we can wait on
-			VPUNoop(s_platform->vx);
+			uint64_t now = SPGetTimeNs();
+			printf("%.2f ms per frame\n", (now - start) / (64 * 1000000.0));
+			start = now;
 		}
 	}
 
+	SPDestroyJobSystem(jobs);
+
 	return 0;
 }
@@ -4,9 +4,8 @@
  *
  * \ingroup examples
  * This example demonstrates the use of the VPU frame buffers to render a Mandelbrot set.
- * The render work is split across the two CPUs, where upon task completion, each CPU
- * pulls the next available tile to render.
- * It's a very simple task system, but should suffice to demontstrate basic thread usage.
+ * The render work is split into tiles and handed to the SDK job system, which runs one
+ * worker per CPU, where upon task completion, each CPU pulls the next available tile to render.
  */
 
 #include <inttypes.h>
@@ -16,38 +15,23 @@
 #include <math.h>
 #include <cmath>
 #include <signal.h>
-#include <pthread.h>
-#include <atomic>
+#include <stdlib.h>
 
 #include "core.h"
 #include "platform.h"
 #include "vpu.h"
+#include "jobs.h"
 
 const float X = -0.235125f;
 const float Y = 0.827215f;
 
-struct SThreadData
+struct SFrameData
 {
-	int tid;
-	int tilex;
-	int tiley;
+	uint16_t* pixels;
+	uint32_t stride;
 	float R;
-	std::atomic<bool> go;
-	struct SPPlatform* platform = nullptr;
-	struct SPSizeAlloc* framebuffer = nullptr;
 };
 
-void InitThreadData(SThreadData* data, struct SPPlatform* platform, struct SPSizeAlloc* framebuffer, int tid, float R, int tilex, int tiley)
-{
-	data->platform = platform;
-	data->framebuffer = framebuffer;
-	data->tid = tid;
-	data->tilex = tilex;
-	data->tiley = tiley;
-	data->R = R;
-	data->go.store(false);
-}
-
 float evalMandel(const int maxiter, int col, int row, float ox, float oy, float sx)
 {
 	float iteration = 0.f;
@@ -68,22 +52,18 @@ float evalMandel(const int maxiter, int col, int row, float ox, float oy, float
 	return iteration;
 }
 
-void mandelbrotFloat(uint32_t tid, uint32_t stride, uint16_t* frame, float ox, float oy, float sx, int tilex, int tiley)
+void mandelbrotFloat(uint32_t stride, uint16_t* frame, float ox, float oy, float sx, uint32_t tilex, uint32_t tiley, uint32_t width, uint32_t height)
 {
 	// http://blog.recursiveprocess.com/2014/04/05/mandelbrot-fractal-v2/
 	float ratio = 27.71f-5.156f*logf(sx);
 
-	for (int y = 0; y < 16; ++y)
+	for (uint32_t row = tiley; row < tiley + height; ++row)
 	{
-		int row = y + tiley*16;
-		for (int x = 0; x < 16; ++x)
+		for (uint32_t col = tilex; col < tilex + width; ++col)
 		{
-			int col = x + tilex*16;
-
 			float M = evalMandel(ratio, col, row, ox, oy, sx);
 			float local_ratio = M / ratio;
 			int c = int(local_ratio*31.f);
-			//c = tid == 0 ? c : c | 2; // DEBUG: watermark threads
 			frame[col + (row*stride>>1)] = MAKECOLORRGB16(c, c, c);
 		}
 	}
@@ -94,51 +74,16 @@ void mandelbrotFloat(uint32_t tid, uint32_t stride, uint16_t* frame, float ox, f
 	// if( di>0.5 ) d=0.0;
 }
 
-void* mandelbrot(void* arg)
-{
-	SThreadData* data = (SThreadData*)arg;
-
-	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_16bit_RGB);
-
-	while(1)
-	{
-		if (data->go.load() == true)
-		{
-			//printf(">%d\n", data->tid);
-			int tilex = data->tilex;
-			int tiley = data->tiley;
-			float R = data->R;
-			mandelbrotFloat(data->tid, stride, (uint16_t*)data->platform->sc->writepage, X, Y, R, tilex, tiley);
-			data->go.store(false);
-		}
-
-		sched_yield();
-	}
-
-	pthread_exit(NULL);
-}
-
-void PickNextTile(int* tilex, int* tiley, float* R)
+void mandelbrotTile(void* userData, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
-	(*tilex)++;
-	if (*tilex == 20)
-	{
-		*tilex = 0;
-		(*tiley)++;
-	}
-	if (*tiley == 15)
-	{
-		*tiley = 0;
-		// Zoom at last tile
-		*R += 0.0002f;
-	}
+	SFrameData* data = (SFrameData*)userData;
+	mandelbrotFloat(data->stride, data->pixels, X, Y, data->R, x, y, width, height);
 }
 
-int main()
+int main(int argc, char** argv)
 {
 	// Initialize platform and video system
-	SPPlatform* platform = new SPPlatform();
-	platform = SPInitPlatform();
+	SPPlatform* platform = SPInitPlatform();
 	if (!platform)
 	{
 		printf("Failed to initialize platform\n");
@@ -159,75 +104,43 @@ int main()
 	VPUSwapPages(platform->vx, platform->sc);
 	VPUClear(platform->vx, 0x00000000);
 
-	float R = 4.0E-6f + 0.01f;
-
-	SThreadData *threadData1;
-	SThreadData *threadData2;
-	pthread_t thread1;
-	pthread_t thread2;
-	pthread_attr_t attr1;
-	pthread_attr_t attr2;
-	cpu_set_t cpuset1;
-	cpu_set_t cpuset2;
-
-	threadData1 = new SThreadData();
-	threadData2 = new SThreadData();
-	InitThreadData(threadData1, platform, framebuffer, 0, R, 0, 0);
-	InitThreadData(threadData2, platform, framebuffer, 1, R, 0, 0);
-
-	CPU_ZERO(&cpuset1);
-	CPU_ZERO(&cpuset2);
-	CPU_SET(0, &cpuset1); // Only on CPU#0
-	CPU_SET(1, &cpuset2); // Only on CPU#1
-
-	pthread_attr_init(&attr1);
-	pthread_attr_setaffinity_np(&attr1, sizeof(cpu_set_t), &cpuset1);
-	pthread_attr_setdetachstate(&attr1, PTHREAD_CREATE_DETACHED);
-
-	pthread_attr_init(&attr2);
-	pthread_attr_setaffinity_np(&attr2, sizeof(cpu_set_t), &cpuset2);
-	pthread_attr_setdetachstate(&attr2, PTHREAD_CREATE_DETACHED);
-
-	// Create threads
-	int success = pthread_create(&thread1, &attr1, mandelbrot, (void*)threadData1);
-	if (success != 0) {
-		printf("Failed to create thread 1\n");
+	// One worker per CPU by default, run with 1 as the argument to compare against a single CPU
+	uint32_t workerCount = argc > 1 ? (uint32_t)atoi(argv[1]) : 0;
+	SPJobSystem* jobs = SPCreateJobSystem(platform, workerCount);
+	if (!jobs)
+	{
+		printf("Failed to create job system\n");
 		return -1;
 	}
+	printf("Rendering on %u workers\n", SPGetJobWorkerCount(jobs));
 
-	success = pthread_create(&thread2, &attr2, mandelbrot, (void*)threadData2);
-	if (success != 0) {
-		printf("Failed to create thread 2\n");
-		return -1;
-	}
+	SFrameData data;
+	data.pixels = (uint16_t*)platform->sc->writepage;
+	data.stride = stride;
+	data.R = 4.0E-6f + 0.01f;
 
-	int tilex = 0;
-	int tiley = 0;
+	uint64_t frames = 0;
+	uint64_t start = SPGetTimeNs();
 	while(1)
 	{
-		if (threadData1->go.load() == false)
-		{
-			PickNextTile(&tilex, &tiley, &R);
-			threadData1->tilex = tilex;
-			threadData1->tiley = tiley;
-			threadData1->R = R;
-			threadData1->go.store(true);
-		}
+		// Each CPU pulls the next 16x16 tile to render when it's done with the previous one
+		SPJobCounter counter;
+		SPInitJobCounter(&counter);
+		SPRunTiles(jobs, mandelbrotTile, &data, 320, 240, 16, 16, &counter);
+		SPWaitJobs(jobs, &counter);
 
-		if (threadData2->go.load() == false)
+		// Zoom at last tile
+		data.R += 0.0002f;
+
+		if (++frames % 32 == 0)
 		{
-			PickNextTile(&tilex, &tiley, &R);
-			threadData2->tilex = tilex;
-			threadData2->tiley = tiley;
-			threadData2->R = R;
-			threadData2->go.store(true);
+			uint64_t now = SPGetTimeNs();
+			printf("%.2f ms per frame\n", (now - start) / (32 * 1000000.0));
+			start = now;
 		}
-
-		sched_yield();
 	}
 
-	//pthread_attr_destroy(&attr1);
-	//pthread_attr_destroy(&attr2);
+	SPDestroyJobSystem(jobs);
 
 	return 0;
 }
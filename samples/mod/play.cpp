@@ -22,6 +22,7 @@
 #include "platform.h"
 #include "apu.h"
 #include "vpu.h"
+#include "kernels.h"
 
 #include "xmp.h"
 
@@ -148,8 +149,7 @@ void *draw_wave(void *data)
 			}
 		}
 
-		for (uint32_t i=0;i<320*240;++i)
-			s_platform->sc->writepage[i] = std::max(0, s_platform->sc->writepage[i]>>1);
+		SPFadeRect8(s_platform->sc->writepage, stride, 320, 240, 1);
 
 		// Let VPU handle the vsync and scanout swap
 		VPUSyncSwap(s_platform->vx, 0);
@@ -238,8 +238,9 @@ int main(int argc, char *argv[])
 	{
 		uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_8bit_Indexed);
 		bufferB.size = bufferA.size = stride*240;
-		SPAllocateBuffer(s_platform, &bufferA);
-		SPAllocateBuffer(s_platform, &bufferB);
+		// Cached, as the fade pass reads every pixel back (VPUSyncSwap flushes the page before it is shown)
+		SPAllocateMappedBuffer(s_platform, &bufferA, SPALIGN_SCANOUT, ESM_Cached);
+		SPAllocateMappedBuffer(s_platform, &bufferB, SPALIGN_SCANOUT, ESM_Cached);
 
 		VPUSetVideoMode(s_platform->vx, EVM_320_Wide, ECM_8bit_Indexed, EVS_Enable);
 
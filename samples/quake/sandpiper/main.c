@@ -26,6 +26,9 @@
 #include <linux/input.h>
 
 #include "core.h"
+#include "clock.h"
+
+extern struct SPClock s_clock;
 
 enum {
 	MOUSE_BUTTON_LEFT = 1,
@@ -106,19 +109,10 @@ static int inited = 0;
 
 uint64_t qembd_get_time()
 {
-	struct timeval tp;
-	struct timezone tzp;
-	static int secbase = 0;
-
-	gettimeofday(&tp, &tzp);
-
-	if (secbase == 0)
-	{
-		secbase = tp.tv_sec;
-		return (uint64_t)tp.tv_usec;
-	}
-
-	return ((tp.tv_sec - secbase) / 1000000) + tp.tv_usec;
+	// Microseconds on the display timeline, so frame times step in whole vblanks
+	if (!s_clock.m_platform)
+		return 0;
+	return SPClockGetDisplayTimeNs(&s_clock) / 1000;
 }
 
 /*void qembd_udelay(uint32_t us)
@@ -7,12 +7,14 @@
 #include "platform.h"
 #include "vpu.h"
 #include "apu.h"
+#include "clock.h"
 
 #define	DISPLAY_WIDTH 320
 #define	DISPLAY_HEIGHT 240
 //((DISPLAY_WIDTH * 9 + 8) / 16)
 
 struct SPPlatform* s_platform;
+struct SPClock s_clock;
 struct SPSizeAlloc framebuffer;
 
 int qembd_get_width()
@@ -29,6 +31,7 @@ void qembd_platform_init()
 {
 	// Initialize platform and video system
 	s_platform = SPInitPlatform();
+	SPClockInit(&s_clock, s_platform);
 }
 
 void qembd_sndinit()
@@ -51,20 +54,21 @@ void qembd_vidinit()
 	VPUSwapPages(s_platform->vx, s_platform->sc);
 }
 
+// Screen image the rectangles of this frame are copied from
+static uint8_t* s_rectSource = NULL;
+
 void qembd_fillrect(uint8_t *src, uint16_t x, uint16_t y, uint16_t xsize, uint16_t ysize)
 {
-	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_8bit_Indexed);
-	uint8_t* pixels = (uint8_t*)s_platform->sc->writepage;
-
-	for (int py = 0; py < ysize; py++) {
-		int offset = (y + py) * DISPLAY_WIDTH + x;
-		int poffset = (y + py) * stride + x;
-		for (int px = 0; px < xsize; px++)
-			pixels[poffset + px] = src[offset + px];
-	}
+	// Overlapping rectangles are merged and copied once, by qembd_refresh
+	s_rectSource = src;
+	VPUAddDamage(s_platform->vx, s_platform->sc, x, y, xsize, ysize);
 }
 
 void qembd_refresh()
 {
-	// Not sure what else this is supposed to be doing, swap buffers?
+	if (s_rectSource)
+		VPUCopyDamage(s_platform->vx, s_platform->sc, s_rectSource, DISPLAY_WIDTH);
+
+	// Not double buffered, only keep track of frame pacing
+	SPClockMarkFrame(&s_clock);
 }
@@ -31,14 +31,10 @@ unsigned d_8to24table[256];
 
 void VID_SetPalette(unsigned char *palette)
 {
-	// Copy palette to G-RAM
-	byte r, g, b;
-	for (int i=0 ; i<256 ; i++) {
-		r = *palette++;
-		g = *palette++;
-		b = *palette++;
-		VPUSetPal(s_platform->vx, i, r, g, b);
-	}
+	// Copy palette to G-RAM, entries that did not change are skipped
+	uint32_t colors[256];
+	SPPaletteFromRGB8(colors, palette, 256, NULL);
+	VPUSetPaletteRange(s_platform->vx, 0, 256, colors);
 }
 
 void VID_Init(unsigned char *palette)
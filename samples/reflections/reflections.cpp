@@ -235,11 +235,12 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	// Grab video buffer
+	// Grab video buffers, cached since the renderer reads back what it has drawn
+	// NOTE: VPUSwapPages flushes each page before it is scanned out
 	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_16bit_RGB);
 	framebufferA.size = framebufferB.size = stride*240;
-	SPAllocateBuffer(s_platform, &framebufferA);
-	SPAllocateBuffer(s_platform, &framebufferB);
+	SPAllocateMappedBuffer(s_platform, &framebufferA, SPALIGN_SCANOUT, ESM_Cached);
+	SPAllocateMappedBuffer(s_platform, &framebufferB, SPALIGN_SCANOUT, ESM_Cached);
 
 	// Set up the video mode and frame pointers
 	VPUSetVideoMode(s_platform->vx, EVM_320_Wide, ECM_16bit_RGB, EVS_Enable);
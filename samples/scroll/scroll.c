@@ -43,6 +43,9 @@ int main(int argc, char** argv)
 	int totalscroll = 0;
 	int direction = 1;
 	int A = 64;
+	uint32_t frame = 0;
+	struct SPShadowStats first;
+	VPUGetShadowStats(s_platform->vx, &first);
 
 	for (int y = 0; y < VIDEO_HEIGHT; y++)
 	{
@@ -69,6 +72,15 @@ int main(int argc, char** argv)
 		VPUShiftPixel(s_platform->vx, pixeloffset);
 
 		VPUWaitVSync(s_platform->vx);
+
+		// The byte offset only changes every 16 frames, the setters skip the writes in between
+		if (++frame % 600 == 0)
+		{
+			struct SPShadowStats stats;
+			VPUGetShadowStats(s_platform->vx, &stats);
+			printf("register writes per frame: %.2f sent, %.2f elided\n",
+				(stats.writes - first.writes) / (float)frame, (stats.elided - first.elided) / (float)frame);
+		}
 	} while(1);
 
 	return 0;
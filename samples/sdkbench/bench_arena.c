@@ -0,0 +1,158 @@
+/**
+ * \file bench_arena.c
+ * \brief Per-frame arenas against the reserved region heap
+ *
+ * Makes the same set of short lived allocations every frame, once from the heap with a free at the
+ * end of the frame, and once from frame arenas that VPUSwapPages recycles. Also checks that arena
+ * memory is only handed out again after its frame left the screen, and that repeated VCP program
+ * uploads no longer grow the heap.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "vcp.h"
+#include "arena.h"
+#include "clock.h"
+#include "sdkbench.h"
+
+#define ARENA_FRAMES			120
+#define ARENA_ALLOCS_PER_FRAME	32
+#define ARENA_FRAME_BYTES		(128*1024)
+#define ARENA_COUNT				3
+#define ARENA_VIDEO_MODE		EVM_320_Wide
+#define ARENA_VIDEO_COLOR		ECM_8bit_Indexed
+#define ARENA_VIDEO_HEIGHT		240
+
+// Sizes between 64 bytes and 4KB, like staging for palette tables, VCP programs and audio blocks
+static uint32_t AllocSize(uint32_t _n)
+{
+	return 64u << (_n % 7);
+}
+
+static uint64_t HeapFrames(struct SPPlatform* _platform)
+{
+	struct SPSizeAlloc allocs[ARENA_ALLOCS_PER_FRAME];
+	uint64_t total = 0;
+
+	for (uint32_t frame = 0; frame < ARENA_FRAMES; ++frame)
+	{
+		uint64_t start = BenchNow();
+		for (uint32_t i = 0; i < ARENA_ALLOCS_PER_FRAME; ++i)
+		{
+			allocs[i].size = AllocSize(frame + i);
+			SPAllocateBuffer(_platform, &allocs[i]);
+		}
+		for (uint32_t i = 0; i < ARENA_ALLOCS_PER_FRAME; ++i)
+			SPFreeBuffer(_platform, &allocs[i]);
+		total += BenchNow() - start;
+	}
+
+	return total;
+}
+
+static uint64_t ArenaFrames(struct SPPlatform* _platform, struct EVideoSwapContext* _sc, uint32_t* _reused)
+{
+	uint64_t total = 0;
+	uint64_t swapVBlank[ARENA_FRAMES];
+	struct SPClock clock;
+	SPClockInit(&clock, _platform);
+
+	*_reused = 0;
+	for (uint32_t frame = 0; frame < ARENA_FRAMES; ++frame)
+	{
+		uint64_t start = BenchNow();
+		for (uint32_t i = 0; i < ARENA_ALLOCS_PER_FRAME; ++i)
+		{
+			struct SPSizeAlloc alloc;
+			alloc.size = AllocSize(frame + i);
+			SPFrameAlloc(_sc, &alloc, SPALIGN_DEFAULT);
+		}
+		total += BenchNow() - start;
+
+		// This frame records into the arena of frame - ARENA_COUNT, which was taken off the screen by
+		// the swap after it, and a vblank has to have gone by since that swap
+		if (frame >= ARENA_COUNT && SPClockGetVBlankCount(&clock) <= swapVBlank[frame - ARENA_COUNT + 1])
+			++*_reused;
+
+		// The new scanout address takes effect at the next vblank, which may come while the swap waits
+		swapVBlank[frame] = SPClockGetVBlankCount(&clock);
+		VPUSwapPages(_platform->vx, _sc);
+	}
+
+	return total;
+}
+
+int BenchArena(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	int failed = 0;
+	struct SPHeapStats before, after;
+
+	uint32_t stride = VPUGetStride(ARENA_VIDEO_MODE, ARENA_VIDEO_COLOR);
+	struct SPSizeAlloc frameBufferA, frameBufferB;
+	frameBufferA.size = frameBufferB.size = stride * ARENA_VIDEO_HEIGHT;
+	if (SPAllocateBuffer(_platform, &frameBufferA) != 0 || SPAllocateBuffer(_platform, &frameBufferB) != 0)
+	{
+		printf("can't allocate frame buffers\n");
+		return -1;
+	}
+	VPUSetVideoMode(_platform->vx, ARENA_VIDEO_MODE, ARENA_VIDEO_COLOR, EVS_Enable);
+
+	struct EVideoSwapContext sc;
+	memset(&sc, 0, sizeof(sc));
+	sc.framebufferA = &frameBufferA;
+	sc.framebufferB = &frameBufferB;
+
+	uint64_t heapNs = HeapFrames(_platform);
+
+	SPGetMemoryStats(_platform, &before);
+	if (SPCreateFrameArenas(_platform, &sc, ARENA_COUNT, ARENA_FRAME_BYTES, ESM_Uncached) != 0)
+	{
+		printf("can't create frame arenas\n");
+		SPFreeBuffer(_platform, &frameBufferB);
+		SPFreeBuffer(_platform, &frameBufferA);
+		return -1;
+	}
+	uint32_t reused = 0;
+	uint64_t arenaNs = ArenaFrames(_platform, &sc, &reused);
+
+	struct SPFrameArenaStats stats;
+	SPGetFrameArenaStats(&sc, &stats);
+	SPDestroyFrameArenas(_platform, &sc);
+	SPGetMemoryStats(_platform, &after);
+
+	const uint32_t allocs = ARENA_FRAMES * ARENA_ALLOCS_PER_FRAME;
+	printf("heap alloc+free   : %8.1f ns per allocation\n", heapNs / (double)allocs);
+	printf("frame arena alloc : %8.1f ns per allocation (%u failed, %u bytes peak per frame)\n",
+		arenaNs / (double)allocs, stats.failedCount, stats.peakUsedBytes);
+	printf("arena reuse       : %u swaps waited %.1f ms in total for a vblank, %u reused too early\n",
+		stats.waitCount, stats.waitNs / 1000000.0, reused);
+	if (reused || stats.failedCount || after.usedBytes != before.usedBytes)
+	{
+		printf("frame arenas: FAILED\n");
+		failed = 1;
+	}
+
+	// Uploads used to leave their staging buffer behind every time
+	static const uint32_t program[32] = { VCP_NOOP };
+	VCPUploadProgram(_platform, program, PRG_128Bytes);
+	SPGetMemoryStats(_platform, &before);
+	for (uint32_t i = 0; i < 100; ++i)
+		VCPUploadProgram(_platform, program, PRG_128Bytes);
+	SPGetMemoryStats(_platform, &after);
+	printf("vcp uploads       : %s (%d bytes of heap growth over 100 uploads)\n",
+		after.usedBytes == before.usedBytes ? "ok" : "FAILED", (int)(after.usedBytes - before.usedBytes));
+	failed |= after.usedBytes != before.usedBytes;
+
+	SPFreeBuffer(_platform, &frameBufferB);
+	SPFreeBuffer(_platform, &frameBufferA);
+
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,198 @@
+/**
+ * \file bench_batch.c
+ * \brief Batched register submission
+ *
+ * Compares a full 256 entry palette load issued one write at a time against
+ * the same load recorded into a batch, and uploaded with VPUSetPaletteRange,
+ * which also skips entries that did not change. A damage flash that fades
+ * the palette towards red a step at a time is timed the same way.
+ * Verifies with the loopback backend that batching never changes the order
+ * in which writes reach the devices.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "apu.h"
+#include "vcp.h"
+#include "palette.h"
+#include "sdkbench.h"
+
+#define PALETTE_ITERATIONS 200
+
+static void LoadPalette(struct SPPlatform* _platform, uint32_t _seed)
+{
+	for (uint32_t i = 0; i < 256; ++i)
+		VPUSetPal(_platform->vx, i, i + _seed, i ^ _seed, 255 - i);
+}
+
+static uint64_t MeasurePalette(struct SPPlatform* _platform, int _batched)
+{
+	uint64_t start = BenchNow();
+	for (uint32_t n = 0; n < PALETTE_ITERATIONS; ++n)
+	{
+		if (_batched)
+			SPBeginBatch(_platform);
+		LoadPalette(_platform, n);
+		if (_batched)
+			SPSubmit(_platform);
+	}
+	return (BenchNow() - start) / PALETTE_ITERATIONS;
+}
+
+static void BuildPalette(uint32_t* _colors, uint32_t _seed)
+{
+	for (uint32_t i = 0; i < 256; ++i)
+		_colors[i] = MAKECOLORRGB24((i + _seed), (i ^ _seed), (255 - i));
+}
+
+// Every iteration uploads a different palette, or the same one again if _same is set
+static uint64_t MeasurePaletteRange(struct SPPlatform* _platform, int _same, uint32_t* _writes)
+{
+	uint32_t colors[256];
+	BuildPalette(colors, 0);
+	VPUSetPaletteRange(_platform->vx, 0, 256, colors);
+	uint32_t writes = _platform->batch.stats.writes;
+	uint64_t start = BenchNow();
+	for (uint32_t n = 0; n < PALETTE_ITERATIONS; ++n)
+	{
+		if (!_same)
+			BuildPalette(colors, n + 1);
+		VPUSetPaletteRange(_platform->vx, 0, 256, colors);
+	}
+	uint64_t ns = BenchNow() - start;
+	*_writes = (_platform->batch.stats.writes - writes) / PALETTE_ITERATIONS;
+	return ns / PALETTE_ITERATIONS;
+}
+
+// Doom's damage palettes, eight steps towards red and back, each one computed and uploaded
+static uint64_t MeasureFlash(struct SPPlatform* _platform, int _ranged)
+{
+	uint32_t base[256], colors[256];
+	BuildPalette(base, 0);
+	uint64_t start = BenchNow();
+	for (uint32_t n = 0; n < PALETTE_ITERATIONS; ++n)
+	{
+		uint32_t step = n % 16 < 8 ? n % 16 : 15 - n % 16;
+		SPPaletteFade(colors, base, 256, 0xFF0000, step * 28);
+		if (_ranged)
+			VPUSetPaletteRange(_platform->vx, 0, 256, colors);
+		else
+		{
+			SPBeginBatch(_platform);
+			for (uint32_t i = 0; i < 256; ++i)
+				VPUSetPal(_platform->vx, i, (colors[i] >> 16) & 0xFF, (colors[i] >> 8) & 0xFF, colors[i] & 0xFF);
+			SPSubmit(_platform);
+		}
+	}
+	return (BenchNow() - start) / PALETTE_ITERATIONS;
+}
+
+int BenchBatch(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	uint64_t single = MeasurePalette(_platform, 0);
+	struct SPBatchStats before = _platform->batch.stats;
+	uint64_t batched = MeasurePalette(_platform, 1);
+	struct SPBatchStats after = _platform->batch.stats;
+
+	printf("palette load, single writes: %8.1f us\n", single / 1000.0);
+	printf("palette load, batched      : %8.1f us (%u syscalls per load)\n", batched / 1000.0,
+		(after.syscalls - before.syscalls) / PALETTE_ITERATIONS);
+
+	uint32_t rangeWrites, sameWrites;
+	uint64_t range = MeasurePaletteRange(_platform, 0, &rangeWrites);
+	uint64_t same = MeasurePaletteRange(_platform, 1, &sameWrites);
+	printf("palette load, range        : %8.1f us (%u writes per load)\n", range / 1000.0, rangeWrites);
+	printf("same palette again, range  : %8.1f us (%u writes per load)\n", same / 1000.0, sameWrites);
+
+	uint64_t flashBatched = MeasureFlash(_platform, 0);
+	uint64_t flashRange = MeasureFlash(_platform, 1);
+	printf("damage flash, batched      : %8.1f us per step\n", flashBatched / 1000.0);
+	printf("damage flash, range        : %8.1f us per step\n", flashRange / 1000.0);
+
+	// Only the entries that changed are written, and VPUSetPal keeps the shadow up to date
+	uint32_t colors[256];
+	BuildPalette(colors, 7);
+	VPUSetPaletteRange(_platform->vx, 0, 256, colors);
+	colors[3] ^= 1;
+	colors[200] ^= 0x100;
+	VPUSetPal(_platform->vx, 17, 1, 2, 3);
+	uint32_t written = VPUSetPaletteRange(_platform->vx, 0, 256, colors);
+	int failed = written != 3;
+	printf("changed entries written    : %u of 3 %s\n", written, failed ? "FAILED" : "ok");
+
+	VPUSetDefaultPalette(_platform->vx);
+	return failed ? -1 : 0;
+}
+
+int BenchLoopback(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)_platform;
+	(void)argc;
+	(void)argv;
+	// A device-less platform, every write ends up in the loopback log
+	struct SPPlatform platform;
+	memset(&platform, 0, sizeof(platform));
+	platform.backend = SPGetDeviceBackend();
+	platform.sandpiperfd = -1;
+	platform.mapped_memory = (uint8_t*)MAP_FAILED;
+	platform.writecombined_memory = (uint8_t*)MAP_FAILED;
+	platform.cached_memory = (uint8_t*)MAP_FAILED;
+	struct EVideoContext vx;
+	memset(&vx, 0, sizeof(vx));
+	vx.m_platform = &platform;
+	struct EAudioContext ac;
+	memset(&ac, 0, sizeof(ac));
+	ac.m_platform = &platform;
+
+	SPSetBatchBackend(&platform, EBB_Loopback);
+
+	// Unbatched, batched, nested and interleaved writes across all four devices
+	VPUNoop(&vx);
+	SPBeginBatch(&platform);
+	VPUSetPal(&vx, 1, 0x11, 0x22, 0x33);
+	APUStartDMA(&ac, 0x18100000);
+	SPBeginBatch(&platform);
+	VPUSetScanoutAddress(&vx, 0x18200000);
+	SPSubmit(&platform);
+	VCPExecProgram(&platform, 1);
+	SPPush(&platform, ESD_Palette, 2, 0x445566);
+	SPSubmit(&platform);
+	APUSync(&ac);
+
+	const struct SPBatchEntry expected[] = {
+		{ ESD_Video, 0, VPUCMD_NOOP },
+		{ ESD_Palette, 1, MAKECOLORRGB24(0x11, 0x22, 0x33) },
+		{ ESD_Audio, 0, 1 },
+		{ ESD_Audio, 0, 0x18100000 },
+		{ ESD_Video, 0, VPUCMD_SETVPAGE },
+		{ ESD_Video, 0, 0x18200000 },
+		{ ESD_VCP, 0, 0x12 },
+		{ ESD_Palette, 2, 0x445566 },
+		{ ESD_Audio, 0, 2 },
+	};
+	const uint32_t expectedCount = sizeof(expected) / sizeof(expected[0]);
+
+	uint32_t count = 0;
+	const struct SPBatchEntry* log = SPGetLoopbackLog(&platform, &count);
+
+	int failed = count != expectedCount;
+	for (uint32_t i = 0; i < count && i < expectedCount; ++i)
+	{
+		int match = log[i].device == expected[i].device && log[i].offset == expected[i].offset && log[i].value == expected[i].value;
+		printf("%2u: dev %u off %3u val %08X %s\n", i, log[i].device, log[i].offset, log[i].value, match ? "" : "<- mismatch");
+		failed |= !match;
+	}
+
+	printf("loopback ordering: %s (%u writes, %u submits)\n", failed ? "FAILED" : "ok", count, platform.batch.stats.submits);
+
+	SPShutdownPlatform(&platform);
+	return failed ? -1 : 0;
+}
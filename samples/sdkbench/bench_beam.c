@@ -0,0 +1,134 @@
+/**
+ * \file bench_beam.c
+ * \brief Beam racing into a single framebuffer
+ *
+ * Races the beam at 320x240 with 8 bands, first with bands that are quick to draw and then with bands
+ * that take longer than the beam needs to scan them. Reports late bands, skipped frames and the slack
+ * left between finished bands and the beam. On the host backend the display is simulated line by line
+ * with beam capture, and every scanned frame is checked for rows of different frames, that is tearing.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "kernels.h"
+#include "beamrace.h"
+#include "hostdevice.h"
+#include "sdkbench.h"
+
+#define BEAM_FRAMES			120
+#define BEAM_BANDS			8
+#define BEAM_VIDEO_MODE		EVM_320_Wide
+#define BEAM_VIDEO_COLOR	ECM_8bit_Indexed
+#define BEAM_VIDEO_HEIGHT	240
+
+struct SBeamScene
+{
+	uint64_t bandNs;				// Extra time each band takes to draw
+};
+
+// Every pixel of a frame carries its frame number, so that rows of different frames tell a tear
+static void DrawBand(void* _userData, uint8_t* _pixels, uint32_t _stride, uint32_t _y0, uint32_t _y1, uint64_t _frame)
+{
+	struct SBeamScene* scene = (struct SBeamScene*)_userData;
+	uint64_t start = SPGetTimeNs();
+	uint32_t color = (uint32_t)(_frame % 255) + 1;
+	SPFillRect(_pixels, _stride, _stride, _y1 - _y0, color * 0x01010101u);
+	while (SPGetTimeNs() - start < scene->bandNs) { }
+}
+
+static int Torn(const uint8_t* _frame, uint32_t _stride)
+{
+	for (uint32_t y = 1; y < BEAM_VIDEO_HEIGHT; ++y)
+		if (_frame[y * _stride] != _frame[0])
+			return 1;
+	return 0;
+}
+
+static int Race(struct SPPlatform* _platform, struct SPSizeAlloc* _framebuffer, const char* _name, uint64_t _bandNs, int _capture, uint32_t* _lateBands)
+{
+	struct SPBeamRacer racer;
+	if (SPBeamRaceInit(&racer, _platform, _framebuffer, BEAM_BANDS, 0) != 0)
+		return -1;
+
+	struct SBeamScene scene;
+	scene.bandNs = _bandNs;
+
+	uint32_t stride = racer.stride;
+	uint8_t* scanned = (uint8_t*)malloc(stride * BEAM_VIDEO_HEIGHT);
+	uint64_t lastScanned = 0;
+	uint32_t checked = 0, torn = 0;
+
+	// A couple of frames to settle, the first scanned frames still show what was there before
+	for (uint32_t i = 0; i < 4; ++i)
+		SPBeamRaceFrame(&racer, DrawBand, &scene);
+	SPResetBeamRaceStats(&racer);
+	if (_capture)
+		SPHostReadScannedFrame(_platform, scanned, stride * BEAM_VIDEO_HEIGHT, &lastScanned);
+
+	for (uint32_t i = 0; i < BEAM_FRAMES; ++i)
+	{
+		SPBeamRaceFrame(&racer, DrawBand, &scene);
+
+		uint64_t frame;
+		if (_capture && SPHostReadScannedFrame(_platform, scanned, stride * BEAM_VIDEO_HEIGHT, &frame) == 0 && frame != lastScanned)
+		{
+			lastScanned = frame;
+			++checked;
+			torn += Torn(scanned, stride);
+		}
+	}
+	free(scanned);
+
+	struct SPBeamRaceStats stats;
+	SPGetBeamRaceStats(&racer, &stats);
+	printf("%-10s: %llu frames, %llu of %llu bands late (worst %u lines), %llu frames skipped, %.0f lines of slack",
+		_name, (unsigned long long)stats.frameCount, (unsigned long long)stats.lateBands, (unsigned long long)stats.bandCount,
+		stats.worstLateLines, (unsigned long long)stats.skippedFrames, stats.averageSlackLines);
+	if (_capture)
+		printf(", %u of %u scanned frames torn\n", torn, checked);
+	else
+		printf("\n");
+
+	*_lateBands = (uint32_t)stats.lateBands;
+	return (int)torn;
+}
+
+int BenchBeam(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	struct EVideoContext* vx = _platform->vx;
+	struct SPSizeAlloc framebuffer;
+	framebuffer.size = VPUGetStride(BEAM_VIDEO_MODE, BEAM_VIDEO_COLOR) * BEAM_VIDEO_HEIGHT;
+	if (SPAllocateBuffer(_platform, &framebuffer) != 0)
+	{
+		printf("can't allocate frame buffer\n");
+		return -1;
+	}
+	VPUSetVideoMode(vx, BEAM_VIDEO_MODE, BEAM_VIDEO_COLOR, EVS_Enable);
+
+	int capture = SPHostSetBeamCapture(_platform, 1) == 0;
+	uint64_t bandPeriodNs = vx->m_framePeriodNs * (VPU_VBLANK_SCANLINE / BEAM_BANDS) / VPU_SCANLINE_COUNT;
+	printf("%u bands of %u rows, a band is scanned in %.0f us%s\n", BEAM_BANDS, BEAM_VIDEO_HEIGHT / BEAM_BANDS,
+		bandPeriodNs / 1000.0, capture ? ", tearing checked with beam capture" : "");
+
+	uint32_t lightLate, heavyLate;
+	int lightTorn = Race(_platform, &framebuffer, "on time", 0, capture, &lightLate);
+	Race(_platform, &framebuffer, "overloaded", bandPeriodNs * 3 / 2, capture, &heavyLate);
+
+	if (capture)
+		SPHostSetBeamCapture(_platform, 0);
+	SPFreeBuffer(_platform, &framebuffer);
+
+	// Tearing without a late band means the beam prediction is off
+	int failed = lightTorn < 0 || (lightTorn > 0 && lightLate == 0);
+	if (failed)
+		printf("beam racing: FAILED, frames tore while every band was reported in time\n");
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,164 @@
+/**
+ * \file bench_blit.c
+ * \brief Sprite blits per frame
+ *
+ * Draws 32x32 round sprites at pseudo random positions, some of them clipped by the screen edges,
+ * into a 320x240 and a 640x480 framebuffer in both color modes. Each blit kind is reported as the
+ * number of sprites that fit into one frame. RLE sprites are also checked against color keyed blits.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "blit.h"
+#include "sdkbench.h"
+
+#define BLIT_SPRITES		2000
+#define BLIT_SIZE			32
+#define BLIT_KEY8			0
+#define BLIT_KEY16			0xF81F
+
+enum EBlitKind
+{
+	EBK_Opaque,
+	EBK_ColorKey,
+	EBK_RLE,
+	EBK_Half,
+	EBK_Add,
+	EBK_Count
+};
+
+static const char* s_kindNames[EBK_Count] = { "opaque", "color key", "rle", "50% blend", "additive" };
+
+// A filled circle with a gradient, the corners are transparent
+static void DrawSprite(struct SPSurface* _sprite, uint32_t _key)
+{
+	for (uint32_t y = 0; y < BLIT_SIZE; ++y)
+	{
+		for (uint32_t x = 0; x < BLIT_SIZE; ++x)
+		{
+			int dx = (int)x - BLIT_SIZE / 2, dy = (int)y - BLIT_SIZE / 2;
+			int inside = dx * dx + dy * dy < (BLIT_SIZE / 2) * (BLIT_SIZE / 2);
+			uint8_t* row = (uint8_t*)_sprite->pixels + y * _sprite->stride;
+			if (_sprite->cmode == ECM_16bit_RGB)
+				((uint16_t*)row)[x] = inside ? (uint16_t)MAKECOLORRGB16(x, (y * 2), (31 - x)) : (uint16_t)_key;
+			else
+				row[x] = inside ? (uint8_t)(16 + ((x + y) & 63)) : (uint8_t)_key;
+		}
+	}
+}
+
+static uint64_t Draw(struct SPSurface* _screen, struct SPSurface* _sprite, struct SPRLESprite* _rle, enum EBlitKind _kind, uint32_t _key)
+{
+	uint32_t seed = 1234;
+	uint64_t start = BenchNow();
+	for (uint32_t i = 0; i < BLIT_SPRITES; ++i)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		int x = (int)((seed >> 8) % (_screen->width + BLIT_SIZE)) - BLIT_SIZE / 2;
+		int y = (int)((seed >> 20) % (_screen->height + BLIT_SIZE)) - BLIT_SIZE / 2;
+		switch (_kind)
+		{
+			case EBK_Opaque: SPBlit(_screen, x, y, _sprite, NULL, EBL_None, SPBLIT_NOKEY); break;
+			case EBK_ColorKey: SPBlit(_screen, x, y, _sprite, NULL, EBL_None, _key); break;
+			case EBK_RLE: SPBlitRLE(_screen, x, y, _rle, EBL_None); break;
+			case EBK_Half: SPBlit(_screen, x, y, _sprite, NULL, EBL_Half, _key); break;
+			default: SPBlit(_screen, x, y, _sprite, NULL, EBL_Add, _key); break;
+		}
+	}
+	return BenchNow() - start;
+}
+
+// RLE spans have to land exactly where color keyed blits put the sprite, clipped on all four edges
+static int CheckRLE(struct SPSurface* _a, struct SPSurface* _b, struct SPSurface* _sprite, struct SPRLESprite* _rle, uint32_t _key, enum ESPBlend _blend)
+{
+	static const int positions[5][2] = { { -7, -9 }, { 300, -20 }, { -25, 220 }, { 310, 225 }, { 100, 100 } };
+	int match = 1;
+	for (uint32_t i = 0; i < 5; ++i)
+	{
+		memset(_a->pixels, 0x55, _a->stride * _a->height);
+		memset(_b->pixels, 0x55, _b->stride * _b->height);
+		SPBlit(_a, positions[i][0], positions[i][1], _sprite, NULL, _blend, _key);
+		SPBlitRLE(_b, positions[i][0], positions[i][1], _rle, _blend);
+		match &= memcmp(_a->pixels, _b->pixels, _a->stride * _a->height) == 0;
+	}
+	return match;
+}
+
+static int BenchMode(struct SPPlatform* _platform, enum EVideoMode _vmode, enum EColorMode _cmode)
+{
+	uint32_t width, height;
+	VPUGetDimensions(_vmode, &width, &height);
+	uint32_t stride = VPUGetStride(_vmode, _cmode);
+	uint32_t key = _cmode == ECM_16bit_RGB ? BLIT_KEY16 : BLIT_KEY8;
+
+	struct SPSizeAlloc framebuffer;
+	framebuffer.size = stride * height;
+	if (SPAllocateBuffer(_platform, &framebuffer) != 0)
+	{
+		printf("can't allocate frame buffer\n");
+		return -1;
+	}
+
+	struct SPSurface screen, sprite;
+	SPInitSurface(&screen, framebuffer.cpuAddress, width, height, stride, _cmode);
+	uint32_t spriteStride = BLIT_SIZE * (_cmode == ECM_16bit_RGB ? 2 : 1);
+	SPInitSurface(&sprite, malloc(spriteStride * BLIT_SIZE), BLIT_SIZE, BLIT_SIZE, spriteStride, _cmode);
+	DrawSprite(&sprite, key);
+
+	struct SPRLESprite rle;
+	if (SPCreateRLESprite(&rle, &sprite, NULL, key) != 0)
+	{
+		printf("can't create rle sprite\n");
+		free(sprite.pixels);
+		SPFreeBuffer(_platform, &framebuffer);
+		return -1;
+	}
+
+	printf("%ux%u %-6s:", width, height, _cmode == ECM_16bit_RGB ? "RGB565" : "8 bit");
+	double framePeriodNs = (double)_platform->vx->m_framePeriodNs;
+	for (uint32_t k = 0; k < EBK_Count; ++k)
+	{
+		if (k >= EBK_Half && _cmode != ECM_16bit_RGB)
+			continue;
+		uint64_t ns = Draw(&screen, &sprite, &rle, (enum EBlitKind)k, key);
+		printf(" %s %.0f", s_kindNames[k], framePeriodNs * BLIT_SPRITES / (double)ns);
+	}
+	printf(" sprites per frame (rle sprite is %u bytes)\n", rle.dataSize);
+
+	// Compare at 320x240 in ordinary memory, which is quicker to clear and read back
+	uint8_t* scratch = (uint8_t*)malloc(2 * 320 * 240 * 2);
+	struct SPSurface a, b;
+	uint32_t smallStride = 320 * (_cmode == ECM_16bit_RGB ? 2 : 1);
+	SPInitSurface(&a, scratch, 320, 240, smallStride, _cmode);
+	SPInitSurface(&b, scratch + smallStride * 240, 320, 240, smallStride, _cmode);
+	int match = CheckRLE(&a, &b, &sprite, &rle, key, EBL_None);
+	if (_cmode == ECM_16bit_RGB)
+		match &= CheckRLE(&a, &b, &sprite, &rle, key, EBL_Half) && CheckRLE(&a, &b, &sprite, &rle, key, EBL_Add);
+	if (!match)
+		printf("rle sprites: FAILED, output differs from color keyed blits\n");
+	free(scratch);
+
+	SPDestroyRLESprite(&rle);
+	free(sprite.pixels);
+	SPFreeBuffer(_platform, &framebuffer);
+	return match ? 0 : -1;
+}
+
+int BenchBlit(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	int failed = 0;
+	printf("%u sprites of %ux%u per measurement, some of them clipped\n", BLIT_SPRITES, BLIT_SIZE, BLIT_SIZE);
+	failed |= BenchMode(_platform, EVM_320_Wide, ECM_8bit_Indexed);
+	failed |= BenchMode(_platform, EVM_320_Wide, ECM_16bit_RGB);
+	failed |= BenchMode(_platform, EVM_640_Wide, ECM_8bit_Indexed);
+	failed |= BenchMode(_platform, EVM_640_Wide, ECM_16bit_RGB);
+	return failed ? -1 : 0;
+}
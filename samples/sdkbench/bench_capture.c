@@ -0,0 +1,270 @@
+/**
+ * \file bench_capture.c
+ * \brief Screenshot encoding speed and the cost of live capture to the render thread
+ *
+ * Encodes a 320x240 frame as QOI and PNG, from 8 bit indexed and RGB565 pixels, and reports the time per
+ * frame, the file size and the frame rate the capture worker could keep up. Each QOI file is decoded again
+ * the way the specification does and checked against the source, as is a small frame with black after
+ * white. Then captures a 30 fps sequence of a program swapping pages at 60 fps, and reports what the swaps
+ * paid for the copies and how many frames were dropped.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "capture.h"
+#include "sdkbench.h"
+
+#define CAPTURE_WIDTH		320
+#define CAPTURE_HEIGHT		240
+#define CAPTURE_REPEATS		10
+#define CAPTURE_FRAMES		60			// Swaps of the live sequence, every other one is captured
+
+static const char* s_formatNames[ECF_Count] = { "qoi", "png" };
+
+// Sky gradient, a checkered floor and a moving block, so both flat runs and detail are in the frame
+static void DrawFrame(uint8_t* _pixels, uint32_t _stride, enum EColorMode _cmode, uint32_t _frame)
+{
+	for (uint32_t y = 0; y < CAPTURE_HEIGHT; ++y)
+	{
+		uint8_t* row = _pixels + y * _stride;
+		for (uint32_t x = 0; x < CAPTURE_WIDTH; ++x)
+		{
+			uint32_t shade;
+			if (x - _frame * 2 % CAPTURE_WIDTH < 48 && y - 40 < 48)
+				shade = 200 + ((x ^ y) & 15);
+			else if (y < CAPTURE_HEIGHT / 2)
+				shade = y * 64 / CAPTURE_HEIGHT;
+			else
+				shade = 96 + ((((x + _frame) >> 4) ^ (y >> 3)) & 1) * 32 + (x & 3);
+			if (_cmode == ECM_16bit_RGB)
+				((uint16_t*)row)[x] = (uint16_t)MAKECOLORRGB16(shade >> 3, shade >> 2, (31 - (shade >> 3)));
+			else
+				row[x] = (uint8_t)shade;
+		}
+	}
+}
+
+static void MakePalette(uint32_t* _palette)
+{
+	for (uint32_t i = 0; i < 256; ++i)
+		_palette[i] = (i << 16) | ((255 - i) << 8) | ((i * 7) & 255);
+}
+
+static uint32_t ReadBE32(const uint8_t* _data)
+{
+	return ((uint32_t)_data[0] << 24) | ((uint32_t)_data[1] << 16) | ((uint32_t)_data[2] << 8) | _data[3];
+}
+
+// Decode a QOI file the way the specification does, with an RGBA index that starts out as transparent black,
+// and compare it to the source pixels widened the same way as the encoder does
+static int CheckQOI(const uint8_t* _data, uint32_t _size, const uint8_t* _pixels, uint32_t _width, uint32_t _height, uint32_t _stride,
+	enum EColorMode _cmode, const uint32_t* _palette)
+{
+	if (_size < 22 || memcmp(_data, "qoif", 4) != 0 || ReadBE32(_data + 4) != _width || ReadBE32(_data + 8) != _height)
+		return 0;
+
+	uint8_t index[64][4];
+	memset(index, 0, sizeof(index));
+	uint8_t px[4] = { 0, 0, 0, 255 };
+	uint32_t pos = 14, run = 0;
+	for (uint32_t i = 0; i < _width * _height; ++i)
+	{
+		if (run)
+			--run;
+		else if (pos < _size - 8)
+		{
+			uint8_t op = _data[pos++];
+			if (op == 0xFE)
+			{
+				memcpy(px, _data + pos, 3);
+				pos += 3;
+			}
+			else if (op == 0xFF)
+			{
+				memcpy(px, _data + pos, 4);
+				pos += 4;
+			}
+			else if ((op & 0xC0) == 0x00)
+				memcpy(px, index[op], 4);
+			else if ((op & 0xC0) == 0x40)
+			{
+				px[0] += ((op >> 4) & 3) - 2;
+				px[1] += ((op >> 2) & 3) - 2;
+				px[2] += (op & 3) - 2;
+			}
+			else if ((op & 0xC0) == 0x80)
+			{
+				int32_t vg = (op & 0x3F) - 32;
+				uint8_t next = _data[pos++];
+				px[0] += vg - 8 + (next >> 4);
+				px[1] += vg;
+				px[2] += vg - 8 + (next & 15);
+			}
+			else
+				run = op & 0x3F;
+			memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+		}
+
+		const uint8_t* row = _pixels + (i / _width) * _stride;
+		uint32_t x = i % _width;
+		uint8_t expected[4];
+		if (_cmode == ECM_16bit_RGB)
+		{
+			uint32_t c = ((const uint16_t*)row)[x];
+			uint32_t r = (c >> 11) & 0x1F, g = (c >> 5) & 0x3F, b = c & 0x1F;
+			expected[0] = (uint8_t)((r << 3) | (r >> 2));
+			expected[1] = (uint8_t)((g << 2) | (g >> 4));
+			expected[2] = (uint8_t)((b << 3) | (b >> 2));
+		}
+		else
+		{
+			uint32_t c = _palette[row[x]];
+			expected[0] = (uint8_t)(c >> 16);
+			expected[1] = (uint8_t)(c >> 8);
+			expected[2] = (uint8_t)c;
+		}
+		expected[3] = 255;
+		if (memcmp(px, expected, 4) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+// White rows above black ones, opaque black hashes to the slot a decoder starts out with transparent black in
+static int CheckQOIBlack(void)
+{
+	uint16_t pixels[16 * 4];
+	for (uint32_t i = 0; i < 16 * 4; ++i)
+		pixels[i] = i < 16 * 2 ? 0xFFFF : 0x0000;
+
+	uint32_t bound = SPGetEncodedSizeBound(ECF_QOI, 16, 4);
+	uint8_t* out = (uint8_t*)malloc(bound);
+	uint32_t size = SPEncodeImage(ECF_QOI, (const uint8_t*)pixels, 16, 4, 16 * 2, ECM_16bit_RGB, NULL, out, bound);
+	int match = size != 0 && CheckQOI(out, size, (const uint8_t*)pixels, 16, 4, 16 * 2, ECM_16bit_RGB, NULL);
+	free(out);
+	printf("qoi black after white: %s\n", match ? "ok" : "FAILED");
+	return !match;
+}
+
+static int BenchEncode(enum EColorMode _cmode, const uint32_t* _palette)
+{
+	uint32_t bpp = _cmode == ECM_16bit_RGB ? 2 : 1;
+	uint8_t* pixels = (uint8_t*)malloc(CAPTURE_WIDTH * CAPTURE_HEIGHT * bpp);
+	DrawFrame(pixels, CAPTURE_WIDTH * bpp, _cmode, 0);
+
+	int failed = 0;
+	for (uint32_t f = 0; f < ECF_Count; ++f)
+	{
+		enum ESPCaptureFormat format = (enum ESPCaptureFormat)f;
+		uint32_t bound = SPGetEncodedSizeBound(format, CAPTURE_WIDTH, CAPTURE_HEIGHT);
+		uint8_t* out = (uint8_t*)malloc(bound);
+
+		uint32_t size = 0;
+		uint64_t start = BenchNow();
+		for (uint32_t r = 0; r < CAPTURE_REPEATS; ++r)
+			size = SPEncodeImage(format, pixels, CAPTURE_WIDTH, CAPTURE_HEIGHT, CAPTURE_WIDTH * bpp, _cmode, _palette, out, bound);
+		double ms = (BenchNow() - start) / (1000000.0 * CAPTURE_REPEATS);
+
+		int match = size != 0 && (format != ECF_QOI || CheckQOI(out, size, pixels, CAPTURE_WIDTH, CAPTURE_HEIGHT, CAPTURE_WIDTH * bpp, _cmode, _palette));
+		failed |= !match;
+		printf("%-6s %s: %7.2f ms per frame, %6u bytes (%4.1f%% of raw), up to %5.1f fps%s\n", _cmode == ECM_16bit_RGB ? "RGB565" : "8 bit",
+			s_formatNames[f], ms, size, 100.0 * size / (CAPTURE_WIDTH * CAPTURE_HEIGHT * bpp), 1000.0 / ms, match ? "" : "  FAILED");
+		free(out);
+	}
+
+	free(pixels);
+	return failed;
+}
+
+// Swap pages at the display rate while a sequence captures every other frame
+static int BenchLive(struct SPPlatform* _platform, enum EColorMode _cmode, enum ESPCaptureFormat _format)
+{
+	VPUSetVideoMode(_platform->vx, EVM_320_Wide, _cmode, EVS_Enable);
+	uint32_t stride = VPUGetStride(EVM_320_Wide, _cmode);
+
+	struct SPSizeAlloc frameBufferA, frameBufferB;
+	frameBufferA.size = frameBufferB.size = stride * CAPTURE_HEIGHT;
+	if (SPAllocateBuffer(_platform, &frameBufferA) != 0 || SPAllocateBuffer(_platform, &frameBufferB) != 0)
+	{
+		printf("can't allocate frame buffers\n");
+		return -1;
+	}
+
+	struct EVideoSwapContext sc;
+	memset(&sc, 0, sizeof(sc));
+	sc.framebufferA = &frameBufferA;
+	sc.framebufferB = &frameBufferB;
+	struct SPCapture* capture = SPCreateCapture(_platform, &sc, 2);
+	if (!capture)
+	{
+		printf("can't create capture\n");
+		SPFreeBuffer(_platform, &frameBufferB);
+		SPFreeBuffer(_platform, &frameBufferA);
+		return -1;
+	}
+
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "/tmp/sdkbench_capture_%%03u.%s", s_formatNames[_format]);
+	VPUSwapPages(_platform->vx, &sc);
+	SPCaptureSequence(capture, pattern, _format, CAPTURE_FRAMES / 2, 2);
+	uint64_t start = BenchNow();
+	for (uint32_t f = 0; f < CAPTURE_FRAMES; ++f)
+	{
+		DrawFrame(sc.writepage, stride, _cmode, f);
+		VPUWaitVSync(_platform->vx);
+		VPUSwapPages(_platform->vx, &sc);
+	}
+	uint64_t swapNs = BenchNow() - start;
+	SPWaitCapture(capture);
+
+	struct SPCaptureStats stats;
+	SPGetCaptureStats(capture, &stats);
+	SPDestroyCapture(capture);
+	SPFreeBuffer(_platform, &frameBufferB);
+	SPFreeBuffer(_platform, &frameBufferA);
+
+	char filename[64];
+	for (uint32_t i = 0; i < CAPTURE_FRAMES / 2; ++i)
+	{
+		snprintf(filename, sizeof(filename), pattern, i);
+		remove(filename);
+	}
+
+	uint32_t copied = stats.frameCount + stats.failedCount;
+	uint32_t captured = copied + stats.droppedCount;
+	printf("%-6s %s: %u of %u frames written, %u dropped, %u failed, %.0f KB, copy %.3f ms average, %.3f ms worst, encode %.2f ms, write %.2f ms, %.1f ms per swap\n",
+		_cmode == ECM_16bit_RGB ? "RGB565" : "8 bit", s_formatNames[_format], stats.frameCount, CAPTURE_FRAMES / 2, stats.droppedCount, stats.failedCount,
+		stats.byteCount / 1024.0, copied ? stats.copyNs / (1000000.0 * copied) : 0.0, stats.worstCopyNs / 1000000.0,
+		stats.frameCount ? stats.encodeNs / (1000000.0 * stats.frameCount) : 0.0, stats.frameCount ? stats.writeNs / (1000000.0 * stats.frameCount) : 0.0,
+		swapNs / (1000000.0 * CAPTURE_FRAMES));
+	return stats.failedCount || captured != CAPTURE_FRAMES / 2 ? -1 : 0;
+}
+
+int BenchCapture(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	uint32_t palette[256];
+	MakePalette(palette);
+	for (uint32_t i = 0; i < 256; ++i)
+		VPUSetPal(_platform->vx, (uint8_t)i, palette[i] >> 16, (palette[i] >> 8) & 255, palette[i] & 255);
+
+	printf("encoding a %ux%u frame, %u times each\n", CAPTURE_WIDTH, CAPTURE_HEIGHT, CAPTURE_REPEATS);
+	int failed = BenchEncode(ECM_8bit_Indexed, palette);
+	failed |= BenchEncode(ECM_16bit_RGB, palette);
+	failed |= CheckQOIBlack();
+
+	printf("capturing %u of %u swaps at the display rate\n", CAPTURE_FRAMES / 2, CAPTURE_FRAMES);
+	for (uint32_t f = 0; f < ECF_Count; ++f)
+	{
+		failed |= BenchLive(_platform, ECM_8bit_Indexed, (enum ESPCaptureFormat)f) != 0;
+		failed |= BenchLive(_platform, ECM_16bit_RGB, (enum ESPCaptureFormat)f) != 0;
+	}
+	return failed;
+}
@@ -0,0 +1,197 @@
+/**
+ * \file bench_color.c
+ * \brief RGB888 to RGB565 and 8 bit indexed conversion throughput and quality
+ *
+ * Converts a 640x480 photo-like test image, smooth gradients with fine noise, the way samples/jpg did with
+ * float math, and with SPConvertRGB888To565 rounded, with ordered dither and with error diffusion. Then
+ * builds a 256 color palette and its inverse colormap, and converts to indexed color the same three ways.
+ * Reports Mpixel/s, and the error of the output against the source averaged over 4x4 blocks, which is what
+ * the eye sees from a distance, so dithered output scores better than plain rounding.
+ * The inverse colormap is checked against a search of the whole palette for a sample of colors.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "color.h"
+#include "sdkbench.h"
+
+#define COLOR_WIDTH			640
+#define COLOR_HEIGHT		480
+#define COLOR_REPEATS		5
+#define COLOR_MAP_CHECKS	4096
+
+static const char* s_ditherNames[3] = { "rounded", "ordered", "diffusion" };
+
+static void DrawImage(uint8_t* _rgb)
+{
+	uint32_t seed = 4321;
+	for (uint32_t y = 0; y < COLOR_HEIGHT; ++y)
+		for (uint32_t x = 0; x < COLOR_WIDTH; ++x)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			int32_t noise = (int32_t)((seed >> 24) & 7) - 4;
+			int32_t dx = (int32_t)x - COLOR_WIDTH / 2, dy = (int32_t)y - COLOR_HEIGHT / 3;
+			int32_t sun = 255 - (dx * dx + dy * dy) / 600;
+			uint8_t* p = _rgb + (y * COLOR_WIDTH + x) * 3;
+			int32_t c[3] = { sun > 0 ? 80 + sun / 2 : 80, (int32_t)(y * 200 / COLOR_HEIGHT) + 20, (int32_t)(x * 160 / COLOR_WIDTH) + 60 };
+			for (uint32_t i = 0; i < 3; ++i)
+			{
+				int32_t v = c[i] + noise;
+				p[i] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+			}
+		}
+}
+
+// The float conversion samples/jpg used before
+static void ConvertFloat(uint16_t* _dst, const uint8_t* _rgb)
+{
+	for (uint32_t i = 0; i < COLOR_WIDTH * COLOR_HEIGHT; ++i)
+	{
+		uint32_t red = (uint32_t)(31.f * (float)_rgb[i * 3 + 0] / 255.f);
+		uint32_t green = (uint32_t)(63.f * (float)_rgb[i * 3 + 1] / 255.f);
+		uint32_t blue = (uint32_t)(31.f * (float)_rgb[i * 3 + 2] / 255.f);
+		_dst[i] = (uint16_t)MAKECOLORRGB16(red, green, blue);
+	}
+}
+
+static void Expand565(uint8_t* _rgb, const uint16_t* _pixels)
+{
+	for (uint32_t i = 0; i < COLOR_WIDTH * COLOR_HEIGHT; ++i)
+	{
+		uint32_t r = _pixels[i] >> 11, g = (_pixels[i] >> 5) & 0x3F, b = _pixels[i] & 0x1F;
+		_rgb[i * 3 + 0] = (uint8_t)((r << 3) | (r >> 2));
+		_rgb[i * 3 + 1] = (uint8_t)((g << 2) | (g >> 4));
+		_rgb[i * 3 + 2] = (uint8_t)((b << 3) | (b >> 2));
+	}
+}
+
+static void ExpandIndexed(uint8_t* _rgb, const uint8_t* _pixels, const uint32_t* _palette)
+{
+	for (uint32_t i = 0; i < COLOR_WIDTH * COLOR_HEIGHT; ++i)
+	{
+		_rgb[i * 3 + 0] = (uint8_t)(_palette[_pixels[i]] >> 16);
+		_rgb[i * 3 + 1] = (uint8_t)(_palette[_pixels[i]] >> 8);
+		_rgb[i * 3 + 2] = (uint8_t)_palette[_pixels[i]];
+	}
+}
+
+// Mean absolute difference per channel between the 4x4 block averages of two images
+static double BlockError(const uint8_t* _a, const uint8_t* _b)
+{
+	uint64_t total = 0;
+	for (uint32_t by = 0; by < COLOR_HEIGHT; by += 4)
+		for (uint32_t bx = 0; bx < COLOR_WIDTH; bx += 4)
+			for (uint32_t c = 0; c < 3; ++c)
+			{
+				int32_t sum = 0;
+				for (uint32_t y = by; y < by + 4; ++y)
+					for (uint32_t x = bx; x < bx + 4; ++x)
+						sum += (int32_t)_a[(y * COLOR_WIDTH + x) * 3 + c] - (int32_t)_b[(y * COLOR_WIDTH + x) * 3 + c];
+				total += (uint64_t)(sum < 0 ? -sum : sum);
+			}
+	return total / (16.0 * 3.0 * (COLOR_WIDTH / 4) * (COLOR_HEIGHT / 4));
+}
+
+static double Mpixels(uint64_t _ns)
+{
+	return (double)COLOR_WIDTH * COLOR_HEIGHT * COLOR_REPEATS * 1000.0 / (double)_ns;
+}
+
+// Every sampled cell has to map to a palette entry as close as the nearest one
+static int CheckColormap(const struct SPColormap* _map)
+{
+	uint32_t seed = 99;
+	for (uint32_t i = 0; i < COLOR_MAP_CHECKS; ++i)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		uint32_t key = seed >> 17;
+		int32_t r = (int32_t)((key >> 10) << 3) + 4, g = (int32_t)(((key >> 5) & 31) << 3) + 4, b = (int32_t)((key & 31) << 3) + 4;
+		uint32_t nearest = 0xFFFFFFFF, mapped = 0;
+		for (uint32_t j = 0; j < _map->count; ++j)
+		{
+			int32_t dr = r - (int32_t)((_map->palette[j] >> 16) & 0xFF), dg = g - (int32_t)((_map->palette[j] >> 8) & 0xFF), db = b - (int32_t)(_map->palette[j] & 0xFF);
+			uint32_t d = (uint32_t)(dr * dr + dg * dg + db * db);
+			nearest = d < nearest ? d : nearest;
+			if (j == _map->index[key])
+				mapped = d;
+		}
+		if (mapped != nearest)
+			return 0;
+	}
+	return 1;
+}
+
+int BenchColor(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)_platform;
+	(void)argc;
+	(void)argv;
+	uint8_t* source = (uint8_t*)malloc(COLOR_WIDTH * COLOR_HEIGHT * 3);
+	uint8_t* expanded = (uint8_t*)malloc(COLOR_WIDTH * COLOR_HEIGHT * 3);
+	uint16_t* pixels16 = (uint16_t*)malloc(COLOR_WIDTH * COLOR_HEIGHT * 2);
+	uint8_t* pixels8 = (uint8_t*)malloc(COLOR_WIDTH * COLOR_HEIGHT);
+	struct SPColormap* map = (struct SPColormap*)malloc(sizeof(struct SPColormap));
+	DrawImage(source);
+	int failed = 0;
+
+	printf("%ux%u image, %u conversions each, error is against 4x4 block averages of the source\n", COLOR_WIDTH, COLOR_HEIGHT, COLOR_REPEATS);
+	uint64_t start = BenchNow();
+	for (uint32_t r = 0; r < COLOR_REPEATS; ++r)
+		ConvertFloat(pixels16, source);
+	uint64_t ns = BenchNow() - start;
+	Expand565(expanded, pixels16);
+	printf("RGB565 float     : %7.1f Mpixel/s, error %.2f\n", Mpixels(ns), BlockError(source, expanded));
+
+	for (uint32_t d = 0; d < 3; ++d)
+	{
+		start = BenchNow();
+		for (uint32_t r = 0; r < COLOR_REPEATS; ++r)
+			SPConvertRGB888To565(pixels16, COLOR_WIDTH * 2, source, COLOR_WIDTH * 3, COLOR_WIDTH, COLOR_HEIGHT, (enum ESPDither)d);
+		ns = BenchNow() - start;
+		Expand565(expanded, pixels16);
+		printf("RGB565 %-9s : %7.1f Mpixel/s, error %.2f\n", s_ditherNames[d], Mpixels(ns), BlockError(source, expanded));
+	}
+
+	uint32_t palette[256];
+	start = BenchNow();
+	uint32_t count = SPBuildPalette(palette, 256, source, COLOR_WIDTH * 3, COLOR_WIDTH, COLOR_HEIGHT);
+	uint64_t paletteNs = BenchNow() - start;
+	start = BenchNow();
+	int err = SPBuildColormap(map, palette, count);
+	uint64_t mapNs = BenchNow() - start;
+	if (err || count == 0)
+	{
+		printf("can't build palette\n");
+		failed = 1;
+	}
+	else
+	{
+		int match = CheckColormap(map);
+		failed |= !match;
+		printf("median cut       : %7.2f ms for %u colors\ninverse colormap : %7.2f ms, spread %u%s\n", paletteNs / 1000000.0, count, mapNs / 1000000.0, map->spread,
+			match ? "" : "  not the nearest color: FAILED");
+
+		for (uint32_t d = 0; d < 3; ++d)
+		{
+			start = BenchNow();
+			for (uint32_t r = 0; r < COLOR_REPEATS; ++r)
+				SPConvertRGB888To8(pixels8, COLOR_WIDTH, source, COLOR_WIDTH * 3, COLOR_WIDTH, COLOR_HEIGHT, map, (enum ESPDither)d);
+			ns = BenchNow() - start;
+			ExpandIndexed(expanded, pixels8, palette);
+			printf("8 bit %-10s : %7.1f Mpixel/s, error %.2f\n", s_ditherNames[d], Mpixels(ns), BlockError(source, expanded));
+		}
+	}
+
+	free(map);
+	free(pixels8);
+	free(pixels16);
+	free(expanded);
+	free(source);
+	return failed;
+}
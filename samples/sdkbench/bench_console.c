@@ -0,0 +1,194 @@
+/**
+ * \file bench_console.c
+ * \brief Full, incremental and ring framebuffer text console resolve
+ *
+ * Replays typical terminal traffic against the 80x60 console: typing at a prompt, the caret blinking
+ * on its own, and a log scrolling past a line or a burst of lines at a time. Each step is resolved with
+ * everything drawn again, drawing only the rows that changed, and into a ring framebuffer that scrolls
+ * through the scanout address. Both faster results are checked against a full resolve.
+ * A full screen redraw is also timed in 8 bit indexed and RGB565 color modes, against one frame.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "sdkbench.h"
+
+#define CONSOLE_STEPS			1200
+#define CONSOLE_REDRAWS			60
+#define CONSOLE_VIDEO_MODE		EVM_640_Wide
+#define CONSOLE_VIDEO_COLOR		ECM_8bit_Indexed
+#define CONSOLE_VIDEO_HEIGHT	480
+
+enum EConsoleScenario
+{
+	ECS_Typing,
+	ECS_Blink,
+	ECS_Log,
+	ECS_Burst,
+	ECS_Count
+};
+
+enum EConsoleResolve
+{
+	ECR_Full,
+	ECR_Incremental,
+	ECR_Ring,
+	ECR_Count
+};
+
+static const char* s_scenarioNames[ECS_Count] = { "typing", "caret blink", "scrolling log", "build burst" };
+
+static const char s_text[] = "ls -la /usr/share/doc | grep sandpiper > out.txt && echo done\n";
+
+static void FollowCursor(struct EVideoContext* _vx)
+{
+	_vx->m_caretX = _vx->m_cursorX;
+	_vx->m_caretY = _vx->m_cursorY;
+}
+
+// A screen of earlier output, with the prompt a third of the way down
+static void ResetConsole(struct EVideoContext* _vx)
+{
+	VPUConsoleSetColors(_vx, CONSOLEDEFAULTFG, CONSOLEDEFAULTBG);
+	VPUConsoleClear(_vx);
+	for (uint32_t i = 0; i < 20; ++i)
+		VPUConsolePrint(_vx, s_text, sizeof(s_text) - 1);
+	_vx->m_caretBlink = 1;
+	_vx->m_caretType = 0;
+	FollowCursor(_vx);
+}
+
+static void Step(struct EVideoContext* _vx, enum EConsoleScenario _scenario, uint32_t _step)
+{
+	switch (_scenario)
+	{
+		case ECS_Typing:
+			VPUConsolePrint(_vx, &s_text[_step % (sizeof(s_text) - 1)], 1);
+			FollowCursor(_vx);
+			break;
+		case ECS_Blink:
+			_vx->m_caretBlink ^= 1;
+			break;
+		case ECS_Log:
+			VPUConsolePrint(_vx, s_text, sizeof(s_text) - 1);
+			FollowCursor(_vx);
+			break;
+		default:
+			// A compiler printing 8 lines between two frames
+			for (uint32_t i = 0; i < 8; ++i)
+				VPUConsolePrint(_vx, s_text, sizeof(s_text) - 1);
+			FollowCursor(_vx);
+			break;
+	}
+}
+
+static uint64_t Replay(struct EVideoContext* _vx, struct SPSizeAlloc* _target, enum EConsoleScenario _scenario, enum EConsoleResolve _resolve)
+{
+	uint64_t total = 0;
+
+	if (_resolve == ECR_Ring)
+		VPUConsoleSetRing(_vx, _target);
+	else
+	{
+		VPUConsoleSetRing(_vx, NULL);
+		VPUSetWriteAddress(_vx, (uint32_t)(uintptr_t)_target->cpuAddress);
+	}
+	ResetConsole(_vx);
+	VPUConsoleResolve(_vx);
+
+	for (uint32_t i = 0; i < CONSOLE_STEPS; ++i)
+	{
+		Step(_vx, _scenario, i);
+		uint64_t start = BenchNow();
+		if (_resolve == ECR_Full)
+			VPUConsoleInvalidate(_vx);
+		VPUConsoleResolve(_vx);
+		total += BenchNow() - start;
+	}
+
+	return total;
+}
+
+// Average cost of drawing every glyph of a full screen, in _cmode
+static uint64_t FullRedraw(struct SPPlatform* _platform, enum EColorMode _cmode)
+{
+	struct EVideoContext* vx = _platform->vx;
+	struct SPSizeAlloc framebuffer;
+	framebuffer.size = VPUGetStride(CONSOLE_VIDEO_MODE, _cmode) * CONSOLE_VIDEO_HEIGHT;
+	if (SPAllocateBuffer(_platform, &framebuffer) != 0)
+		return 0;
+
+	VPUSetVideoMode(vx, CONSOLE_VIDEO_MODE, _cmode, EVS_Enable);
+	VPUSetWriteAddress(vx, (uint32_t)(uintptr_t)framebuffer.cpuAddress);
+	ResetConsole(vx);
+	for (uint32_t i = 0; i < 3; ++i)
+		VPUConsolePrint(vx, s_text, sizeof(s_text) - 1);
+
+	uint64_t start = BenchNow();
+	for (uint32_t i = 0; i < CONSOLE_REDRAWS; ++i)
+	{
+		VPUConsoleInvalidate(vx);
+		VPUConsoleResolve(vx);
+	}
+	uint64_t total = BenchNow() - start;
+
+	SPFreeBuffer(_platform, &framebuffer);
+	return total / CONSOLE_REDRAWS;
+}
+
+int BenchConsole(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	int failed = 0;
+	struct EVideoContext* vx = _platform->vx;
+
+	uint32_t stride = VPUGetStride(CONSOLE_VIDEO_MODE, CONSOLE_VIDEO_COLOR);
+	struct SPSizeAlloc reference, incremental, ring;
+	reference.size = incremental.size = stride * CONSOLE_VIDEO_HEIGHT;
+	ring.size = 2 * stride * CONSOLE_VIDEO_HEIGHT;
+	if (SPAllocateBuffer(_platform, &reference) != 0 || SPAllocateBuffer(_platform, &incremental) != 0 || SPAllocateBuffer(_platform, &ring) != 0)
+	{
+		printf("can't allocate frame buffers\n");
+		return -1;
+	}
+	VPUSetVideoMode(vx, CONSOLE_VIDEO_MODE, CONSOLE_VIDEO_COLOR, EVS_Enable);
+
+	printf("us per resolve   full  incremental     ring\n");
+	for (uint32_t s = 0; s < ECS_Count; ++s)
+	{
+		enum EConsoleScenario scenario = (enum EConsoleScenario)s;
+		uint64_t fullNs = Replay(vx, &reference, scenario, ECR_Full);
+
+		uint64_t incrementalNs = Replay(vx, &incremental, scenario, ECR_Incremental);
+		int match = memcmp(incremental.cpuAddress, reference.cpuAddress, reference.size) == 0;
+
+		// The screen starts wherever the ring scrolled to
+		uint64_t ringNs = Replay(vx, &ring, scenario, ECR_Ring);
+		uint32_t top = vx->m_scanoutAddressCacheAligned - (uint32_t)(uintptr_t)ring.dmaAddress;
+		match &= memcmp(ring.cpuAddress + top, reference.cpuAddress, reference.size) == 0;
+		failed |= !match;
+
+		printf("%-14s: %8.1f %12.1f %8.1f%s\n", s_scenarioNames[s],
+			fullNs / (1000.0 * CONSOLE_STEPS), incrementalNs / (1000.0 * CONSOLE_STEPS), ringNs / (1000.0 * CONSOLE_STEPS),
+			match ? "" : "  output differs: FAILED");
+	}
+	VPUConsoleSetRing(vx, NULL);
+
+	uint64_t redraw8 = FullRedraw(_platform, ECM_8bit_Indexed);
+	uint64_t redraw16 = FullRedraw(_platform, ECM_16bit_RGB);
+	printf("full screen     : %.2f ms in 8 bit, %.2f ms in RGB565, a frame is %.2f ms\n",
+		redraw8 / 1000000.0, redraw16 / 1000000.0, vx->m_framePeriodNs / 1000000.0);
+
+	SPFreeBuffer(_platform, &ring);
+	SPFreeBuffer(_platform, &incremental);
+	SPFreeBuffer(_platform, &reference);
+
+	return failed ? -1 : 0;
+}
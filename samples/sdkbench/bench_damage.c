@@ -0,0 +1,240 @@
+/**
+ * \file bench_damage.c
+ * \brief Partial presentation with damage rectangles
+ *
+ * Replays typical frames of a 320x240 8 bit game, from a few status bar digits changing to the whole
+ * screen, and presents each of them three ways: copying the full screen from a buffer in ordinary memory
+ * like Doom used to, copying only the damaged regions from that buffer with VPUCopyDamage, and drawing
+ * the damaged regions straight into a double buffered swap context, where VPUSwapPages carries them over
+ * into the next write page, and the same with a three image swap chain, where SPAcquireNextImage does.
+ * The framebuffers are checked against the buffer after every frame.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "kernels.h"
+#include "swapchain.h"
+#include "sdkbench.h"
+
+#define DAMAGE_FRAMES		300
+#define DAMAGE_WIDTH		320
+#define DAMAGE_HEIGHT		240
+#define DAMAGE_MAX_RECTS	24
+
+enum EDamageScenario
+{
+	EDS_Digits,
+	EDS_Text,
+	EDS_View,
+	EDS_Full,
+	EDS_Count
+};
+
+static const char* s_scenarioNames[EDS_Count] = { "status digits", "message line", "view + digits", "full screen" };
+
+// Regions the game redraws in a frame of each scenario
+static uint32_t FrameRects(enum EDamageScenario _scenario, uint32_t _frame, struct SPRect* _rects)
+{
+	uint32_t count = 0;
+	switch (_scenario)
+	{
+		case EDS_Digits:
+			// Ammo and health counters in the status bar
+			for (uint32_t i = 0; i < 3; ++i)
+				_rects[count++] = (struct SPRect){ 44 + (int)i * 14, 203, 14, 16 };
+			_rects[count++] = (struct SPRect){ 90 + (int)(_frame % 3) * 14, 203, 14, 16 };
+			break;
+		case EDS_Text:
+			// A pickup message printed one glyph at a time
+			for (uint32_t i = 0; i < 20; ++i)
+				_rects[count++] = (struct SPRect){ (int)i * 8, 0, 7, 8 };
+			break;
+		case EDS_View:
+			_rects[count++] = (struct SPRect){ 0, 0, 320, 168 };
+			_rects[count++] = (struct SPRect){ 44, 203, 14, 16 };
+			_rects[count++] = (struct SPRect){ 58, 203, 14, 16 };
+			break;
+		default:
+			_rects[count++] = (struct SPRect){ 0, 0, DAMAGE_WIDTH, DAMAGE_HEIGHT };
+			break;
+	}
+	return count;
+}
+
+static void DrawRects(uint8_t* _pixels, uint32_t _stride, const struct SPRect* _rects, uint32_t _count, uint32_t _frame)
+{
+	for (uint32_t i = 0; i < _count; ++i)
+	{
+		const struct SPRect* r = &_rects[i];
+		uint32_t color = (_frame * 7 + i * 13) & 0xFF;
+		SPFillRect(_pixels + r->y * _stride + r->x, _stride, r->width, r->height, color * 0x01010101u);
+	}
+}
+
+static int SameImage(const uint8_t* _framebuffer, uint32_t _stride, const uint8_t* _image)
+{
+	for (uint32_t y = 0; y < DAMAGE_HEIGHT; ++y)
+		if (memcmp(_framebuffer + y * _stride, _image + y * DAMAGE_WIDTH, DAMAGE_WIDTH) != 0)
+			return 0;
+	return 1;
+}
+
+// Game renders into _image, which is copied to a single framebuffer in full or by damage
+static uint64_t ReplayCopy(struct EVideoContext* _vx, struct SPSizeAlloc* _framebuffer, uint8_t* _image, enum EDamageScenario _scenario, int _useDamage, int* _match)
+{
+	struct EVideoSwapContext sc;
+	memset(&sc, 0, sizeof(sc));
+	sc.framebufferA = sc.framebufferB = _framebuffer;
+	sc.writepage = _framebuffer->cpuAddress;
+	VPUSetWriteAddress(_vx, (uint32_t)(uintptr_t)sc.writepage);
+
+	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_8bit_Indexed);
+	memset(_image, 0, DAMAGE_WIDTH * DAMAGE_HEIGHT);
+	SPCopyRect(_framebuffer->cpuAddress, stride, _image, DAMAGE_WIDTH, DAMAGE_WIDTH, DAMAGE_HEIGHT);
+
+	struct SPRect rects[DAMAGE_MAX_RECTS];
+	uint64_t total = 0;
+	for (uint32_t f = 0; f < DAMAGE_FRAMES; ++f)
+	{
+		uint32_t count = FrameRects(_scenario, f, rects);
+		DrawRects(_image, DAMAGE_WIDTH, rects, count, f);
+
+		uint64_t start = BenchNow();
+		if (_useDamage)
+		{
+			for (uint32_t i = 0; i < count; ++i)
+				VPUAddDamage(_vx, &sc, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+			VPUCopyDamage(_vx, &sc, _image, DAMAGE_WIDTH);
+		}
+		else
+			SPCopyRect(_framebuffer->cpuAddress, stride, _image, DAMAGE_WIDTH, DAMAGE_WIDTH, DAMAGE_HEIGHT);
+		total += BenchNow() - start;
+
+		*_match &= SameImage(_framebuffer->cpuAddress, stride, _image);
+	}
+	return total;
+}
+
+// Game draws straight into the write page of a double buffered swap context
+static uint64_t ReplaySwap(struct EVideoContext* _vx, struct SPSizeAlloc* _a, struct SPSizeAlloc* _b, uint8_t* _image, enum EDamageScenario _scenario, int* _match)
+{
+	struct EVideoSwapContext sc;
+	memset(&sc, 0, sizeof(sc));
+	sc.framebufferA = _a;
+	sc.framebufferB = _b;
+
+	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_8bit_Indexed);
+	memset(_image, 0, DAMAGE_WIDTH * DAMAGE_HEIGHT);
+	memset(_a->cpuAddress, 0, _a->size);
+	memset(_b->cpuAddress, 0, _b->size);
+	VPUSwapPages(_vx, &sc);
+
+	struct SPRect rects[DAMAGE_MAX_RECTS];
+	uint64_t total = 0;
+	for (uint32_t f = 0; f < DAMAGE_FRAMES; ++f)
+	{
+		uint32_t count = FrameRects(_scenario, f, rects);
+		DrawRects(_image, DAMAGE_WIDTH, rects, count, f);
+		DrawRects(sc.writepage, stride, rects, count, f);
+
+		uint64_t start = BenchNow();
+		for (uint32_t i = 0; i < count; ++i)
+			VPUAddDamage(_vx, &sc, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+		VPUSwapPages(_vx, &sc);
+		total += BenchNow() - start;
+
+		// Both the page on the screen and the next one to draw into hold the latest frame
+		*_match &= SameImage(sc.writepage, stride, _image);
+		*_match &= SameImage(sc.cycle % 2 ? _b->cpuAddress : _a->cpuAddress, stride, _image);
+	}
+	return total;
+}
+
+// Same as ReplaySwap with a three image swap chain in mailbox mode, so frames never wait for the display
+static uint64_t ReplayChain(struct SPPlatform* _platform, struct SPSizeAlloc** _images, uint8_t* _image, enum EDamageScenario _scenario, int* _match)
+{
+	struct EVideoContext* vx = _platform->vx;
+	struct SPSwapChain chain;
+	SPSwapChainInit(&chain, _platform, _images, 3, EPM_Mailbox);
+
+	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_8bit_Indexed);
+	memset(_image, 0, DAMAGE_WIDTH * DAMAGE_HEIGHT);
+	for (uint32_t i = 0; i < 3; ++i)
+		memset(_images[i]->cpuAddress, 0, _images[i]->size);
+
+	struct SPRect rects[DAMAGE_MAX_RECTS];
+	uint64_t total = 0;
+	for (uint32_t f = 0; f < DAMAGE_FRAMES; ++f)
+	{
+		uint64_t start = BenchNow();
+		int index = SPAcquireNextImage(&chain);
+		total += BenchNow() - start;
+
+		// Whichever image comes back holds the latest frame
+		*_match &= index >= 0 && SameImage(chain.sc.writepage, stride, _image);
+		if (index < 0)
+			break;
+
+		uint32_t count = FrameRects(_scenario, f, rects);
+		DrawRects(_image, DAMAGE_WIDTH, rects, count, f);
+		DrawRects(chain.sc.writepage, stride, rects, count, f);
+
+		start = BenchNow();
+		for (uint32_t i = 0; i < count; ++i)
+			VPUAddDamage(vx, &chain.sc, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+		SPQueuePresent(&chain, index);
+		total += BenchNow() - start;
+	}
+	return total;
+}
+
+int BenchDamage(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	int failed = 0;
+	struct EVideoContext* vx = _platform->vx;
+
+	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_8bit_Indexed);
+	struct SPSizeAlloc single, pageA, pageB, pageC;
+	single.size = pageA.size = pageB.size = pageC.size = stride * DAMAGE_HEIGHT;
+	if (SPAllocateBuffer(_platform, &single) != 0 || SPAllocateBuffer(_platform, &pageA) != 0 || SPAllocateBuffer(_platform, &pageB) != 0 ||
+		SPAllocateBuffer(_platform, &pageC) != 0)
+	{
+		printf("can't allocate frame buffers\n");
+		return -1;
+	}
+	uint8_t* image = (uint8_t*)malloc(DAMAGE_WIDTH * DAMAGE_HEIGHT);
+	VPUSetVideoMode(vx, EVM_320_Wide, ECM_8bit_Indexed, EVS_Enable);
+
+	struct SPSizeAlloc* images[3] = { &pageA, &pageB, &pageC };
+	printf("us per frame     full copy  damage copy  damage swap  damage chain\n");
+	for (uint32_t s = 0; s < EDS_Count; ++s)
+	{
+		enum EDamageScenario scenario = (enum EDamageScenario)s;
+		int match = 1;
+		uint64_t fullNs = ReplayCopy(vx, &single, image, scenario, 0, &match);
+		uint64_t copyNs = ReplayCopy(vx, &single, image, scenario, 1, &match);
+		uint64_t swapNs = ReplaySwap(vx, &pageA, &pageB, image, scenario, &match);
+		uint64_t chainNs = ReplayChain(_platform, images, image, scenario, &match);
+		failed |= !match;
+
+		printf("%-14s: %11.1f %12.1f %12.1f %13.1f%s\n", s_scenarioNames[s],
+			fullNs / (1000.0 * DAMAGE_FRAMES), copyNs / (1000.0 * DAMAGE_FRAMES), swapNs / (1000.0 * DAMAGE_FRAMES), chainNs / (1000.0 * DAMAGE_FRAMES),
+			match ? "" : "  output differs: FAILED");
+	}
+
+	free(image);
+	SPFreeBuffer(_platform, &pageC);
+	SPFreeBuffer(_platform, &pageB);
+	SPFreeBuffer(_platform, &pageA);
+	SPFreeBuffer(_platform, &single);
+
+	return failed ? -1 : 0;
+}
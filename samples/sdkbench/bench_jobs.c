@@ -0,0 +1,160 @@
+/**
+ * \file bench_jobs.c
+ * \brief Work stealing job system scaling and overhead
+ *
+ * Draws a 320x240 RGB565 Mandelbrot frame in 16x16 tiles, first with a single worker and then with one
+ * worker per core, and reports the speedup, how many jobs were stolen and how the tiles were shared out.
+ * The outlines of the set cost a lot more than the rest, so a static split would leave a core idle.
+ * Both images are checked against each other. The cost of starting and waiting for a batch of empty
+ * jobs is timed as well, and a few frames are paced with the frame end barrier.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "jobs.h"
+#include "sdkbench.h"
+
+#define JOBS_WIDTH			320
+#define JOBS_HEIGHT			240
+#define JOBS_TILE			16
+#define JOBS_FRAMES			8
+#define JOBS_BATCHES		2000
+#define JOBS_PACED_FRAMES	30
+
+struct SJobsFrame
+{
+	uint16_t* pixels;
+	float zoom;
+};
+
+static void DrawTile(void* _userData, uint32_t _x, uint32_t _y, uint32_t _width, uint32_t _height)
+{
+	struct SJobsFrame* frame = (struct SJobsFrame*)_userData;
+	for (uint32_t y = _y; y < _y + _height; ++y)
+	{
+		for (uint32_t x = _x; x < _x + _width; ++x)
+		{
+			float cr = ((float)x - 160.f) / 240.f * frame->zoom - 0.235125f;
+			float ci = ((float)y - 120.f) / 240.f * frame->zoom + 0.827215f;
+			float zr = 0.f, zi = 0.f;
+			uint32_t i = 0;
+			while (zr * zr + zi * zi < 4.f && i < 255)
+			{
+				float t = zr * zr - zi * zi + cr;
+				zi = 2.f * zr * zi + ci;
+				zr = t;
+				++i;
+			}
+			frame->pixels[y * JOBS_WIDTH + x] = (uint16_t)MAKECOLORRGB16(i >> 3, i >> 2, i >> 3);
+		}
+	}
+}
+
+static void Nothing(void* _userData, uint32_t _begin, uint32_t _end)
+{
+	(void)_userData;
+	(void)_begin;
+	(void)_end;
+}
+
+// Average time to draw a frame with _workerCount workers, 0 for one per core
+static uint64_t DrawFrames(struct SPPlatform* _platform, uint32_t _workerCount, uint16_t* _pixels, struct SPJobStats* _stats)
+{
+	struct SPJobSystem* jobs = SPCreateJobSystem(_platform, _workerCount);
+	if (!jobs)
+		return 0;
+
+	struct SJobsFrame frame;
+	frame.pixels = _pixels;
+	uint64_t start = BenchNow();
+	for (uint32_t f = 0; f < JOBS_FRAMES; ++f)
+	{
+		struct SPJobCounter counter;
+		SPInitJobCounter(&counter);
+		frame.zoom = 0.02f / (float)(f + 1);
+		SPRunTiles(jobs, DrawTile, &frame, JOBS_WIDTH, JOBS_HEIGHT, JOBS_TILE, JOBS_TILE, &counter);
+		SPWaitJobs(jobs, &counter);
+	}
+	uint64_t total = BenchNow() - start;
+
+	SPGetJobStats(jobs, _stats);
+	SPDestroyJobSystem(jobs);
+	return total / JOBS_FRAMES;
+}
+
+int BenchJobs(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	uint16_t* single = (uint16_t*)malloc(JOBS_WIDTH * JOBS_HEIGHT * 2);
+	uint16_t* pinned = (uint16_t*)malloc(JOBS_WIDTH * JOBS_HEIGHT * 2);
+
+	struct SPJobStats singleStats, stats;
+	uint64_t singleNs = DrawFrames(_platform, 1, single, &singleStats);
+	uint64_t pinnedNs = DrawFrames(_platform, 0, pinned, &stats);
+	if (!singleNs || !pinnedNs)
+	{
+		printf("can't create job system\n");
+		free(pinned);
+		free(single);
+		return -1;
+	}
+	int match = memcmp(single, pinned, JOBS_WIDTH * JOBS_HEIGHT * 2) == 0;
+
+	printf("%ux%u in %ux%u tiles: %.2f ms on 1 worker, %.2f ms on %u workers, %.2fx%s\n", JOBS_WIDTH, JOBS_HEIGHT, JOBS_TILE, JOBS_TILE,
+		singleNs / 1000000.0, pinnedNs / 1000000.0, stats.workerCount, (double)singleNs / (double)pinnedNs,
+		match ? "" : "  output differs: FAILED");
+	printf("jobs %llu, stolen %llu, split %llu, overflowed %llu, worker sleeps %llu, tiles per worker",
+		(unsigned long long)stats.jobCount, (unsigned long long)stats.stealCount, (unsigned long long)stats.splitCount,
+		(unsigned long long)stats.overflowCount, (unsigned long long)stats.sleepCount);
+	for (uint32_t i = 0; i < stats.workerCount; ++i)
+		printf(" %llu", (unsigned long long)stats.workerItems[i]);
+	printf("\n");
+
+	struct SPJobSystem* jobs = SPCreateJobSystem(_platform, 0);
+
+	// Start and wait for a batch of 64 empty items, split down to single items
+	uint64_t start = BenchNow();
+	for (uint32_t i = 0; i < JOBS_BATCHES; ++i)
+	{
+		struct SPJobCounter counter;
+		SPInitJobCounter(&counter);
+		SPRunJobs(jobs, Nothing, NULL, 64, 1, &counter);
+		SPWaitJobs(jobs, &counter);
+	}
+	uint64_t batchNs = (BenchNow() - start) / JOBS_BATCHES;
+	printf("batch of 64 empty jobs: %.2f us\n", batchNs / 1000.0);
+
+	// Pace frames with the barrier, with the next frame's tiles started before waiting for the vblank
+	VPUSetVideoMode(_platform->vx, EVM_320_Wide, ECM_16bit_RGB, EVS_Enable);
+	struct SJobsFrame frames[2] = { { single, 0.02f }, { pinned, 0.01f } };
+	struct SPJobCounter counters[2];
+	SPInitJobCounter(&counters[0]);
+	SPInitJobCounter(&counters[1]);
+	SPResetJobStats(jobs);
+	SPRunTiles(jobs, DrawTile, &frames[0], JOBS_WIDTH, JOBS_HEIGHT, JOBS_TILE, JOBS_TILE, &counters[0]);
+	VPUWaitVSync(_platform->vx);
+	start = BenchNow();
+	for (uint32_t f = 0; f < JOBS_PACED_FRAMES; ++f)
+	{
+		uint32_t next = (f + 1) % 2;
+		SPRunTiles(jobs, DrawTile, &frames[next], JOBS_WIDTH, JOBS_HEIGHT, JOBS_TILE, JOBS_TILE, &counters[next]);
+		SPJobFrameEnd(jobs, &counters[f % 2]);
+	}
+	uint64_t frameNs = (BenchNow() - start) / JOBS_PACED_FRAMES;
+	SPWaitJobs(jobs, &counters[JOBS_PACED_FRAMES % 2]);
+	SPGetJobStats(jobs, &stats);
+	printf("frame end barrier: %.2f ms per frame, a frame is %.2f ms, %llu jobs of the next frame run while waiting for the vblank\n",
+		frameNs / 1000000.0, _platform->vx->m_framePeriodNs / 1000000.0, (unsigned long long)stats.helpedCount);
+
+	SPDestroyJobSystem(jobs);
+	free(pinned);
+	free(single);
+	return match ? 0 : -1;
+}
@@ -0,0 +1,88 @@
+/**
+ * \file bench_memory.c
+ * \brief Reserved region bandwidth per mapping policy
+ *
+ * Allocates a buffer with each mapping policy and measures CPU read, write and
+ * mixed (read-modify-write, as in a framebuffer fade) bandwidth, including the
+ * cost of the flush a device read would require afterwards.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "core.h"
+#include "platform.h"
+#include "sdkbench.h"
+
+#define MEMORY_BUFFER_SIZE	(1024*1024)
+#define MEMORY_ITERATIONS	16
+
+static double MBps(uint64_t _bytes, uint64_t _ns)
+{
+	return _ns ? ((double)_bytes * 1000.0) / (double)_ns : 0.0;
+}
+
+int BenchMemory(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	static const char* policyNames[ESM_Count] = { "uncached", "writecombined", "cached" };
+	const uint32_t words = MEMORY_BUFFER_SIZE / sizeof(uint32_t);
+	const uint64_t totalBytes = (uint64_t)MEMORY_BUFFER_SIZE * MEMORY_ITERATIONS;
+
+	printf("%-14s %10s %10s %10s %10s\n", "policy", "read MB/s", "write MB/s", "mixed MB/s", "flush us");
+
+	for (uint32_t p = 0; p < ESM_Count; ++p)
+	{
+		struct SPSizeAlloc buffer;
+		buffer.size = MEMORY_BUFFER_SIZE;
+		if (SPAllocateMappedBuffer(_platform, &buffer, SPALIGN_DEFAULT, (enum ESPMapPolicy)p) != 0)
+		{
+			printf("%-14s allocation failed\n", policyNames[p]);
+			continue;
+		}
+		if (buffer.policy != (enum ESPMapPolicy)p)
+		{
+			printf("%-14s not supported by the driver\n", policyNames[p]);
+			SPFreeBuffer(_platform, &buffer);
+			continue;
+		}
+
+		volatile uint32_t* mem = (volatile uint32_t*)buffer.cpuAddress;
+
+		uint64_t start = BenchNow();
+		for (uint32_t n = 0; n < MEMORY_ITERATIONS; ++n)
+			for (uint32_t i = 0; i < words; ++i)
+				mem[i] = i ^ n;
+		uint64_t writeTime = BenchNow() - start;
+
+		start = BenchNow();
+		SPFlushRange(_platform, buffer.cpuAddress, buffer.size);
+		uint64_t flushTime = BenchNow() - start;
+
+		uint32_t sum = 0;
+		start = BenchNow();
+		for (uint32_t n = 0; n < MEMORY_ITERATIONS; ++n)
+			for (uint32_t i = 0; i < words; ++i)
+				sum += mem[i];
+		uint64_t readTime = BenchNow() - start;
+
+		start = BenchNow();
+		for (uint32_t n = 0; n < MEMORY_ITERATIONS; ++n)
+			for (uint32_t i = 0; i < words; ++i)
+				mem[i] = (mem[i] >> 1) & 0x7F7F7F7F;
+		uint64_t mixedTime = BenchNow() - start;
+
+		printf("%-14s %10.1f %10.1f %10.1f %10.1f\n", policyNames[p],
+			MBps(totalBytes, readTime), MBps(totalBytes, writeTime), MBps(totalBytes, mixedTime), flushTime / 1000.0);
+
+		// Keep the compiler from dropping the read loop
+		if (sum == 0xFFFFFFFF)
+			printf("\n");
+
+		SPFreeBuffer(_platform, &buffer);
+	}
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * \file bench_regs.c
+ * \brief Register access cost
+ *
+ * Measures the average cost of a single control register write and read,
+ * through the ioctl() path and through the directly mapped register pages.
+ * Writes are VPU no-ops, which the VPU retires without side effects.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "sdkbench.h"
+
+#define REGISTER_ITERATIONS 100000
+
+static void MeasureRegisterAccess(struct SPPlatform* _platform, const char* _name)
+{
+	uint64_t start = BenchNow();
+	for (uint32_t i = 0; i < REGISTER_ITERATIONS; ++i)
+		VPUNoop(_platform->vx);
+	uint64_t writeTime = BenchNow() - start;
+
+	// Let the FIFO drain so reads do not compete with pending no-ops
+	while (VPUGetFIFONotEmpty(_platform->vx)) { }
+
+	volatile uint32_t sink = 0;
+	start = BenchNow();
+	for (uint32_t i = 0; i < REGISTER_ITERATIONS; ++i)
+		sink = sink + VPUReadVBlankCounter(_platform->vx);
+	uint64_t readTime = BenchNow() - start;
+
+	printf("%-8s: write %8.1f ns, read %8.1f ns\n", _name,
+		(double)writeTime / REGISTER_ITERATIONS,
+		(double)readTime / REGISTER_ITERATIONS);
+}
+
+int BenchRegisters(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	enum ESPRegisterAccess initialAccess = _platform->registerAccess;
+
+	SPSetRegisterAccess(_platform, ERA_Ioctl);
+	MeasureRegisterAccess(_platform, "ioctl");
+
+	if (SPSetRegisterAccess(_platform, ERA_Direct) == 0)
+		MeasureRegisterAccess(_platform, "direct");
+	else
+		printf("direct  : not available, driver does not allow mapping device registers\n");
+
+	SPSetRegisterAccess(_platform, initialAccess);
+	return 0;
+}
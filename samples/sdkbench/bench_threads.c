@@ -0,0 +1,218 @@
+/**
+ * \file bench_threads.c
+ * \brief Register writes from several threads
+ *
+ * Stresses submission from several threads at once. The first part checks against the loopback
+ * backend that every write arrives, and that each thread's writes keep their order across devices.
+ * The second part kicks audio DMA on one thread while another one submits long batches of palette
+ * writes, and checks that the kicks never have to wait for a whole batch to go out.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "apu.h"
+#include "sdkbench.h"
+
+#define ORDER_THREADS		4
+#define ORDER_BATCHES		2000
+#define ORDER_BATCH_SIZE	100
+#define BURST_SIZE			1024
+#define KICK_COUNT			500
+
+struct SOrderThread
+{
+	struct SPPlatform* platform;
+	pthread_barrier_t* start;
+	uint32_t tag;
+};
+
+// Each thread writes a running sequence number tagged with its index to the same two devices, batched
+// on even threads and one write at a time on odd threads
+static void* OrderThread(void* _arg)
+{
+	struct SOrderThread* data = (struct SOrderThread*)_arg;
+	uint32_t sequence = 0;
+
+	pthread_barrier_wait(data->start);
+	for (uint32_t n = 0; n < ORDER_BATCHES; ++n)
+	{
+		if (!(data->tag & 1))
+			SPBeginBatch(data->platform);
+		for (uint32_t i = 0; i < ORDER_BATCH_SIZE; ++i, ++sequence)
+			SPPush(data->platform, (i & 1) ? ESD_Audio : ESD_Video, data->tag, (data->tag << 24) | sequence);
+		if (!(data->tag & 1))
+			SPSubmit(data->platform);
+	}
+
+	return NULL;
+}
+
+static int CheckOrdering()
+{
+	// A device-less platform, every write ends up in the loopback log
+	struct SPPlatform platform;
+	memset(&platform, 0, sizeof(platform));
+	platform.backend = SPGetDeviceBackend();
+	platform.sandpiperfd = -1;
+	platform.mapped_memory = (uint8_t*)MAP_FAILED;
+	platform.writecombined_memory = (uint8_t*)MAP_FAILED;
+	platform.cached_memory = (uint8_t*)MAP_FAILED;
+	SPSetBatchBackend(&platform, EBB_Loopback);
+
+	pthread_barrier_t start;
+	pthread_barrier_init(&start, NULL, ORDER_THREADS);
+	pthread_t threads[ORDER_THREADS];
+	struct SOrderThread data[ORDER_THREADS];
+	for (uint32_t t = 0; t < ORDER_THREADS; ++t)
+	{
+		data[t].platform = &platform;
+		data[t].start = &start;
+		data[t].tag = t;
+		pthread_create(&threads[t], NULL, OrderThread, &data[t]);
+	}
+	for (uint32_t t = 0; t < ORDER_THREADS; ++t)
+		pthread_join(threads[t], NULL);
+	pthread_barrier_destroy(&start);
+
+	uint32_t count = 0;
+	const struct SPBatchEntry* log = SPGetLoopbackLog(&platform, &count);
+
+	// Sequence numbers per thread have to come out in increasing order, whichever device they went to
+	int32_t last[ORDER_THREADS];
+	memset(last, 0xFF, sizeof(last));
+	uint32_t outOfOrder = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t tag = log[i].value >> 24;
+		int32_t sequence = (int32_t)(log[i].value & 0xFFFFFF);
+		if (tag >= ORDER_THREADS || log[i].offset != tag || sequence <= last[tag])
+			++outOfOrder;
+		else
+			last[tag] = sequence;
+	}
+
+	const uint32_t expected = ORDER_THREADS * ORDER_BATCHES * ORDER_BATCH_SIZE;
+	int failed = count != expected || outOfOrder;
+	printf("ordering: %s (%u of %u writes, %u out of order, %u queued behind another thread)\n",
+		failed ? "FAILED" : "ok", count, expected, outOfOrder, platform.batch.stats.queued);
+
+	SPShutdownPlatform(&platform);
+	return failed;
+}
+
+struct SLatency
+{
+	uint64_t total;
+	uint64_t worst;
+	uint32_t count;
+};
+
+static void AddSample(struct SLatency* _latency, uint64_t _ns)
+{
+	_latency->total += _ns;
+	_latency->count++;
+	if (_ns > _latency->worst)
+		_latency->worst = _ns;
+}
+
+struct SBurstThread
+{
+	struct SPPlatform* platform;
+	volatile int stop;
+	struct SLatency bursts;
+};
+
+static void* BurstThread(void* _arg)
+{
+	struct SBurstThread* data = (struct SBurstThread*)_arg;
+	uint32_t seed = 0;
+
+	while (!data->stop)
+	{
+		uint64_t start = BenchNow();
+		SPBeginBatch(data->platform);
+		for (uint32_t i = 0; i < BURST_SIZE; ++i)
+			VPUSetPal(data->platform->vx, i & 0xFF, i + seed, i ^ seed, 255 - i);
+		SPSubmit(data->platform);
+		AddSample(&data->bursts, BenchNow() - start);
+		++seed;
+	}
+
+	return NULL;
+}
+
+static void MeasureKicks(struct SPPlatform* _platform, uint32_t _dmaAddress, struct SLatency* _latency)
+{
+	memset(_latency, 0, sizeof(struct SLatency));
+	for (uint32_t i = 0; i < KICK_COUNT; ++i)
+	{
+		uint64_t start = BenchNow();
+		APUStartDMA(_platform->ac, _dmaAddress);
+		AddSample(_latency, BenchNow() - start);
+		usleep(1000);
+	}
+}
+
+static int CheckKickLatency(struct SPPlatform* _platform)
+{
+	// Silent buffer, with the APU halted the kicks have nothing to play anyway
+	struct SPSizeAlloc silence;
+	silence.size = 4096;
+	if (SPAllocateBuffer(_platform, &silence) != 0)
+	{
+		printf("kick latency: can't allocate audio buffer\n");
+		return 1;
+	}
+	memset(silence.cpuAddress, 0, silence.size);
+
+	struct SLatency idle;
+	MeasureKicks(_platform, (uint32_t)(uintptr_t)silence.dmaAddress, &idle);
+
+	struct SBurstThread burst;
+	memset(&burst, 0, sizeof(burst));
+	burst.platform = _platform;
+	pthread_t thread;
+	pthread_create(&thread, NULL, BurstThread, &burst);
+
+	struct SLatency loaded;
+	struct SPBatchStats before = _platform->batch.stats;
+	MeasureKicks(_platform, (uint32_t)(uintptr_t)silence.dmaAddress, &loaded);
+	struct SPBatchStats after = _platform->batch.stats;
+
+	burst.stop = 1;
+	pthread_join(thread, NULL);
+	VPUSetDefaultPalette(_platform->vx);
+	SPFreeBuffer(_platform, &silence);
+
+	// With a single core the kicking thread only runs again once the scheduler preempts the burst thread,
+	// so its latency measures the time slice rather than the submission
+	uint64_t burstAverage = burst.bursts.count ? burst.bursts.total / burst.bursts.count : 0;
+	int singleCore = sysconf(_SC_NPROCESSORS_ONLN) < 2;
+	int failed = !singleCore && (!burst.bursts.count || loaded.worst >= burstAverage);
+
+	printf("palette burst (%u writes)    : %8.1f us avg %8.1f us worst (%u bursts)\n", BURST_SIZE,
+		burstAverage / 1000.0, burst.bursts.worst / 1000.0, burst.bursts.count);
+	printf("audio kick, idle            : %8.1f us avg %8.1f us worst\n", idle.total / (idle.count * 1000.0), idle.worst / 1000.0);
+	printf("audio kick, during bursts   : %8.1f us avg %8.1f us worst (%u writes queued)\n", loaded.total / (loaded.count * 1000.0),
+		loaded.worst / 1000.0, after.queued - before.queued);
+	printf("kick latency: %s\n", singleCore ? "not checked, needs two cores" : failed ? "FAILED, a kick waited as long as a whole burst" : "ok");
+
+	return failed;
+}
+
+int BenchThreads(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	int failed = CheckOrdering();
+	failed |= CheckKickLatency(_platform);
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * \file bench_tilemap.c
+ * \brief Hardware scrolled tile layer against full redraws
+ *
+ * Scrolls a 64x64 map of 16x16 tiles across a 320x240 screen, in 8 bit and RGB565 color modes, the way
+ * a side scroller, a vertical shooter and a top down game would move their camera. Each frame is drawn by
+ * SPTilemapScrollTo, which only draws the strips that scroll into view, and by drawing the whole screen
+ * again. Reported times are CPU time per frame. The scrolled screen is checked against a full redraw at
+ * the end of each run.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "vpu.h"
+#include "tilemap.h"
+#include "sdkbench.h"
+
+#define TILEMAP_FRAMES		600
+#define TILEMAP_TILE		16
+#define TILEMAP_TILES		16			// In a 4x4 grid
+#define TILEMAP_CELLS		64
+
+enum ETilemapScenario
+{
+	ETS_Side,
+	ETS_Vertical,
+	ETS_Diagonal,
+	ETS_Count
+};
+
+static const char* s_scenarioNames[ETS_Count] = { "2 px right", "1 px down", "3 px up, 1 left" };
+static const int32_t s_steps[ETS_Count][2] = { { 2, 0 }, { 0, 1 }, { -1, -3 } };
+
+static void DrawTiles(struct SPSurface* _tiles)
+{
+	for (uint32_t y = 0; y < _tiles->height; ++y)
+	{
+		uint8_t* row = (uint8_t*)_tiles->pixels + y * _tiles->stride;
+		for (uint32_t x = 0; x < _tiles->width; ++x)
+		{
+			uint32_t tile = (y / TILEMAP_TILE) * 4 + x / TILEMAP_TILE;
+			uint32_t u = x % TILEMAP_TILE, v = y % TILEMAP_TILE;
+			uint32_t shade = (u == 0 || v == 0) ? 0 : tile * 8 + ((u ^ v) & 7);
+			if (_tiles->cmode == ECM_16bit_RGB)
+				((uint16_t*)row)[x] = (uint16_t)MAKECOLORRGB16(shade >> 2, shade >> 1, (31 - (shade >> 2)));
+			else
+				row[x] = (uint8_t)(16 + shade);
+		}
+	}
+}
+
+static uint64_t Scroll(struct SPTilemap* _map, enum ETilemapScenario _scenario, int _full)
+{
+	int32_t x = 0, y = 0;
+	SPTilemapScrollTo(_map, x, y);
+
+	uint64_t start = BenchNow();
+	for (uint32_t f = 0; f < TILEMAP_FRAMES; ++f)
+	{
+		x += s_steps[_scenario][0];
+		y += s_steps[_scenario][1];
+		if (_full)
+		{
+			_map->x = x;
+			_map->y = y;
+			SPTilemapRedraw(_map);
+		}
+		else
+			SPTilemapScrollTo(_map, x, y);
+	}
+	return BenchNow() - start;
+}
+
+// The screen after scrolling has to look the same when drawn in full
+static int CheckWindow(struct SPTilemap* _map, uint8_t* _copy)
+{
+	struct SPSurface window;
+	SPTilemapGetWindow(_map, &window);
+	uint32_t rowBytes = window.width * _map->bpp;
+	for (uint32_t y = 0; y < window.height; ++y)
+		memcpy(_copy + y * rowBytes, (uint8_t*)window.pixels + y * window.stride, rowBytes);
+
+	SPTilemapRedraw(_map);
+	SPTilemapGetWindow(_map, &window);
+	for (uint32_t y = 0; y < window.height; ++y)
+		if (memcmp(_copy + y * rowBytes, (uint8_t*)window.pixels + y * window.stride, rowBytes) != 0)
+			return 0;
+	return 1;
+}
+
+static int BenchMode(struct SPPlatform* _platform, enum EColorMode _cmode, uint16_t* _cells)
+{
+	VPUSetVideoMode(_platform->vx, EVM_320_Wide, _cmode, EVS_Enable);
+
+	uint32_t bpp = _cmode == ECM_16bit_RGB ? 2 : 1;
+	struct SPSurface tiles;
+	SPInitSurface(&tiles, malloc(4 * TILEMAP_TILE * 4 * TILEMAP_TILE * bpp), 4 * TILEMAP_TILE, 4 * TILEMAP_TILE, 4 * TILEMAP_TILE * bpp, _cmode);
+	DrawTiles(&tiles);
+
+	struct SPTilemap map;
+	if (SPTilemapInit(&map, _platform, &tiles, TILEMAP_TILE, TILEMAP_TILE, _cells, TILEMAP_CELLS, TILEMAP_CELLS) != 0)
+	{
+		printf("can't create tile map\n");
+		free(tiles.pixels);
+		return -1;
+	}
+	uint8_t* copy = (uint8_t*)malloc(map.width * map.height * bpp);
+
+	int failed = 0;
+	printf("%s\n", _cmode == ECM_16bit_RGB ? "RGB565" : "8 bit");
+	for (uint32_t s = 0; s < ETS_Count; ++s)
+	{
+		enum ETilemapScenario scenario = (enum ETilemapScenario)s;
+		uint64_t fullNs = Scroll(&map, scenario, 1);
+
+		SPResetTilemapStats(&map);
+		uint64_t scrollNs = Scroll(&map, scenario, 0);
+		struct SPTilemapStats stats;
+		SPGetTilemapStats(&map, &stats);
+		int match = CheckWindow(&map, copy);
+		failed |= !match;
+
+		// The first frame of each run is a full redraw
+		printf("%-16s: full redraw %.3f ms, scrolled %.3f ms, %.0f pixels and %.1f tiles per frame, %llu resets%s\n", s_scenarioNames[s],
+			fullNs / (1000000.0 * TILEMAP_FRAMES), scrollNs / (1000000.0 * TILEMAP_FRAMES),
+			(double)stats.pixelCount / stats.frameCount, (double)stats.tileCount / stats.frameCount, (unsigned long long)stats.resetCount,
+			match ? "" : "  output differs: FAILED");
+	}
+
+	free(copy);
+	SPTilemapDestroy(&map);
+	free(tiles.pixels);
+	return failed ? -1 : 0;
+}
+
+int BenchTilemap(struct SPPlatform* _platform, int argc, char** argv)
+{
+	(void)argc;
+	(void)argv;
+	uint16_t* cells = (uint16_t*)malloc(TILEMAP_CELLS * TILEMAP_CELLS * sizeof(uint16_t));
+	uint32_t seed = 1234;
+	for (uint32_t i = 0; i < TILEMAP_CELLS * TILEMAP_CELLS; ++i)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		cells[i] = (uint16_t)((seed >> 16) % TILEMAP_TILES);
+	}
+
+	printf("%u frames of a %ux%u map of %ux%u tiles at 320x240, CPU time per frame\n", TILEMAP_FRAMES, TILEMAP_CELLS, TILEMAP_CELLS, TILEMAP_TILE, TILEMAP_TILE);
+	int failed = BenchMode(_platform, ECM_8bit_Indexed, cells);
+	failed |= BenchMode(_platform, ECM_16bit_RGB, cells);
+
+	free(cells);
+	return failed;
+}
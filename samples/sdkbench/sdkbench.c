@@ -0,0 +1,84 @@
+/**
+ * \file sdkbench.c
+ * \brief SDK microbenchmarks
+ *
+ * \ingroup examples
+ * This sample collects small benchmarks that measure the CPU side cost of SDK operations,
+ * such as register access, so that changes to the SDK can be compared on the device.
+ *
+ * Run without arguments to see the list of available benchmarks.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "platform.h"
+#include "sdkbench.h"
+
+struct SBenchEntry
+{
+	const char* name;
+	const char* description;
+	int needsDevice;
+	int (*run)(struct SPPlatform* _platform, int argc, char** argv);
+};
+
+static const struct SBenchEntry s_benchmarks[] = {
+	{ "regs", "ns per register read/write for ioctl and direct access", 1, BenchRegisters },
+	{ "batch", "cost of a 256 entry palette load with and without batching", 1, BenchBatch },
+	{ "mem", "read/write/mixed bandwidth of the reserved region per mapping policy", 1, BenchMemory },
+	{ "loopback", "check batch ordering against the loopback backend (no device needed)", 0, BenchLoopback },
+	{ "threads", "multi-threaded submission ordering, and audio kick latency during palette bursts", 1, BenchThreads },
+	{ "arena", "per-frame arena allocations against heap alloc/free, and reuse only after vblank", 1, BenchArena },
+	{ "console", "full, incremental and ring framebuffer text console resolve for typical terminal output", 1, BenchConsole },
+	{ "blit", "sprites per frame for opaque, color keyed, rle and blended blits at 320x240 and 640x480", 1, BenchBlit },
+	{ "damage", "full screen copies against damage rectangles, from a buffer and across swapped pages", 1, BenchDamage },
+	{ "beam", "late bands and tearing when racing the beam into a single framebuffer", 1, BenchBeam },
+	{ "jobs", "work stealing job system speedup over one worker, batch overhead and frame end barrier", 1, BenchJobs },
+	{ "tilemap", "cpu time per frame of a hardware scrolled tile layer against full redraws", 1, BenchTilemap },
+	{ "capture", "qoi and png screenshot encoding speed, and render thread cost of a live 30 fps capture", 1, BenchCapture },
+	{ "color", "rgb888 to rgb565 and 8 bit indexed conversion in Mpixel/s, with ordered dither and error diffusion", 0, BenchColor },
+};
+
+#define BENCH_COUNT (sizeof(s_benchmarks) / sizeof(s_benchmarks[0]))
+
+void printusage()
+{
+	printf("sdkbench\nusage: sdkbench [benchmark] [args]\nbenchmarks\n");
+	for (uint32_t i = 0; i < BENCH_COUNT; ++i)
+		printf("%-10s: %s\n", s_benchmarks[i].name, s_benchmarks[i].description);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc <= 1)
+	{
+		printusage();
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < BENCH_COUNT; ++i)
+	{
+		if (strcmp(argv[1], s_benchmarks[i].name))
+			continue;
+
+		struct SPPlatform* platform = NULL;
+		if (s_benchmarks[i].needsDevice)
+		{
+			platform = SPInitPlatform();
+			if (!platform)
+			{
+				printf("Failed to initialize platform\n");
+				return -1;
+			}
+		}
+
+		return s_benchmarks[i].run(platform, argc - 2, argv + 2);
+	}
+
+	printusage();
+	return -1;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include "platform.h"
+
+// Monotonic time in nanoseconds
+static inline uint64_t BenchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Individual benchmarks, each returns 0 on success
+// Benchmarks that do not need the device receive a NULL platform
+int BenchRegisters(struct SPPlatform* _platform, int argc, char** argv);
+int BenchBatch(struct SPPlatform* _platform, int argc, char** argv);
+int BenchMemory(struct SPPlatform* _platform, int argc, char** argv);
+int BenchLoopback(struct SPPlatform* _platform, int argc, char** argv);
+int BenchThreads(struct SPPlatform* _platform, int argc, char** argv);
+int BenchArena(struct SPPlatform* _platform, int argc, char** argv);
+int BenchConsole(struct SPPlatform* _platform, int argc, char** argv);
+int BenchBlit(struct SPPlatform* _platform, int argc, char** argv);
+int BenchDamage(struct SPPlatform* _platform, int argc, char** argv);
+int BenchBeam(struct SPPlatform* _platform, int argc, char** argv);
+int BenchJobs(struct SPPlatform* _platform, int argc, char** argv);
+int BenchTilemap(struct SPPlatform* _platform, int argc, char** argv);
+int BenchCapture(struct SPPlatform* _platform, int argc, char** argv);
+int BenchColor(struct SPPlatform* _platform, int argc, char** argv);
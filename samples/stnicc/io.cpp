@@ -1,30 +1,18 @@
 #include "io.h"
+#include "loader.h"
 #include <stdlib.h>
 #include <assert.h>
 
-int st_niccc_open(ST_NICCC_IO* io, const char* filename, int mode)
+int st_niccc_open(ST_NICCC_IO* io, struct SPPlatform* platform, const char* filename, int mode)
 {
-    io->f = fopen(filename, (mode == ST_NICCC_WRITE) ? "wb" : "rb");
-    if(io->f == NULL)
+	// Read the whole thing into a cached buffer from the reserved region
+	io->f = NULL;
+	io->platform = platform;
+	if (SPLoadFile(platform, filename, &io->scenebuffer, ESM_Cached, NULL) != 0)
 	{
-        return 0;
-    }
-
-	// Read the whole thing into memory
-	{
-		fpos_t pos, endpos;
-		fgetpos(io->f, &pos);
-		fseek(io->f, 0, SEEK_END);
-		fgetpos(io->f, &endpos);
-		fsetpos(io->f, &pos);
-		uint32_t fsize = (uint32_t)endpos.__pos;
-		io->scenedata = (uint8_t*)malloc(fsize);
-		uint32_t rsize = fread(io->scenedata, 1, fsize, io->f);
-		if (fsize != rsize)
-			printf("mismatching size on read\n");
-		fclose(io->f);
-		io->f = NULL;
+		return 0;
 	}
+	io->scenedata = io->scenebuffer.cpuAddress;
 
     io->mode = mode;
     st_niccc_rewind(io);
@@ -34,9 +22,8 @@ int st_niccc_open(ST_NICCC_IO* io, const char* filename, int mode)
 
 void st_niccc_close(ST_NICCC_IO* io)
 {
-    //fclose(io->f);
-    //io->f = NULL;
-	delete [] io->scenedata;
+	SPFreeBuffer(io->platform, &io->scenebuffer);
+	io->scenedata = NULL;
 }
 
 void st_niccc_rewind(ST_NICCC_IO* io){
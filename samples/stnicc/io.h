@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include "platform.h"
 #include "vpu.h"
 
 #ifdef __cplusplus
@@ -40,6 +41,8 @@ typedef struct {
     uint32_t addr;
     uint32_t word_addr;
 	uint8_t* scenedata;
+	struct SPPlatform* platform;
+	struct SPSizeAlloc scenebuffer;
     union {
         uint32_t word;
         uint8_t bytes[4];
@@ -48,7 +51,7 @@ typedef struct {
     int eof;
 } ST_NICCC_IO ;
 
-int      st_niccc_open(ST_NICCC_IO* io, const char* filename, int mode);
+int      st_niccc_open(ST_NICCC_IO* io, struct SPPlatform* platform, const char* filename, int mode);
 void     st_niccc_close(ST_NICCC_IO* io);
 void     st_niccc_rewind(ST_NICCC_IO* io);
 uint8_t  st_niccc_read_byte(ST_NICCC_IO* io);
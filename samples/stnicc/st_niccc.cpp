@@ -143,18 +143,18 @@ int main(int argc, char** argv)
 	ST_NICCC_FRAME frame;
 	ST_NICCC_POLYGON polygon;
 
-	if(!st_niccc_open(&io,scene_file,ST_NICCC_READ))
-	{
-        	fprintf(stderr,"could not open data file\n");
-	        exit(-1);
-    	}
-
 	s_platform = SPInitPlatform();
 	if (!s_platform) {
 		fprintf(stderr, "Failed to initialize platform\n");
 		return -1;
 	}
 
+	if(!st_niccc_open(&io,s_platform,scene_file,ST_NICCC_READ))
+	{
+        	fprintf(stderr,"could not open data file\n");
+	        exit(-1);
+    	}
+
 	uint32_t stride = VPUGetStride(VIDEO_MODE, VIDEO_COLOR);
 	frameBufferB.size = frameBufferA.size = stride*VIDEO_HEIGHT;
 	SPAllocateBuffer(s_platform, &frameBufferA);
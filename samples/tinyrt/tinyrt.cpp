@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include "platform.h"
 #include "vpu.h"
+#include "clock.h"
+#include "jobs.h"
 
 struct SPSizeAlloc framebuffer;
 static struct SPPlatform* s_platform = NULL;
@@ -114,32 +116,33 @@ static void printk(uint64_t kx) {
     printf("%d", fracpart);
 }
 
-static uint64_t instret_start;
-static uint64_t cycles_start;
+static struct SPClock s_clock;
+static uint64_t time_start;
+static uint64_t vblank_start;
 
 // Begins statistics collection for current frame.
 // Leave emtpy if not needed.
 static inline void stats_begin_frame() {
-    instret_start = 0;//E32ReadRetiredInstructions();
-    cycles_start  = 0;//E32ReadCycles();
+    time_start   = SPClockGetTimeNs(&s_clock);
+    vblank_start = SPClockGetVBlankCount(&s_clock);
 }
 
 // Ends statistics collection for current frame
 // and displays result.
 // Leave emtpy if not needed.
-static inline void stats_end_frame() {
+static inline uint64_t stats_end_frame() {
    graphics_terminate();
-   uint64_t instret = 0;//E32ReadRetiredInstructions() - instret_start;
-   uint64_t cycles = 0;//E32ReadCycles()    - cycles_start ;
-   uint64_t kCPI       = cycles*1000/instret;
-   uint64_t pixels     = graphics_width * graphics_height;
-   uint64_t kRAYSTONES = (pixels*1000000000)/cycles;
+   uint64_t ns      = SPClockGetTimeNs(&s_clock) - time_start;
+   uint64_t vblanks = SPClockGetVBlankCount(&s_clock) - vblank_start;
+   uint64_t pixels  = graphics_width * graphics_height;
+   uint64_t kNSPP   = ns*1000/pixels;
    printf("\n%dx%d      %s", graphics_width, graphics_height, bench_run ? "no gfx output (measurement is accurate)" : "gfx output (measurement is NOT accurate)");
-   printf("CPI=");
-   printk(kCPI);
-   printf("     RAYSTONES=");
-   printk(kRAYSTONES);
+   printf("\nms=");
+   printk(ns/1000);
+   printf("     vblanks=%d     ns/pixel=", (int)vblanks);
+   printk(kNSPP);
    printf("\n");
+   return ns;
 }
 
 // Normally you will not need to modify anything beyond that point.
@@ -409,24 +412,40 @@ static inline void render_pixel(
    //stats_end_pixel();
 }
 
-void render(Sphere* spheres, int nb_spheres, Light* lights, int nb_lights) {
-	stats_begin_frame();
-	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_16bit_RGB);
-#ifdef graphics_double_lines
-   for (int j = 0; j<graphics_height; j+=2) {
-      for (int i = 0; i<graphics_width; i++) {
-	  render_pixel(i,j  ,spheres,nb_spheres,lights,nb_lights);
-	  render_pixel(i,j+1,spheres,nb_spheres,lights,nb_lights);
+struct Scene {
+   uint32_t addrs;
+   uint32_t stride;
+   Sphere* spheres;
+   int nb_spheres;
+   Light* lights;
+   int nb_lights;
+};
+
+void render_tile(void* user, uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+   Scene* scene = (Scene*)user;
+   for (int j = y; j < (int)(y+h); j++) {
+      for (int i = x; i < (int)(x+w); i++) {
+         render_pixel(scene->addrs, scene->stride, i, j, scene->spheres, scene->nb_spheres, scene->lights, scene->nb_lights);
       }
    }
-#else
-  for (int j = 0; j<graphics_height; j++) {
-    for (int i = 0; i<graphics_width; i++) {
-      render_pixel((uint32_t)s_platform->sc->writepage, stride, i,j ,spheres,nb_spheres,lights,nb_lights);
-    }
-  }
-#endif
-   //stats_end_frame();
+}
+
+uint64_t render(SPJobSystem* jobs, Sphere* spheres, int nb_spheres, Light* lights, int nb_lights) {
+   stats_begin_frame();
+   Scene scene;
+   scene.addrs = (uint32_t)s_platform->sc->writepage;
+   scene.stride = VPUGetStride(EVM_320_Wide, ECM_16bit_RGB);
+   scene.spheres = spheres;
+   scene.nb_spheres = nb_spheres;
+   scene.lights = lights;
+   scene.nb_lights = nb_lights;
+
+   // Glass and mirror pixels cost a lot more than the background, small tiles keep the CPUs evenly busy
+   SPJobCounter counter;
+   SPInitJobCounter(&counter);
+   SPRunTiles(jobs, render_tile, &scene, graphics_width, graphics_height, 16, 8, &counter);
+   SPWaitJobs(jobs, &counter);
+   return stats_end_frame();
 }
 
 int nb_spheres = 4;
@@ -467,6 +486,7 @@ int main()
 		fprintf(stderr, "Failed to initialize platform\n");
 		return -1;
 	}
+	SPClockInit(&s_clock, s_platform);
 
 	// Grab video buffer
 	uint32_t stride = VPUGetStride(EVM_320_Wide, ECM_16bit_RGB);
@@ -486,7 +506,18 @@ int main()
 	bench_run = 0;
 	graphics_width = 320;
 	graphics_height = 240;
-	render(spheres, nb_spheres, lights, nb_lights);
+
+	// Render once on a single CPU, then on all of them
+	SPJobSystem* single = SPCreateJobSystem(s_platform, 1);
+	uint64_t singleNs = render(single, spheres, nb_spheres, lights, nb_lights);
+	SPDestroyJobSystem(single);
+
+	SPJobSystem* jobs = SPCreateJobSystem(s_platform, 0);
+	uint64_t jobsNs = render(jobs, spheres, nb_spheres, lights, nb_lights);
+	printf("%d workers: ", (int)SPGetJobWorkerCount(jobs));
+	printk(singleNs*1000/jobsNs);
+	printf("x speedup\n");
+	SPDestroyJobSystem(jobs);
 
 	while(1) {
 	}
@@ -14,7 +14,13 @@
  * The VPU based approach guarantees that the CPU is as close as possible to the vblank event,
  * minimizing latency and potential visual artifacts.
  * 
- * User is expected to pick one of the two methods via command line argument ("cpu" or "vpu").
+ * A third option drives a three buffer swap chain, where a frame that is drawn faster than the display
+ * refreshes either waits in line (fifo) or replaces the one that is waiting (mailbox).
+ *
+ * The fourth option uses a single framebuffer and races the beam, drawing each band of rows just before
+ * the beam scans it, for tear free output with one band of latency.
+ *
+ * User is expected to pick one of the methods via command line argument ("cpu", "vpu", "chain" or "beam").
  */
 
 #include <stdint.h>
@@ -26,6 +32,8 @@
 #include "core.h"
 #include "platform.h"
 #include "vpu.h"
+#include "swapchain.h"
+#include "beamrace.h"
 
 #define VIDEO_MODE      EVM_320_Wide
 #define VIDEO_COLOR     ECM_8bit_Indexed
@@ -34,10 +42,22 @@
 static struct SPPlatform* s_platform = NULL;
 struct SPSizeAlloc frameBufferA;
 struct SPSizeAlloc frameBufferB;
+struct SPSizeAlloc frameBufferC;
 
 void printusage()
 {
-	printf("vsyncdemo\nusage: vsyncdemo [arg]\nargs\ncpu : demo of CPU based vsync\nvpu: demo of VPU based vsync\n");
+	printf("vsyncdemo\nusage: vsyncdemo [arg]\nargs\ncpu : demo of CPU based vsync\nvpu: demo of VPU based vsync\nchain [mailbox] : demo of a triple buffered swap chain, fifo by default\nbeam : demo of racing the beam into a single buffer\n");
+}
+
+// Diagonal stripes that scroll by one pixel per frame, a torn frame shows a kink at the tear
+void drawband(void* _userData, uint8_t* _pixels, uint32_t _stride, uint32_t _y0, uint32_t _y1, uint64_t _frame)
+{
+	for (uint32_t y = _y0; y < _y1; y++)
+	{
+		uint8_t* row = _pixels + (y - _y0) * _stride;
+		for (uint32_t x = 0; x < _stride; x++)
+			row[x] = (uint8_t)(((x + y + _frame) / 16) % 16);
+	}
 }
 
 int main(int argc, char** argv)
@@ -143,6 +163,69 @@ int main(int argc, char** argv)
 			VPUNoop(s_platform->vx);
 		} while(1);
 	}
+	else if (!strcmp(argv[1], "chain")) // Swap chain - draw as fast as the buffers allow
+	{
+		enum ESPPresentMode mode = (argc > 2 && !strcmp(argv[2], "mailbox")) ? EPM_Mailbox : EPM_Fifo;
+
+		frameBufferC.size = frameBufferA.size;
+		SPAllocateBuffer(s_platform, &frameBufferC);
+
+		struct SPSizeAlloc* framebuffers[3] = { &frameBufferA, &frameBufferB, &frameBufferC };
+		struct SPSwapChain chain;
+		SPSwapChainInit(&chain, s_platform, framebuffers, 3, mode);
+
+		uint32_t frame = 0;
+		uint64_t lastReport = SPGetTimeNs();
+		do
+		{
+			// 1) Get a buffer that is off the screen, this only waits if all of them are in use
+			int image = SPAcquireNextImage(&chain);
+			uint8_t* pixels = framebuffers[image]->cpuAddress;
+
+			// 2) Draw game frame here, a bar moving down one line per frame
+			uint32_t bar = frame % VIDEO_HEIGHT;
+			for (int x = 0; x < stride; x++)
+				pixels[bar * stride + x] = (uint8_t)frame;
+
+			// 3) Hand it over, it reaches the screen at one of the next vblanks
+			SPQueuePresent(&chain, image);
+
+			// Report every 5 seconds, mailbox mode presents far more frames than the display shows
+			++frame;
+			if (SPGetTimeNs() - lastReport > 5000000000ull)
+			{
+				lastReport = SPGetTimeNs();
+				struct SPSwapChainStats stats;
+				SPGetSwapChainStats(&chain, &stats);
+				printf("%s: %llu presented, %llu shown, %llu dropped, latency %.2f ms avg %.2f ms worst, %llu waits for a buffer\n",
+					mode == EPM_Mailbox ? "mailbox" : "fifo", (unsigned long long)stats.presentCount, (unsigned long long)stats.displayCount,
+					(unsigned long long)stats.dropCount, stats.averageLatencyMs, stats.worstLatencyNs / 1000000.0, (unsigned long long)stats.acquireWaitCount);
+			}
+		} while(1);
+	}
+	else if (!strcmp(argv[1], "beam")) // Beam racing - one framebuffer, drawn a band at a time ahead of the beam
+	{
+		// 8 bands of 30 rows, each one is started as the beam enters the band above it
+		struct SPBeamRacer racer;
+		SPBeamRaceInit(&racer, s_platform, &frameBufferA, 8, 0);
+
+		uint64_t lastReport = SPGetTimeNs();
+		do
+		{
+			// Draws every band of the next frame, waiting for the beam in between
+			SPBeamRaceFrame(&racer, drawband, NULL);
+
+			if (SPGetTimeNs() - lastReport > 5000000000ull)
+			{
+				lastReport = SPGetTimeNs();
+				struct SPBeamRaceStats stats;
+				SPGetBeamRaceStats(&racer, &stats);
+				printf("beam: %llu frames, %llu late bands in %llu frames, %llu skipped, %.0f lines of slack\n",
+					(unsigned long long)stats.frameCount, (unsigned long long)stats.lateBands, (unsigned long long)stats.lateFrames,
+					(unsigned long long)stats.skippedFrames, stats.averageSlackLines);
+			}
+		} while(1);
+	}
 	else
 		printusage();
 